@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+#define UNBOUNDED UINT64_MAX
+
+// Cost charged per executed instruction when estimating the worst case. Structural markers (block, loop,
+// else, end, nop) do not execute anything in the host and are free, calls are charged at one like the rest.
+static uint64_t op_cost(
+    uint8_t     op)
+{
+    switch (op)
+    {
+        case 0x01U:     // nop
+        case 0x02U:     // block
+        case 0x03U:     // loop
+        case 0x05U:     // else
+        case 0x0BU:     // end
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+typedef struct
+{
+    uint32_t    off;        // offset of the loop instruction in the analysed buffer
+    int         parent;     // enclosing loop, -1 if outermost
+    int         depth;      // loop nesting depth, 1 = outermost
+    int         guard;      // 0 = missing, 1 = constant, 2 = non-constant maxiter
+    uint64_t    guard_id;
+    uint64_t    guard_max;
+    uint64_t    bound;      // effective bound: the guard's maxiter, which caps the loop's iterations in total
+    uint64_t    cost;       // worst-case cost of one iteration, nested loops not included
+    uint64_t    total;      // worst-case cost of all its iterations, nested loops included
+} loop_info;
+
+typedef struct
+{
+    uint8_t     kind;       // 0x02 block, 0x03 loop, 0x04 if, 0x00 function body
+    int         loop;       // index into the loop table for loop frames
+    uint64_t    cost;       // worst-case cost accumulated in the current arm, per iteration of the innermost loop
+    uint64_t    loops;      // and the totals of the loops nested in it, which don't depend on that loop
+    uint64_t    then_cost;  // if frames: cost and loops of the then arm once the else arm starts
+    uint64_t    then_loops;
+} frame;
+
+static uint64_t sat_add(uint64_t a, uint64_t b)
+{
+    return (a > UNBOUNDED - b ? UNBOUNDED : a + b);
+}
+
+static uint64_t sat_mul(uint64_t a, uint64_t b)
+{
+    if (a == 0 || b == 0)
+        return 0;
+    return (a > UNBOUNDED / b ? UNBOUNDED : a * b);
+}
+
+// walk one function body, building its loop tree and worst-case cost
+static int analyze_func(
+    wasm_module*    m,
+    wasm_func*      f,
+    int             guard_idx,
+    loop_info**     loops,
+    int*            loop_count,
+    uint64_t*       wce)
+{
+    if (wasm_decode_body(m, f))
+        return 1;
+
+    frame* stack = malloc(sizeof(frame) * (f->ins_count + 1));
+    *loops = malloc(sizeof(loop_info) * (f->ins_count + 1));
+    *loop_count = 0;
+    if (!stack || !*loops)
+    {
+        free(stack);
+        free(*loops);
+        *loops = 0;
+        return fprintf(stderr, "Could not allocate analysis tables\n");
+    }
+
+    int sp = 0;
+    int cur_loop = -1;
+    stack[0] = (frame){ .kind = 0x00U, .loop = -1 };
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        frame* top = stack + sp;
+        top->cost = sat_add(top->cost, op_cost(in->op));
+
+        switch (in->op)
+        {
+            case 0x02U: // block
+            case 0x03U: // loop
+            case 0x04U: // if
+            {
+                frame* fr = stack + ++sp;
+                *fr = (frame){ .kind = in->op, .loop = -1 };
+                if (in->op == 0x03U)
+                {
+                    loop_info* l = *loops + *loop_count;
+                    memset(l, 0, sizeof(*l));
+                    l->off = in->off;
+                    l->parent = cur_loop;
+                    l->depth = (cur_loop < 0 ? 1 : (*loops)[cur_loop].depth + 1);
+                    fr->loop = cur_loop = (*loop_count)++;
+                }
+                break;
+            }
+
+            case 0x05U: // else
+            {
+                top->then_cost = top->cost;
+                top->then_loops = top->loops;
+                top->cost = 0;
+                top->loops = 0;
+                break;
+            }
+
+            case 0x0BU: // end
+            {
+                if (sp == 0)
+                    break;
+
+                // the arms are maximized apiece, which can only overestimate
+                uint64_t cost = top->cost;
+                uint64_t nested = top->loops;
+                if (top->kind == 0x04U && top->then_cost > cost)
+                    cost = top->then_cost;
+                if (top->kind == 0x04U && top->then_loops > nested)
+                    nested = top->then_loops;
+
+                sp--;
+                if (top->kind == 0x03U)
+                {
+                    // _g caps the hits of its id over the whole execution, so the guard bounds every iteration
+                    // of the loop, however often the loops around it run
+                    loop_info* l = *loops + top->loop;
+                    l->cost = cost;
+                    l->total = sat_add((l->guard == 1 ? sat_mul(cost, l->guard_max) : UNBOUNDED), nested);
+                    cur_loop = l->parent;
+                    stack[sp].loops = sat_add(stack[sp].loops, l->total);
+                }
+                else
+                {
+                    stack[sp].cost = sat_add(stack[sp].cost, cost);
+                    stack[sp].loops = sat_add(stack[sp].loops, nested);
+                }
+                break;
+            }
+
+            case 0x10U: // call
+            {
+                // only a guard directly inside the loop (not in a nested block) bounds its iterations
+                if (in->imm != guard_idx || top->kind != 0x03U)
+                    break;
+
+                loop_info* l = *loops + top->loop;
+                if (l->guard)
+                    break;
+
+                if (i >= 2 && f->ins[i-1].op == 0x41U && f->ins[i-2].op == 0x41U)
+                {
+                    l->guard = 1;
+                    l->guard_id = (uint32_t)f->ins[i-2].imm;
+                    l->guard_max = (uint32_t)f->ins[i-1].imm;
+                }
+                else
+                    l->guard = 2;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < *loop_count; ++i)
+    {
+        loop_info* l = *loops + i;
+        l->bound = (l->guard == 1 ? l->guard_max : UNBOUNDED);
+    }
+
+    *wce = sat_add(stack[0].cost, stack[0].loops);
+    free(stack);
+    return 0;
+}
+
+static void print_bound(
+    FILE*       out,
+    uint64_t    v)
+{
+    if (v == UNBOUNDED)
+        fprintf(out, "unbounded");
+    else
+        fprintf(out, "%ld", v);
+}
+
+// print the loops of one function depth first, so nested loops appear under their parent
+static void print_loops(
+    FILE*       out,
+    loop_info*  loops,
+    int         count,
+    int         parent)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        loop_info* l = loops + i;
+        if (l->parent != parent)
+            continue;
+
+        fprintf(out, "%*sloop at 0x%X: ", 2 * l->depth, "", l->off);
+        if (l->guard == 1)
+            fprintf(out, "guard _g(0x%08lx, %ld), ", l->guard_id, l->guard_max);
+        else if (l->guard == 2)
+            fprintf(out, "UNBOUNDED guard (maxiter is not a constant), ");
+        else
+            fprintf(out, "MISSING guard, ");
+
+        fprintf(out, "effective bound ");
+        print_bound(out, l->bound);
+        fprintf(out, ", iteration cost ");
+        print_bound(out, l->cost);
+        fprintf(out, ", total cost ");
+        print_bound(out, l->total);
+        fprintf(out, "\n");
+
+        print_loops(out, loops, count, i);
+    }
+}
+
+/*
+ * Build the loop nesting tree of hook() and cbak() in a (cleaned) module and estimate the worst-case number of
+ * instructions each entry point can execute. A loop's effective bound is its guard's maxiter: the ledger counts
+ * the calls to _g with each id over the whole execution, so an inner loop's guard already covers every run of it
+ * the loops around it cause. An if is charged the more expensive of its arms. Returns non-zero if any loop is
+ * missing a guard or has a guard whose maxiter can't be determined statically.
+ */
+int analyze(
+    uint8_t*    w,
+    ssize_t     len,
+    FILE*       out)
+{
+    wasm_module m;
+    if (wasm_parse(w, len, &m))
+        return fprintf(stderr, "Could not parse module for analysis\n");
+
+    int guard_idx = wasm_find_import(&m, "_g");
+    int problems = 0;
+
+    const char* names[] = { "hook", "cbak" };
+    for (int e = 0; e < 2; ++e)
+    {
+        int idx = wasm_find_export(&m, names[e]);
+        if (idx < 0)
+            continue;
+
+        if (idx < (int)m.import_func_count || (uint32_t)idx - m.import_func_count >= m.func_count)
+        {
+            wasm_free(&m);
+            return fprintf(stderr, "Export %s refers to invalid function %d\n", names[e], idx);
+        }
+
+        loop_info* loops = 0;
+        int loop_count = 0;
+        uint64_t wce = 0;
+        if (analyze_func(&m, m.funcs + (idx - m.import_func_count), guard_idx, &loops, &loop_count, &wce))
+        {
+            free(loops);
+            wasm_free(&m);
+            return fprintf(stderr, "Could not analyse %s()\n", names[e]);
+        }
+
+        fprintf(out, "%s: %d loop%s, worst-case ", names[e], loop_count, (loop_count == 1 ? "" : "s"));
+        print_bound(out, wce);
+        fprintf(out, " instructions\n");
+        print_loops(out, loops, loop_count, -1);
+
+        for (int i = 0; i < loop_count; ++i)
+            if (loops[i].guard != 1)
+                problems++;
+
+        free(loops);
+    }
+
+    wasm_free(&m);
+
+    if (problems)
+        return fprintf(stderr, "%d loop%s without a usable guard\n", problems, (problems == 1 ? "" : "s"));
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+#define ARENA_ALIGN 16U
+#define ARENA_MIN_BLOCK 0x10000U
+
+struct arena_block
+{
+    arena_block*    next;
+    size_t          cap;
+    size_t          used;
+    uint8_t         data[];
+};
+
+static arena_block* new_block(
+    size_t  cap)
+{
+    arena_block* b = malloc(sizeof(arena_block) + cap);
+    if (!b)
+        return 0;
+    b->next = 0;
+    b->cap = cap;
+    b->used = 0;
+    return b;
+}
+
+void arena_init(
+    arena*  a,
+    size_t  limit)
+{
+    memset(a, 0, sizeof(*a));
+    a->limit = limit;
+}
+
+/*
+ * Allocations come from the current block, a new block is only added when it's full. Since every allocation made
+ * before a reset stays valid, blocks are never moved or resized in place.
+ */
+void* arena_alloc(
+    arena*  a,
+    size_t  n)
+{
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (a->head && a->head->cap - a->head->used >= n)
+    {
+        void* p = a->head->data + a->head->used;
+        a->head->used += n;
+        a->used += n;
+        if (a->used > a->peak)
+            a->peak = a->used;
+        return p;
+    }
+
+    if (a->used + n > a->limit)
+    {
+        fprintf(stderr, "Could not allocate %ld bytes, arena limit of %ld bytes reached\n",
+                (uint64_t)n, (uint64_t)a->limit);
+        return 0;
+    }
+
+    // grow geometrically, but never past what the limit could still hand out
+    size_t cap = (a->head ? a->head->cap * 2 : ARENA_MIN_BLOCK);
+    if (cap < n)
+        cap = n;
+    if (cap > a->limit - a->used)
+        cap = a->limit - a->used;
+
+    arena_block* b = new_block(cap);
+    if (!b)
+    {
+        fprintf(stderr, "Could not allocate %ld bytes\n", (uint64_t)cap);
+        return 0;
+    }
+    b->next = a->head;
+    a->head = b;
+    a->reserved += cap;
+
+    b->used = n;
+    a->used += n;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return b->data;
+}
+
+/*
+ * Release everything allocated so far. If that took more than one block they are replaced by a single block
+ * big enough for the peak, so a worker that processes similar inputs stops allocating after the first one.
+ */
+void arena_reset(
+    arena*  a)
+{
+    if (a->head && a->head->next)
+    {
+        size_t cap = a->peak;
+        if (cap > a->limit)
+            cap = a->limit;
+        arena_free(a);
+        a->head = new_block(cap);
+        a->reserved = (a->head ? cap : 0);
+    }
+    else if (a->head)
+        a->head->used = 0;
+
+    a->used = 0;
+}
+
+void arena_free(
+    arena*  a)
+{
+    while (a->head)
+    {
+        arena_block* next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->used = 0;
+    a->reserved = 0;
+}
@@ -0,0 +1,769 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "cleaner.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+
+/*
+ * Multi-file runs: every input is cleaned into the output directory under its own file name. Worker threads run
+ * the passes, each with its own arena. The I/O either happens on the workers with plain blocking calls, or, where
+ * io_uring is available, on one thread that keeps the opens, reads, writes and closes of many files in flight at
+ * once (into buffers registered with the kernel) while the workers clean what's been read. Files that fail are
+ * reported and skipped, the rest are still cleaned.
+ */
+
+// bytes of each registered buffer, bigger files get a buffer of their own
+#define BATCH_BUF_SIZE (256U * 1024U)
+
+// files in flight per job
+#define BATCH_SLOTS_PER_JOB 8
+
+#define S_FREE      0
+#define S_OPEN_IN   1
+#define S_READ      2
+#define S_CLEAN     3
+#define S_OPEN_OUT  4
+#define S_WRITE     5
+#define S_CLOSE_OUT 6
+
+typedef struct
+{
+    const char* in;
+    char        out[4096];
+    int         fd;
+    int         state;
+    uint8_t*    buf;
+    ssize_t     cap;
+    int         own;        // buf is malloc'd rather than the slot's registered buffer
+    ssize_t     len;        // bytes of input, then of output
+    ssize_t     in_len;
+    ssize_t     done;       // read or written so far
+    int         failed;
+    char        hash[HOOK_HASH_SIZE * 2 + 1];
+} batch_slot;
+
+typedef struct
+{
+    run_opts*       opts;
+    char**          files;
+    int             file_count;
+    const char*     out_dir;
+    batch_slot*     slots;
+    int             slot_count;
+    int             failures;
+
+    // slots waiting to be cleaned, and cleaned ones waiting to be written
+    int*            todo;
+    int             todo_count;
+    int*            cleaned;
+    int             cleaned_count;
+    int             next_file;      // blocking backend: next file to take
+    int             stop;
+    int             event_fd;       // io_uring backend: workers signal cleaned slots on this
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} batch_state;
+
+static const char* base_name(
+    const char* path)
+{
+    const char* s = strrchr(path, '/');
+    return (s ? s + 1 : path);
+}
+
+static int cmp_base_names(
+    const void* a,
+    const void* b)
+{
+    return strcmp(base_name(*(char* const*)a), base_name(*(char* const*)b));
+}
+
+// grow the slot's buffer to at least `need` bytes, keeping what's in it
+static int grow(
+    batch_slot* s,
+    ssize_t     need,
+    ssize_t     keep)
+{
+    if (need <= s->cap)
+        return 0;
+    uint8_t* n = malloc(need);
+    if (!n)
+        return 1;
+    memcpy(n, s->buf, keep);
+    if (s->own)
+        free(s->buf);
+    s->buf = n;
+    s->cap = need;
+    s->own = 1;
+    return 0;
+}
+
+// run the passes over the slot's input, leaving the output in its buffer
+static void clean_slot(
+    batch_slot* s,
+    run_opts*   opts,
+    arena*      a)
+{
+    uint8_t* buf = arena_alloc(a, s->len + 1);
+    if (!buf)
+    {
+        s->failed = 1;
+        return;
+    }
+    memcpy(buf, s->buf, s->len);
+
+    ssize_t len = s->len;
+    int retval = run_passes(&buf, &len, opts, a, 0, 0, 0);
+    if (retval == 0 && opts->validate)
+        retval = wasm_validate(buf, len);
+    if (retval == 0)
+        retval = grow(s, len, 0);
+    if (retval == 0)
+    {
+        memcpy(s->buf, buf, len);
+        s->in_len = s->len;
+        s->len = len;
+        if (opts->hash)
+        {
+            uint8_t hash[HOOK_HASH_SIZE];
+            hook_hash(buf, len, hash);
+            hook_hash_hex(hash, s->hash);
+        }
+    }
+    s->failed = (retval != 0);
+}
+
+// the outcome of one file, on the thread that finished it
+static void report(
+    batch_state*    b,
+    batch_slot*     s)
+{
+    if (s->failed)
+    {
+        __atomic_fetch_add(&b->failures, 1, __ATOMIC_SEQ_CST);
+        fprintf(stderr, "Could not clean `%s`\n", s->in);
+        return;
+    }
+    fprintf(stderr, "Cleaned `%s` -> `%s`: %ld -> %ld bytes\n", s->in, s->out, s->in_len, s->len);
+    if (b->opts->hash)
+        printf("HookHash: %s  %s\n", s->hash, s->out);
+}
+
+static int read_all(
+    batch_slot* s)
+{
+    int fd = open(s->in, O_RDONLY);
+    if (fd < 0)
+        return fprintf(stderr, "Could not open file `%s` for reading\n", s->in);
+
+    s->len = 0;
+    for (;;)
+    {
+        if (s->len == s->cap && (s->cap >= ARENA_LIMIT || grow(s, s->cap * 2, s->len)))
+        {
+            close(fd);
+            return fprintf(stderr, "File `%s` is too large to clean\n", s->in);
+        }
+        ssize_t r = read(fd, s->buf + s->len, s->cap - s->len);
+        if (r < 0)
+        {
+            close(fd);
+            return fprintf(stderr, "Could not read file `%s`\n", s->in);
+        }
+        if (r == 0)
+            break;
+        s->len += r;
+    }
+    close(fd);
+    return 0;
+}
+
+static int write_all(
+    batch_slot* s)
+{
+    int fd = open(s->out, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if (fd < 0)
+        return fprintf(stderr, "Could not open file `%s` for writing\n", s->out);
+    ssize_t upto = 0;
+    while (upto < s->len)
+    {
+        ssize_t w = write(fd, s->buf + upto, s->len - upto);
+        if (w <= 0)
+            break;
+        upto += w;
+    }
+    close(fd);
+    if (upto != s->len)
+        return fprintf(stderr, "Could not write all of output file `%s`, only wrote %ld out of %ld bytes\n",
+                s->out, upto, s->len);
+    return 0;
+}
+
+// blocking backend: each worker takes the next file and does all of it
+static void* blocking_worker(
+    void*   arg)
+{
+    batch_state* b = arg;
+    arena a;
+    arena_init(&a, ARENA_LIMIT);
+    batch_slot s = { .cap = BATCH_BUF_SIZE, .own = 1, .buf = malloc(BATCH_BUF_SIZE) };
+
+    for (;;)
+    {
+        int i = __atomic_fetch_add(&b->next_file, 1, __ATOMIC_SEQ_CST);
+        if (i >= b->file_count)
+            break;
+        s.in = b->files[i];
+        snprintf(s.out, sizeof(s.out), "%s/%s", b->out_dir, base_name(s.in));
+        s.failed = read_all(&s);
+        if (!s.failed)
+        {
+            arena_reset(&a);
+            clean_slot(&s, b->opts, &a);
+        }
+        if (!s.failed)
+            s.failed = write_all(&s);
+        report(b, &s);
+    }
+
+    free(s.buf);
+    arena_free(&a);
+    return 0;
+}
+
+// io_uring backend: workers only clean, taking slots from todo and handing them back through cleaned
+static void* uring_worker(
+    void*   arg)
+{
+    batch_state* b = arg;
+    arena a;
+    arena_init(&a, ARENA_LIMIT);
+
+    pthread_mutex_lock(&b->lock);
+    for (;;)
+    {
+        while (!b->stop && b->todo_count == 0)
+            pthread_cond_wait(&b->cond, &b->lock);
+        if (b->todo_count == 0)
+            break;
+        batch_slot* s = b->slots + b->todo[--b->todo_count];
+        pthread_mutex_unlock(&b->lock);
+
+        arena_reset(&a);
+        clean_slot(s, b->opts, &a);
+
+        pthread_mutex_lock(&b->lock);
+        b->cleaned[b->cleaned_count++] = s - b->slots;
+#ifdef HAVE_URING
+        uint64_t one = 1;
+        if (write(b->event_fd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "Could not signal a cleaned file\n");
+#endif
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    arena_free(&a);
+    return 0;
+}
+
+#ifdef HAVE_URING
+
+// completions are tagged with the slot, or this for the event fd
+#define EVENT_TAG   UINT32_MAX
+#define CLOSE_TAG   (1ULL << 32)    // set on closes nothing waits for
+
+typedef struct
+{
+    int                     fd;
+    uint32_t*               sq_head;
+    uint32_t*               sq_tail;
+    uint32_t*               sq_mask;
+    uint32_t*               sq_array;
+    struct io_uring_sqe*    sqes;
+    uint32_t*               cq_head;
+    uint32_t*               cq_tail;
+    uint32_t*               cq_mask;
+    struct io_uring_cqe*    cqes;
+    void*                   sq_ptr;
+    size_t                  sq_size;
+    void*                   cq_ptr;
+    size_t                  cq_size;
+    size_t                  sqe_size;
+    uint32_t                to_submit;
+    int                     fixed;      // the slot buffers are registered
+} uring;
+
+static void uring_free(
+    uring*  r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqe_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr)
+        munmap(r->sq_ptr, r->sq_size);
+    if (r->fd >= 0)
+        close(r->fd);
+}
+
+// the ops this backend needs, all there since 5.6
+static int uring_probe(
+    uring*  r)
+{
+    static const uint8_t need[] =
+        { IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+          IORING_OP_WRITE_FIXED };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* p = calloc(1, size);
+    int ok = (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, p, 256) == 0);
+    for (uint32_t i = 0; i < sizeof(need) && ok; ++i)
+        ok = (need[i] <= p->last_op && (p->ops[need[i]].flags & IO_URING_OP_SUPPORTED));
+    free(p);
+    return ok;
+}
+
+static int uring_init(
+    uring*      r,
+    uint32_t    entries)
+{
+    memset(r, 0, sizeof(*r));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return 1;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && r->cq_size > r->sq_size)
+        r->sq_size = r->cq_size;
+
+    r->sq_ptr = mmap(0, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+    {
+        r->sq_ptr = 0;
+        uring_free(r);
+        return 1;
+    }
+    r->cq_ptr = r->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        r->cq_ptr = mmap(0, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+        {
+            r->cq_ptr = 0;
+            uring_free(r);
+            return 1;
+        }
+    }
+    r->sqe_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        r->sqes = 0;
+        uring_free(r);
+        return 1;
+    }
+
+    uint8_t* sq = r->sq_ptr;
+    uint8_t* cq = r->cq_ptr;
+    r->sq_head = (uint32_t*)(sq + p.sq_off.head);
+    r->sq_tail = (uint32_t*)(sq + p.sq_off.tail);
+    r->sq_mask = (uint32_t*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (uint32_t*)(sq + p.sq_off.array);
+    r->cq_head = (uint32_t*)(cq + p.cq_off.head);
+    r->cq_tail = (uint32_t*)(cq + p.cq_off.tail);
+    r->cq_mask = (uint32_t*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    if (!uring_probe(r))
+    {
+        uring_free(r);
+        return 1;
+    }
+    return 0;
+}
+
+// the ring is sized so every slot and the event fd can have an op queued at once, this never runs out
+static struct io_uring_sqe* uring_sqe(
+    uring*      r,
+    uint8_t     op,
+    uint64_t    tag)
+{
+    uint32_t tail = *r->sq_tail;
+    uint32_t i = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = r->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->user_data = tag;
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+// submit what's queued and wait for at least one completion
+static int uring_enter(
+    uring*  r)
+{
+    for (;;)
+    {
+        long n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        if (n >= 0)
+        {
+            r->to_submit -= n;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+    }
+}
+
+static void queue_rw(
+    uring*      r,
+    batch_slot* s,
+    int         slot,
+    int         write)
+{
+    int fixed = (r->fixed && !s->own);
+    uint8_t op = (write ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) :
+            (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ));
+    struct io_uring_sqe* sqe = uring_sqe(r, op, slot);
+    sqe->fd = s->fd;
+    sqe->off = s->done;
+    sqe->addr = (uint64_t)(uintptr_t)(s->buf + s->done);
+    sqe->len = (write ? s->len : s->cap) - s->done;
+    sqe->buf_index = (fixed ? slot : 0);
+}
+
+static void queue_open(
+    uring*          r,
+    batch_slot*     s,
+    int             slot,
+    const char*     path,
+    int             flags)
+{
+    struct io_uring_sqe* sqe = uring_sqe(r, IORING_OP_OPENAT, slot);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->open_flags = flags;
+    sqe->len = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+}
+
+static void queue_close(
+    uring*      r,
+    int         fd,
+    uint64_t    tag)
+{
+    struct io_uring_sqe* sqe = uring_sqe(r, IORING_OP_CLOSE, tag);
+    sqe->fd = fd;
+}
+
+// start the next file in a free slot, returns 0 if there are none left
+static int start_file(
+    batch_state*    b,
+    uring*          r,
+    int             slot)
+{
+    if (b->next_file >= b->file_count)
+        return 0;
+    batch_slot* s = b->slots + slot;
+    s->in = b->files[b->next_file++];
+    snprintf(s->out, sizeof(s->out), "%s/%s", b->out_dir, base_name(s->in));
+    s->len = s->done = 0;
+    s->failed = 0;
+    s->state = S_OPEN_IN;
+    queue_open(r, s, slot, s->in, O_RDONLY);
+    return 1;
+}
+
+// a slot finished with its file, one way or the other. Returns the change in the number of files in flight
+static int finish(
+    batch_state*    b,
+    uring*          r,
+    int             slot)
+{
+    batch_slot* s = b->slots + slot;
+    report(b, s);
+    s->state = S_FREE;
+    return start_file(b, r, slot) - 1;
+}
+
+// fail the slot's file, closing what it has open
+static int fail(
+    batch_state*    b,
+    uring*          r,
+    int             slot,
+    const char*     what,
+    int             err)
+{
+    batch_slot* s = b->slots + slot;
+    fprintf(stderr, "Could not %s `%s`: %s\n", what, (s->state >= S_OPEN_OUT ? s->out : s->in), strerror(err));
+    if (s->state == S_READ || s->state == S_WRITE)
+        queue_close(r, s->fd, CLOSE_TAG | slot);
+    s->failed = 1;
+    return finish(b, r, slot);
+}
+
+// advance a slot's file on the completion of its op, returning the change in the number of files in flight
+static int complete(
+    batch_state*    b,
+    uring*          r,
+    int             slot,
+    int             res)
+{
+    batch_slot* s = b->slots + slot;
+    switch (s->state)
+    {
+        case S_OPEN_IN:
+        case S_OPEN_OUT:
+        {
+            if (res < 0)
+                return fail(b, r, slot, (s->state == S_OPEN_IN ? "open for reading" : "open for writing"), -res);
+            s->fd = res;
+            s->done = 0;
+            s->state = (s->state == S_OPEN_IN ? S_READ : S_WRITE);
+            queue_rw(r, s, slot, s->state == S_WRITE);
+            return 0;
+        }
+
+        case S_READ:
+        {
+            if (res < 0)
+                return fail(b, r, slot, "read", -res);
+            s->done += res;
+            if (res > 0)
+            {
+                if (s->done == s->cap && (s->cap >= ARENA_LIMIT || grow(s, s->cap * 2, s->done)))
+                    return fail(b, r, slot, "read all of", EFBIG);
+                queue_rw(r, s, slot, 0);
+                return 0;
+            }
+            queue_close(r, s->fd, CLOSE_TAG | slot);
+            s->len = s->done;
+            s->state = S_CLEAN;
+            pthread_mutex_lock(&b->lock);
+            b->todo[b->todo_count++] = slot;
+            pthread_cond_signal(&b->cond);
+            pthread_mutex_unlock(&b->lock);
+            return 0;
+        }
+
+        case S_WRITE:
+        {
+            if (res <= 0)
+                return fail(b, r, slot, "write", (res < 0 ? -res : EIO));
+            s->done += res;
+            if (s->done < s->len)
+            {
+                queue_rw(r, s, slot, 1);
+                return 0;
+            }
+            s->state = S_CLOSE_OUT;
+            queue_close(r, s->fd, slot);
+            return 0;
+        }
+
+        case S_CLOSE_OUT:
+        {
+            if (res < 0)
+            {
+                s->failed = 1;
+                fprintf(stderr, "Could not close `%s`: %s\n", s->out, strerror(-res));
+            }
+            return finish(b, r, slot);
+        }
+    }
+    return 0;
+}
+
+static int run_uring(
+    batch_state*    b,
+    uring*          r,
+    uint8_t*        bufs)
+{
+    // the slot buffers are registered once, so the kernel needn't map them for every read and write
+    struct iovec* iov = malloc(sizeof(struct iovec) * b->slot_count);
+    for (int i = 0; i < b->slot_count; ++i)
+        iov[i] = (struct iovec){ .iov_base = bufs + (size_t)i * BATCH_BUF_SIZE, .iov_len = BATCH_BUF_SIZE };
+    r->fixed = (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, b->slot_count) == 0);
+    free(iov);
+    if (DEBUG)
+        fprintf(stderr, "io_uring backend, %d slots, %s buffers\n", b->slot_count,
+                (r->fixed ? "registered" : "unregistered"));
+
+    uint64_t event = 0;
+    struct io_uring_sqe* sqe = uring_sqe(r, IORING_OP_READ, EVENT_TAG);
+    sqe->fd = b->event_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&event;
+    sqe->len = sizeof(event);
+
+    int active = 0;
+    for (int i = 0; i < b->slot_count; ++i)
+        active += start_file(b, r, i);
+
+    int retval = 0;
+    while (active > 0 && retval == 0)
+    {
+        if ((retval = uring_enter(r)) != 0)
+            break;
+
+        uint32_t head = *r->cq_head;
+        uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            struct io_uring_cqe* cqe = r->cqes + (head & *r->cq_mask);
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+
+            if (tag & CLOSE_TAG)
+                continue;
+
+            if (tag != EVENT_TAG)
+            {
+                active += complete(b, r, tag, res);
+                continue;
+            }
+
+            // cleaned slots, the failed ones are done and the rest go on to be written
+            pthread_mutex_lock(&b->lock);
+            int n = b->cleaned_count;
+            int* cleaned = malloc(sizeof(int) * (n + 1));
+            memcpy(cleaned, b->cleaned, sizeof(int) * n);
+            b->cleaned_count = 0;
+            pthread_mutex_unlock(&b->lock);
+            for (int i = 0; i < n; ++i)
+            {
+                batch_slot* s = b->slots + cleaned[i];
+                if (s->failed)
+                {
+                    active += finish(b, r, cleaned[i]);
+                    continue;
+                }
+                s->state = S_OPEN_OUT;
+                queue_open(r, s, cleaned[i], s->out, O_TRUNC | O_CREAT | O_WRONLY);
+            }
+            free(cleaned);
+
+            sqe = uring_sqe(r, IORING_OP_READ, EVENT_TAG);
+            sqe->fd = b->event_fd;
+            sqe->addr = (uint64_t)(uintptr_t)&event;
+            sqe->len = sizeof(event);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // let the last closes go through before the ring goes
+    if (r->to_submit)
+        syscall(__NR_io_uring_enter, r->fd, r->to_submit, 0, 0, 0, 0);
+    return retval;
+}
+#endif
+
+/*
+ * Clean every file in `files` into `out_dir`, named after the input. With `use_uring` the io_uring backend is
+ * tried first, falling back to blocking I/O when the kernel doesn't have it (or doesn't allow it).
+ */
+int run_batch(
+    char**          files,
+    int             file_count,
+    const char*     out_dir,
+    run_opts*       opts,
+    int             jobs,
+    int             use_uring)
+{
+    // two inputs with the same name would race to the same output
+    char** sorted = malloc(sizeof(char*) * (file_count + 1));
+    memcpy(sorted, files, sizeof(char*) * file_count);
+    qsort(sorted, file_count, sizeof(char*), cmp_base_names);
+    for (int i = 1; i < file_count; ++i)
+        if (strcmp(base_name(sorted[i - 1]), base_name(sorted[i])) == 0)
+        {
+            fprintf(stderr, "Inputs `%s` and `%s` would both be written to `%s/%s`\n", sorted[i - 1], sorted[i],
+                    out_dir, base_name(sorted[i]));
+            free(sorted);
+            return 1;
+        }
+    free(sorted);
+
+    if (jobs < 1)
+        jobs = 1;
+
+    batch_state b = { .opts = opts, .files = files, .file_count = file_count, .out_dir = out_dir, .event_fd = -1 };
+    pthread_mutex_init(&b.lock, 0);
+    pthread_cond_init(&b.cond, 0);
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    int retval = 0;
+
+#ifdef HAVE_URING
+    uring r = { .fd = -1 };
+    b.slot_count = jobs * BATCH_SLOTS_PER_JOB;
+    uint32_t entries = 1;
+    while (entries < (uint32_t)b.slot_count * 2 + 2)
+        entries <<= 1;
+    if (use_uring && uring_init(&r, entries) == 0)
+    {
+        b.event_fd = eventfd(0, 0);
+        b.slots = calloc(b.slot_count, sizeof(batch_slot));
+        b.todo = malloc(sizeof(int) * b.slot_count);
+        b.cleaned = malloc(sizeof(int) * b.slot_count);
+        uint8_t* bufs = malloc((size_t)b.slot_count * BATCH_BUF_SIZE);
+        for (int i = 0; i < b.slot_count; ++i)
+            b.slots[i] = (batch_slot){ .buf = bufs + (size_t)i * BATCH_BUF_SIZE, .cap = BATCH_BUF_SIZE };
+
+        for (int i = 0; i < jobs; ++i)
+            pthread_create(threads + i, 0, uring_worker, &b);
+
+        retval = run_uring(&b, &r, bufs);
+
+        pthread_mutex_lock(&b.lock);
+        b.stop = 1;
+        b.todo_count = 0;
+        pthread_cond_broadcast(&b.cond);
+        pthread_mutex_unlock(&b.lock);
+        for (int i = 0; i < jobs; ++i)
+            pthread_join(threads[i], 0);
+
+        for (int i = 0; i < b.slot_count; ++i)
+            if (b.slots[i].own)
+                free(b.slots[i].buf);
+        free(bufs);
+        free(b.slots);
+        free(b.todo);
+        free(b.cleaned);
+        close(b.event_fd);
+        uring_free(&r);
+    }
+    else
+#endif
+    {
+        if (use_uring)
+            fprintf(stderr, "io_uring isn't available, using blocking I/O\n");
+        for (int i = 0; i < jobs; ++i)
+            pthread_create(threads + i, 0, blocking_worker, &b);
+        for (int i = 0; i < jobs; ++i)
+            pthread_join(threads[i], 0);
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "Batch: %d files, %d failed\n", file_count, b.failures);
+
+    free(threads);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.cond);
+    return (retval ? retval : b.failures != 0);
+}
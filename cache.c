@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+/*
+ * Incremental re-cleaning. A cache holds the hash of every section of the input a module was cleaned from and the
+ * output it gave, so the next run over the same hook can tell what changed since.
+ *
+ * Everything the cleaner works out across sections (the import count and which imports are kept, the type remap,
+ * the guard's index, which bodies are hook() and cbak()) comes from the type, import, function, export and code
+ * sections, and every pass reads those again, so a change to any of them is cleaned in full. The data section is
+ * the exception: it's copied as is, and the only thing the passes ever look at is where its segments go and how
+ * long they are. So when only the bytes of the data changed, the cached output is reused with the new data
+ * section put in place of the old one, and when nothing changed it's reused as it is. Custom sections are dropped
+ * by the cleaner and ignored here.
+ *
+ * File format: the magic "HCC1", the build the cache was written by and the options that shape the output (the
+ * passes and inline limit), the section count, then per section its id byte and HookHash-sized SHA-512Half, the
+ * hash of the data segment layout, a flag byte (bit 0: the output holds the input's data section as is), the
+ * output's hash, and the output as a leb128 length and its bytes. Counts and numbers are leb128. The output is
+ * checked against its hash before it's reused, so a damaged cache is cleaned over rather than written out.
+ */
+
+static const uint8_t magic[4] = { 'H', 'C', 'C', '1' };
+
+// every file of the build is compiled together, so this changes whenever the cleaner could
+static const char build[] = __DATE__ " " __TIME__;
+
+// the passes that read where data segments go, so reusing their output needs the layout to be the same
+#define LAYOUT_PASSES (PASS_PRUNE_GLOBALS | PASS_SHRINK_STACK | PASS_SHRINK_MEMORY | PASS_CANONICAL)
+
+#define DATA_VERBATIM 0x01U
+
+static void sha512_half(
+    sha512_ctx* ctx,
+    uint8_t*    hash)
+{
+    uint8_t digest[64];
+    sha512_final(ctx, digest);
+    memcpy(hash, digest, HOOK_HASH_SIZE);
+}
+
+// hash of the data section without the segment bytes: their modes, memories, offsets and lengths
+static int data_layout(
+    uint8_t*    p,
+    uint8_t*    end,
+    uint8_t*    hash)
+{
+    sha512_ctx ctx;
+    sha512_init(&ctx);
+
+    uint8_t* q = p;
+    uint64_t count = leb(&q, end, 0);
+    if (q == p)
+        return 1;
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint8_t* seg = q;
+        uint64_t mode = leb(&q, end, 0);
+        if (q == seg || mode > 2)
+            return 1;
+        if (mode == 2)
+        {
+            uint8_t* r = q;
+            leb(&q, end, 0);
+            if (q == r)
+                return 1;
+        }
+        if (mode != 1)
+        {
+            // the offset expression, up to and including its end
+            wasm_instr in;
+            do
+            {
+                if (wasm_decode_instr(q, end, &in, 0))
+                    return 1;
+                q += in.len;
+            } while (in.op != 0x0BU);
+        }
+
+        uint8_t* r = q;
+        uint64_t bytes = leb(&q, end, 0);
+        if (q == r || bytes > (uint64_t)(end - q))
+            return 1;
+        sha512_update(&ctx, seg, q - seg);
+        q += bytes;
+    }
+
+    if (q != end)
+        return 1;
+
+    sha512_half(&ctx, hash);
+    return 0;
+}
+
+// the payload of the first section `id` of a module, 0 if it has none. *head is set to its id byte
+static uint8_t* find_section(
+    uint8_t*    buf,
+    ssize_t     len,
+    uint8_t     id,
+    uint8_t**   head,
+    uint32_t*   sec_len)
+{
+    uint8_t* p = buf + 8;
+    uint8_t* end = buf + len;
+    while (p < end)
+    {
+        *head = p;
+        uint8_t sid = *p++;
+        uint8_t* q = p;
+        uint64_t n = leb(&p, end, 0);
+        if (p == q || n > (uint64_t)(end - p))
+            return 0;
+        if (sid == id)
+        {
+            *sec_len = n;
+            return p;
+        }
+        p += n;
+    }
+    return 0;
+}
+
+/*
+ * Split a module into its sections and hash each of them. Fails, leaving the module to be cleaned in full (and
+ * its problems reported by the cleaner), if it isn't a module whose sections can be told apart.
+ */
+int cache_scan(
+    uint8_t*        buf,
+    ssize_t         len,
+    cache_sections* cs)
+{
+    cs->count = 0;
+    cs->data = -1;
+    memset(cs->layout, 0, sizeof(cs->layout));
+
+    if (len < 8 || memcmp(buf, "\0asm\x01\0\0\0", 8) != 0)
+        return 1;
+
+    uint8_t* p = buf + 8;
+    uint8_t* end = buf + len;
+    while (p < end)
+    {
+        uint8_t id = *p++;
+        uint8_t* q = p;
+        uint64_t n = leb(&p, end, 0);
+        if (p == q || n > (uint64_t)(end - p))
+            return 1;
+
+        if (id != 0x00U)
+        {
+            if (cs->count == WASM_MAX_SECTIONS)
+                return 1;
+            cache_section* s = cs->s + cs->count;
+            s->id = id;
+            s->off = p - buf;
+            s->len = n;
+            hook_hash(p, n, s->hash);
+
+            if (id == 0x0BU)
+            {
+                if (cs->data >= 0 || data_layout(p, p + n, cs->layout))
+                    return 1;
+                cs->data = cs->count;
+            }
+            cs->count++;
+        }
+        p += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the cache of `out`, the output cleaned with `opts` from the input scanned into `cs`, to `b`.
+ */
+void cache_encode(
+    cache_sections* cs,
+    run_opts*       opts,
+    uint8_t*        out,
+    ssize_t         len,
+    wasm_buf*       b)
+{
+    wasm_put(b, magic, sizeof(magic));
+    wasm_put_leb(b, sizeof(build) - 1);
+    wasm_put(b, build, sizeof(build) - 1);
+    wasm_put_leb(b, opts->passes);
+    wasm_put_leb(b, (opts->inline_limit ? opts->inline_limit : DEFAULT_INLINE_LIMIT));
+
+    wasm_put_leb(b, cs->count);
+    for (int i = 0; i < cs->count; ++i)
+    {
+        wasm_put_byte(b, cs->s[i].id);
+        wasm_put(b, cs->s[i].hash, HOOK_HASH_SIZE);
+    }
+    wasm_put(b, cs->layout, HOOK_HASH_SIZE);
+
+    // the data section can only be swapped later if it went through untouched
+    uint8_t flags = 0;
+    uint32_t data_len = 0;
+    uint8_t* head;
+    uint8_t* data = find_section(out, len, 0x0BU, &head, &data_len);
+    if (cs->data >= 0 && data)
+    {
+        uint8_t data_hash[HOOK_HASH_SIZE];
+        hook_hash(data, data_len, data_hash);
+        if (data_len == cs->s[cs->data].len && memcmp(data_hash, cs->s[cs->data].hash, HOOK_HASH_SIZE) == 0)
+            flags |= DATA_VERBATIM;
+    }
+    wasm_put_byte(b, flags);
+
+    uint8_t hash[HOOK_HASH_SIZE];
+    hook_hash(out, len, hash);
+    wasm_put(b, hash, HOOK_HASH_SIZE);
+    wasm_put_leb(b, len);
+    wasm_put(b, out, len);
+}
+
+// reads `n` bytes of the cache, or gives up on it
+#define TAKE(n) ((uint64_t)(end - p) < (uint64_t)(n) ? 0 : (p += (n), p - (n)))
+
+/*
+ * Reuse the output cached in `cache` for the input `buf` scanned into `cs`, if cleaning it with `opts` would give
+ * the same output or the same output with a new data section. On success *out and *len are the output, which
+ * points into the cache and `buf` and is allocated from `a` as needed; with `segs` it's the pieces in segs and
+ * nothing is copied. *stale is set if the output isn't the cached one, so the cache wants writing again.
+ * Otherwise returns non-zero after saying why the input needs cleaning in full.
+ */
+int cache_reuse(
+    uint8_t*        cache,
+    ssize_t         cache_len,
+    uint8_t*        buf,
+    cache_sections* cs,
+    run_opts*       opts,
+    arena*          a,
+    uint8_t**       out,
+    ssize_t*        len,
+    out_segs*       segs,
+    int*            stale)
+{
+    *stale = 0;
+    uint8_t* p = cache;
+    uint8_t* end = cache + cache_len;
+    uint8_t* q;
+
+    #define FULL(why)\
+        return fprintf(stderr, "Incremental: %s, cleaning in full\n", why)
+
+    if (!TAKE(sizeof(magic)) || memcmp(cache, magic, sizeof(magic)) != 0)
+        FULL("not a cache file");
+
+    q = p;
+    uint64_t build_len = leb(&p, end, 0);
+    uint8_t* stamp = (p == q ? 0 : TAKE(build_len));
+    q = p;
+    uint64_t passes = leb(&p, end, 0);
+    uint64_t inline_limit = leb(&p, end, 0);
+    if (!stamp || p == q || build_len != sizeof(build) - 1 || memcmp(stamp, build, build_len) != 0 ||
+            passes != opts->passes ||
+            inline_limit != (opts->inline_limit ? opts->inline_limit : DEFAULT_INLINE_LIMIT))
+        FULL("the cache was written by another build or with other options");
+
+    q = p;
+    uint64_t count = leb(&p, end, 0);
+    if (p == q || count != (uint64_t)cs->count)
+        FULL("the module has different sections");
+
+    int data_changed = 0;
+    for (int i = 0; i < cs->count; ++i)
+    {
+        uint8_t* id = TAKE(1);
+        uint8_t* hash = TAKE(HOOK_HASH_SIZE);
+        if (!hash || *id != cs->s[i].id)
+            FULL("the module has different sections");
+        if (memcmp(hash, cs->s[i].hash, HOOK_HASH_SIZE) == 0)
+            continue;
+        if (i != cs->data)
+        {
+            fprintf(stderr, "Incremental: section %d changed, cleaning in full\n", cs->s[i].id);
+            return 1;
+        }
+        data_changed = 1;
+    }
+
+    uint8_t* layout = TAKE(HOOK_HASH_SIZE);
+    uint8_t* flags = TAKE(1);
+    uint8_t* out_hash = TAKE(HOOK_HASH_SIZE);
+    q = p;
+    uint64_t cached_len = leb(&p, end, 0);
+    uint8_t* cached = (!out_hash || p == q ? 0 : TAKE(cached_len));
+    if (!cached)
+        FULL("the cache is truncated");
+
+    uint8_t hash[HOOK_HASH_SIZE];
+    hook_hash(cached, cached_len, hash);
+    if (memcmp(hash, out_hash, HOOK_HASH_SIZE) != 0)
+        FULL("the cached output is damaged");
+
+    if (!data_changed)
+    {
+        fprintf(stderr, "Incremental: reusing the cached output, %ld bytes\n", cached_len);
+        *out = cached;
+        *len = cached_len;
+        if (segs)
+            *segs = (out_segs){ .s = { { .iov_base = cached, .iov_len = cached_len } }, .count = 1,
+                .len = cached_len };
+        return 0;
+    }
+
+    if (!(*flags & DATA_VERBATIM))
+        FULL("the data changed and these passes don't copy it as is");
+    if ((opts->passes & LAYOUT_PASSES) && memcmp(layout, cs->layout, HOOK_HASH_SIZE) != 0)
+        FULL("the data segments moved or changed size");
+
+    uint32_t old_len = 0;
+    uint8_t* head;
+    uint8_t* old = find_section(cached, cached_len, 0x0BU, &head, &old_len);
+    if (!old)
+        FULL("the cached output has no data section");
+
+    // the cached output around its data section, with the new section in between
+    uint8_t* data = buf + cs->s[cs->data].off;
+    uint32_t data_len = cs->s[cs->data].len;
+    uint8_t* tail = old + old_len;
+    uint8_t* hdr = arena_alloc(a, 1 + 10);
+    if (!hdr)
+        return 1;
+    uint8_t* h = hdr;
+    *h++ = 0x0BU;
+    leb_out(data_len, &h);
+
+    struct iovec piece[4] =
+    {
+        { .iov_base = cached, .iov_len = head - cached },
+        { .iov_base = hdr, .iov_len = h - hdr },
+        { .iov_base = data, .iov_len = data_len },
+        { .iov_base = tail, .iov_len = cached + cached_len - tail },
+    };
+    ssize_t total = 0;
+    for (int i = 0; i < 4; ++i)
+        total += piece[i].iov_len;
+
+    fprintf(stderr, "Incremental: reusing the cached output with the new data section, %ld bytes\n", total);
+    *stale = 1;
+
+    if (segs)
+    {
+        *segs = (out_segs){ .count = 4, .len = total };
+        memcpy(segs->s, piece, sizeof(piece));
+        *out = cached;
+        *len = total;
+        return 0;
+    }
+
+    uint8_t* o = arena_alloc(a, total);
+    if (!o)
+        return 1;
+    *out = o;
+    *len = total;
+    for (int i = 0; i < 4; ++i)
+    {
+        memcpy(o, piece[i].iov_base, piece[i].iov_len);
+        o += piece[i].iov_len;
+    }
+    return 0;
+
+    #undef FULL
+}
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// the order local declarations are grouped in
+static const uint8_t local_order[] =
+    { WASM_I32, WASM_I64, WASM_F32, WASM_F64, WASM_V128, WASM_FUNCREF, WASM_EXTERNREF };
+
+#define MAX_CANONICAL_LOCALS 50000
+
+typedef struct
+{
+    wasm_type   t;
+    uint32_t    old;
+} type_slot;
+
+typedef struct
+{
+    wasm_import im;
+    uint32_t    old;
+} import_slot;
+
+// by signature: parameter count, result count, then the value types. Ties keep the input order
+static int cmp_type(
+    const void* a,
+    const void* b)
+{
+    const type_slot* x = a;
+    const type_slot* y = b;
+    if (x->t.pc != y->t.pc)
+        return (x->t.pc > y->t.pc) - (x->t.pc < y->t.pc);
+    if (x->t.rc != y->t.rc)
+        return (x->t.rc > y->t.rc) - (x->t.rc < y->t.rc);
+    int c = memcmp(x->t.p, y->t.p, x->t.pc);
+    if (!c)
+        c = memcmp(x->t.r, y->t.r, x->t.rc);
+    return (c ? c : (x->old > y->old) - (x->old < y->old));
+}
+
+static int same_type(
+    const wasm_type*    a,
+    const wasm_type*    b)
+{
+    return a->pc == b->pc && a->rc == b->rc && memcmp(a->p, b->p, a->pc) == 0 && memcmp(a->r, b->r, a->rc) == 0;
+}
+
+static int cmp_bytes(
+    const uint8_t*  a,
+    uint32_t        alen,
+    const uint8_t*  b,
+    uint32_t        blen)
+{
+    int c = memcmp(a, b, (alen < blen ? alen : blen));
+    return (c ? c : (alen > blen) - (alen < blen));
+}
+
+// by module then name
+static int cmp_import(
+    const void* a,
+    const void* b)
+{
+    const import_slot* x = a;
+    const import_slot* y = b;
+    int c = cmp_bytes(x->im.mod, x->im.mod_len, y->im.mod, y->im.mod_len);
+    if (!c)
+        c = cmp_bytes(x->im.name, x->im.name_len, y->im.name, y->im.name_len);
+    return (c ? c : (x->old > y->old) - (x->old < y->old));
+}
+
+static int cmp_export(
+    const void* a,
+    const void* b)
+{
+    const wasm_export* x = a;
+    const wasm_export* y = b;
+    return cmp_bytes(x->name, x->name_len, y->name, y->name_len);
+}
+
+// re-encode a single instruction constant expression minimally, in place since it can only get shorter
+static void minimal_const_expr(
+    uint8_t*    expr,
+    uint32_t*   len)
+{
+    wasm_instr in;
+    if (wasm_decode_instr(expr, expr + *len, &in, 0) || in.len + 1 != *len)
+        return;
+    if (in.op != 0x41U && in.op != 0x42U && in.op != 0x23U)
+        return;
+
+    wasm_buf b = { 0 };
+    wasm_put_byte(&b, in.op);
+    if (in.op == 0x23U)
+        wasm_put_leb(&b, in.imm);
+    else
+        wasm_put_sleb(&b, in.imm);
+    wasm_put_byte(&b, 0x0BU);
+
+    if (b.len <= *len)
+    {
+        memcpy(expr, b.p, b.len);
+        *len = b.len;
+    }
+    free(b.p);
+}
+
+/*
+ * Renumber the declared locals: grouped by type, in the order the body first uses them, and without the ones it
+ * never uses. Parameters stay where they are.
+ */
+static int group_locals(
+    wasm_module*    m,
+    wasm_func*      f)
+{
+    uint32_t params = m->types[f->type].pc;
+    uint64_t declared = 0;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        declared += f->locals[i].count;
+    if (declared == 0)
+        return 0;
+    if (declared > MAX_CANONICAL_LOCALS)
+        return fprintf(stderr, "Too many locals to canonicalize: %ld\n", declared);
+
+    uint8_t* type = malloc(declared);
+    uint32_t* first = malloc(sizeof(uint32_t) * declared);     // declared locals in order of first use
+    uint32_t* remap = malloc(sizeof(uint32_t) * declared);
+    uint8_t* seen = calloc(declared, 1);
+    for (uint32_t i = 0, k = 0; i < f->local_group_count; ++i)
+        for (uint32_t j = 0; j < f->locals[i].count; ++j)
+            type[k++] = f->locals[i].type;
+
+    int retval = 0;
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < f->ins_count && !retval; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        if (in->op < 0x20U || in->op > 0x22U || in->imm < params)
+            continue;
+        if (in->imm - params >= declared)
+            retval = fprintf(stderr, "Local index %ld out of range\n", in->imm);
+        else if (!seen[in->imm - params])
+        {
+            seen[in->imm - params] = 1;
+            first[used++] = in->imm - params;
+        }
+    }
+
+    wasm_local_group* groups = calloc(sizeof(local_order), sizeof(wasm_local_group));
+    uint32_t group_count = 0, next = 0;
+    for (uint32_t t = 0; t < sizeof(local_order); ++t)
+    {
+        uint32_t n = 0;
+        for (uint32_t k = 0; k < used; ++k)
+            if (type[first[k]] == local_order[t])
+            {
+                remap[first[k]] = params + next++;
+                n++;
+            }
+        if (n)
+            groups[group_count++] = (wasm_local_group){ .count = n, .type = local_order[t] };
+    }
+
+    if (retval == 0 && next != used)
+        retval = fprintf(stderr, "Unknown local type in function body\n");
+
+    for (uint32_t i = 0; i < f->ins_count && !retval; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        if (in->op >= 0x20U && in->op <= 0x22U && in->imm >= params)
+            in->imm = remap[in->imm - params];
+    }
+
+    if (retval == 0)
+    {
+        free(f->locals);
+        f->locals = groups;
+        f->local_group_count = group_count;
+    }
+    else
+        free(groups);
+
+    free(type);
+    free(first);
+    free(remap);
+    free(seen);
+    return retval;
+}
+
+/*
+ * Bring the module into a canonical form, so builds of the same logic that only differ in the order the
+ * toolchain laid things out come out byte identical (and so share a HookHash). Types are deduplicated and
+ * sorted by signature, function imports by module and name, exports by name, declared locals are grouped by
+ * type in order of first use (unused ones dropped) and nops removed. wasm_emit already writes every size, count
+ * and immediate it encodes minimally; bodies are all re-encoded here and single-instruction constant expressions
+ * are rewritten minimally too.
+ */
+int canonicalize(
+    wasm_module*    m)
+{
+    uint32_t nops = 0;
+    for (uint32_t i = 0; i < m->func_count; ++i)
+    {
+        wasm_func* f = m->funcs + i;
+        if (wasm_decode_body(m, f))
+            return fprintf(stderr, "Could not decode function %d\n", i + m->import_func_count);
+
+        uint32_t n = 0;
+        for (uint32_t j = 0; j < f->ins_count; ++j)
+            if (f->ins[j].op != 0x01U)
+                f->ins[n++] = f->ins[j];
+        nops += f->ins_count - n;
+        f->ins_count = n;
+    }
+
+    // types: sort, merge duplicates and drop the ones nothing uses
+    uint8_t* used = calloc(m->type_count + 1, 1);
+    for (uint32_t i = 0; i < m->import_count; ++i)
+        if (m->imports[i].kind == 0x00U && m->imports[i].type < m->type_count)
+            used[m->imports[i].type] = 1;
+    for (uint32_t i = 0; i < m->func_count; ++i)
+    {
+        wasm_func* f = m->funcs + i;
+        if (f->type < m->type_count)
+            used[f->type] = 1;
+        for (uint32_t j = 0; j < f->ins_count; ++j)
+        {
+            wasm_instr* in = f->ins + j;
+            if (((in->op >= 0x02U && in->op <= 0x04U) || in->op == 0x11U) && in->imm >= 0 &&
+                in->imm < m->type_count)
+                used[in->imm] = 1;
+        }
+    }
+
+    type_slot* ts = malloc(sizeof(type_slot) * (m->type_count + 1));
+    uint32_t* type_new = malloc(sizeof(uint32_t) * (m->type_count + 1));
+    uint32_t tn = 0;
+    for (uint32_t i = 0; i < m->type_count; ++i)
+        if (used[i])
+            ts[tn++] = (type_slot){ .t = m->types[i], .old = i };
+    qsort(ts, tn, sizeof(type_slot), cmp_type);
+
+    wasm_type* types = malloc(sizeof(wasm_type) * (tn + 1));
+    uint32_t type_count = 0;
+    for (uint32_t i = 0; i < tn; ++i)
+    {
+        if (!type_count || !same_type(&types[type_count - 1], &ts[i].t))
+            types[type_count++] = ts[i].t;
+        type_new[ts[i].old] = type_count - 1;
+    }
+    free(ts);
+    free(used);
+
+    if (DEBUG)
+        fprintf(stderr, "Canonical: %d types (was %d), %d nops stripped\n", type_count, m->type_count, nops);
+
+    uint32_t old_type_count = m->type_count;
+    free(m->types);
+    m->types = types;
+    m->type_count = type_count;
+
+    // function imports: sorted among themselves, other imports keep their places
+    import_slot* is = malloc(sizeof(import_slot) * (m->import_func_count + 1));
+    uint32_t* func_new = malloc(sizeof(uint32_t) * (m->import_func_count + 1));
+    uint32_t in_count = 0;
+    for (uint32_t i = 0; i < m->import_count; ++i)
+        if (m->imports[i].kind == 0x00U)
+        {
+            is[in_count] = (import_slot){ .im = m->imports[i], .old = in_count };
+            is[in_count].im.type = type_new[m->imports[i].type];
+            in_count++;
+        }
+    qsort(is, in_count, sizeof(import_slot), cmp_import);
+    for (uint32_t i = 0, k = 0; i < m->import_count; ++i)
+        if (m->imports[i].kind == 0x00U)
+        {
+            func_new[is[k].old] = k;
+            m->imports[i] = is[k++].im;
+        }
+    free(is);
+
+    for (uint32_t i = 0; i < m->export_count; ++i)
+        if (m->exports[i].kind == 0x00U && m->exports[i].idx < in_count)
+            m->exports[i].idx = func_new[m->exports[i].idx];
+    qsort(m->exports, m->export_count, sizeof(wasm_export), cmp_export);
+
+    int retval = 0;
+    for (uint32_t i = 0; i < m->func_count && !retval; ++i)
+    {
+        wasm_func* f = m->funcs + i;
+        f->type = type_new[f->type];
+        for (uint32_t j = 0; j < f->ins_count && !retval; ++j)
+        {
+            wasm_instr* in = f->ins + j;
+            if (((in->op >= 0x02U && in->op <= 0x04U) || in->op == 0x11U) && in->imm >= old_type_count)
+                retval = fprintf(stderr, "Type %ld out of range at 0x%X\n", in->imm, in->off);
+            else if (((in->op >= 0x02U && in->op <= 0x04U) || in->op == 0x11U) && in->imm >= 0)
+                in->imm = type_new[in->imm];
+            else if ((in->op == 0x10U || in->op == 0xD2U) && in->imm < in_count)
+                in->imm = func_new[in->imm];
+        }
+        if (!retval)
+            retval = group_locals(m, f);
+    }
+    free(type_new);
+    free(func_new);
+
+    for (uint32_t i = 0; i < m->global_count; ++i)
+        minimal_const_expr(m->globals[i].init, &m->globals[i].init_len);
+    for (uint32_t i = 0; i < m->data_count; ++i)
+        if (m->data[i].mode != 1)
+            minimal_const_expr(m->data[i].offset, &m->data[i].offset_len);
+
+    return retval;
+}
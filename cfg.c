@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// a push with no side effects, so a drop right after it takes both away
+static int pure_push(
+    wasm_instr* in)
+{
+    return in->op == 0x20U || in->op == 0x23U || (in->op >= 0x41U && in->op <= 0x44U);
+}
+
+// block types whose results are exactly their params, so that an empty arm (or body) leaves the stack as it was
+static int passes_through(
+    wasm_module*    m,
+    int64_t         bt)
+{
+    if (bt == -64)
+        return 1;
+    if (bt < 0 || bt >= m->type_count)
+        return 0;
+    wasm_type* t = m->types + bt;
+    return t->pc == t->rc && memcmp(t->p, t->r, t->pc) == 0;
+}
+
+// append a drop of the value on top of the stack, or take back the push that produced it
+static void put_drop(
+    wasm_instr* o,
+    uint32_t*   n,
+    uint32_t    off)
+{
+    if (*n && pure_push(o + *n - 1))
+        (*n)--;
+    else
+        o[(*n)++] = (wasm_instr){ .op = 0x1AU, .off = off, .len = 1 };
+}
+
+/*
+ * Collapse trivial structure: `br_if 0` right before the end (or else) of the block or if it targets becomes a
+ * drop of its condition, an empty else arm of an if whose results are its params is removed, and so are blocks and
+ * ifs left with nothing in them (an if's condition is dropped). Loops are left alone, they hold the guards.
+ */
+static int collapse(
+    wasm_module*    m,
+    wasm_func*      f)
+{
+    uint32_t* open = malloc(sizeof(uint32_t) * (f->ins_count + 1));    // output index of each open block / loop / if
+    int sp = 0;
+    uint32_t n = 0;
+    int changed = 0;
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        wasm_instr in = f->ins[i];
+        wasm_instr* next = (i + 1 < f->ins_count ? f->ins + i + 1 : 0);
+        wasm_instr* top = (sp > 0 ? f->ins + open[sp - 1] : 0);
+
+        switch (in.op)
+        {
+            case 0x02U: case 0x03U: case 0x04U:
+            {
+                open[sp++] = n;
+                f->ins[n++] = in;
+                continue;
+            }
+
+            case 0x0DU:
+            {
+                if (in.imm == 0 && next && (next->op == 0x0BU || next->op == 0x05U) && (!top || top->op != 0x03U))
+                {
+                    put_drop(f->ins, &n, in.off);
+                    changed = 1;
+                    continue;
+                }
+                break;
+            }
+
+            case 0x05U:
+            {
+                if (next && next->op == 0x0BU && top && passes_through(m, top->imm))
+                {
+                    changed = 1;
+                    continue;
+                }
+                break;
+            }
+
+            case 0x0BU:
+            {
+                if (!top)
+                    break;
+                sp--;
+                if (n == open[sp] + 1 && top->op != 0x03U && passes_through(m, top->imm))
+                {
+                    uint8_t op = top->op;
+                    uint32_t off = top->off;
+                    n--;
+                    if (op == 0x04U)
+                        put_drop(f->ins, &n, off);
+                    changed = 1;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        f->ins[n++] = in;
+    }
+
+    f->ins_count = n;
+    free(open);
+    return changed;
+}
+
+typedef struct
+{
+    uint32_t    at;         // instruction index of the block, loop or if, or -1 for the function body
+    int         kept;
+    int         level;      // depth among the kept entries, the function body is 0
+} label;
+
+/*
+ * Remove the blocks no branch targets, renumbering the depths of the branches that cross them. Returns the number
+ * of blocks removed, or -1 if the body's labels don't match its nesting (the body is then left as it was).
+ */
+static int flatten(
+    wasm_func*  f)
+{
+    uint8_t* ref = calloc(f->ins_count + 1, 1);
+    label* stack = malloc(sizeof(label) * (f->ins_count + 1));
+    int sp = 0;
+    int bad = 0;
+    stack[0] = (label){ .at = UINT32_MAX, .kept = 1, .level = 0 };
+
+    for (uint32_t i = 0; i < f->ins_count && !bad; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        switch (in->op)
+        {
+            case 0x02U: case 0x03U: case 0x04U:
+                stack[++sp] = (label){ .at = i };
+                break;
+
+            case 0x0BU:
+                if (sp > 0)
+                    sp--;
+                break;
+
+            case 0x0CU: case 0x0DU:
+                if (in->imm < 0 || in->imm > sp)
+                    bad = 1;
+                else if (sp - in->imm > 0)
+                    ref[stack[sp - in->imm].at] = 1;
+                break;
+
+            case 0x0EU:
+                for (uint32_t k = 0; k <= in->imm && !bad; ++k)
+                {
+                    uint32_t l = f->brt[in->imm2 + k];
+                    if (l > sp)
+                        bad = 1;
+                    else if (sp - l > 0)
+                        ref[stack[sp - l].at] = 1;
+                }
+                break;
+        }
+    }
+
+    if (bad)
+    {
+        free(ref);
+        free(stack);
+        return -1;
+    }
+
+    uint32_t n = 0;
+    int removed = 0;
+    sp = 0;
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        wasm_instr in = f->ins[i];
+        label* top = stack + sp;
+        int top_level = (top->kept ? top->level : top->level - 1);
+
+        switch (in.op)
+        {
+            case 0x02U: case 0x03U: case 0x04U:
+            {
+                int kept = (in.op != 0x02U || ref[i]);
+                stack[++sp] = (label){ .at = i, .kept = kept, .level = top_level + 1 };
+                if (!kept)
+                {
+                    removed++;
+                    continue;
+                }
+                break;
+            }
+
+            case 0x0BU:
+            {
+                if (sp > 0)
+                {
+                    sp--;
+                    if (!top->kept)
+                        continue;
+                }
+                break;
+            }
+
+            case 0x0CU: case 0x0DU:
+                in.imm = top_level - stack[sp - in.imm].level;
+                break;
+
+            case 0x0EU:
+                for (uint32_t k = 0; k <= in.imm; ++k)
+                    f->brt[in.imm2 + k] = top_level - stack[sp - f->brt[in.imm2 + k]].level;
+                break;
+        }
+
+        f->ins[n++] = in;
+    }
+    f->ins_count = n;
+
+    free(ref);
+    free(stack);
+    return removed;
+}
+
+/*
+ * Opt-in control-flow simplification of the retained bodies: removes blocks no branch targets (renumbering the
+ * branches across them), empty else arms, empty blocks and ifs, and `br_if` to the immediately following end.
+ * Repeats until nothing changes, since each of these can expose another.
+ */
+int simplify_cfg(
+    wasm_module*    m)
+{
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+            return 1;
+
+        uint32_t before = f->ins_count;
+        int blocks = 0;
+        int changed = 1;
+        while (changed)
+        {
+            changed = collapse(m, f);
+            int removed = flatten(f);
+            if (removed < 0)
+                return fprintf(stderr, "Branch depth out of range in func %d\n", fi + m->import_func_count);
+            blocks += removed;
+            changed |= (removed > 0);
+        }
+
+        if (DEBUG)
+            fprintf(stderr, "Simplify func %d: %d -> %d instructions, %d blocks removed\n",
+                    fi + m->import_func_count, before, f->ins_count, blocks);
+    }
+
+    return 0;
+}
@@ -4,14 +4,18 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include "cleaner.h"
 
 #define VERSION "1.1"
-#define DEBUG 1
-#define DEBUG_VERBOSE 0
 
 #define MAX_TYPES 256
 #define MAX_FUNCS 256   /* this includes imports! */
 
+// the longest guard a dirty guard rewrite can insert: i32.const (5) i32.const (5) call _g (3) drop
+#define MAX_GUARD_REWRITE 16
+
+// Returns 0 without advancing *buf if the leb128 is truncated or longer than the 10 bytes a 64 bit value takes,
+// which callers can check for. Bits past the 64th are dropped, signed immediates are read unsigned too.
 uint64_t leb(
     uint8_t** buf,
     uint8_t* bufend,
@@ -21,14 +25,13 @@ uint64_t leb(
     while (*buf + i < bufend)
     {
         uint64_t b = (uint64_t)((*buf)[i]);
-        uint64_t last = val;
-        val += (b & 0x7FU) << shift;
-        if (val < last)
+        if (shift > 63)
         {
-            fprintf(stderr, "LEB128 overflow in input wasm at offset %ld.\n",
-                    i);
-            exit(100);
+            if (DEBUG)
+                fprintf(stderr, "LEB128 overflow in input wasm at byte %ld of the leb.\n", i);
+            return 0;
         }
+        val |= (b & 0x7FU) << shift;
         ++i;
         if (b & 0x80U)
         {
@@ -37,8 +40,8 @@ uint64_t leb(
         }
         *buf += i;
 
-        if (is_signed && shift < 64 && (b & 0x40U))
-            val |= (~0 << shift);
+        if (is_signed && shift + 7 < 64 && (b & 0x40U))
+            val |= (~0ULL << (shift + 7));
 
         return val;
     }
@@ -62,12 +65,34 @@ void leb_out(
 }
 
 
+int leb_len(
+    uint64_t i)
+{
+    int n = 1;
+    while (i >>= 7U)
+        n++;
+    return n;
+}
+
+// insert the leb128 encoding of `i` at `at`, shifting everything up to `*end` along
+void leb_insert(
+    uint8_t*    at,
+    uint8_t**   end,
+    uint64_t    i)
+{
+    int n = leb_len(i);
+    memmove(at + n, at, *end - at);
+    leb_out(i, &at);
+    *end += n;
+}
+
 void leb_out_pad(
     uint64_t i,
     uint8_t** o,
     int padto)
 {
-    fprintf(stderr, "Leb_out_pad(i=%ld, pad=%d): [", i, padto);
+    if (DEBUG_VERBOSE)
+        fprintf(stderr, "Leb_out_pad(i=%ld, pad=%d): [", i, padto);
     padto--;
     do
     {
@@ -78,22 +103,97 @@ void leb_out_pad(
 
         **o = b;
         (*o)++;
-        fprintf(stderr, " 0x%02X", b);
+        if (DEBUG_VERBOSE)
+            fprintf(stderr, " 0x%02X", b);
         padto--;
     } while (i > 0 || padto >= 0);
 
+    if (DEBUG_VERBOSE)
+        fprintf(stderr, " ]\n");
+}
+
+/*
+ * Mark the function imports a body calls. If the body doesn't decode every import is marked, so nothing it
+ * might call is dropped.
+ */
+static void mark_import_calls(
+    uint8_t*    body,
+    uint8_t*    end,
+    int         import_count,
+    uint8_t*    used)
+{
+    uint8_t* p = body;
+    uint64_t groups = leb(&p, end, 0);
+    for (uint64_t i = 0; i < groups && p < end; ++i)
+    {
+        leb(&p, end, 0);
+        p++;
+    }
 
-    fprintf(stderr, " ]\n");
+    while (p < end)
+    {
+        wasm_instr in;
+        if (wasm_decode_instr(p, end, &in, 0))
+        {
+            memset(used, 1, import_count);
+            return;
+        }
+        if (in.op == 0x10U && in.imm >= 0 && in.imm < import_count)
+            used[in.imm] = 1;
+        p += in.len;
+    }
+}
+
+typedef struct
+{
+    uint8_t set;
+    uint8_t rc;
+    uint8_t r[30];
+    uint8_t pc;
+    uint8_t p[31];
+} type_info;
+
+// upper bound on the calls to _g in a function body: any call to it also matches this byte pattern
+static int count_guard_calls(
+    uint8_t*    p,
+    uint8_t*    end,
+    uint64_t    guard_idx)
+{
+    int n = 0;
+    for (; p < end; ++p)
+    {
+        if (*p != 0x10U)
+            continue;
+        uint64_t v = 0;
+        for (int shift = 0; p + 1 + shift / 7 < end && shift < 35; shift += 7)
+        {
+            uint8_t b = p[1 + shift / 7];
+            v |= (uint64_t)(b & 0x7FU) << shift;
+            if (!(b & 0x80U))
+            {
+                n += (v == guard_idx);
+                break;
+            }
+        }
+    }
+    return n;
 }
 
 int cleaner (
     uint8_t*    w,      // web assembly input buffer
-    uint8_t*    o,      // web assembly output buffer
-    ssize_t*    len)    // length of input buffer when called, and len of output buffer when returned
+    uint8_t**   out,    // set to the web assembly output, allocated from `a`
+    ssize_t*    len,    // length of input buffer when called, and len of output buffer when returned
+    arena*      a,
+    reloc_map*  map,    // if not null, filled with the output -> input offset of every retained instruction
+    uint64_t    max_work,   // bytes scanned plus bytes moved before giving up, 0 for no limit
+    out_segs*   segs)   // if not null, sections copied as is are left in the input and the output goes here
 {
-    // require at least `need` bytes
+    // require at least `need` bytes, and that every leb128 read so far was well formed
     #define REQUIRE(need)\
     {\
+        if (bad_leb)\
+            return fprintf(stderr, "Truncated or overlong leb128 before position %ld [0x%lx]. SrcLine: %d\n",\
+                    ((uint64_t)(w - wstart)), ((uint64_t)(w - wstart)), __LINE__);\
         if (DEBUG && DEBUG_VERBOSE)\
             fprintf(stderr, "Require %ld b\tfrom 0x%lX to 0x%lX\n",\
                 ((uint64_t)(need)),\
@@ -128,13 +228,32 @@ int cleaner (
     }
 
     
+    // a declared count of items taking at least `min` bytes each has to fit in the bytes left before `end`
+    #define COUNT(count, min, end)\
+    {\
+        REQUIRE(0);\
+        if ((uint64_t)(count) > (uint64_t)((end) - w) / (min))\
+            return fprintf(stderr, "Declared count %ld at 0x%lX exceeds the remaining %ld bytes. SrcLine: %d\n",\
+                    ((uint64_t)(count)), ((uint64_t)(w - wstart)), ((uint64_t)((end) - w)), __LINE__);\
+    }
+
+    // account for `n` bytes scanned or moved
+    #define WORK(n)\
+    {\
+        work += (n);\
+        if (max_work && work > max_work)\
+            return fprintf(stderr, "Work budget of %ld bytes exceeded at position %ld\n",\
+                    max_work, ((uint64_t)(w - wstart)));\
+    }
+
+    // a leb128 that didn't advance was truncated or overlong, REQUIRE reports it
     #define LEB()\
-        (tmp2=w-wstart,tmp=leb(&w, wend, 0),\
+        (tmp2=w-wstart,tmp=leb(&w, wend, 0),bad_leb|=(w-wstart==tmp2),\
         (DEBUG && DEBUG_VERBOSE &&\
         fprintf(stderr, "Leb read at 0x%lX: %ld\n", tmp2, tmp)),tmp)
 
     #define SIGNED_LEB()\
-        (tmp2=w-wstart,tmp=leb(&w, wend, 1),\
+        (tmp2=w-wstart,tmp=leb(&w, wend, 1),bad_leb|=(w-wstart==tmp2),\
         (DEBUG && DEBUG_VERBOSE &&\
         fprintf(stderr, "Signed Leb read at 0x%lX: %ld\n", tmp2, tmp)),tmp)
 
@@ -142,6 +261,11 @@ int cleaner (
     ssize_t     wlen = *len;
     uint8_t*    wend = w + wlen;
     uint64_t    tmp, tmp2;
+    int         bad_leb = 0;
+    uint64_t    work = 0;
+
+    // each pass scans the input once, everything else is accounted for as it happens
+    WORK(2 * (uint64_t)wlen);
 
     // read magic number
     REQUIRE(4);
@@ -166,21 +290,28 @@ int cleaner (
     int func_cbak = -1;
     int mem_export = -1; // RH UPTO: find out what memory is exported and carry it over (do we need this??)
    
+    int     import_count = -1;      // the number of function imports in the input
     int     out_import_count = -1;  // the number of imports there will be in the output file
     ssize_t out_import_size = 0;    // the size ofthe import section in the output
+    ssize_t import_size[MAX_FUNCS]; // the size of each function import's entry
+    uint8_t import_used[MAX_FUNCS]; // whether hook() or cbak() calls it
+    int     import_new[MAX_FUNCS];  // its index in the output, -1 if it's dropped
+    memset(import_used, 0, sizeof(import_used));
     
-    ssize_t out_code_size = 0;
 
     int func_count = -1;
     int hook_cbak_type = -1;
     int func_type[MAX_FUNCS];    // each function we discover import/func has its type id recorded here
-    struct {
-        uint8_t set;
-        uint8_t rc;
-        uint8_t r[30];
-        uint8_t pc;
-        uint8_t p[31];
-    } types[MAX_TYPES];
+    type_info* types = arena_alloc(a, sizeof(type_info) * MAX_TYPES);
+    if (!types)
+        return 1;
+
+    // the first pass works out the exact size of everything but guard rewrites, see below
+    ssize_t out_size = 8;           // magic number and version
+    uint64_t sections_seen = 0;     // bit per section id < 64
+    ssize_t out_code_bodies = 0;    // retained bodies with their sizes, including guard rewrite reservations
+    int guard_calls = 0;            // upper bound on the guards that may need rewriting
+    int sections_left = 0;          // sections pass two will leave in the input, each adds two pieces to segs
 
     for (int x = 0; x < MAX_TYPES; ++x)
     {
@@ -213,11 +344,30 @@ int cleaner (
 
         next_section_start = w + section_len;
 
+        if (section_type < 64)
+            sections_seen |= (1ULL << section_type);
+
         switch (section_type)
         {
+            case 0x05U: // memory
+            case 0x06U: // globals
+            case 0x0BU: // data
+            case 0x0CU: // data count
+            {
+                // copied as is, or only their headers when they stay in the input (while segs has room for them)
+                int left = (segs && 2 * sections_left + 3 <= MAX_OUT_SEGS);
+                sections_left += left;
+                out_size += 1 + leb_len(section_len) + (left ? 0 : section_len);
+                ADVANCE(section_len);
+                continue;
+            }
+
             case 0x01U: // types
             {
-                int type_count = LEB();
+                uint64_t type_count = LEB();
+                COUNT(type_count, 3, next_section_start);
+                if (type_count > MAX_TYPES)
+                    return fprintf(stderr, "Unsupported number of types: %ld\n", type_count);
                 for (int i = 0; i < type_count; ++i)
                 {
                     REQUIRE(1);
@@ -226,7 +376,11 @@ int cleaner (
                                 (w - wstart));
                     ADVANCE(1);
 
-                    int param_count = LEB();
+                    uint64_t param_count = LEB();
+                    COUNT(param_count, 1, next_section_start);
+                    if (param_count > sizeof(types[i].p))
+                        return fprintf(stderr, "Type %d has %ld params, at most %ld are supported\n",
+                                i, param_count, sizeof(types[i].p));
 
                     types[i].pc = param_count;
 
@@ -241,11 +395,14 @@ int cleaner (
 
                     }
 
-                    int result_count = LEB();
+                    uint64_t result_count = LEB();
+                    COUNT(result_count, 1, next_section_start);
+                    if (result_count > sizeof(types[i].r))
+                        return fprintf(stderr, "Type %d has %ld results, at most %ld are supported\n",
+                                i, result_count, sizeof(types[i].r));
                     types[i].set = 1;
                     types[i].rc = result_count;
 
-                    if (result_count == 1)
                     for (int j = 0; j < result_count; ++j)
                     {
                         int result_type = LEB();
@@ -268,9 +425,10 @@ int cleaner (
             case 0x02U: // imports
             {
                 // just get an import count
-                int count = LEB();
+                uint64_t count = LEB();
+                COUNT(count, 4, next_section_start);
                 if (DEBUG)
-                    fprintf(stderr, "Import count: %d\n", count);
+                    fprintf(stderr, "Import count: %ld\n", count);
 
                 int func_upto = 0;
 
@@ -278,14 +436,14 @@ int cleaner (
                 {
                     uint8_t* import_start = w;
                     // module name
-                    int mod_length = LEB();
+                    uint64_t mod_length = LEB();
                     REQUIRE(mod_length);
                     if (mod_length != 3 || w[0] != 'e' || w[1] != 'n' || w[2] != 'v')
                         return fprintf(stderr, "Did not import only from module 'env'\n");
                     ADVANCE(mod_length);
 
                     // import name
-                    int name_length = LEB();
+                    uint64_t name_length = LEB();
                     REQUIRE(name_length);
                     if (name_length == 2 && w[0] == '_' && w[1] == 'g')
                     {
@@ -307,10 +465,10 @@ int cleaner (
 
                         if (import_type == 0x01U)
                         {
-                            // table type
-                            REQUIRE(1);
+                            // table type: reftype, then limits
+                            REQUIRE(2);
                             ADVANCE(1);
-                            int dualLimit = (*w == 0x00U);
+                            int dualLimit = (*w & 0x01U);
                             ADVANCE(1);
                             LEB();
                             if (dualLimit)
@@ -318,8 +476,10 @@ int cleaner (
                         }
                         else if (import_type == 0x02U)
                         {
-                            // mem type
-                            int dualLimit = (*w == 0x00U);
+                            // mem type: limits
+                            REQUIRE(1);
+                            int dualLimit = (*w & 0x01U);
+                            ADVANCE(1);
                             LEB();
                             if (dualLimit)
                                 LEB();
@@ -333,34 +493,47 @@ int cleaner (
                     else
                     {
                         uint64_t import_idx = LEB();
+                        if (func_upto >= MAX_FUNCS)
+                            return fprintf(stderr, "Unsupported number of imports, at most %d are\n", MAX_FUNCS);
+                        if (import_idx >= MAX_TYPES)
+                            return fprintf(stderr, "Import %d type %ld out of range\n", func_upto, import_idx);
+                        import_size[func_upto] = (w - import_start);
                         func_type[func_upto++] = import_idx;
-                        out_import_size += (w - import_start);
                         if (DEBUG)
-                            fprintf(stderr, "Import %d type %ld out_import_size = %ld\n",
-                                func_upto, import_idx, out_import_size);
+                            fprintf(stderr, "Import %d type %ld size = %ld\n",
+                                func_upto, import_idx, import_size[func_upto - 1]);
                     }
                 }
 
-                out_import_count = func_upto;
+                import_count = func_upto;
 
-                if (out_import_count > 127*127)
-                    return fprintf(stderr, "Unsupported number of imports: %d\n", out_import_count);
-
-                out_import_size += (out_import_count <= 127 ? 1U : 2U);
+                if (import_count > 127*127)
+                    return fprintf(stderr, "Unsupported number of imports: %d\n", import_count);
                 continue;
             }
 
             case 0x03U: // funcs
             {
-                func_count = LEB();
+                // without an import section there's no _g, which is reported once the whole module is read
+                if (import_count < 0)
+                    import_count = 0;
+                uint64_t count = LEB();
+                COUNT(count, 1, next_section_start);
+                if (import_count + count > MAX_FUNCS)
+                    return fprintf(stderr, "Unsupported number of functions: %ld, at most %d with imports\n",
+                            count, MAX_FUNCS);
+                func_count = count;
                 if (DEBUG)
                     fprintf(stderr, "Function count: %d\n", func_count);
                 for (int i = 0; i < func_count; ++i)
                 {
-                    func_type[out_import_count + i] = LEB();
+                    func_type[import_count + i] = LEB();
+                    if (func_type[import_count + i] < 0 || func_type[import_count + i] >= MAX_TYPES)
+                        return fprintf(stderr, "Func %d type %d out of range\n",
+                                import_count + i, func_type[import_count + i]);
                     if (DEBUG)
                         fprintf(stderr, "Func %d is type %d\n",
-                            out_import_count + i, func_type[out_import_count + i]);
+                            import_count + i, func_type[import_count + i]);
                 }
                 continue;
             }
@@ -372,6 +545,7 @@ int cleaner (
                 uint8_t* export_end = w + section_len; 
     
                 uint64_t export_count = LEB();
+                COUNT(export_count, 3, export_end);
             
                 for (uint64_t i = 0; i < export_count; ++i)
                 {
@@ -422,15 +596,22 @@ int cleaner (
             case 0x0AU:
             {
                 uint64_t code_count = LEB();
+                COUNT(code_count, 2, next_section_start);
                 for (uint64_t i = 0; i < code_count; ++i)
                 {
-                    uint8_t* code_start = w;
                     uint64_t code_size = LEB();
+                    uint8_t* body_start = w;
 
                     ADVANCE(code_size);
 
-                    if (i == (func_hook - out_import_count) || i == (func_cbak - out_import_count))
-                        out_code_size += (w - code_start);
+                    if (i == (func_hook - import_count) || i == (func_cbak - import_count))
+                    {
+                        mark_import_calls(body_start, w, import_count, import_used);
+                        int calls = count_guard_calls(body_start, w, guard_func_idx);
+                        uint64_t body_max = code_size + (uint64_t)calls * MAX_GUARD_REWRITE;
+                        out_code_bodies += leb_len(body_max) + body_max;
+                        guard_calls += calls;
+                    }
     
                 }
                 continue;
@@ -455,6 +636,101 @@ int cleaner (
     if (guard_func_idx == -1)
         return fprintf(stderr, "Guard function _g was not imported / missing.\n");
 
+    // only the imports hook() and cbak() call are kept, and _g, which every hook must import
+    import_used[guard_func_idx] = 1;
+    out_import_count = 0;
+    for (int i = 0; i < import_count; ++i)
+    {
+        import_new[i] = (import_used[i] ? out_import_count++ : -1);
+        if (import_used[i])
+            out_import_size += import_size[i];
+        else if (DEBUG)
+            fprintf(stderr, "Dropping unused import %d\n", i);
+    }
+    out_import_size += leb_len(out_import_count);
+
+    // plan the output type section: the types of the retained imports in order of first use, then hook/cbak's
+    int type_new[MAX_TYPES];
+    memset(type_new, 0, sizeof(type_new));
+
+    int type_order[MAX_TYPES];
+    int out_type_count = 0;
+    ssize_t out_type_size = 0;
+    int imports_use_hook_cbak_type = 0;
+    {
+        uint8_t used[MAX_TYPES];
+        memset(used, 0, MAX_TYPES);
+        for (int i = 0; i < import_count; ++i)
+        {
+            if (!import_used[i])
+                continue;
+            int t = func_type[i];
+            if (!types[t].set)
+                return fprintf(stderr, "Tried to write unset type %d from func %d\n", t, i);
+            if (used[t])
+                continue;
+            used[t] = 1;
+            type_order[out_type_count] = t;
+            type_new[t] = out_type_count++;
+            out_type_size += 3U + types[t].rc + types[t].pc;
+            if (t == hook_cbak_type && !imports_use_hook_cbak_type)
+            {
+                imports_use_hook_cbak_type = 1;
+                if (DEBUG)
+                    fprintf(stderr, "Imports DO use hook_cbak_type = %d\n", type_new[t]);
+            }
+        }
+
+        if (imports_use_hook_cbak_type)
+            hook_cbak_type = type_new[hook_cbak_type];
+        else
+        {
+            hook_cbak_type = out_type_count++;
+            out_type_size += 5U;
+            if (DEBUG)
+                fprintf(stderr, "Imports do not use hook_cbak_type = %d\n", hook_cbak_type);
+        }
+
+        if (out_type_count > 127*127)
+            return fprintf(stderr, "Too many types in wasm!\n");
+
+        // account for the type vector size bytes
+        out_type_size += (out_type_count > 127 ? 2U : 1U);
+    }
+
+    if (hook_cbak_type > 127U*127U)
+        return fprintf(stderr, "Illegally large hook_cbak type index\n");
+
+    ssize_t out_func_size = (func_cbak == -1 ? 0x01U : 0x02U);
+    if (hook_cbak_type > 127U)
+        out_func_size <<= 1U;   // double size if > 127
+    out_func_size++;            // one byte for the vector size
+
+    if (sections_seen & (1ULL << 0x01U))
+        out_size += 1 + leb_len(out_type_size) + out_type_size;
+    if (sections_seen & (1ULL << 0x02U))
+        out_size += 1 + leb_len(out_import_size) + out_import_size;
+    if (sections_seen & (1ULL << 0x03U))
+        out_size += 1 + leb_len(out_func_size) + out_func_size;
+    if (sections_seen & (1ULL << 0x07U))
+        out_size += 2 + (func_cbak == -1 ? 0x08U : 0x0FU);
+
+    // A dirty guard rewrite inserts a fresh guard at the loop head, so the body grows by at most
+    // MAX_GUARD_REWRITE per rewrite and there is at most one rewrite per call to _g. That's reserved up front
+    // (see the code section above) and each rewrite is checked against it.
+    if (sections_seen & (1ULL << 0x0AU))
+        out_size += 1 + leb_len(1 + out_code_bodies) + 1 + out_code_bodies;
+
+    if (DEBUG)
+        fprintf(stderr, "Output size: %ld bytes, including %d x %d bytes reserved for guard rewrites\n",
+                out_size, guard_calls, MAX_GUARD_REWRITE);
+
+    uint8_t* o = arena_alloc(a, out_size);
+    if (!o)
+        return 1;
+    *out = o;
+    int guard_rewrites = 0;
+
     // reset to top
     w = wstart;
 
@@ -465,13 +741,26 @@ int cleaner (
 
     uint8_t* ostart = o;
 
+    // with segs the output is the cleaner's own bytes up to seg_start, then each section left in the input and the
+    // own bytes written after it in turn. Map offsets count the skipped sections too
+    ssize_t skipped = 0;
+    uint8_t* seg_start = o;
+    if (segs)
+        *segs = (out_segs){ .count = 0 };
+    #define OUT_OFF(p) ((p) - ostart + skipped)
+
+    // what's written next has to fit in what the first pass reserved
+    #define OUT_ROOM(n)\
+    {\
+        if ((uint64_t)(o - ostart) + (uint64_t)(n) > (uint64_t)out_size)\
+            return fprintf(stderr, "Internal sanity check failed. %ld bytes at output offset %ld overrun the %ld "\
+                    "reserved. SrcLine: %d\n", ((uint64_t)(n)), ((uint64_t)(o - ostart)), out_size, __LINE__);\
+    }
+
     // magic number and version: 8 bytes
     for (int i = 0; i < 8; ++i)
         *o++ = *w++;
 
-    int type_new[MAX_TYPES];
-    memset(type_new, 0, sizeof(type_new));
-
     next_section_start = 0;
 
     while (w < wend)
@@ -510,14 +799,27 @@ int cleaner (
             }
 
             case 0x05U: // memory
+            case 0x06U: // globals
             case 0x0BU: // data section
             case 0x0CU: // data count section
             {
-                // copied as is
+                // copied as is, or left in place with segs
+                OUT_ROOM(1 + leb_len(section_len));
                 *o++ = section_type;
                 leb_out(section_len, &o);
-                memcpy(o, w, section_len);
-                o += section_len;
+                if (segs && segs->count + 3 <= MAX_OUT_SEGS)
+                {
+                    segs->s[segs->count++] = (struct iovec){ .iov_base = seg_start, .iov_len = o - seg_start };
+                    segs->s[segs->count++] = (struct iovec){ .iov_base = w, .iov_len = section_len };
+                    seg_start = o;
+                    skipped += section_len;
+                }
+                else
+                {
+                    OUT_ROOM(section_len);
+                    memcpy(o, w, section_len);
+                    o += section_len;
+                }
                 ADVANCE(section_len);
                 continue;
             }
@@ -526,83 +828,35 @@ int cleaner (
             {
                 ADVANCE(section_len);
 
+                OUT_ROOM(1 + leb_len(out_type_size) + out_type_size);
                 *o++ = 0x01U;   // write section type
 
-                uint8_t used[MAX_TYPES];
-                memset(used, 0, MAX_TYPES);
-
-                // count types
-                int type_count = 0;
-                int imports_use_hook_cbak_type = 0;
-                int section_size = 0;
-                for (int i = 0; i < out_import_count; ++i)
-                {
-                    if (!used[func_type[i]])
-                    {
-                        type_count++;
-                        used[func_type[i]] = 1;
-                        section_size += 3U + types[func_type[i]].rc + types[func_type[i]].pc;
-                        if (func_type[i] == hook_cbak_type && !imports_use_hook_cbak_type)
-                        {
-                            imports_use_hook_cbak_type = 1;
-                            hook_cbak_type = type_count-1;
-                            if (DEBUG)
-                                fprintf(stderr, "Imports DO use hook_cbak_type = %d\n", hook_cbak_type);
-                        }
-                    }
-                }
-                
-                if (!imports_use_hook_cbak_type)
-                {
-                    hook_cbak_type = type_count++;
-                    section_size += 5U;
-                    if (DEBUG)
-                        fprintf(stderr, "Imports do not use hook_cbak_type = %d\n", hook_cbak_type);
-                }
-                
-                if (type_count > 127*127)
-                    return fprintf(stderr, "Too many types in wasm!\n");
-
-                // account for the type vector size bytes
-                section_size += (type_count > 127 ? 2U : 1U);
-
                 if (DEBUG)
-                    fprintf(stderr, "Writing type section, proposed size: %d\n", section_size);
-                // write out section size
-                leb_out(section_size, &o);
-
+                    fprintf(stderr, "Writing type section, size: %ld\n", out_type_size);
+                leb_out(out_type_size, &o);
 
                 uint8_t* out_start = o;
 
                 // write type vector len
-                leb_out(type_count, &o);
+                leb_out(out_type_count, &o);
 
-                // write out types
-                memset(used, 0, MAX_TYPES);
-                int upto = 0;
-                for (int i = 0; i < out_import_count; ++i)
+                // write out the types used by imports
+                for (int i = 0; i < out_type_count; ++i)
                 {
-                    int t = func_type[i];
-                    if (!types[t].set)
-                        return fprintf(stderr, "Tried to write unset type %d from func %d\n", func_type[i], i);
-                    
-
-                    if (used[t])
-                        continue;
-                    used[t] = 1;
+                    if (!imports_use_hook_cbak_type && i == hook_cbak_type)
+                        break;
 
+                    int t = type_order[i];
                     *o++ = 0x60U;   // functype lead in byte
                     // write parameter count
                     leb_out(types[t].pc, &o);
                     // write each parameter type
                     for (int j = 0; j < types[t].pc; ++j)
                         leb_out(types[t].p[j], &o);
-                
+
                     leb_out(types[t].rc, &o);
                     for (int j = 0; j < types[t].rc; ++j)
                         leb_out(types[t].r[j], &o);
-
-                    type_new[t] = upto++;
                     // done for this record
                 }
 
@@ -623,7 +877,8 @@ int cleaner (
 
             case 0x02U: // imports
             {
-                *o++ = 0x02U;   
+                OUT_ROOM(1 + leb_len(out_import_size) + out_import_size);
+                *o++ = 0x02U;
 
                 if (DEBUG)
                 {
@@ -635,24 +890,24 @@ int cleaner (
                 uint8_t* import_start = o;
                 leb_out(out_import_count, &o);
 
-                int type_count = 0;
-                
-                int count = LEB();
+                int func_upto = 0;
+                uint64_t count = LEB();
                 for (int i = 0; i < count; ++i)
                 {
                     // module name
-                    int mod_length = LEB();
+                    uint64_t mod_length = LEB();
                     REQUIRE(mod_length);
                     uint8_t* mod = w;
                     ADVANCE(mod_length);
 
                     // import name
-                    int name_length = LEB();
+                    uint64_t name_length = LEB();
                     REQUIRE(name_length);
                     uint8_t* name = w;
                     ADVANCE(name_length);
 
                     // only function imports
+                    REQUIRE(1);
                     if (*w != 0x00U)
                     {
                         int it = *w;
@@ -660,10 +915,10 @@ int cleaner (
 
                         if (it == 0x01U)
                         {
-                            // table type
-                            REQUIRE(1);
+                            // table type: reftype, then limits
+                            REQUIRE(2);
                             ADVANCE(1);
-                            int dualLimit = (*w == 0x00U);
+                            int dualLimit = (*w & 0x01U);
                             ADVANCE(1);
                             LEB();
                             if (dualLimit)
@@ -671,8 +926,10 @@ int cleaner (
                         }
                         else if (it == 0x02U)
                         {
-                            // mem type
-                            int dualLimit = (*w == 0x00U);
+                            // mem type: limits
+                            REQUIRE(1);
+                            int dualLimit = (*w & 0x01U);
+                            ADVANCE(1);
                             LEB();
                             if (dualLimit)
                                 LEB();
@@ -687,6 +944,13 @@ int cleaner (
 
                     ADVANCE(1);
 
+                    int fi = func_upto++;
+                    if (!import_used[fi])
+                    {
+                        LEB(); // skip type
+                        continue;
+                    }
+
                     // write mod 
                     leb_out(mod_length, &o);
                     memcpy(o, mod, mod_length);
@@ -701,10 +965,11 @@ int cleaner (
                     *o++ = 0x00U;
 
                     if (DEBUG)
-                        fprintf(stderr, "New import: %d old type: %d new type: %d\n", i, func_type[i], type_new[func_type[i]]);
+                        fprintf(stderr, "New import: %d old type: %d new type: %d\n", import_new[fi], func_type[fi],
+                                type_new[func_type[fi]]);
 
                     // write new type idx
-                    leb_out(type_new[func_type[i]], &o);
+                    leb_out(type_new[func_type[fi]], &o);
 
                     LEB(); // discard old type
                     // advance to next entry
@@ -718,19 +983,13 @@ int cleaner (
 
             case 0x03U: // functions
             {
+                OUT_ROOM(1 + leb_len(out_func_size) + out_func_size);
                 *o++ = 0x03U;
-                
 
-                ssize_t s = (func_cbak == -1 ? 0x01U : 0x02U);
-                if (hook_cbak_type > 127U*127U)
-                    return fprintf(stderr, "Illegally large hook_cbak type index\n");
-                if (hook_cbak_type > 127U)
-                    s <<= 1U;   // double size if > 127
-                s++;            // one byte for the vector size
                 if (DEBUG)
-                    fprintf(stderr, "Writing function section, proposed size: %ld\n", s);
+                    fprintf(stderr, "Writing function section, size: %ld\n", out_func_size);
 
-                leb_out(s, &o); // sections size
+                leb_out(out_func_size, &o); // sections size
                 uint8_t* function_start = o;
                 *o++ = (func_cbak == -1 ? 0x01U : 0x02U);   // vector size
                 leb_out(hook_cbak_type, &o);    // vector entries
@@ -747,19 +1006,9 @@ int cleaner (
                 continue;
             }
 
-            case 0x06U: // globals
-            {
-                // globals are copied byte for byte
-                *o++ = 0x06U;
-                leb_out(section_len, &o);
-                memcpy(o, w, section_len);
-                o += section_len;
-                ADVANCE(section_len);
-                continue;
-            }
-
             case 0x07U: // exports
             {
+                OUT_ROOM(2 + (func_cbak == -1 ? 0x08U : 0x0FU));
                 *o++ = 0x07U;
                 
                 // size
@@ -805,56 +1054,39 @@ int cleaner (
 
             case 0x0AU: // code section (aka function body)
             {
+                OUT_ROOM(2);
                 *o++ = 0x0AU;
 
-                if (DEBUG)
-                    fprintf(stderr, "Output code size: %ld\n", out_code_size + 1);
-
-    
                 // RH NOTE:
                 // In addition to moving a properly formed clean guard of the form { i32.const, i32.const, _g, drop }
                 // we can also reinterpret a badly formed guard like { i32.con, i32.store, ..., i32.con, _g, drop }.
                 // This becomes what's known as a guard rewrite. In this case additional instructions beyond the
-                // original size of the hook will be inserted at the start of the relevant loop. This counter tracks
-                // these, and the reserved space allows us to output the right LEB128 at the end.
-                int total_guard_rewrite_bytes = 0;
-                uint8_t* codesec_out_size_ptr = o;
-
-
-
-                // we need to correct this at the end
-                leb_out_pad(out_code_size + 1 /* allow for vec len */, &o, 3);
+                // original size of the hook will be inserted at the start of the relevant loop. So the section and
+                // body sizes are only known once they are written: each is written first and its size is inserted
+                // in front of it afterwards, minimally encoded.
+                uint8_t* codesec_start = o;
 
                 *o++ = (func_cbak == -1 ? 0x01U : 0x02U); // vec len
 
                 uint64_t count = LEB();
                 for (uint64_t i = 0; i < count; ++i)
                 {
-                    uint8_t* code_start = w;
                     uint64_t code_size = LEB();
-                    if (i == (func_hook - out_import_count) || i == (func_cbak - out_import_count))
+                    if (i == (func_hook - import_count) || i == (func_cbak - import_count))
                     {
+                        // a body writes no more than its own bytes and the guard rewrites still left, then its size
+                        uint64_t body_max = code_size + (uint64_t)(guard_calls - guard_rewrites) * MAX_GUARD_REWRITE;
+                        OUT_ROOM(leb_len(body_max) + body_max);
 
-                        //leb_out(code_size, &o);
                         int guard_rewrite_bytes = 0;
-                        uint8_t* code_size_ptr = o;
-
-                        // we need to correct this at the end
-                        leb_out_pad(code_size, &o, 3);
-                        
-                        int pad_len = 3 - (w-code_start);
-                        if (pad_len < 0)
-                            return fprintf(stderr, 
-                                    "Codesec %ld was too large! Size must fit in 3 leb128 bytes!\n", i);
-
-                        total_guard_rewrite_bytes += pad_len;
-
-
-                        //memcpy(o, code_start, w-code_start);
+                        uint8_t* code_start_out = o;
+                        uint32_t body_map_start = (map ? map->count : 0);
 
                         // parse locals
                         uint8_t* locals_start = w;
+                        uint8_t* body_end = w + code_size;
                         uint64_t locals_count = LEB();
+                        COUNT(locals_count, 2, body_end);
                         fprintf(stderr, "Locals count: %ld\n", locals_count);
                         for (int i = 0; i < locals_count; ++i)
                         {
@@ -862,6 +1094,9 @@ int cleaner (
                             REQUIRE(1); // local type
                             ADVANCE(1);
                         }
+                        if (w >= body_end)
+                            return fprintf(stderr, "Locals of the body at 0x%lX run past its end\n",
+                                    locals_start - wstart);
 
                         memcpy(o, locals_start, w-locals_start);
                         o += (w-locals_start);
@@ -874,6 +1109,7 @@ int cleaner (
                         // parse code
                         uint8_t* last_loop = 0;         // where the start of the last loop instruction is in the input
                         uint8_t* last_loop_out = 0;     // where the start of the last loop instruction is in the output
+                        uint32_t last_loop_map = 0;     // the first map entry after it, nothing before it moves
 
                         int i32_found = 0;
                         uint8_t* call_guard_found = 0;
@@ -883,6 +1119,21 @@ int cleaner (
                         uint64_t second_last_i32_actual = 0; // the actual leb value
                         int between_const_and_guard = 0;
 
+                        // -O0 code passes the guard's arguments through locals set from constants, so what is
+                        // pushed is followed that far to tell the id from the bound
+                        struct { uint64_t idx; uint64_t val; uint8_t* at; } const_local[8];
+                        int const_locals = 0;
+                        uint8_t* last_i32_end = 0;
+                        uint64_t arg_val[2] = { 0 };
+                        uint8_t* arg_at[2] = { 0 };     // the i32.const each came from, 0 if it isn't known
+                        uint8_t* recent[3] = { 0 };     // where the last three instructions start
+                        uint8_t* guard_gets = 0;        // the two gets or constants right before the guard call
+
+                        // nothing in the body may read past its end, the output only has room for the body
+                        uint8_t* input_end = wend;
+                        wend = body_end;
+                        wlen = body_end - wstart;
+
                         #define RESET_GUARD_FINDER()\
                         {\
                             i32_found = 0;\
@@ -892,17 +1143,37 @@ int cleaner (
                             second_last_i32 = 0;\
                             second_last_i32_actual = 0;\
                             between_const_and_guard = 0;\
+                            const_locals = 0;\
+                            arg_at[0] = arg_at[1] = 0;\
+                            guard_gets = 0;\
+                        }
+
+                        #define PUSH_GUARD_ARG(v, p)\
+                        {\
+                            arg_val[0] = arg_val[1];\
+                            arg_at[0] = arg_at[1];\
+                            arg_val[1] = (v);\
+                            arg_at[1] = (p);\
                         }
 
 
                         while (w - expr_start < expr_size)
                         {
                             uint8_t* instr_start = w;
+                            reloc_add(map, OUT_OFF(o), instr_start - wstart);
+                            recent[0] = recent[1];
+                            recent[1] = recent[2];
+                            recent[2] = instr_start;
 
                             REQUIRE(1);
                             uint8_t ins = *w;
                             ADVANCE(1);
 
+                            // anything but constants moving through locals makes the arguments unknown
+                            if (ins != 0x41U && (ins < 0x20U || ins > 0x22U) && ins != 0x10U && ins != 0x1AU &&
+                                ins != 0x01U)
+                                arg_at[0] = arg_at[1] = 0;
+
                             if (ins == 0x02U || ins == 0x03U || ins == 0x04U) // block, loop, if
                             {
                                 REQUIRE(1);
@@ -924,6 +1195,7 @@ int cleaner (
                                 {
                                     last_loop = w;
                                     last_loop_out = o;
+                                    last_loop_map = (map ? map->count : 0);
                                 }
                                 
                                 RESET_GUARD_FINDER();    
@@ -940,8 +1212,17 @@ int cleaner (
                                     if (between_const_and_guard > 0)
                                     {
 
-                                        if (second_last_i32_actual < last_i32_actual)
+                                        if (arg_at[0] && arg_at[1])
                                         {
+                                            // _g(id, maxiter), in the order the call takes them
+                                            second_last_i32 = arg_at[0];
+                                            second_last_i32_actual = arg_val[0];
+                                            last_i32 = arg_at[1];
+                                            last_i32_actual = arg_val[1];
+                                        }
+                                        else if (second_last_i32_actual < last_i32_actual)
+                                        {
+                                            // not followed, take the larger for the id
                                             uint64_t swap = last_i32_actual;
                                             last_i32_actual = second_last_i32_actual;
                                             second_last_i32_actual = swap;
@@ -954,11 +1235,15 @@ int cleaner (
                                         *g++ = 0x41U;
                                         leb_out(last_i32_actual, &g);
                                         *g++ = 0x10U;
-                                        leb_out(guard_func_idx, &g);
+                                        leb_out(import_new[guard_func_idx], &g);
                                         *g++ = 0x1AU;
 
                                         ssize_t guard_len = g - guard_code;
-                                        ssize_t rest_len = w - last_loop;
+
+                                        if (guard_len > MAX_GUARD_REWRITE || ++guard_rewrites > guard_calls)
+                                            return fprintf(stderr, "Guard rewrite at 0x%lX doesn't fit the %d "
+                                                    "bytes reserved for it\n", second_last_i32 - wstart,
+                                                    MAX_GUARD_REWRITE);
 
                                         char guard_print[128]; guard_print[0] = '\0';
                                         snprintf(guard_print, 128, "_g(0x%08lx,%ld)", second_last_i32_actual,
@@ -986,27 +1271,55 @@ int cleaner (
                                                 last_loop - wstart + guard_len
                                             );
 
-                                        // erase guard call with nops and an additional drop
-                                        // to preserve the stack at this location during runtime
-                                        int bytes_to_fill = w - call_guard_found - 2;
-                                        *call_guard_found = 0x1AU;                      // drop
-                                        while (bytes_to_fill-- > 0)
-                                            *(++call_guard_found) = 0x01U;              // nop
-
-                                        // first move the instructions down
-                                        memcpy(last_loop_out + guard_len, last_loop, rest_len);
-
-                                        // then copy the guard into position
+                                        // The old call goes, and so do its arguments when they're the two
+                                        // local.gets or constants right before it. Otherwise two drops take them
+                                        // off the stack. Either way the loop runs no more instructions than it did.
+                                        static const uint8_t drops[2] = { 0x1AU, 0x1AU };
+                                        uint8_t* guard_call = call_guard_found;
+                                        uint8_t* cut = (guard_gets ? guard_gets : call_guard_found);
+                                        ssize_t keep_len = cut - last_loop;
+                                        ssize_t fill_len = (guard_gets ? 0 : 2);
+
+                                        // a loop's instructions move at most once, so moves add up to the body size
+                                        WORK(keep_len + guard_len);
+
+                                        // the removed instructions were the last to be mapped
+                                        uint32_t cut_out = OUT_OFF(last_loop_out + keep_len);
+                                        while (map && map->count > last_loop_map &&
+                                               map->e[map->count - 1].out >= cut_out)
+                                            map->count--;
+
+                                        // first move the instructions down, then copy the guard into position
+                                        memcpy(last_loop_out + guard_len, last_loop, keep_len);
+                                        memcpy(last_loop_out + guard_len + keep_len, drops, fill_len);
                                         memcpy(last_loop_out, guard_code, guard_len);
 
+                                        // everything from the loop head on moved up, the new guard maps back to
+                                        // the instructions of the one it replaces
+                                        if (map)
+                                        {
+                                            uint32_t at = OUT_OFF(last_loop_out);
+                                            uint32_t second = at + 1 + leb_len(second_last_i32_actual);
+                                            uint32_t call = second + 1 + leb_len(last_i32_actual);
+                                            reloc_shift(map, last_loop_map, at, guard_len);
+                                            reloc_add(map, at, second_last_i32 - wstart);
+                                            reloc_add(map, second, last_i32 - wstart);
+                                            reloc_add(map, call, guard_call - wstart);
+                                            reloc_add(map, at + guard_len - 1, (w - 1) - wstart);
+                                            if (fill_len)
+                                            {
+                                                reloc_add(map, cut_out + guard_len, guard_call - wstart);
+                                                reloc_add(map, cut_out + guard_len + 1, (w - 1) - wstart);
+                                            }
+                                        }
+
                                         // prevent moving a second guard here if somehow there is one
                                         last_loop = 0;
 
                                         RESET_GUARD_FINDER();
 
-                                        guard_rewrite_bytes += guard_len;
-                                        total_guard_rewrite_bytes += guard_len;
-                                        o += guard_len;
+                                        guard_rewrite_bytes += guard_len + fill_len - (w - cut);
+                                        o = last_loop_out + guard_len + keep_len + fill_len;
                                     }
                                     else
                                     {
@@ -1024,12 +1337,18 @@ int cleaner (
                                                 last_loop - wstart + guard_len
                                             );
 
+                                        WORK(rest_len + guard_len);
+
                                         // first move the instructions down
                                         memcpy(last_loop_out + guard_len, last_loop, rest_len);
 
                                         // then copy the guard into position
                                         memcpy(last_loop_out, second_last_i32, guard_len);
 
+                                        reloc_rotate(map, last_loop_map, OUT_OFF(last_loop_out),
+                                                OUT_OFF(last_loop_out) + rest_len,
+                                                OUT_OFF(last_loop_out) + rest_len + guard_len);
+
                                         // prevent moving a second guard here if somehow there is one
                                         last_loop = 0;
                                     }
@@ -1046,7 +1365,24 @@ int cleaner (
                                 if (f != guard_func_idx)
                                     RESET_GUARD_FINDER()
                                 else
+                                {
                                     call_guard_found = ptr;
+                                    guard_gets = (last_loop && recent[0] >= last_loop &&
+                                                  (*recent[0] == 0x20U || *recent[0] == 0x41U) &&
+                                                  (*recent[1] == 0x20U || *recent[1] == 0x41U) ? recent[0] : 0);
+                                }
+
+                                // renumber past the dropped imports. The index keeps its width and is patched in
+                                // the input too, since guard moves copy the loop back from there
+                                int64_t nf = (f < import_count ? import_new[f] :
+                                              f == func_hook || f == func_cbak ?
+                                              out_import_count + (f != (func_cbak != -1 && func_cbak < func_hook ?
+                                                  func_cbak : func_hook)) : -1);
+                                if (nf < 0)
+                                    return fprintf(stderr, "Call at 0x%lX to function %ld, which is not retained\n",
+                                            instr_start - wstart, f);
+                                uint8_t* imm = ptr + 1;
+                                leb_out_pad(nf, &imm, w - (ptr + 1));
                                 memcpy(o, instr_start, w-instr_start);
                                 o += (w - instr_start);
                                 continue;
@@ -1060,6 +1396,8 @@ int cleaner (
                                 second_last_i32_actual = last_i32_actual;
 
                                 last_i32_actual = LEB();
+                                last_i32_end = w;
+                                PUSH_GUARD_ARG(last_i32_actual, last_i32);
 
                                 memcpy(o, instr_start, w-instr_start);
                                 o += (w - instr_start);
@@ -1074,7 +1412,8 @@ int cleaner (
                             {
                                 REQUIRE(1);
                                 uint64_t vc = LEB();
-                                for (int i = 0; i < vc; ++i)
+                                COUNT(vc, 1, body_end);
+                                for (uint64_t i = 0; i < vc; ++i)
                                 {
                                     LEB();
                                 }
@@ -1114,7 +1453,35 @@ int cleaner (
                                 ins == 0x0DU)                       // br if
                             {
                                 REQUIRE(1);
-                                LEB();
+                                uint64_t idx = LEB();
+
+                                if (ins >= 0x20U && ins <= 0x22U)   // local.get set tee
+                                {
+                                    int k = 0;
+                                    while (k < const_locals && const_local[k].idx != idx)
+                                        k++;
+                                    if (ins == 0x20U)
+                                        PUSH_GUARD_ARG(k < const_locals ? const_local[k].val : 0,
+                                                       k < const_locals ? const_local[k].at : 0)
+                                    else if (instr_start == last_i32_end && k < 8)
+                                    {
+                                        const_local[k].idx = idx;
+                                        const_local[k].val = last_i32_actual;
+                                        const_local[k].at = last_i32;
+                                        const_locals += (k == const_locals);
+                                    }
+                                    else if (k < const_locals)
+                                        const_local[k] = const_local[--const_locals];
+
+                                    // a set takes its value off the stack
+                                    if (ins == 0x21U)
+                                    {
+                                        arg_val[1] = arg_val[0];
+                                        arg_at[1] = arg_at[0];
+                                        arg_at[0] = 0;
+                                    }
+                                }
+
                                 memcpy(o, instr_start, w-instr_start);
                                 o += (w - instr_start);
                                 continue;
@@ -1275,35 +1642,36 @@ int cleaner (
                                 o += (w - instr_start);
                                 continue;
                             }
+
+                            return fprintf(stderr, "Unknown opcode 0x%02X at 0x%lX\n", ins, instr_start - wstart);
                         }
-                      
-                        /*
-                            int guard_rewrite_bytes = 0;
-                            uint8_t* code_size_ptr = o;
-                        */
 
-                        fprintf(stderr, "Rewriting codesec from: %ld to %ld at %ld [0x%lx]\n",
-                                code_size,
-                                code_size + guard_rewrite_bytes,
+                        wend = input_end;
+                        wlen = input_end - wstart;
+                        if (w != body_end)
+                            return fprintf(stderr, "Body at 0x%lX doesn't end where its size says\n",
+                                    locals_start - wstart);
+
+                        fprintf(stderr, "Rewriting codesec from: %ld to %ld\n",
                                 code_size,
-                                code_size);
+                                code_size + guard_rewrite_bytes);
 
-                        leb_out_pad(code_size + guard_rewrite_bytes, /* 1 byte for vec len */
-                                &code_size_ptr, 3);
+                        reloc_shift(map, body_map_start, OUT_OFF(code_start_out), leb_len(o - code_start_out));
+                        WORK(o - code_start_out);
+                        leb_insert(code_start_out, &o, o - code_start_out);
                     }
                     else
                         ADVANCE(code_size);     // skip other functions
                 }
 
-                // rewrite the total size of the section
-                fprintf(stderr, "Rewriting codesec section from: %ld to %ld at %ld [0x%lx] \n",
-                        out_code_size + 1,
-                        out_code_size + 1 + total_guard_rewrite_bytes,
-                        out_code_size,
-                        out_code_size);
+                // the total size of the section
+                if (DEBUG)
+                    fprintf(stderr, "Output code section size: %ld\n", o - codesec_start);
 
-                leb_out_pad(out_code_size + total_guard_rewrite_bytes + 1, /* 1 byte for vec len */
-                        &codesec_out_size_ptr, 3);
+                reloc_shift(map, 0, OUT_OFF(codesec_start), leb_len(o - codesec_start));
+                OUT_ROOM(leb_len(o - codesec_start));
+                WORK(o - codesec_start);
+                leb_insert(codesec_start, &o, o - codesec_start);
                 continue;
             }
 
@@ -1317,12 +1685,190 @@ int cleaner (
 
     }
 
-    *len = (o - ostart);
+    if (o - ostart > out_size)
+        return fprintf(stderr, "Internal sanity check failed. Wrote %ld bytes into a %ld byte output\n",
+                o - ostart, out_size);
+
+    if (DEBUG)
+        fprintf(stderr, "Output size: %ld bytes written of %ld reserved\n", o - ostart, out_size);
+
+    // guard moves leave the entries out of order
+    reloc_sort(map);
+
+    if (segs)
+    {
+        segs->s[segs->count++] = (struct iovec){ .iov_base = seg_start, .iov_len = o - seg_start };
+        segs->len = OUT_OFF(o);
+    }
+
+    *len = OUT_OFF(o);
     return 0; 
 }
 
+// hex digits have no use for these, they're trimmed from hex input
+static int blank(
+    char    c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int is_hex_digit(
+    char    c)
+{
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
 
-int run(char* fnin, char* fnout)
+/*
+ * Replace the input as read with the module it holds: hex, or the hex string value of the first CreateCode key of
+ * a SetHook transaction. That's all of the JSON that's looked at, it isn't otherwise parsed or checked. Whitespace
+ * between the digits, e.g. hex wrapped over several lines, is skipped.
+ */
+static int decode_input(
+    uint8_t**   inp,
+    off_t*      len,
+    int         format,
+    arena*      a)
+{
+    char* s = (char*)*inp;
+    char* end = s + *len;
+
+    if (format == FORMAT_JSON)
+    {
+        // the key is the quoted name followed by a colon, the same quoted string as a value doesn't count
+        static const char key[] = "\"CreateCode\"";
+        char* k = s;
+        for (;; k++)
+        {
+            while (k + sizeof(key) - 1 <= end && memcmp(k, key, sizeof(key) - 1) != 0)
+                k++;
+            if (k + sizeof(key) - 1 > end)
+                return fprintf(stderr, "No CreateCode in the SetHook JSON\n");
+            char* c = k + sizeof(key) - 1;
+            while (c < end && blank(*c))
+                c++;
+            if (c < end && *c == ':')
+            {
+                s = c + 1;
+                break;
+            }
+        }
+
+        while (s < end && blank(*s))
+            s++;
+        if (s == end || *s != '"')
+            return fprintf(stderr, "CreateCode isn't a string\n");
+        s++;
+        end = memchr(s, '"', end - s);
+        if (!end)
+            return fprintf(stderr, "Unterminated CreateCode string\n");
+    }
+
+    // gather the digits at the front, in place, the codec checks them
+    char* digits = s;
+    char* d = s;
+    for (char* c = s; c < end; ++c)
+        if (!blank(*c))
+            *d++ = *c;
+    size_t n = d - digits;
+    if (n % 2)
+        return fprintf(stderr, "Input has an odd number of hex digits (%ld)\n", n);
+
+    uint8_t* w = arena_alloc(a, n / 2 + 1);
+    if (!w)
+        return 1;
+    if (hex_decode(digits, n, w))
+    {
+        size_t i = 0;
+        while (i < n && is_hex_digit(digits[i]))
+            i++;
+        return fprintf(stderr, "Invalid hex digit 0x%02X, digit %ld of the input\n", (uint8_t)digits[i], i);
+    }
+
+    fprintf(stderr, "Decoded %ld hex digits to %ld bytes\n", n, n / 2);
+    *inp = w;
+    *len = n / 2;
+    return 0;
+}
+
+/*
+ * The output as written for the text formats: the module in hex on one line, or a SetHook transaction skeleton
+ * creating it, wrapped as the tx_json of a sign request, with the HookHash alongside. Account, Fee and Sequence
+ * are left to the signer.
+ */
+static int encode_output(
+    uint8_t*    out,
+    ssize_t     len,
+    int         format,
+    const char* hash,
+    arena*      a,
+    uint8_t**   text,
+    ssize_t*    text_len)
+{
+    static const char zero[] = "0000000000000000000000000000000000000000000000000000000000000000";
+    size_t cap = 2 * len + 1024;
+    char* t = arena_alloc(a, cap);
+    if (!t)
+        return 1;
+
+    size_t n = 0;
+    if (format == FORMAT_JSON)
+        n += snprintf(t, cap,
+                "{\n"
+                "    \"tx_json\": {\n"
+                "        \"TransactionType\": \"SetHook\",\n"
+                "        \"Hooks\": [\n"
+                "            {\n"
+                "                \"Hook\": {\n"
+                "                    \"CreateCode\": \"");
+    hex_encode(out, len, t + n);
+    n += 2 * len;
+    if (format == FORMAT_JSON)
+        n += snprintf(t + n, cap - n,
+                "\",\n"
+                "                    \"HookOn\": \"%s\",\n"
+                "                    \"HookNamespace\": \"%s\",\n"
+                "                    \"HookApiVersion\": 0,\n"
+                "                    \"Flags\": 1\n"
+                "                }\n"
+                "            }\n"
+                "        ]\n"
+                "    },\n"
+                "    \"HookHash\": \"%s\"\n"
+                "}\n", zero, zero, hash);
+    else
+        t[n++] = '\n';
+
+    *text = (uint8_t*)t;
+    *text_len = n;
+    return 0;
+}
+
+// the whole of the cache file `fn`, allocated from `a`. Fails quietly if there isn't one yet
+static int read_cache(
+    const char* fn,
+    arena*      a,
+    uint8_t**   buf,
+    ssize_t*    len)
+{
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    *len = lseek(fd, 0L, SEEK_END);
+    lseek(fd, 0L, SEEK_SET);
+    *buf = (*len > 0 ? arena_alloc(a, *len) : 0);
+    ssize_t upto = 0;
+    while (*buf && upto < *len)
+    {
+        ssize_t r = read(fd, *buf + upto, *len - upto);
+        if (r <= 0)
+            break;
+        upto += r;
+    }
+    close(fd);
+    return (!*buf || upto != *len);
+}
+
+int run(char* fnin, char* fnout, run_opts* opts)
 {
     if (strlen(fnin) == 0 || (fnout && strlen(fnout) == 0))
     {
@@ -1350,10 +1896,14 @@ int run(char* fnin, char* fnout)
     }
 
 
+    // input, output and the cleaner's tables all come from one arena
+    arena a;
+    arena_init(&a, ARENA_LIMIT);
+
     // create a buffer
-    uint8_t* inp = (uint8_t*)malloc(finlen);
+    uint8_t* inp = arena_alloc(&a, finlen);
     if (!inp)
-        return fprintf(stderr, "Could not allocate %ld bytes\n", finlen);
+        return 1;
     
     // read file into buffer
     ssize_t upto = 0;
@@ -1376,14 +1926,63 @@ int run(char* fnin, char* fnout)
 
     fprintf(stderr, "Read source bytes: %ld out of %ld\n", upto, finlen);
 
+    if (opts->in_format != FORMAT_WASM && decode_input(&inp, &finlen, opts->in_format, &a))
+    {
+        arena_free(&a);
+        return 1;
+    }
 
-    uint8_t* out = (uint8_t*)malloc(finlen * 2);
-    if (!out)
-        return fprintf(stderr, "Could not allocate %ld bytes\n", finlen);
+    // the input hash identifies the module as submitted, before any rewriting
+    char hex[HOOK_HASH_SIZE * 2 + 1];
+    if (opts->hash_input)
+    {
+        uint8_t hash[HOOK_HASH_SIZE];
+        hook_hash(inp, finlen, hash);
+        hook_hash_hex(hash, hex);
+    }
+
+    reloc_map map = { 0 };
+    reloc_map* mapp = (opts->reloc_map || opts->instrument_sites ? &map : 0);
+
+    pass_stats stats;
+    pass_stats* st = (opts->pass_stats ? &stats : 0);
 
     // done with fin
     close(fin);
 
+    // the sections are hashed as read, the pipeline rewrites the input in place
+    char cache_fn[4096];
+    cache_sections cs;
+    int cache = 0;
+    if (opts->incremental)
+    {
+        if (!opts->cache && (strcmp(fnout, "-") == 0 || strcmp(fnout, "/dev/stdout") == 0))
+        {
+            arena_free(&a);
+            return fprintf(stderr, "--incremental needs a cache file (--incremental=FILE) to write to stdout\n");
+        }
+        if (opts->cache)
+            snprintf(cache_fn, sizeof(cache_fn), "%s", opts->cache);
+        else
+            snprintf(cache_fn, sizeof(cache_fn), "%s.hcc", fnout);
+        cache = (cache_scan(inp, finlen, &cs) == 0);
+        if (!cache)
+            fprintf(stderr, "Incremental: the input's sections can't be told apart, cleaning in full\n");
+    }
+
+    // analysis mode reports on the cleaned module instead of writing it out
+    if (opts->analyze)
+    {
+        ssize_t len = finlen;
+        int retval = run_passes(&inp, &len, opts, &a, 0, st, 0);
+        if (retval == 0 && st)
+            print_pass_stats(st, stderr);
+        if (retval == 0)
+            retval = analyze(inp, len, stdout);
+        arena_free(&a);
+        return retval;
+    }
+
     int fout = 1;
 
     if (strcmp(fnout, "-") != 0 && strcmp(fnout, "/dev/stdout") != 0)
@@ -1391,64 +1990,355 @@ int run(char* fnin, char* fnout)
         // open output file
         fout = open(fnout, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
         if (fout < 0)
+        {
+            arena_free(&a);
             return fprintf(stderr, "Could not open file `%s` for writing\n", fnout);
+        }
     }
 
-    // run cleaner
+    // run the pipeline, out ends up pointing at the result
     ssize_t len = finlen;
-    int retval = cleaner(inp, out, &len);
+    uint8_t* out = inp;
+    // binary output can be gathered straight from the pieces, the rest needs it in one piece
+    out_segs segs;
+    out_segs* segp = (opts->out_format == FORMAT_WASM && !opts->validate ? &segs : 0);
+    uint8_t* cached = 0;
+    ssize_t cached_len = 0;
+    int reused = 0, stale = 0;
+    if (cache && read_cache(cache_fn, &a, &cached, &cached_len) != 0)
+        fprintf(stderr, "Incremental: no cache in `%s` yet, cleaning in full\n", cache_fn);
+    else if (cache)
+        reused = (cache_reuse(cached, cached_len, inp, &cs, opts, &a, &out, &len, segp, &stale) == 0);
+
+    int retval = 0;
+    if (!reused)
+        retval = run_passes(&out, &len, opts, &a, mapp, st, segp);
+    if (retval == 0 && st && !reused)
+        print_pass_stats(st, stderr);
+    if (retval == 0 && opts->validate)
+        retval = wasm_validate(out, len);
+
+    if (retval == 0 && opts->reloc_map)
+    {
+        FILE* f = fopen(opts->reloc_map, "wb");
+        if (!f || reloc_write(mapp, f) != 0)
+            retval = fprintf(stderr, "Could not write relocation map `%s`\n", opts->reloc_map);
+        else if (DEBUG)
+            fprintf(stderr, "Wrote relocation map with %d entries\n", mapp->count);
+        if (f)
+            fclose(f);
+    }
+    reloc_free(&map);
+
+    if (!segp || segs.count == 0)
+        segs = (out_segs){ .s = { { .iov_base = out, .iov_len = len } }, .count = 1, .len = len };
+
+    // the cache is of the module in one piece, whatever form it's written in
+    if (retval == 0 && cache && (!reused || stale))
+    {
+        uint8_t* whole = (segs.count == 1 ? segs.s[0].iov_base : arena_alloc(&a, segs.len));
+        for (int i = 0, at = 0; whole && segs.count > 1 && i < segs.count; at += segs.s[i++].iov_len)
+            memcpy(whole + at, segs.s[i].iov_base, segs.s[i].iov_len);
+
+        wasm_buf b = { 0 };
+        if (whole)
+            cache_encode(&cs, opts, whole, segs.len, &b);
+        FILE* f = (whole ? fopen(cache_fn, "wb") : 0);
+        if (!f || fwrite(b.p, 1, b.len, f) != b.len)
+            retval = fprintf(stderr, "Could not write cache `%s`\n", cache_fn);
+        else if (DEBUG)
+            fprintf(stderr, "Wrote cache of %d sections, %ld bytes\n", cs.count, b.len);
+        if (f)
+            fclose(f);
+        free(b.p);
+    }
+
+    // the HookHash is always of the module, whatever form it's written in
+    char hash[HOOK_HASH_SIZE * 2 + 1];
+    if (retval == 0 && (opts->hash || opts->out_format == FORMAT_JSON))
+    {
+        sha512_ctx ctx;
+        sha512_init(&ctx);
+        for (int i = 0; i < segs.count; ++i)
+            sha512_update(&ctx, segs.s[i].iov_base, segs.s[i].iov_len);
+        uint8_t digest[64];
+        sha512_final(&ctx, digest);
+        hook_hash_hex(digest, hash);
+    }
 
-    // write output hook
+    if (retval == 0 && opts->out_format != FORMAT_WASM)
+    {
+        uint8_t* text = 0;
+        ssize_t text_len = 0;
+        retval = encode_output(out, len, opts->out_format, hash, &a, &text, &text_len);
+        segs = (out_segs){ .s = { { .iov_base = text, .iov_len = text_len } }, .count = 1, .len = text_len };
+    }
+
+    // write output hook, in one gather write of all its pieces unless the output takes several
     if (retval == 0)
     {
+        if (DEBUG && segs.count > 1)
+            fprintf(stderr, "Writing output in %d pieces\n", segs.count);
+
+        struct iovec* v = segs.s;
+        int n = segs.count;
         ssize_t upto = 0;
-        while (upto < len)
+        while (n > 0)
         {
-            ssize_t bytes_written = write(fout, out + upto, len - upto);
-            upto += bytes_written;
-            if (bytes_written < 0 || (bytes_written == 0 && upto < len))
+            ssize_t bytes_written = writev(fout, v, n);
+            if (bytes_written <= 0)
             {
                 retval =
                     fprintf(stderr,
                     "Could not write all of output file `%s`, only wrote %ld out of %ld bytes. Check disk space.\n",
-                    fnout, upto, len);
+                    fnout, upto, segs.len);
                 break;
             }
+            upto += bytes_written;
+
+            // past the pieces written in full, and into the one written in part
+            for (; n > 0 && (size_t)bytes_written >= v->iov_len; --n, ++v)
+                bytes_written -= v->iov_len;
+            if (n > 0)
+            {
+                v->iov_base = (uint8_t*)v->iov_base + bytes_written;
+                v->iov_len -= bytes_written;
+            }
         }
-        fprintf(stderr, "Wrote output bytes: %ld out of %ld\n", upto, len);
+        fprintf(stderr, "Wrote output bytes: %ld out of %ld\n", upto, segs.len);
+
+        // keep stdout clean for the module when that's where it went
+        FILE* report = (fout == 1 ? stderr : stdout);
+        if (retval == 0 && opts->hash_input)
+            fprintf(report, "InputHash: %s\n", hex);
+        if (retval == 0 && opts->hash)
+            fprintf(report, "HookHash: %s\n", hash);
     }
         
     // close output file
     close(fout);
 
+    if (DEBUG)
+        fprintf(stderr, "Arena peak: %ld bytes\n", (uint64_t)a.peak);
+
     // free buffers
-    free(inp);
-    free(out);
+    arena_free(&a);
 
     return retval;
 
 }
 
+#ifndef HOOK_CLEANER_NO_MAIN
 int print_help(int argc, char** argv)
 {
     fprintf(stderr, 
             "Hook Cleaner v" VERSION ". Richard Holland / XRPL-Labs 26/04/2022.\n"
-            "Usage: %s in.wasm [out.wasm]\n"
+            "Usage: %s [options] in.wasm [out.wasm]\n"
+            "       %s --out-dir=DIR [--jobs=N] [options] in.wasm...\n"
+            "       %s --tar [--jobs=N] [options] < in.tar > out.tar\n"
+            "Options:\n"
+            "       -O0         Only strip: clean without inlining helpers.\n"
+            "       -O1         Inline helpers, then clean (the default).\n"
+            "       -Os         Also run the simplify-cfg, peephole, coalesce-locals, prune-globals and shrink-memory\n"
+            "                   passes.\n"
+            "       --passes=LIST\n"
+            "                   Run exactly these comma separated passes instead of a preset: inline, auto-guard,\n"
+            "                   simplify-cfg, peephole, shrink-stack, coalesce-locals, prune-globals, shrink-memory,\n"
+            "                   canonical, instrument. The cleaner always runs and passes run in the order listed\n"
+            "                   here whatever order LIST has. Options naming single passes add to (or with\n"
+            "                   --no-inline, take from) whatever came before.\n"
+            "       --pass-stats\n"
+            "                   Print the time taken and bytes saved by each pass.\n"
+            "       --analyze   Print the loop nesting tree of hook() and cbak() with guard bounds and the\n"
+            "                   worst-case instruction count instead of writing output.\n"
+            "       --auto-guard\n"
+            "                   Guard counted loops that have no guard with the number of times their head can\n"
+            "                   run. The hook must import _g. Loops whose count can't be inferred are reported.\n"
+            "       --peephole  Simplify instruction sequences in the retained bodies (local.tee forming,\n"
+            "                   constant folding, dead drops and branches to the following end).\n"
+            "       --simplify-cfg\n"
+            "                   Remove blocks no branch targets, empty blocks, ifs and else arms, and br_if to the\n"
+            "                   following end, renumbering the branch depths.\n"
+            "       --coalesce-locals\n"
+            "                   Let locals of the same type that are never live at the same time share a slot, and\n"
+            "                   declare the locals of each type as one group.\n"
+            "       --hash      Print the HookHash (SHA-512Half) of the output.\n"
+            "       --hash-input\n"
+            "                   Also print the SHA-512Half of the input as read.\n"
+            "       --reloc-map=FILE\n"
+            "                   Write a map from output to input offsets of every retained instruction to FILE,\n"
+            "                   see hook-reloc.\n"
+            "       --canonical Write the canonical form: types and imports sorted and deduplicated, exports sorted,\n"
+            "                   locals grouped by type and nops removed, so equivalent builds hash the same.\n"
+            "       --instrument[=FILE]\n"
+            "                   Import env." PROF_IMPORT "(i32) and call it with a site id on entry to hook() and\n"
+            "                   cbak() and at the start of every block and loop. With FILE, write the id, kind,\n"
+            "                   input offset and guard bound of each site to it. For profiling builds only.\n"
+            "       --inline-limit=N\n"
+            "                   Largest helper, in instructions, inlined at more than one call site (default %d).\n"
+            "       --no-inline Don't inline helpers called from hook() and cbak().\n"
+            "       --max-work=N\n"
+            "                   Give up on modules that take more than N bytes scanned plus bytes moved to clean\n"
+            "                   (default %d). The work is linear in the input size.\n"
+            "       --prune-globals\n"
+            "                   Remove globals the retained code no longer refers to and renumber the rest.\n"
+            "       --shrink-stack\n"
+            "                   Move the stack down to just above the data, as deep as the frames of the deepest\n"
+            "                   call chain, when every frame is a fixed one. Use with --shrink-memory.\n"
+            "       --shrink-memory\n"
+            "                   Lower the declared memory pages to what the data segments and stack need.\n"
+            "       --validate  Check the output with the built-in validator before writing it.\n"
+            "       --incremental[=FILE]\n"
+            "                   Keep the hash of every input section and the output in FILE (default: the output's\n"
+            "                   name with .hcc added) and reuse that output while the input is the same, or differs\n"
+            "                   only in the bytes of its data segments. Anything else is cleaned in full.\n"
+            "       --in-format=wasm|hex|json\n"
+            "                   Read the module as binary (the default), as hex, or from the CreateCode field of\n"
+            "                   a SetHook transaction in JSON.\n"
+            "       --out-format=wasm|hex|sethook-json\n"
+            "                   Write the module as binary (the default), as uppercase hex, or as a SetHook\n"
+            "                   transaction skeleton with the CreateCode and HookHash filled in.\n"
+            "       --tar       Read a tar stream on stdin and write it to stdout with each regular .wasm member\n"
+            "                   cleaned and every other member passed through. Hashes go to stderr. --reloc-map,\n"
+            "                   --instrument=FILE and the formats aren't available. Stops at the first member that\n"
+            "                   fails.\n"
+            "       --out-dir=DIR\n"
+            "                   Clean every input into DIR under its own file name. Files that fail are reported\n"
+            "                   and skipped. Hashes go to stdout, the per module files and formats aren't available.\n"
+            "       --io=uring|blocking\n"
+            "                   With --out-dir, keep the reads and writes of many files in flight with io_uring\n"
+            "                   (the default, falling back to blocking I/O where it isn't available) or use\n"
+            "                   blocking I/O on the worker threads.\n"
+            "       --jobs=N    With --tar or --out-dir, clean up to N modules at once. Tar output keeps the\n"
+            "                   input order.\n"
             "Notes: If out.wasm is omitted then in.wasm is replaced.\n"
-            "       Strips all functions and exports except cbak() and hook().\n"
+            "       Strips all functions and exports except cbak() and hook(), and the imports they don't call.\n"
             "       Also strips custom sections.\n"
-            "       Specify - for stdin/out.\n", argv[0]);
+            "       Specify - for stdin/out.\n", argv[0], argv[0], argv[0], DEFAULT_INLINE_LIMIT, DEFAULT_MAX_WORK);
     return 1;
 }
 
 int main(int argc, char** argv)
 {
-    if (argc == 2 && 
-        ((strlen(argv[1]) >= 2 && argv[1][0] == '-' && argv[1][1] == 'h') ||
-         (strlen(argv[1]) >= 3 && argv[1][0] == '-' && argv[1][1] == '-') && argv[1][2] == 'h'))
+    run_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.passes = PASSES_O1;
+    int tar = 0, jobs = 1, use_uring = 1;
+    char* out_dir = 0;
+
+    // options come first, a lone - is stdin/stdout and not an option
+    int a = 1;
+    for (; a < argc && argv[a][0] == '-' && argv[a][1] != '\0'; ++a)
+    {
+        if (strcmp(argv[a], "--analyze") == 0)
+            opts.analyze = 1;
+        else if (strcmp(argv[a], "-O0") == 0)
+            opts.passes = PASSES_O0;
+        else if (strcmp(argv[a], "-O1") == 0)
+            opts.passes = PASSES_O1;
+        else if (strcmp(argv[a], "-Os") == 0)
+            opts.passes = PASSES_OS;
+        else if (strncmp(argv[a], "--passes=", 9) == 0)
+        {
+            if (parse_passes(argv[a] + 9, &opts.passes))
+                return 1;
+        }
+        else if (strcmp(argv[a], "--pass-stats") == 0)
+            opts.pass_stats = 1;
+        else if (strcmp(argv[a], "--peephole") == 0)
+            opts.passes |= PASS_PEEPHOLE;
+        else if (strcmp(argv[a], "--auto-guard") == 0)
+            opts.passes |= PASS_AUTO_GUARD;
+        else if (strcmp(argv[a], "--coalesce-locals") == 0)
+            opts.passes |= PASS_COALESCE_LOCALS;
+        else if (strcmp(argv[a], "--shrink-stack") == 0)
+            opts.passes |= PASS_SHRINK_STACK;
+        else if (strcmp(argv[a], "--simplify-cfg") == 0)
+            opts.passes |= PASS_SIMPLIFY_CFG;
+        else if (strcmp(argv[a], "--hash") == 0)
+            opts.hash = 1;
+        else if (strcmp(argv[a], "--hash-input") == 0)
+            opts.hash_input = 1;
+        else if (strncmp(argv[a], "--reloc-map=", 12) == 0 && argv[a][12])
+            opts.reloc_map = argv[a] + 12;
+        else if (strcmp(argv[a], "--canonical") == 0)
+            opts.passes |= PASS_CANONICAL;
+        else if (strcmp(argv[a], "--instrument") == 0)
+            opts.passes |= PASS_INSTRUMENT;
+        else if (strncmp(argv[a], "--instrument=", 13) == 0 && argv[a][13])
+        {
+            opts.passes |= PASS_INSTRUMENT;
+            opts.instrument_sites = argv[a] + 13;
+        }
+        else if (strncmp(argv[a], "--inline-limit=", 15) == 0 && atoi(argv[a] + 15) > 0)
+            opts.inline_limit = atoi(argv[a] + 15);
+        else if (strncmp(argv[a], "--max-work=", 11) == 0 && strtoull(argv[a] + 11, 0, 0) > 0)
+            opts.max_work = strtoull(argv[a] + 11, 0, 0);
+        else if (strcmp(argv[a], "--no-inline") == 0)
+            opts.passes &= ~PASS_INLINE;
+        else if (strcmp(argv[a], "--prune-globals") == 0)
+            opts.passes |= PASS_PRUNE_GLOBALS;
+        else if (strcmp(argv[a], "--shrink-memory") == 0)
+            opts.passes |= PASS_SHRINK_MEMORY;
+        else if (strcmp(argv[a], "--validate") == 0)
+            opts.validate = 1;
+        else if (strcmp(argv[a], "--incremental") == 0)
+            opts.incremental = 1;
+        else if (strncmp(argv[a], "--incremental=", 14) == 0 && argv[a][14])
+        {
+            opts.incremental = 1;
+            opts.cache = argv[a] + 14;
+        }
+        else if (strcmp(argv[a], "--in-format=wasm") == 0)
+            opts.in_format = FORMAT_WASM;
+        else if (strcmp(argv[a], "--in-format=hex") == 0)
+            opts.in_format = FORMAT_HEX;
+        else if (strcmp(argv[a], "--in-format=json") == 0)
+            opts.in_format = FORMAT_JSON;
+        else if (strcmp(argv[a], "--out-format=wasm") == 0)
+            opts.out_format = FORMAT_WASM;
+        else if (strcmp(argv[a], "--out-format=hex") == 0)
+            opts.out_format = FORMAT_HEX;
+        else if (strcmp(argv[a], "--out-format=sethook-json") == 0)
+            opts.out_format = FORMAT_JSON;
+        else if (strcmp(argv[a], "--tar") == 0)
+            tar = 1;
+        else if (strncmp(argv[a], "--out-dir=", 10) == 0 && argv[a][10])
+            out_dir = argv[a] + 10;
+        else if (strcmp(argv[a], "--io=uring") == 0)
+            use_uring = 1;
+        else if (strcmp(argv[a], "--io=blocking") == 0)
+            use_uring = 0;
+        else if (strncmp(argv[a], "--jobs=", 7) == 0 && atoi(argv[a] + 7) > 0)
+            jobs = atoi(argv[a] + 7);
+        else
+            return print_help(argc, argv);
+    }
+
+    // the per module files have nowhere to go in a stream or batch
+    int per_module = (opts.analyze || opts.reloc_map || opts.instrument_sites || opts.in_format || opts.out_format ||
+            opts.incremental);
+    if ((tar && (a != argc || out_dir)) || ((tar || out_dir) && per_module) || (out_dir && a == argc))
         return print_help(argc, argv);
-    else if (argc == 2 || argc == 3)
-        return run(argv[1], (argc == 2 ? 0 : argv[2]));
+
+    // the cache holds the module only, not the files written alongside it
+    if (opts.incremental && (opts.analyze || opts.reloc_map || opts.instrument_sites))
+    {
+        fprintf(stderr, "%s can't be used with --incremental\n",
+                (opts.analyze ? "--analyze" : opts.reloc_map ? "--reloc-map" : "--instrument=FILE"));
+        return 1;
+    }
+    if (tar)
+        return run_tar(&opts, jobs);
+    if (out_dir)
+        return run_batch(argv + a, argc - a, out_dir, &opts, jobs, use_uring);
+
+    argc -= (a - 1);
+    argv += (a - 1);
+
+    if (argc == 2 || argc == 3)
+        return run(argv[1], (argc == 2 ? 0 : argv[2]), &opts);
     else
         return print_help(argc, argv);
 }
+#endif
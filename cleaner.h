@@ -0,0 +1,642 @@
+#ifndef HOOK_CLEANER_H
+#define HOOK_CLEANER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define DEBUG 1
+#define DEBUG_VERBOSE 0
+
+// leb128 helpers (cleaner.c)
+uint64_t leb(
+    uint8_t** buf,
+    uint8_t* bufend,
+    int is_signed);
+
+void leb_out(
+    uint64_t i,
+    uint8_t** o);
+
+void leb_insert(
+    uint8_t*    at,
+    uint8_t**   end,
+    uint64_t    i);
+
+void leb_out_pad(
+    uint64_t i,
+    uint8_t** o,
+    int padto);
+
+// Bump allocator (arena.c). Everything allocated stays valid until the next reset, which keeps one block sized
+// for the peak so that repeated use stops allocating once warmed up. Allocation fails past `limit` bytes.
+#define ARENA_LIMIT (64U * 1024U * 1024U)
+
+typedef struct arena_block arena_block;
+
+typedef struct
+{
+    arena_block*    head;
+    size_t          limit;
+    size_t          used;
+    size_t          peak;
+    size_t          reserved;   // bytes obtained from malloc
+} arena;
+
+void arena_init(
+    arena*  a,
+    size_t  limit);
+
+void* arena_alloc(
+    arena*  a,
+    size_t  n);
+
+void arena_reset(
+    arena*  a);
+
+void arena_free(
+    arena*  a);
+
+int leb_len(
+    uint64_t i);
+
+// output -> input offset map, one entry per instruction of the retained bodies (reloc.c)
+typedef struct
+{
+    uint32_t    out;
+    uint32_t    in;
+} reloc_entry;
+
+typedef struct
+{
+    reloc_entry*    e;
+    uint32_t        count;
+    uint32_t        cap;
+} reloc_map;
+
+void reloc_add(
+    reloc_map*  map,
+    uint32_t    out,
+    uint32_t    in);
+
+void reloc_shift(
+    reloc_map*  map,
+    uint32_t    from,
+    uint32_t    at,
+    int64_t     delta);
+
+void reloc_rotate(
+    reloc_map*  map,
+    uint32_t    from,
+    uint32_t    lo,
+    uint32_t    mid,
+    uint32_t    hi);
+
+void reloc_sort(
+    reloc_map*  map);
+
+int64_t reloc_lookup(
+    reloc_map*  map,
+    uint32_t    out);
+
+void reloc_compose(
+    reloc_map*  outer,
+    reloc_map*  inner);
+
+void reloc_free(
+    reloc_map*  map);
+
+int reloc_write(
+    reloc_map*  map,
+    FILE*       f);
+
+int reloc_read(
+    uint8_t*    buf,
+    ssize_t     len,
+    reloc_map*  map);
+
+// Work budget of a clean, in bytes scanned plus bytes moved. Every path is linear in the input size, so this is
+// only ever hit by modules far larger than any hook (or than the arena allows).
+#define DEFAULT_MAX_WORK (256U * 1024U * 1024U)
+
+/*
+ * The output as pieces written one after the other: the cleaner's own bytes, and the sections it copies as they are
+ * left where they are in the input (which must outlive them). Each section copied adds at most two pieces, past
+ * MAX_OUT_SEGS they're copied after all.
+ */
+#define MAX_OUT_SEGS 32
+
+typedef struct
+{
+    struct iovec    s[MAX_OUT_SEGS];
+    int             count;
+    size_t          len;
+} out_segs;
+
+// map and segs may be null, max_work 0 for no limit. With segs the output is the pieces in it, *out is the first
+int cleaner (
+    uint8_t*    w,
+    uint8_t**   out,
+    ssize_t*    len,
+    arena*      a,
+    reloc_map*  map,
+    uint64_t    max_work,
+    out_segs*   segs);
+
+
+/*
+ * Module representation (wasm.c)
+ *
+ * A parsed view over a wasm buffer. Everything points into the source buffer, which must outlive the
+ * module. Function bodies are only decoded into instructions on request (wasm_decode_body).
+ */
+
+// value types / block types as they appear in the binary
+#define WASM_I32        0x7FU
+#define WASM_I64        0x7EU
+#define WASM_F32        0x7DU
+#define WASM_F64        0x7CU
+#define WASM_V128       0x7BU
+#define WASM_FUNCREF    0x70U
+#define WASM_EXTERNREF  0x6FU
+#define WASM_EMPTY      0x40U
+
+typedef struct
+{
+    uint8_t     op;     // opcode byte
+    uint32_t    sub;    // sub-opcode of 0xFC / 0xFD prefixed instructions
+    int64_t     imm;    // first immediate: index, label depth, constant, block type (signed s33), memarg align
+    uint64_t    imm2;   // second immediate: memarg offset, call_indirect table, br_table pool index
+    uint32_t    off;    // offset of the instruction in the buffer it was decoded from
+    uint32_t    len;    // encoded length in that buffer
+    uint8_t*    raw;    // source encoding, needed to re-emit opaque immediates (floats, v128, select t*)
+} wasm_instr;
+
+typedef struct
+{
+    uint32_t        pc;     // param count
+    uint32_t        rc;     // result count
+    const uint8_t*  p;      // param value types
+    const uint8_t*  r;      // result value types
+} wasm_type;
+
+typedef struct
+{
+    uint8_t*    mod;
+    uint32_t    mod_len;
+    uint8_t*    name;
+    uint32_t    name_len;
+    uint8_t     kind;       // 0 func, 1 table, 2 mem, 3 global
+    uint32_t    type;       // type index, function imports only
+    uint8_t*    desc;       // raw descriptor for non-function imports
+    uint32_t    desc_len;
+} wasm_import;
+
+typedef struct
+{
+    uint8_t     valtype;
+    uint8_t     mut;
+    uint8_t*    init;       // raw init expression including its end opcode
+    uint32_t    init_len;
+} wasm_global;
+
+typedef struct
+{
+    uint8_t*    name;
+    uint32_t    name_len;
+    uint8_t     kind;
+    uint32_t    idx;
+} wasm_export;
+
+typedef struct
+{
+    uint32_t    count;
+    uint8_t     type;
+} wasm_local_group;
+
+typedef struct
+{
+    uint32_t            type;           // type index
+    uint32_t            off;            // offset of the body (its size leb) in the source
+    wasm_local_group*   locals;
+    uint32_t            local_group_count;
+    uint8_t*            expr;           // raw expression, including the final end
+    uint32_t            expr_len;
+    wasm_instr*         ins;            // decoded expression, see wasm_decode_body
+    uint32_t            ins_count;
+    uint32_t            ins_cap;
+    uint32_t*           brt;            // br_table label pool, each table is count labels then the default
+    uint32_t            brt_count;
+    uint32_t            brt_cap;
+} wasm_func;
+
+typedef struct
+{
+    uint32_t    mode;       // 0 active memory 0, 1 passive, 2 active explicit memory
+    uint32_t    mem;
+    uint8_t*    offset;     // raw offset expression including its end opcode
+    uint32_t    offset_len;
+    uint8_t*    bytes;
+    uint32_t    bytes_len;
+} wasm_data;
+
+typedef struct
+{
+    uint8_t     id;
+    uint8_t*    start;      // payload, after the size leb
+    uint32_t    len;
+} wasm_section;
+
+#define WASM_MAX_SECTIONS 64
+
+typedef struct
+{
+    uint8_t*        buf;
+    uint32_t        len;
+
+    wasm_section    sec[WASM_MAX_SECTIONS];
+    int             sec_count;
+
+    wasm_type*      types;
+    uint32_t        type_count;
+
+    wasm_import*    imports;
+    uint32_t        import_count;
+    uint32_t        import_func_count;
+    uint32_t        import_global_count;
+
+    wasm_func*      funcs;          // defined functions only, index = func idx - import_func_count
+    uint32_t        func_count;
+
+    int             has_memory;
+    uint8_t         mem_flags;      // 0 = min only, 1 = min and max
+    uint32_t        mem_min;
+    uint32_t        mem_max;
+
+    wasm_global*    globals;        // defined globals only
+    uint32_t        global_count;
+
+    wasm_export*    exports;
+    uint32_t        export_count;
+
+    wasm_data*      data;
+    uint32_t        data_count;
+
+    reloc_map*      map;            // if set, wasm_emit records output -> instruction offset for every instruction
+} wasm_module;
+
+int wasm_decode_instr(
+    uint8_t*    p,
+    uint8_t*    end,
+    wasm_instr* in,
+    wasm_func*  f);
+
+int wasm_parse(
+    uint8_t*        buf,
+    ssize_t         len,
+    wasm_module*    m);
+
+int wasm_decode_body(
+    wasm_module*    m,
+    wasm_func*      f);
+
+void wasm_free(
+    wasm_module*    m);
+
+int wasm_find_export(
+    wasm_module*    m,
+    const char*     name);
+
+int wasm_find_import(
+    wasm_module*    m,
+    const char*     name);
+
+int wasm_is_guard(
+    wasm_func*  f,
+    uint32_t    i,
+    int         guard_idx);
+
+wasm_type* wasm_func_type(
+    wasm_module*    m,
+    uint32_t        func_idx);
+
+int wasm_block_arity(
+    wasm_module*    m,
+    int64_t         block_type,
+    int*            params,
+    int*            results);
+
+int wasm_stack_effect(
+    wasm_module*    m,
+    wasm_instr*     in,
+    int*            pop,
+    int*            push);
+
+// growable output buffer
+typedef struct
+{
+    uint8_t*    p;
+    size_t      len;
+    size_t      cap;
+} wasm_buf;
+
+void wasm_buf_need(
+    wasm_buf*   b,
+    size_t      n);
+
+void wasm_put(
+    wasm_buf*       b,
+    const void*     data,
+    size_t          n);
+
+void wasm_put_byte(
+    wasm_buf*   b,
+    uint8_t     v);
+
+void wasm_put_leb(
+    wasm_buf*   b,
+    uint64_t    v);
+
+void wasm_put_sleb(
+    wasm_buf*   b,
+    int64_t     v);
+
+int wasm_encode_instr(
+    wasm_buf*   b,
+    wasm_func*  f,
+    wasm_instr* in);
+
+int wasm_emit(
+    wasm_module*    m,
+    wasm_buf*       o);
+
+
+// structural and type-checking validation (validate.c)
+int wasm_validate(
+    uint8_t*    buf,
+    ssize_t     len);
+
+// optional passes, see passes.c
+#define PASS_INLINE          0x01U
+#define PASS_PEEPHOLE        0x02U
+#define PASS_PRUNE_GLOBALS   0x04U
+#define PASS_SHRINK_MEMORY   0x08U
+#define PASS_CANONICAL       0x10U
+#define PASS_INSTRUMENT      0x20U
+#define PASS_SIMPLIFY_CFG    0x40U
+#define PASS_AUTO_GUARD      0x80U
+#define PASS_COALESCE_LOCALS 0x100U
+#define PASS_SHRINK_STACK    0x200U
+
+// presets: -O0 only strips, -O1 (the default) also inlines helpers, -Os shrinks everything it safely can
+#define PASSES_O0   0U
+#define PASSES_O1   PASS_INLINE
+#define PASSES_OS   (PASS_INLINE | PASS_SIMPLIFY_CFG | PASS_PEEPHOLE | PASS_COALESCE_LOCALS | PASS_PRUNE_GLOBALS | \
+                     PASS_SHRINK_MEMORY)
+
+// input and output formats
+#define FORMAT_WASM 0
+#define FORMAT_HEX  1       // uppercase hex, as in CreateCode
+#define FORMAT_JSON 2       // a SetHook transaction, read from its CreateCode
+
+// command line options (cleaner.c)
+typedef struct
+{
+    int         analyze;    // print the worst-case execution report instead of writing the output
+    uint32_t    passes;     // PASS_* flags of the optional passes to run
+    int         pass_stats; // print each pass's time and size change
+    int         validate;   // validate the output before writing it
+    int         inline_limit;   // largest helper inlined at several call sites, 0 for the default
+    uint64_t    max_work;       // the cleaner's work budget in bytes, 0 for the default
+    int         hash;           // print the hook hash of the output
+    int         hash_input;     // also print the hash of the input as read
+    char*       reloc_map;      // write the output -> input offset map to this file
+    char*       instrument_sites;   // write the instrumentation site list to this file
+    int         in_format;      // FORMAT_*
+    int         out_format;
+    int         incremental;    // reuse what the cache says is still valid, and refresh it
+    char*       cache;          // the cache file, 0 for the output's name with .hcc added
+} run_opts;
+
+// pass pipeline (passes.c)
+typedef struct
+{
+    const char* name;
+    double      ms;
+    ssize_t     before;     // module size going in
+    ssize_t     after;      // and coming out
+} pass_stat;
+
+#define MAX_PASS_STATS 16
+
+typedef struct
+{
+    pass_stat   p[MAX_PASS_STATS];
+    int         count;
+} pass_stats;
+
+int parse_passes(
+    const char* list,
+    uint32_t*   passes);
+
+int run_passes(
+    uint8_t**   buf,
+    ssize_t*    len,
+    run_opts*   opts,
+    arena*      a,
+    reloc_map*  map,
+    pass_stats* st,
+    out_segs*   segs);
+
+void print_pass_stats(
+    pass_stats* st,
+    FILE*       f);
+
+// multi-file runs into a directory (batch.c)
+int run_batch(
+    char**          files,
+    int             file_count,
+    const char*     out_dir,
+    run_opts*       opts,
+    int             jobs,
+    int             use_uring);
+
+// tar stream mode, stdin to stdout (tar.c)
+int run_tar(
+    run_opts*   opts,
+    int         jobs);
+
+// peephole optimizer for retained bodies (peephole.c)
+int peephole(
+    wasm_module*    m);
+
+// control-flow simplification of retained bodies (cfg.c)
+int simplify_cfg(
+    wasm_module*    m);
+
+// helper inlining into hook() and cbak(), run on the input before cleaning (inline.c)
+#define DEFAULT_INLINE_LIMIT 64
+
+int inline_helpers(
+    uint8_t**   buf,
+    ssize_t*    len,
+    int         limit,
+    arena*      a,
+    reloc_map*  map);
+
+// sharing of local slots with disjoint live ranges (locals.c)
+int coalesce_locals(
+    wasm_module*    m);
+
+// unreferenced global removal (prune.c)
+int prune_globals(
+    wasm_module*    m);
+
+// memory limit shrinking (memory.c)
+#define ADDR_UNBOUNDED UINT64_MAX
+#define STATIC_BASE    1024U    // wasm-ld's default --global-base, where static data starts
+
+typedef struct
+{
+    uint64_t    lo;     // the address
+    uint64_t    hi;     // end of the bytes accessed there, ADDR_UNBOUNDED for a base the code may index from
+    uint32_t    at;     // offset of the instruction, or address of the data word, it comes from
+} addr_use;
+
+int address_uses(
+    wasm_module*    m,
+    addr_use**      uses,
+    uint32_t*       count);
+
+int shrink_memory(
+    wasm_module*    m);
+
+// shadow stack sizing (stack.c)
+int shrink_stack(
+    wasm_module*    m);
+
+// canonical output form (canonical.c)
+int canonicalize(
+    wasm_module*    m);
+
+// guards for counted loops that lack one (guard.c)
+// the ids of inserted guards are the loop's offset with the top two bits set, clear of the line numbers GUARD() uses
+#define AUTO_GUARD_ID(off)      ((int32_t)(0xC0000000U | ((off) & 0x3FFFFFFFU)))
+#define IS_AUTO_GUARD_ID(id)    (((uint32_t)(id) & 0xC0000000U) == 0xC0000000U)
+
+int auto_guard(
+    wasm_module*    m,
+    reloc_map*      map);
+
+// profiling instrumentation (instrument.c)
+#define PROF_IMPORT "__prof"
+
+typedef struct
+{
+    uint32_t    off;        // offset of the block, loop or first instruction the site was placed for
+    uint8_t     kind;       // 0x02 block, 0x03 loop, 0 function entry
+    int64_t     guard_max;  // the loop's guard bound, 0 if it has none
+} prof_site;
+
+int instrument(
+    wasm_module*    m,
+    prof_site**     sites,
+    uint32_t*       site_count);
+
+int write_prof_sites(
+    prof_site*  sites,
+    uint32_t    count,
+    FILE*       f);
+
+// hex codec (hex.c)
+void hex_encode(
+    const uint8_t*  in,
+    size_t          len,
+    char*           out);   // 2 * len chars, not terminated
+
+int hex_decode(
+    const char* in,
+    size_t      len,
+    uint8_t*    out);       // len / 2 bytes
+
+// SHA-512 and the SHA-512Half hook hash (sha512.c)
+#define HOOK_HASH_SIZE 32
+
+typedef struct
+{
+    uint64_t    h[8];
+    uint64_t    total;      // bytes hashed so far
+    uint8_t     buf[128];
+    size_t      fill;
+} sha512_ctx;
+
+void sha512_init(
+    sha512_ctx* ctx);
+
+void sha512_update(
+    sha512_ctx*     ctx,
+    const uint8_t*  data,
+    size_t          len);
+
+void sha512_final(
+    sha512_ctx* ctx,
+    uint8_t*    digest);    // 64 bytes
+
+void hook_hash(
+    const uint8_t*  buf,
+    size_t          len,
+    uint8_t*        hash);  // HOOK_HASH_SIZE bytes
+
+void hook_hash_hex(
+    const uint8_t*  hash,
+    char*           hex);   // HOOK_HASH_SIZE * 2 + 1 bytes
+
+// incremental re-cleaning from per-section input hashes (cache.c)
+typedef struct
+{
+    uint8_t     id;
+    uint32_t    off;        // payload offset in the input
+    uint32_t    len;
+    uint8_t     hash[HOOK_HASH_SIZE];
+} cache_section;
+
+typedef struct
+{
+    cache_section   s[WASM_MAX_SECTIONS];   // custom sections aren't included
+    int             count;
+    int             data;                   // index of the data section in s, -1 if there's none
+    uint8_t         layout[HOOK_HASH_SIZE]; // hash of the data segments without their bytes
+} cache_sections;
+
+int cache_scan(
+    uint8_t*        buf,
+    ssize_t         len,
+    cache_sections* cs);
+
+void cache_encode(
+    cache_sections* cs,
+    run_opts*       opts,
+    uint8_t*        out,
+    ssize_t         len,
+    wasm_buf*       b);
+
+int cache_reuse(
+    uint8_t*        cache,
+    ssize_t         cache_len,
+    uint8_t*        buf,
+    cache_sections* cs,
+    run_opts*       opts,
+    arena*          a,
+    uint8_t**       out,
+    ssize_t*        len,
+    out_segs*       segs,
+    int*            stale);
+
+// static worst-case execution analysis (analyze.c)
+int analyze(
+    uint8_t*    w,
+    ssize_t     len,
+    FILE*       out);
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// loops still going after this many passes through their head are reported instead of guarded
+#define MAX_INFERRED_ITER 1048576
+
+typedef struct
+{
+    uint32_t    at;         // instruction index of the loop
+    uint32_t    end;        // and of its end
+    int         parent;     // enclosing loop, -1 if outermost
+    uint64_t    total;      // times its head can run in one hook execution, 0 if unknown
+} guard_loop;
+
+typedef struct
+{
+    uint32_t    func;       // defined function index
+    uint32_t    at;         // the loop instruction the guard goes after
+    int32_t     id;
+    uint32_t    max;
+} guard_site;
+
+static int compare(
+    uint8_t     op,
+    uint32_t    a,
+    uint32_t    b)
+{
+    switch (op)
+    {
+        case 0x46U: return a == b;
+        case 0x47U: return a != b;
+        case 0x48U: return (int32_t)a < (int32_t)b;
+        case 0x49U: return a < b;
+        case 0x4AU: return (int32_t)a > (int32_t)b;
+        case 0x4BU: return a > b;
+        case 0x4CU: return (int32_t)a <= (int32_t)b;
+        case 0x4DU: return a <= b;
+        case 0x4EU: return (int32_t)a >= (int32_t)b;
+        default:    return a >= b;
+    }
+}
+
+/*
+ * Times the head of a counted loop runs each time it's entered, or 0 with the reason in *why. Two shapes are
+ * recognised, as compilers leave them:
+ *
+ *   bottom tested                      top tested
+ *   i32.const K; local.set $i          i32.const K; local.set $i
+ *   loop                               block  (optional)
+ *     ...                                loop
+ *     local.get $i                         local.get $i; i32.const C; i32.ge_s; br_if 1  (any depth out)
+ *     i32.const S; i32.add                 ...
+ *     local.tee $i                         local.get $i; i32.const S; i32.add; local.set $i
+ *     i32.const C; i32.lt_s                ...
+ *     br_if 0                              br 0
+ *   end                                  end
+ *
+ * with any i32 comparison in either operand order (local.get or local.tee in place of each other), i32.sub for
+ * the step, $i written nowhere else in the loop, the step at the loop's own nesting level and no other branch back
+ * to the head. Other exits are fine, they only make the bound less tight. The count is found by running the
+ * counter with i32 wrapping, so it is exact for the loop as written.
+ */
+static uint64_t count_loop(
+    wasm_func*      f,
+    uint32_t        at,
+    uint32_t        end,
+    const char**    why)
+{
+    wasm_instr* ins = f->ins;
+    uint32_t last = end - 1;
+    int top = (ins[last].op == 0x0CU && ins[last].imm == 0);
+    if (last <= at || !(top || (ins[last].op == 0x0DU && ins[last].imm == 0)))
+    {
+        *why = "it doesn't end with a branch back to its head";
+        return 0;
+    }
+
+    // the exit test, at the head for the top tested shape and right before the back edge otherwise
+    uint32_t c = (top ? at + 3 : last - 1);
+    if ((top && c + 1 >= last) || c < at + 3 || ins[c].op < 0x46U || ins[c].op > 0x4FU ||
+        (top && (ins[c + 1].op != 0x0DU || ins[c + 1].imm == 0)))
+    {
+        *why = "its exit isn't a local compared with a constant";
+        return 0;
+    }
+
+    wasm_instr* a = ins + c - 2;
+    wasm_instr* b = ins + c - 1;
+    int const_first = (a->op == 0x41U && b->op == 0x20U);
+    if (!const_first && !((a->op == 0x20U || a->op == 0x22U) && b->op == 0x41U))
+    {
+        *why = "its exit isn't a local compared with a constant";
+        return 0;
+    }
+    int64_t x = (const_first ? b->imm : a->imm);
+    uint32_t limit = (uint32_t)(const_first ? a->imm : b->imm);
+
+    // every branch back to the head but the last instruction, and every write of the counter
+    int depth = 0, writes = 0, back = 0;
+    uint32_t w = 0;
+    for (uint32_t i = at + 1; i < last; ++i)
+    {
+        wasm_instr* in = ins + i;
+        if (in->op == 0x02U || in->op == 0x03U || in->op == 0x04U)
+            depth++;
+        else if (in->op == 0x0BU)
+            depth--;
+        else if ((in->op == 0x0CU || in->op == 0x0DU) && in->imm == depth)
+            back++;
+        else if (in->op == 0x0EU)
+        {
+            for (int64_t k = 0; k <= in->imm; ++k)
+                back += (f->brt[in->imm2 + k] == (uint32_t)depth);
+        }
+        else if ((in->op == 0x21U || in->op == 0x22U) && in->imm == x)
+        {
+            writes++;
+            if (depth == 0)
+                w = i;
+        }
+    }
+
+    if (back)
+    {
+        *why = "it branches back to its head more than once";
+        return 0;
+    }
+
+    int sub = (w > 0 && ins[w - 1].op == 0x6BU);
+    if (writes != 1 || w == 0 || w < at + 4 || (top && w <= c + 1) || (!sub && ins[w - 1].op != 0x6AU))
+    {
+        *why = "its counter isn't stepped once per pass";
+        return 0;
+    }
+
+    uint32_t step;
+    if (ins[w - 3].op == 0x20U && ins[w - 3].imm == x && ins[w - 2].op == 0x41U)
+        step = (uint32_t)ins[w - 2].imm;
+    else if (!sub && ins[w - 3].op == 0x41U && ins[w - 2].op == 0x20U && ins[w - 2].imm == x)
+        step = (uint32_t)ins[w - 3].imm;
+    else
+    {
+        *why = "its counter isn't stepped by a constant";
+        return 0;
+    }
+    if (sub)
+        step = -step;
+
+    // the counter's value on the way in, skipping a block wrapped around the loop
+    uint32_t p = (at > 0 && ins[at - 1].op == 0x02U ? at - 1 : at);
+    if (p < 2 || ins[p - 1].op != 0x21U || ins[p - 1].imm != x || ins[p - 2].op != 0x41U)
+    {
+        *why = "its counter isn't set to a constant just before it";
+        return 0;
+    }
+
+    uint32_t v = (uint32_t)ins[p - 2].imm;
+    uint64_t heads = 0;
+    for (;;)
+    {
+        if (++heads > MAX_INFERRED_ITER)
+        {
+            *why = "it doesn't finish within 1048576 passes";
+            return 0;
+        }
+
+        if (top)
+        {
+            if (compare(ins[c].op, (const_first ? limit : v), (const_first ? v : limit)))
+                break;
+            v += step;
+        }
+        else
+        {
+            v += step;
+            if (!compare(ins[c].op, (const_first ? limit : v), (const_first ? v : limit)))
+                break;
+        }
+    }
+    return heads;
+}
+
+static int id_used(
+    int32_t*    ids,
+    uint32_t    count,
+    int32_t     id)
+{
+    for (uint32_t i = 0; i < count; ++i)
+        if (ids[i] == id)
+            return 1;
+    return 0;
+}
+
+/*
+ * Guard the counted loops that have no guard: find how many times each one's head can run in a hook execution
+ * and put `i32.const id; i32.const max; call _g; drop` right after the loop instruction. A nested loop's max is
+ * its own count times its enclosing loop's, whether that one's guard was written or inferred. Only loops in hook()
+ * and cbak() are considered, since anything else can run any number of times. Loops whose count can't be worked
+ * out are reported (by input offset when there's a map) and left alone for the analysis, and the host, to reject.
+ */
+int auto_guard(
+    wasm_module*    m,
+    reloc_map*      map)
+{
+    // the cleaner won't pass a module that doesn't import it
+    int guard_idx = wasm_find_import(m, "_g");
+    if (guard_idx < 0)
+        return fprintf(stderr, "Module doesn't import _g\n");
+
+    int entry[2] = { wasm_find_export(m, "hook"), wasm_find_export(m, "cbak") };
+
+    int has_elem = 0;
+    for (int i = 0; i < m->sec_count; ++i)
+        has_elem |= (m->sec[i].id == 0x09U);
+
+    uint32_t total_funcs = m->import_func_count + m->func_count;
+    uint8_t* called = calloc(total_funcs + 1, 1);
+    int32_t* ids = 0;
+    uint32_t id_count = 0, id_cap = 0;
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+        {
+            free(called);
+            free(ids);
+            return fprintf(stderr, "Could not decode function %d\n", fi + m->import_func_count);
+        }
+
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+        {
+            wasm_instr* in = f->ins + i;
+            if ((in->op == 0x10U || in->op == 0xD2U) && in->imm >= 0 && in->imm < total_funcs)
+                called[in->imm] = 1;
+            if (in->op == 0x10U && in->imm == guard_idx && i >= 2 && f->ins[i - 2].op == 0x41U)
+            {
+                if (id_count == id_cap)
+                {
+                    id_cap = (id_cap ? id_cap * 2 : 64);
+                    ids = realloc(ids, id_cap * sizeof(int32_t));
+                }
+                ids[id_count++] = (int32_t)f->ins[i - 2].imm;
+            }
+        }
+    }
+
+    guard_site* sites = 0;
+    uint32_t site_count = 0, site_cap = 0, unbounded = 0;
+    int retval = 0;
+    for (uint32_t fi = 0; fi < m->func_count && retval == 0; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        uint32_t func_idx = fi + m->import_func_count;
+        int once = !has_elem && !called[func_idx] && (entry[0] == (int)func_idx || entry[1] == (int)func_idx);
+
+        // the loops in order, so a loop's parent always comes before it
+        guard_loop* loops = malloc(sizeof(guard_loop) * (f->ins_count + 1));
+        uint32_t* open = malloc(sizeof(uint32_t) * (f->ins_count + 1));     // loop index or UINT32_MAX for blocks
+        uint32_t loop_count = 0, sp = 0;
+        int cur = -1;
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+        {
+            wasm_instr* in = f->ins + i;
+            if (in->op == 0x02U || in->op == 0x04U)
+                open[sp++] = UINT32_MAX;
+            else if (in->op == 0x03U)
+            {
+                loops[loop_count] = (guard_loop){ .at = i, .parent = cur };
+                cur = loop_count;
+                open[sp++] = loop_count++;
+            }
+            else if (in->op == 0x0BU && sp > 0 && open[--sp] != UINT32_MAX)
+            {
+                loops[open[sp]].end = i;
+                cur = loops[open[sp]].parent;
+            }
+        }
+        free(open);
+
+        for (uint32_t l = 0; l < loop_count; ++l)
+        {
+            guard_loop* lp = loops + l;
+            if (wasm_is_guard(f, lp->at + 1, guard_idx))
+            {
+                int64_t max = f->ins[lp->at + 2].imm;
+                lp->total = (max > 0 ? (uint32_t)max : 0);
+                continue;
+            }
+
+            const char* why = 0;
+            uint64_t n = 0;
+            if (!once)
+                why = "its function can run more than once per execution";
+            else if (lp->end == 0)
+                why = "it has no end";
+            else
+                n = count_loop(f, lp->at, lp->end, &why);
+
+            if (!why && lp->parent >= 0 && loops[lp->parent].total == 0)
+                why = "an enclosing loop has no bound";
+            else if (!why && lp->parent >= 0 && n * loops[lp->parent].total > INT32_MAX)
+                why = "its bound is too large for a guard";
+
+            uint32_t off = f->ins[lp->at].off;
+            int64_t in_off = (map ? reloc_lookup(map, off) : off);
+            if (in_off < 0)
+                in_off = off;
+
+            if (why)
+            {
+                fprintf(stderr, "Loop at 0x%lX in func %d has no guard and no bound could be inferred: %s\n",
+                        in_off, func_idx, why);
+                unbounded++;
+                continue;
+            }
+
+            lp->total = n * (lp->parent >= 0 ? loops[lp->parent].total : 1);
+
+            int32_t id = AUTO_GUARD_ID(off);
+            while (id_used(ids, id_count, id))
+                id++;
+            if (id_count == id_cap)
+            {
+                id_cap = (id_cap ? id_cap * 2 : 64);
+                ids = realloc(ids, id_cap * sizeof(int32_t));
+            }
+            ids[id_count++] = id;
+
+            if (site_count == site_cap)
+            {
+                site_cap = (site_cap ? site_cap * 2 : 16);
+                sites = realloc(sites, site_cap * sizeof(guard_site));
+            }
+            sites[site_count++] = (guard_site){ .func = fi, .at = lp->at, .id = id, .max = lp->total };
+
+            if (DEBUG)
+                fprintf(stderr, "Guarded loop at 0x%lX in func %d: %ld passes\n", in_off, func_idx, lp->total);
+        }
+        free(loops);
+    }
+    free(called);
+    free(ids);
+
+    for (uint32_t s = 0; s < site_count && retval == 0; )
+    {
+        wasm_func* f = m->funcs + sites[s].func;
+        uint32_t k = s;
+        while (k < site_count && sites[k].func == sites[s].func)
+            k++;
+
+        wasm_instr* ins = malloc(sizeof(wasm_instr) * (f->ins_count + 4 * (k - s)));
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+        {
+            ins[n++] = f->ins[i];
+            if (s < k && sites[s].at == i)
+            {
+                uint32_t off = f->ins[i].off;
+                ins[n++] = (wasm_instr){ .op = 0x41U, .imm = sites[s].id, .off = off };
+                ins[n++] = (wasm_instr){ .op = 0x41U, .imm = sites[s].max, .off = off };
+                ins[n++] = (wasm_instr){ .op = 0x10U, .imm = guard_idx, .off = off };
+                ins[n++] = (wasm_instr){ .op = 0x1AU, .off = off };
+                s++;
+            }
+        }
+
+        free(f->ins);
+        f->ins = ins;
+        f->ins_count = n;
+        f->ins_cap = n;
+    }
+
+    if (DEBUG)
+        fprintf(stderr, "Auto guard: %d loops guarded, %d left without a bound\n", site_count, unbounded);
+
+    free(sites);
+    return retval;
+}
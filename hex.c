@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "cleaner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_X86 1
+#endif
+
+/*
+ * Uppercase hex, the way CreateCode carries hooks in SetHook transactions. The vector paths do 16 (SSE2) or 32
+ * (AVX2, picked at run time) bytes at a time and leave the tail to the scalar loop, which is also all there is
+ * off x86.
+ */
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static void encode_scalar(
+    const uint8_t*  in,
+    size_t          len,
+    char*           out)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        out[2 * i] = hex_digits[in[i] >> 4];
+        out[2 * i + 1] = hex_digits[in[i] & 0x0FU];
+    }
+}
+
+static int nibble(
+    char    c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static int decode_scalar(
+    const char* in,
+    size_t      len,
+    uint8_t*    out)
+{
+    for (size_t i = 0; i < len / 2; ++i)
+    {
+        int h = nibble(in[2 * i]);
+        int l = nibble(in[2 * i + 1]);
+        if (h < 0 || l < 0)
+            return 1;
+        out[i] = (h << 4) | l;
+    }
+    return 0;
+}
+
+#ifdef __SSE2__
+// nibbles to their digits: n + '0', and another 7 to get from ':' to 'A' for 10 and up
+static __m128i digits_sse2(
+    __m128i n)
+{
+    __m128i d = _mm_add_epi8(n, _mm_set1_epi8('0'));
+    return _mm_add_epi8(d, _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7)));
+}
+
+static size_t encode_sse2(
+    const uint8_t*  in,
+    size_t          len,
+    char*           out)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+        __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0F));
+        _mm_storeu_si128((__m128i*)(out + 2 * i), digits_sse2(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128((__m128i*)(out + 2 * i + 16), digits_sse2(_mm_unpackhi_epi8(hi, lo)));
+    }
+    return i;
+}
+
+/*
+ * Digits to nibbles, setting the bytes of *bad for anything that isn't a hex digit. Both ranges are checked as
+ * signed offsets so bytes of 0x80 and up fall outside them too.
+ */
+static __m128i nibbles_sse2(
+    __m128i     c,
+    __m128i*    bad)
+{
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i is_d = _mm_and_si128(_mm_cmpgt_epi8(d, _mm_set1_epi8(-1)), _mm_cmplt_epi8(d, _mm_set1_epi8(10)));
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i is_l = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8(-1)), _mm_cmplt_epi8(l, _mm_set1_epi8(6)));
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(is_d, is_l), _mm_set1_epi8(-1)));
+    return _mm_or_si128(_mm_and_si128(d, is_d), _mm_and_si128(_mm_add_epi8(l, _mm_set1_epi8(10)), is_l));
+}
+
+// pairs of nibbles, high one first, to one byte in each 16 bit lane
+static __m128i join_sse2(
+    __m128i n)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4), _mm_srli_epi16(n, 8));
+}
+
+static size_t decode_sse2(
+    const char* in,
+    size_t      len,
+    uint8_t*    out,
+    int*        bad)
+{
+    __m128i b = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m128i a = join_sse2(nibbles_sse2(_mm_loadu_si128((const __m128i*)(in + i)), &b));
+        __m128i c = join_sse2(nibbles_sse2(_mm_loadu_si128((const __m128i*)(in + i + 16)), &b));
+        _mm_storeu_si128((__m128i*)(out + i / 2), _mm_packus_epi16(a, c));
+    }
+    *bad = (_mm_movemask_epi8(b) != 0);
+    return i;
+}
+#endif
+
+#ifdef HEX_X86
+__attribute__((target("avx2")))
+static __m256i digits_avx2(
+    __m256i n)
+{
+    __m256i d = _mm256_add_epi8(n, _mm256_set1_epi8('0'));
+    return _mm256_add_epi8(d, _mm256_and_si256(_mm256_cmpgt_epi8(n, _mm256_set1_epi8(9)), _mm256_set1_epi8(7)));
+}
+
+// the unpacks work within 128 bit lanes, so the halves are swapped back into order on the way out
+__attribute__((target("avx2")))
+static size_t encode_avx2(
+    const uint8_t*  in,
+    size_t          len,
+    char*           out)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+        __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0F));
+        __m256i a = digits_avx2(_mm256_unpacklo_epi8(hi, lo));
+        __m256i b = digits_avx2(_mm256_unpackhi_epi8(hi, lo));
+        _mm256_storeu_si256((__m256i*)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i nibbles_avx2(
+    __m256i     c,
+    __m256i*    bad)
+{
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i is_d = _mm256_and_si256(_mm256_cmpgt_epi8(d, _mm256_set1_epi8(-1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(10), d));
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i is_l = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8(-1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(6), l));
+    *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(is_d, is_l), _mm256_set1_epi8(-1)));
+    return _mm256_or_si256(_mm256_and_si256(d, is_d),
+            _mm256_and_si256(_mm256_add_epi8(l, _mm256_set1_epi8(10)), is_l));
+}
+
+__attribute__((target("avx2")))
+static __m256i join_avx2(
+    __m256i n)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00FF)), 4),
+            _mm256_srli_epi16(n, 8));
+}
+
+__attribute__((target("avx2")))
+static size_t decode_avx2(
+    const char* in,
+    size_t      len,
+    uint8_t*    out,
+    int*        bad)
+{
+    __m256i b = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i x = join_avx2(nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + i)), &b));
+        __m256i y = join_avx2(nibbles_avx2(_mm256_loadu_si256((const __m256i*)(in + i + 32)), &b));
+        // packus interleaves the lanes of x and y, put them back as x then y
+        __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, y), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + i / 2), p);
+    }
+    *bad = (_mm256_movemask_epi8(b) != 0);
+    return i;
+}
+
+static int have_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// write the 2 * len uppercase digits of `in` to `out`, without a terminator
+void hex_encode(
+    const uint8_t*  in,
+    size_t          len,
+    char*           out)
+{
+    size_t i = 0;
+#ifdef HEX_X86
+    if (have_avx2())
+        i = encode_avx2(in, len, out);
+#endif
+#ifdef __SSE2__
+    i += encode_sse2(in + i, len - i, out + 2 * i);
+#endif
+    encode_scalar(in + i, len - i, out + 2 * i);
+}
+
+// decode `len` digits of either case into len / 2 bytes. Returns nonzero for an odd length or a non-hex digit
+int hex_decode(
+    const char* in,
+    size_t      len,
+    uint8_t*    out)
+{
+    if (len % 2)
+        return 1;
+
+    size_t i = 0;
+    int bad = 0;
+#ifdef HEX_X86
+    if (have_avx2())
+        i = decode_avx2(in, len, out, &bad);
+#endif
+#ifdef __SSE2__
+    if (!bad)
+    {
+        int b = 0;
+        i += decode_sse2(in + i, len - i, out + i / 2, &b);
+        bad = b;
+    }
+#endif
+    return bad || decode_scalar(in + i, len - i, out + i / 2);
+}
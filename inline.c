@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// inlining more levels than this means the helpers are (mutually) recursive
+#define MAX_INLINE_ROUNDS 32
+
+// inlining may grow hook() or cbak() to at most this many instructions per input byte, which keeps the work (and
+// the output) linear in the input size however the helpers call each other
+#define MAX_INLINE_GROWTH 8
+
+// zero constants for float locals, the encoder copies float immediates from the source encoding
+static uint8_t f32_zero[] = { 0x43U, 0, 0, 0, 0 };
+static uint8_t f64_zero[] = { 0x44U, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+typedef struct
+{
+    wasm_instr* ins;
+    uint32_t    count;
+    uint32_t    cap;
+} ins_list;
+
+static void push(
+    ins_list*   l,
+    wasm_instr  in)
+{
+    if (l->count == l->cap)
+    {
+        l->cap = (l->cap ? l->cap * 2 : 64);
+        l->ins = realloc(l->ins, l->cap * sizeof(wasm_instr));
+        if (!l->ins)
+        {
+            fprintf(stderr, "Could not allocate %ld bytes\n", (uint64_t)(l->cap * sizeof(wasm_instr)));
+            exit(101);
+        }
+    }
+    l->ins[l->count++] = in;
+}
+
+static void add_locals(
+    wasm_func*  f,
+    uint32_t    count,
+    uint8_t     type)
+{
+    if (!count)
+        return;
+    if (f->local_group_count && f->locals[f->local_group_count - 1].type == type)
+    {
+        f->locals[f->local_group_count - 1].count += count;
+        return;
+    }
+    f->locals = realloc(f->locals, (f->local_group_count + 1) * sizeof(wasm_local_group));
+    f->locals[f->local_group_count++] = (wasm_local_group){ .count = count, .type = type };
+}
+
+static uint32_t local_count(
+    wasm_module*    m,
+    wasm_func*      f)
+{
+    uint32_t n = m->types[f->type].pc;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        n += f->locals[i].count;
+    return n;
+}
+
+// block type (as the signed immediate) for a wrapper block yielding the given results, nonzero if none fits
+static int result_block_type(
+    wasm_module*    m,
+    wasm_type*      t,
+    int64_t*        bt)
+{
+    if (t->rc <= 1)
+    {
+        // value types are single byte negative s33s
+        *bt = (int64_t)(t->rc ? t->r[0] : WASM_EMPTY) - 0x80;
+        return 0;
+    }
+    for (uint32_t i = 0; i < m->type_count; ++i)
+        if (m->types[i].pc == 0 && m->types[i].rc == t->rc && memcmp(m->types[i].r, t->r, t->rc) == 0)
+        {
+            *bt = i;
+            return 0;
+        }
+    return 1;
+}
+
+/*
+ * Replace the call at `call` in `f` with the body of `callee`. The arguments are popped into fresh locals of the
+ * caller, except trailing ones that are a plain local.get or constant for a param the callee never writes, which
+ * are taken off the end of `o` and substituted for the param's local.get. The callee's own locals get fresh caller
+ * locals too, zeroed when the call sits in a loop (`in_loop`, each inlined entry must see them the way a call
+ * would; elsewhere it runs once and they are still zero). A callee that returns or branches to its function label
+ * is wrapped in a block yielding its results, so a return becomes a branch to that block, any other body is
+ * spliced in as is.
+ */
+static int expand(
+    wasm_module*    m,
+    wasm_func*      f,
+    ins_list*       o,
+    wasm_instr*     call,
+    wasm_func*      callee,
+    int             in_loop)
+{
+    wasm_type* t = m->types + callee->type;
+    int64_t bt;
+    if (result_block_type(m, t, &bt))
+        return fprintf(stderr, "Can't inline func %ld: no block type for its %d results\n", call->imm, t->rc);
+
+    uint32_t base = local_count(m, f);
+
+    // label `depth` is the function's own, a branch to it leaves the body the way a return does
+    int wrap = 0;
+    int depth = 0;
+    for (uint32_t i = 0; i < callee->ins_count && !wrap; ++i)
+    {
+        wasm_instr* in = callee->ins + i;
+        if (in->op == 0x02U || in->op == 0x03U || in->op == 0x04U)
+            depth++;
+        else if (in->op == 0x0BU)
+            depth--;
+        else if (in->op == 0x0FU || ((in->op == 0x0CU || in->op == 0x0DU) && in->imm == depth))
+            wrap = 1;
+        else if (in->op == 0x0EU)
+            for (int64_t k = 0; k <= in->imm; ++k)
+                wrap |= (callee->brt[in->imm2 + k] == (uint32_t)depth);
+    }
+
+    // arguments are on the stack in order, so the last parameter is popped first
+    wasm_instr* direct = calloc(t->pc + 1, sizeof(wasm_instr));
+    uint32_t p = t->pc;
+    for (; p > 0 && o->count > 0; --p)
+    {
+        wasm_instr* arg = o->ins + o->count - 1;
+        if (arg->op != 0x20U && (arg->op < 0x41U || arg->op > 0x44U))
+            break;
+        int written = 0;
+        for (uint32_t i = 0; i < callee->ins_count && !written; ++i)
+            written = ((callee->ins[i].op == 0x21U || callee->ins[i].op == 0x22U) && callee->ins[i].imm == p - 1);
+        if (written)
+            break;
+        direct[p - 1] = *arg;
+        o->count--;
+    }
+    for (; p > 0; --p)
+        push(o, (wasm_instr){ .op = 0x21U, .imm = base + p - 1, .off = call->off });
+    for (uint32_t i = 0; i < t->pc; ++i)
+        add_locals(f, 1, t->p[i]);
+
+    uint32_t local = base + t->pc;
+    for (uint32_t g = 0; g < callee->local_group_count; ++g)
+    {
+        uint8_t type = callee->locals[g].type;
+        wasm_instr zero = { .off = call->off };
+        switch (type)
+        {
+            case WASM_I32: zero.op = 0x41U; break;
+            case WASM_I64: zero.op = 0x42U; break;
+            case WASM_F32: zero.op = 0x43U; zero.raw = f32_zero; zero.len = sizeof(f32_zero); break;
+            case WASM_F64: zero.op = 0x44U; zero.raw = f64_zero; zero.len = sizeof(f64_zero); break;
+            default:
+                return fprintf(stderr, "Can't inline func %ld: local of type 0x%02X\n", call->imm, type);
+        }
+        for (uint32_t i = 0; i < callee->locals[g].count && in_loop; ++i)
+        {
+            push(o, zero);
+            push(o, (wasm_instr){ .op = 0x21U, .imm = local++, .off = call->off });
+        }
+        add_locals(f, callee->locals[g].count, type);
+    }
+
+    if (wrap)
+        push(o, (wasm_instr){ .op = 0x02U, .imm = bt, .off = call->off });
+
+    // the wrapper block stands in for the callee's function block, so branch depths carry over unchanged
+    depth = 0;
+    for (uint32_t i = 0; i < callee->ins_count; ++i)
+    {
+        wasm_instr in = callee->ins[i];
+        switch (in.op)
+        {
+            case 0x02U: case 0x03U: case 0x04U:
+                depth++;
+                break;
+            case 0x0BU:
+                // without a wrapper the function's end has nothing left to close
+                if (--depth < 0 && !wrap)
+                    continue;
+                break;
+            case 0x0FU:
+                in = (wasm_instr){ .op = 0x0CU, .imm = depth, .off = in.off };
+                break;
+            case 0x20U: case 0x21U: case 0x22U:
+                if (in.op == 0x20U && (uint64_t)in.imm < t->pc && direct[in.imm].op)
+                    in = direct[in.imm];
+                else
+                    in.imm += base;
+                break;
+            case 0x0EU:
+            {
+                // copy the label table into the caller's pool
+                f->brt = realloc(f->brt, (f->brt_count + in.imm + 1) * sizeof(uint32_t));
+                f->brt_cap = f->brt_count + in.imm + 1;
+                memcpy(f->brt + f->brt_count, callee->brt + in.imm2, (in.imm + 1) * sizeof(uint32_t));
+                in.imm2 = f->brt_count;
+                f->brt_count += in.imm + 1;
+                break;
+            }
+        }
+        push(o, in);
+    }
+
+    free(direct);
+    return 0;
+}
+
+/*
+ * Only hook() and cbak() survive cleaning, so any helper they still call would be dangling afterwards. This runs
+ * on the input module before cleaning and substitutes every call from hook() or cbak() to a defined function with
+ * the callee's body, repeating for calls the inlined bodies bring with them. A callee is inlined if it has at
+ * most `limit` instructions or only one call site, anything else is an error rather than a broken output. The
+ * module is only rewritten (into a new buffer from `a`) if something was inlined.
+ */
+int inline_helpers(
+    uint8_t**   buf,
+    ssize_t*    len,
+    int         limit,
+    arena*      a,
+    reloc_map*  map)
+{
+    wasm_module m;
+    if (wasm_parse(*buf, *len, &m))
+        return fprintf(stderr, "Could not parse module for inlining\n");
+
+    int roots[2] = { wasm_find_export(&m, "hook"), wasm_find_export(&m, "cbak") };
+    uint32_t* sites = calloc(m.import_func_count + m.func_count + 1, sizeof(uint32_t));
+    int retval = 0;
+    int inlined = 0;
+    int round = 0;
+
+    for (;;)
+    {
+        memset(sites, 0, (m.import_func_count + m.func_count) * sizeof(uint32_t));
+        int calls = 0;
+        for (int r = 0; r < 2 && !retval; ++r)
+        {
+            if (roots[r] < (int)m.import_func_count || (r == 1 && roots[1] == roots[0]))
+                continue;
+            wasm_func* f = m.funcs + (roots[r] - m.import_func_count);
+            retval = wasm_decode_body(&m, f);
+            for (uint32_t i = 0; !retval && i < f->ins_count; ++i)
+                if (f->ins[i].op == 0x10U && f->ins[i].imm >= m.import_func_count &&
+                    f->ins[i].imm < m.import_func_count + m.func_count)
+                {
+                    sites[f->ins[i].imm]++;
+                    calls++;
+                }
+        }
+
+        if (retval || !calls)
+            break;
+
+        if (++round > MAX_INLINE_ROUNDS)
+        {
+            retval = fprintf(stderr, "Helpers are still calling helpers after %d rounds of inlining, "
+                    "recursive calls can't be inlined\n", MAX_INLINE_ROUNDS);
+            break;
+        }
+
+        for (int r = 0; r < 2 && !retval; ++r)
+        {
+            if (roots[r] < (int)m.import_func_count || (r == 1 && roots[1] == roots[0]))
+                continue;
+            wasm_func* f = m.funcs + (roots[r] - m.import_func_count);
+            ins_list o = { 0 };
+
+            // the kind of each open block (1 for a loop) and how many of them are loops
+            uint8_t* loop = malloc(f->ins_count + 1);
+            int open = 0;
+            int loops = 0;
+
+            for (uint32_t i = 0; !retval && i < f->ins_count; ++i)
+            {
+                wasm_instr* in = f->ins + i;
+                if (in->op == 0x02U || in->op == 0x03U || in->op == 0x04U)
+                    loops += (loop[open++] = (in->op == 0x03U));
+                else if (in->op == 0x0BU && open > 0)
+                    loops -= loop[--open];
+
+                if (in->op != 0x10U || in->imm < m.import_func_count || in->imm >= m.import_func_count + m.func_count)
+                {
+                    push(&o, *in);
+                    continue;
+                }
+
+                wasm_func* callee = m.funcs + (in->imm - m.import_func_count);
+                if (callee == f)
+                {
+                    retval = fprintf(stderr, "Func %d calls itself and can't be inlined\n", roots[r]);
+                    break;
+                }
+                if ((retval = wasm_decode_body(&m, callee)))
+                    break;
+                if (callee->ins_count > limit && sites[in->imm] > 1)
+                {
+                    retval = fprintf(stderr, "Can't inline func %ld: %d instructions exceeds the inline limit of %d "
+                            "and it has %d call sites\n", in->imm, callee->ins_count, limit, sites[in->imm]);
+                    break;
+                }
+
+                if (DEBUG)
+                    fprintf(stderr, "Inlining func %ld (%d instructions) into func %d at 0x%X\n",
+                            in->imm, callee->ins_count, roots[r], in->off);
+
+                retval = expand(&m, f, &o, in, callee, loops > 0);
+                inlined++;
+                if (retval == 0 && o.count > MAX_INLINE_GROWTH * (uint64_t)*len)
+                    retval = fprintf(stderr, "Inlining into func %d stopped at %d instructions, more than %d per "
+                            "input byte\n", roots[r], o.count, MAX_INLINE_GROWTH);
+            }
+
+            free(loop);
+            free(f->ins);
+            f->ins = o.ins;
+            f->ins_count = o.count;
+            f->ins_cap = o.cap;
+        }
+
+        if (retval)
+            break;
+    }
+
+    free(sites);
+
+    if (retval || !inlined)
+    {
+        wasm_free(&m);
+        return retval;
+    }
+
+    // instructions keep their source offsets, so the emitted map leads straight back to the input
+    m.map = map;
+    wasm_buf b = { 0 };
+    retval = wasm_emit(&m, &b);
+    wasm_free(&m);
+    if (retval)
+    {
+        free(b.p);
+        return retval;
+    }
+
+    fprintf(stderr, "Inlined %d calls: %ld -> %ld bytes\n", inlined, *len, b.len);
+
+    uint8_t* n = arena_alloc(a, b.len);
+    if (n)
+        memcpy(n, b.p, b.len);
+    free(b.p);
+    if (!n)
+        return 1;
+
+    *buf = n;
+    *len = b.len;
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+static uint8_t prof_mod[] = "env";
+static uint8_t prof_name[] = PROF_IMPORT;
+static const uint8_t prof_params[] = { WASM_I32 };
+
+// index of the type (i32) -> (), added if the module doesn't have it yet
+static uint32_t prof_type(
+    wasm_module*    m)
+{
+    for (uint32_t i = 0; i < m->type_count; ++i)
+        if (m->types[i].pc == 1 && m->types[i].p[0] == WASM_I32 && m->types[i].rc == 0)
+            return i;
+
+    m->types = realloc(m->types, (m->type_count + 1) * sizeof(wasm_type));
+    m->types[m->type_count] = (wasm_type){ .pc = 1, .p = prof_params, .rc = 0 };
+    return m->type_count++;
+}
+
+/*
+ * Profiling build: import env.__prof(i32) and call it with a unique site id on entry to hook() / cbak() and at
+ * the start of every block and loop (after the guard, which has to stay first). Function indices at and above the
+ * new import move up by one. Each site is recorded in `sites` with the offset of the instruction it was placed
+ * for, its kind and, for loops, the guard's iteration bound.
+ */
+int instrument(
+    wasm_module*    m,
+    prof_site**     sites,
+    uint32_t*       site_count)
+{
+    *sites = 0;
+    *site_count = 0;
+
+    for (int i = 0; i < m->sec_count; ++i)
+        if (m->sec[i].id == 0x08U || m->sec[i].id == 0x09U)
+            return fprintf(stderr, "Can't instrument a module with a start or element section\n");
+
+    if (wasm_find_import(m, PROF_IMPORT) >= 0)
+        return fprintf(stderr, "Module already imports " PROF_IMPORT "\n");
+
+    int has_imports = 0;
+    for (int i = 0; i < m->sec_count; ++i)
+        has_imports |= (m->sec[i].id == 0x02U);
+    if (!has_imports)
+        return fprintf(stderr, "Can't instrument a module without imports\n");
+
+    int guard_idx = wasm_find_import(m, "_g");
+
+    // the new import goes after the last function import, so it takes the first defined function's index
+    uint32_t prof_idx = m->import_func_count;
+    uint32_t at = 0;
+    for (uint32_t i = 0; i < m->import_count; ++i)
+        if (m->imports[i].kind == 0x00U)
+            at = i + 1;
+
+    wasm_import im = { .mod = prof_mod, .mod_len = 3, .name = prof_name, .name_len = sizeof(prof_name) - 1,
+        .kind = 0x00U, .type = prof_type(m) };
+    m->imports = realloc(m->imports, (m->import_count + 1) * sizeof(wasm_import));
+    memmove(m->imports + at + 1, m->imports + at, (m->import_count - at) * sizeof(wasm_import));
+    m->imports[at] = im;
+    m->import_count++;
+    m->import_func_count++;
+
+    for (uint32_t i = 0; i < m->export_count; ++i)
+        if (m->exports[i].kind == 0x00U && m->exports[i].idx >= prof_idx)
+            m->exports[i].idx++;
+
+    uint32_t cap = 0;
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+            return 1;
+
+        wasm_instr* ins = malloc(sizeof(wasm_instr) * (f->ins_count * 3 + 2));
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i <= f->ins_count; ++i)
+        {
+            // i == 0 is the function entry, i > 0 follows instruction i - 1
+            wasm_instr* in = (i > 0 ? f->ins + i - 1 : 0);
+            if (in)
+            {
+                if ((in->op == 0x10U || in->op == 0xD2U) && in->imm >= prof_idx)
+                    in->imm++;
+                ins[n++] = *in;
+                if (in->op != 0x02U && in->op != 0x03U)
+                    continue;
+            }
+
+            prof_site site = { .off = (in ? in->off : (f->ins_count ? f->ins[0].off : 0)),
+                .kind = (in ? in->op : 0x00U) };
+
+            // a loop's counter goes after its guard
+            if (in && in->op == 0x03U && guard_idx >= 0 && wasm_is_guard(f, i, guard_idx))
+            {
+                site.guard_max = f->ins[i + 1].imm;
+                for (int k = 0; k < 4; ++k)
+                    ins[n++] = f->ins[i++];
+            }
+
+            if (*site_count == cap)
+            {
+                cap = (cap ? cap * 2 : 64);
+                *sites = realloc(*sites, cap * sizeof(prof_site));
+            }
+            (*sites)[(*site_count)++] = site;
+
+            ins[n++] = (wasm_instr){ .op = 0x41U, .imm = *site_count - 1, .off = site.off };
+            ins[n++] = (wasm_instr){ .op = 0x10U, .imm = prof_idx, .off = site.off };
+        }
+
+        free(f->ins);
+        f->ins = ins;
+        f->ins_count = n;
+        f->ins_cap = f->ins_count * 3 + 2;
+    }
+
+    if (DEBUG)
+        fprintf(stderr, "Instrumented %d sites, " PROF_IMPORT " is func %d\n", *site_count, prof_idx);
+
+    return 0;
+}
+
+// sidecar listing: one line per site id with its kind, input offset and (for loops) the guard's bound
+int write_prof_sites(
+    prof_site*  sites,
+    uint32_t    count,
+    FILE*       f)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        const char* kind = (sites[i].kind == 0x03U ? "loop" : (sites[i].kind == 0x02U ? "block" : "func"));
+        if (sites[i].kind == 0x03U && sites[i].guard_max)
+            fprintf(f, "%d\t%s\t0x%X\t%ld\n", i, kind, sites[i].off, sites[i].guard_max);
+        else
+            fprintf(f, "%d\t%s\t0x%X\t-\n", i, kind, sites[i].off);
+    }
+    return ferror(f);
+}
@@ -0,0 +1,1322 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h>
+#include "cleaner.h"
+
+/*
+ * Reference interpreter for benchmarking hooks without a ledger node. It instantiates a module, stubs the env
+ * imports with scripted responses and runs hook() or cbak() to completion, counting the instructions executed, the
+ * guard calls and the memory and stack used. Given an original build and its cleaned output (or --clean, which
+ * cleans in-process) it runs both and fails if they end differently or the cleaned one executes more instructions.
+ *
+ * The MVP instruction set is supported along with sign extension, saturating truncation and bulk memory copy/fill.
+ * Tables, reference types and vector instructions trap, hooks can't use them.
+ */
+
+#define STACK_SLOTS     0x10000U
+#define MAX_CALL_DEPTH  256
+#define MAX_PAGES       256
+#define DEFAULT_LIMIT   100000000ULL
+
+enum
+{
+    OUT_RETURNED,       // the entry function returned without calling accept() or rollback()
+    OUT_ACCEPT,
+    OUT_ROLLBACK,
+    OUT_GUARD,          // a guard's iteration bound was exceeded
+    OUT_TRAP
+};
+
+static const char* outcome_name[] = { "returned", "accept", "rollback", "guard violation", "trap" };
+
+/*
+ * Script lines are `name value [hex]`: a call to the import `name` returns value and, if hex bytes are given,
+ * writes them to the call's first (pointer, length) argument pair. Several lines for the same import are used
+ * in turn and the last one keeps answering. Imports without a line return 0.
+ */
+typedef struct
+{
+    char        name[64];
+    int64_t     value;
+    uint8_t*    data;
+    uint32_t    data_len;
+    int         used;
+} response;
+
+typedef struct
+{
+    response*   r;
+    uint32_t    count;
+} script;
+
+typedef struct
+{
+    uint32_t    id;
+    uint32_t    max;
+    uint64_t    hits;
+} guard_stat;
+
+typedef struct
+{
+    uint32_t*   end;        // index of the matching end of every block, loop and if; of the if's end for else
+    uint32_t*   els;        // index of the else of every if, or 0 if it has none
+    uint32_t    max_depth;  // deepest block nesting
+} func_info;
+
+typedef struct
+{
+    uint32_t    cont;       // where a branch to the label continues
+    uint32_t    height;     // operand stack height at entry, without the block's parameters
+    uint32_t    arity;      // values a branch carries
+    int         loop;       // branches to loops stay inside them
+} label;
+
+typedef struct
+{
+    wasm_module     m;
+    func_info*      fi;
+    wasm_import**   fimports;   // function imports by function index
+
+    uint8_t*        mem;
+    uint64_t        mem_len;
+    uint64_t        mem_high;   // one past the highest byte written
+    uint64_t*       globals;
+
+    uint64_t*       stack;
+    uint32_t        sp;
+    uint32_t        peak_sp;
+    int             depth;
+    int             peak_depth;
+
+    uint64_t        limit;
+    uint64_t        instrs;
+    uint64_t        host_calls;
+    uint64_t        wasm_calls;
+    guard_stat*     guards;
+    uint32_t        guard_count;
+
+    script*         script;
+    int             verbose;
+
+    int             outcome;
+    int64_t         code;
+    char            msg[128];
+} vm;
+
+static int parse_script(
+    char*   fn,
+    script* s)
+{
+    memset(s, 0, sizeof(*s));
+    FILE* f = fopen(fn, "r");
+    if (!f)
+        return fprintf(stderr, "Could not open script `%s`\n", fn);
+
+    char line[4096];
+    int n = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        n++;
+        char name[64], hex[sizeof(line)];
+        long long value;
+        hex[0] = '\0';
+        int fields = sscanf(line, " %63s %lli %4095s", name, &value, hex);
+        if (fields <= 0 || name[0] == '#')
+            continue;
+        if (fields < 2)
+        {
+            fclose(f);
+            return fprintf(stderr, "%s:%d: expected `name value [hex]`\n", fn, n);
+        }
+
+        s->r = realloc(s->r, (s->count + 1) * sizeof(response));
+        response* r = s->r + s->count++;
+        memset(r, 0, sizeof(*r));
+        strcpy(r->name, name);
+        r->value = value;
+
+        size_t hl = strlen(hex);
+        if (hl % 2)
+        {
+            fclose(f);
+            return fprintf(stderr, "%s:%d: odd number of hex digits\n", fn, n);
+        }
+        r->data = malloc(hl / 2 + 1);
+        for (size_t i = 0; i < hl; i += 2)
+        {
+            unsigned int b;
+            if (sscanf(hex + i, "%2x", &b) != 1)
+            {
+                fclose(f);
+                return fprintf(stderr, "%s:%d: invalid hex\n", fn, n);
+            }
+            r->data[r->data_len++] = b;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static response* next_response(
+    script*     s,
+    uint8_t*    name,
+    uint32_t    name_len)
+{
+    response* last = 0;
+    for (uint32_t i = 0; s && i < s->count; ++i)
+    {
+        response* r = s->r + i;
+        if (strlen(r->name) != name_len || memcmp(r->name, name, name_len) != 0)
+            continue;
+        if (!r->used)
+        {
+            // the last line for a name is never used up
+            for (uint32_t j = i + 1; j < s->count; ++j)
+                if (strcmp(s->r[j].name, r->name) == 0)
+                {
+                    r->used = 1;
+                    break;
+                }
+            return r;
+        }
+        last = r;
+    }
+    return last;
+}
+
+static void stop(
+    vm*         v,
+    int         outcome,
+    int64_t     code,
+    const char* msg,
+    uint32_t    msg_len)
+{
+    v->outcome = outcome;
+    v->code = code;
+    if (msg_len >= sizeof(v->msg))
+        msg_len = sizeof(v->msg) - 1;
+    memcpy(v->msg, msg, msg_len);
+    v->msg[msg_len] = '\0';
+}
+
+static int trap(
+    vm*         v,
+    const char* why)
+{
+    stop(v, OUT_TRAP, 0, why, strlen(why));
+    return 1;
+}
+
+// match every block, loop and if with its end (and else) so branches don't have to scan
+static int prepare(
+    vm* v)
+{
+    wasm_module* m = &v->m;
+    v->fi = calloc(m->func_count + 1, sizeof(func_info));
+    for (uint32_t i = 0; i < m->func_count; ++i)
+    {
+        wasm_func* f = m->funcs + i;
+        if (wasm_decode_body(m, f))
+            return fprintf(stderr, "Could not decode function %d\n", i + m->import_func_count);
+
+        func_info* fi = v->fi + i;
+        fi->end = calloc(f->ins_count + 1, sizeof(uint32_t));
+        fi->els = calloc(f->ins_count + 1, sizeof(uint32_t));
+        uint32_t* open = malloc(sizeof(uint32_t) * (f->ins_count + 1));
+        uint32_t depth = 0;
+        for (uint32_t j = 0; j < f->ins_count; ++j)
+        {
+            uint8_t op = f->ins[j].op;
+            if (op == 0x02U || op == 0x03U || op == 0x04U)
+            {
+                open[depth++] = j;
+                if (depth > fi->max_depth)
+                    fi->max_depth = depth;
+            }
+            else if (op == 0x05U && depth)
+                fi->els[open[depth - 1]] = j;
+            else if (op == 0x0BU && depth)
+            {
+                uint32_t b = open[--depth];
+                fi->end[b] = j;
+                if (fi->els[b])
+                    fi->end[fi->els[b]] = j;
+            }
+        }
+        free(open);
+        if (depth)
+            return fprintf(stderr, "Unbalanced blocks in function %d\n", i + m->import_func_count);
+    }
+    return 0;
+}
+
+static int const_expr(
+    vm*         v,
+    uint8_t*    expr,
+    uint32_t    len,
+    uint64_t*   value)
+{
+    wasm_instr in;
+    if (wasm_decode_instr(expr, expr + len, &in, 0))
+        return 1;
+    switch (in.op)
+    {
+        case 0x41U: *value = (uint32_t)in.imm; return 0;
+        case 0x42U: *value = in.imm; return 0;
+        case 0x43U: *value = 0; memcpy(value, in.raw + 1, 4); return 0;
+        case 0x44U: memcpy(value, in.raw + 1, 8); return 0;
+        case 0x23U:
+        {
+            // imported globals read as 0, defined ones can only refer to imported ones
+            *value = (in.imm >= v->m.import_global_count ? v->globals[in.imm] : 0);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int instantiate(
+    vm*         v,
+    uint8_t*    buf,
+    ssize_t     len)
+{
+    if (wasm_parse(buf, len, &v->m))
+        return fprintf(stderr, "Could not parse module\n");
+    wasm_module* m = &v->m;
+
+    if (prepare(v))
+        return 1;
+
+    v->fimports = calloc(m->import_func_count + 1, sizeof(wasm_import*));
+    for (uint32_t i = 0, n = 0; i < m->import_count; ++i)
+    {
+        wasm_import* im = m->imports + i;
+        if (im->kind == 0x00U)
+            v->fimports[n++] = im;
+        else if (im->kind != 0x03U)
+            return fprintf(stderr, "Only function and global imports can be stubbed\n");
+    }
+
+    if (m->has_memory)
+    {
+        if (m->mem_min > MAX_PAGES)
+            return fprintf(stderr, "Memory of %d pages is over the %d page limit\n", m->mem_min, MAX_PAGES);
+        v->mem_len = (uint64_t)m->mem_min * 0x10000U;
+        v->mem = calloc(MAX_PAGES * 0x10000U, 1);
+    }
+
+    v->globals = calloc(m->import_global_count + m->global_count + 1, sizeof(uint64_t));
+    for (uint32_t i = 0; i < m->global_count; ++i)
+        if (const_expr(v, m->globals[i].init, m->globals[i].init_len, v->globals + m->import_global_count + i))
+            return fprintf(stderr, "Unsupported initialiser for global %d\n", i + m->import_global_count);
+
+    for (uint32_t i = 0; i < m->data_count; ++i)
+    {
+        wasm_data* d = m->data + i;
+        if (d->mode == 1)
+            continue;
+        uint64_t off;
+        if (const_expr(v, d->offset, d->offset_len, &off) || (uint32_t)off + (uint64_t)d->bytes_len > v->mem_len)
+            return fprintf(stderr, "Data segment %d does not fit in memory\n", i);
+        memcpy(v->mem + (uint32_t)off, d->bytes, d->bytes_len);
+    }
+
+    v->stack = malloc(STACK_SLOTS * sizeof(uint64_t));
+    return 0;
+}
+
+static void release(
+    vm* v)
+{
+    for (uint32_t i = 0; v->fi && i < v->m.func_count; ++i)
+    {
+        free(v->fi[i].end);
+        free(v->fi[i].els);
+    }
+    free(v->fi);
+    free(v->fimports);
+    free(v->mem);
+    free(v->globals);
+    free(v->stack);
+    free(v->guards);
+    wasm_free(&v->m);
+}
+
+static int guard(
+    vm*         v,
+    uint32_t    id,
+    uint32_t    max)
+{
+    guard_stat* g = 0;
+    for (uint32_t i = 0; i < v->guard_count && !g; ++i)
+        if (v->guards[i].id == id)
+            g = v->guards + i;
+    if (!g)
+    {
+        v->guards = realloc(v->guards, (v->guard_count + 1) * sizeof(guard_stat));
+        g = v->guards + v->guard_count++;
+        g->id = id;
+        g->hits = 0;
+    }
+    g->max = max;
+    if (++g->hits > max)
+    {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "guard %d passed %d times", id, max);
+        stop(v, OUT_GUARD, id, msg, strlen(msg));
+        return 1;
+    }
+    return 0;
+}
+
+static int host_call(
+    vm*         v,
+    uint32_t    idx)
+{
+    wasm_import* im = v->fimports[idx];
+    wasm_type* t = v->m.types + im->type;
+    if (v->sp < t->pc)
+        return trap(v, "operand stack underflow");
+    uint64_t* args = v->stack + v->sp - t->pc;
+    v->sp -= t->pc;
+
+    #define IS(s) (im->name_len == sizeof(s) - 1 && memcmp(im->name, s, sizeof(s) - 1) == 0)
+    #define ARG32(i) ((uint32_t)(t->pc > (i) ? args[i] : 0))
+    #define IN_MEM(p, n) ((uint64_t)(p) + (n) <= v->mem_len)
+
+    // --instrument's counter and the guards --auto-guard inserts aren't the hook's own calls
+    if (!IS(PROF_IMPORT) && !(IS("_g") && IS_AUTO_GUARD_ID(ARG32(0))))
+        v->host_calls++;
+
+    int64_t result = 0;
+    if (IS("_g"))
+    {
+        if (guard(v, ARG32(0), ARG32(1)))
+            return 1;
+        result = 1;
+    }
+    else if (IS("accept") || IS("rollback"))
+    {
+        uint32_t p = ARG32(0), n = ARG32(1);
+        if (!IN_MEM(p, n))
+            return trap(v, "accept/rollback message out of bounds");
+        stop(v, (IS("accept") ? OUT_ACCEPT : OUT_ROLLBACK), (t->pc > 2 ? (int64_t)args[2] : 0),
+                (const char*)v->mem + p, n);
+        return 1;
+    }
+    else if (IS("trace") || IS("trace_num"))
+    {
+        uint32_t p = ARG32(0), n = ARG32(1);
+        if (!IN_MEM(p, n))
+            return trap(v, "trace message out of bounds");
+        if (v->verbose)
+        {
+            fprintf(stderr, "    trace: %.*s", n, (const char*)v->mem + p);
+            if (IS("trace_num"))
+                fprintf(stderr, " %ld", (int64_t)args[2]);
+            fprintf(stderr, "\n");
+        }
+    }
+    else
+    {
+        response* r = next_response(v->script, im->name, im->name_len);
+        if (r)
+        {
+            result = r->value;
+            if (r->data_len && t->pc >= 2)
+            {
+                uint32_t p = ARG32(0), n = ARG32(1);
+                if (n > r->data_len)
+                    n = r->data_len;
+                if (!IN_MEM(p, n))
+                    return trap(v, "scripted response out of bounds");
+                memcpy(v->mem + p, r->data, n);
+                if (p + n > v->mem_high)
+                    v->mem_high = p + n;
+            }
+        }
+        if (v->verbose)
+            fprintf(stderr, "    %.*s -> %ld\n", im->name_len, im->name, result);
+    }
+
+    if (t->rc && v->sp >= STACK_SLOTS)
+        return trap(v, "operand stack exhausted");
+    if (t->rc)
+        v->stack[v->sp++] = (t->r[0] == WASM_I32 ? (uint32_t)result : (uint64_t)result);
+    return 0;
+
+    #undef IS
+    #undef ARG32
+    #undef IN_MEM
+}
+
+static int invoke(
+    vm*         v,
+    uint32_t    idx);
+
+static float f32(uint64_t x)     { uint32_t u = x; float f; memcpy(&f, &u, 4); return f; }
+static double f64(uint64_t x)    { double d; memcpy(&d, &x, 8); return d; }
+static uint64_t b32(float f)     { uint32_t u; memcpy(&u, &f, 4); return u; }
+static uint64_t b64(double d)    { uint64_t u; memcpy(&u, &d, 8); return u; }
+
+// wasm min/max: NaN if either operand is, and -0 below +0
+static double fminmax(double a, double b, int max)
+{
+    if (isnan(a) || isnan(b))
+        return NAN;
+    if (a == b)
+        return (max ? (signbit(a) ? b : a) : (signbit(a) ? a : b));
+    return (max ? (a > b ? a : b) : (a < b ? a : b));
+}
+
+/*
+ * Float truncation to integer. `lo` and `hi` are the exclusive bounds of the target range, plain truncation traps
+ * outside them and the saturating form clamps.
+ */
+static const char* trunc_to(
+    double      a,
+    double      lo,
+    double      hi,
+    int         sat,
+    int         is_signed,
+    int         wide,
+    uint64_t*   out)
+{
+    if (isnan(a))
+    {
+        *out = 0;
+        return (sat ? 0 : "invalid conversion to integer");
+    }
+    if (a <= lo || a >= hi)
+    {
+        if (!sat)
+            return "integer overflow";
+        if (a <= lo)
+            *out = (is_signed ? (wide ? (uint64_t)INT64_MIN : (uint32_t)INT32_MIN) : 0);
+        else
+            *out = (is_signed ? (wide ? (uint64_t)INT64_MAX : (uint32_t)INT32_MAX) :
+                    (wide ? UINT64_MAX : UINT32_MAX));
+        return 0;
+    }
+    if (is_signed)
+        *out = (wide ? (uint64_t)(int64_t)a : (uint32_t)(int32_t)a);
+    else
+        *out = (wide ? (uint64_t)a : (uint32_t)a);
+    return 0;
+}
+
+// floating point comparisons, arithmetic and conversions, including the 0xFC saturating truncations
+static const char* float_op(
+    vm*         v,
+    wasm_instr* in)
+{
+    uint64_t* s = v->stack + v->sp;
+    uint8_t op = in->op;
+
+    // i32.trunc_f32_s ... i64.trunc_f64_u, in the order of the 0xFC saturating forms
+    static const uint8_t trunc_ops[8] = { 0xA8U, 0xA9U, 0xAAU, 0xABU, 0xAEU, 0xAFU, 0xB0U, 0xB1U };
+    static const double trunc_bounds[8][2] =
+    {
+        { -2147483904.0, 2147483648.0 },            { -1.0, 4294967296.0 },
+        { -2147483649.0, 2147483648.0 },            { -1.0, 4294967296.0 },
+        { -9223373136366403584.0, 9223372036854775808.0 }, { -1.0, 18446744073709551616.0 },
+        { -9223372036854777856.0, 9223372036854775808.0 }, { -1.0, 18446744073709551616.0 }
+    };
+    for (uint32_t k = 0; k < 8; ++k)
+        if ((op == 0xFCU && in->sub == k) || op == trunc_ops[k])
+        {
+            double x = (k & 2U ? f64(s[-1]) : f32(s[-1]));
+            return trunc_to(x, trunc_bounds[k][0], trunc_bounds[k][1], (op == 0xFCU), !(k & 1U), (k >= 4), s - 1);
+        }
+
+    if (op >= 0x5BU && op <= 0x60U)
+    {
+        float b = f32(s[-1]), a = f32(s[-2]);
+        int r = (op == 0x5BU ? a == b : op == 0x5CU ? a != b : op == 0x5DU ? a < b :
+                 op == 0x5EU ? a > b : op == 0x5FU ? a <= b : a >= b);
+        s[-2] = r;
+        v->sp--;
+        return 0;
+    }
+
+    if (op >= 0x61U && op <= 0x66U)
+    {
+        double b = f64(s[-1]), a = f64(s[-2]);
+        int r = (op == 0x61U ? a == b : op == 0x62U ? a != b : op == 0x63U ? a < b :
+                 op == 0x64U ? a > b : op == 0x65U ? a <= b : a >= b);
+        s[-2] = r;
+        v->sp--;
+        return 0;
+    }
+
+    if (op >= 0x8BU && op <= 0x91U)
+    {
+        float a = f32(s[-1]);
+        switch (op)
+        {
+            case 0x8BU: s[-1] &= 0x7FFFFFFFU; return 0;
+            case 0x8CU: s[-1] ^= 0x80000000U; return 0;
+            case 0x8DU: s[-1] = b32(ceilf(a)); return 0;
+            case 0x8EU: s[-1] = b32(floorf(a)); return 0;
+            case 0x8FU: s[-1] = b32(truncf(a)); return 0;
+            case 0x90U: s[-1] = b32(nearbyintf(a)); return 0;
+            case 0x91U: s[-1] = b32(sqrtf(a)); return 0;
+        }
+    }
+
+    if (op >= 0x92U && op <= 0x98U)
+    {
+        float b = f32(s[-1]), a = f32(s[-2]);
+        float r = (op == 0x92U ? a + b : op == 0x93U ? a - b : op == 0x94U ? a * b : op == 0x95U ? a / b :
+                   op == 0x96U ? (float)fminmax(a, b, 0) : op == 0x97U ? (float)fminmax(a, b, 1) : copysignf(a, b));
+        s[-2] = b32(r);
+        v->sp--;
+        return 0;
+    }
+
+    if (op >= 0x99U && op <= 0x9FU)
+    {
+        double a = f64(s[-1]);
+        switch (op)
+        {
+            case 0x99U: s[-1] &= 0x7FFFFFFFFFFFFFFFULL; return 0;
+            case 0x9AU: s[-1] ^= 0x8000000000000000ULL; return 0;
+            case 0x9BU: s[-1] = b64(ceil(a)); return 0;
+            case 0x9CU: s[-1] = b64(floor(a)); return 0;
+            case 0x9DU: s[-1] = b64(trunc(a)); return 0;
+            case 0x9EU: s[-1] = b64(nearbyint(a)); return 0;
+            case 0x9FU: s[-1] = b64(sqrt(a)); return 0;
+        }
+    }
+
+    if (op >= 0xA0U && op <= 0xA6U)
+    {
+        double b = f64(s[-1]), a = f64(s[-2]);
+        double r = (op == 0xA0U ? a + b : op == 0xA1U ? a - b : op == 0xA2U ? a * b : op == 0xA3U ? a / b :
+                    op == 0xA4U ? fminmax(a, b, 0) : op == 0xA5U ? fminmax(a, b, 1) : copysign(a, b));
+        s[-2] = b64(r);
+        v->sp--;
+        return 0;
+    }
+
+    switch (op)
+    {
+        case 0xB2U: s[-1] = b32((float)(int32_t)s[-1]); return 0;
+        case 0xB3U: s[-1] = b32((float)(uint32_t)s[-1]); return 0;
+        case 0xB4U: s[-1] = b32((float)(int64_t)s[-1]); return 0;
+        case 0xB5U: s[-1] = b32((float)s[-1]); return 0;
+        case 0xB6U: s[-1] = b32((float)f64(s[-1])); return 0;
+        case 0xB7U: s[-1] = b64((double)(int32_t)s[-1]); return 0;
+        case 0xB8U: s[-1] = b64((double)(uint32_t)s[-1]); return 0;
+        case 0xB9U: s[-1] = b64((double)(int64_t)s[-1]); return 0;
+        case 0xBAU: s[-1] = b64((double)s[-1]); return 0;
+        case 0xBBU: s[-1] = b64((double)f32(s[-1])); return 0;
+    }
+
+    return "unsupported instruction";
+}
+
+static int execute(
+    vm*         v,
+    uint32_t    idx)
+{
+    wasm_module* m = &v->m;
+    wasm_func* f = m->funcs + (idx - m->import_func_count);
+    func_info* fi = v->fi + (idx - m->import_func_count);
+    wasm_type* t = m->types + f->type;
+
+    if (v->sp < t->pc)
+        return trap(v, "operand stack underflow");
+    uint32_t fp = v->sp - t->pc;
+
+    uint64_t local_count = t->pc;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        local_count += f->locals[i].count;
+    if (fp + local_count >= STACK_SLOTS)
+        return trap(v, "operand stack exhausted");
+    memset(v->stack + v->sp, 0, (local_count - t->pc) * sizeof(uint64_t));
+    v->sp = fp + local_count;
+    uint64_t* locals = v->stack + fp;
+
+    label* L = malloc(sizeof(label) * (fi->max_depth + 1));
+    uint32_t n = 1;
+    L[0] = (label){ .cont = f->ins_count, .height = v->sp, .arity = t->rc };
+
+    #define TOP         (v->stack[v->sp - 1])
+    #define POP()       (v->stack[--v->sp])
+    #define PUSH(x)     do { if (v->sp >= STACK_SLOTS) { r = trap(v, "operand stack exhausted"); goto out; } \
+                             v->stack[v->sp++] = (x); } while (0)
+    #define TRAP(s)     do { r = trap(v, s); goto out; } while (0)
+    #define U32(x)      ((uint64_t)(uint32_t)(x))
+    #define BIN32(e)    do { uint32_t b = POP(), a = POP(); (void)a; (void)b; PUSH(U32(e)); } while (0)
+    #define BIN64(e)    do { uint64_t b = POP(), a = POP(); (void)a; (void)b; PUSH((uint64_t)(e)); } while (0)
+    #define UN32(e)     do { uint32_t a = POP(); PUSH(U32(e)); } while (0)
+    #define UN64(e)     do { uint64_t a = POP(); PUSH((uint64_t)(e)); } while (0)
+
+    int r = 0;
+    uint32_t pc = 0;
+    while (pc < f->ins_count)
+    {
+        wasm_instr* in = f->ins + pc;
+        if (++v->instrs > v->limit)
+            TRAP("instruction limit reached");
+        if (v->sp > v->peak_sp)
+            v->peak_sp = v->sp;
+
+        uint32_t br = UINT32_MAX;       // label depth to branch to
+        switch (in->op)
+        {
+            case 0x00U: TRAP("unreachable");
+            case 0x01U: break;
+
+            case 0x02U:     // block
+            case 0x03U:     // loop
+            case 0x04U:     // if
+            {
+                int params, results;
+                if (wasm_block_arity(m, in->imm, &params, &results))
+                    TRAP("invalid block type");
+                uint32_t cond = (in->op == 0x04U ? (uint32_t)POP() : 1);
+                L[n++] = (in->op == 0x03U ?
+                    (label){ .cont = pc + 1, .height = v->sp - params, .arity = params, .loop = 1 } :
+                    (label){ .cont = fi->end[pc] + 1, .height = v->sp - params, .arity = results });
+                if (!cond)
+                {
+                    pc = (fi->els[pc] ? fi->els[pc] + 1 : fi->end[pc]);
+                    continue;
+                }
+                break;
+            }
+
+            case 0x05U:     // else, reached from the then arm: carry on at the if's end
+            {
+                pc = fi->end[pc];
+                continue;
+            }
+
+            case 0x0BU:     // end
+            {
+                n--;
+                break;
+            }
+
+            case 0x0CU: br = in->imm; break;
+            case 0x0DU: if ((uint32_t)POP()) br = in->imm; break;
+            case 0x0EU:
+            {
+                uint32_t i = POP();
+                uint32_t* pool = f->brt + in->imm2;
+                br = pool[i < in->imm ? i : in->imm];
+                break;
+            }
+            case 0x0FU: br = n - 1; break;
+
+            case 0x10U:
+            {
+                if ((r = invoke(v, in->imm)))
+                    goto out;
+                break;
+            }
+
+            case 0x1AU: v->sp--; break;
+            case 0x1BU:
+            case 0x1CU:
+            {
+                uint32_t c = POP();
+                uint64_t b = POP(), a = POP();
+                PUSH(c ? a : b);
+                break;
+            }
+
+            case 0x20U: PUSH(locals[in->imm]); break;
+            case 0x21U: locals[in->imm] = POP(); break;
+            case 0x22U: locals[in->imm] = TOP; break;
+            case 0x23U: PUSH(v->globals[in->imm]); break;
+            case 0x24U: v->globals[in->imm] = POP(); break;
+
+            case 0x28U: case 0x29U: case 0x2AU: case 0x2BU: case 0x2CU: case 0x2DU: case 0x2EU: case 0x2FU:
+            case 0x30U: case 0x31U: case 0x32U: case 0x33U: case 0x34U: case 0x35U:
+            {
+                static const uint8_t width[] = { 4, 8, 4, 8, 1, 1, 2, 2, 1, 1, 2, 2, 4, 4 };
+                uint8_t w = width[in->op - 0x28U];
+                uint64_t addr = (uint64_t)(uint32_t)POP() + in->imm2;
+                if (addr + w > v->mem_len)
+                    TRAP("out of bounds memory access");
+                uint64_t x = 0;
+                memcpy(&x, v->mem + addr, w);
+                switch (in->op)
+                {
+                    case 0x2CU: x = U32((int8_t)x); break;
+                    case 0x2EU: x = U32((int16_t)x); break;
+                    case 0x30U: x = (int64_t)(int8_t)x; break;
+                    case 0x32U: x = (int64_t)(int16_t)x; break;
+                    case 0x34U: x = (int64_t)(int32_t)x; break;
+                }
+                PUSH(x);
+                break;
+            }
+
+            case 0x36U: case 0x37U: case 0x38U: case 0x39U: case 0x3AU: case 0x3BU: case 0x3CU: case 0x3DU:
+            case 0x3EU:
+            {
+                static const uint8_t width[] = { 4, 8, 4, 8, 1, 2, 1, 2, 4 };
+                uint8_t w = width[in->op - 0x36U];
+                uint64_t x = POP();
+                uint64_t addr = (uint64_t)(uint32_t)POP() + in->imm2;
+                if (addr + w > v->mem_len)
+                    TRAP("out of bounds memory access");
+                memcpy(v->mem + addr, &x, w);
+                if (addr + w > v->mem_high)
+                    v->mem_high = addr + w;
+                break;
+            }
+
+            case 0x3FU: PUSH(U32(v->mem_len / 0x10000U)); break;
+            case 0x40U:
+            {
+                uint32_t grow = POP();
+                uint64_t pages = v->mem_len / 0x10000U;
+                uint64_t max = (m->mem_flags & 1U ? m->mem_max : MAX_PAGES);
+                if (max > MAX_PAGES)
+                    max = MAX_PAGES;
+                if (pages + grow > max)
+                    PUSH(U32(-1));
+                else
+                {
+                    v->mem_len += (uint64_t)grow * 0x10000U;
+                    PUSH(U32(pages));
+                }
+                break;
+            }
+
+            case 0x41U: PUSH(U32(in->imm)); break;
+            case 0x42U: PUSH((uint64_t)in->imm); break;
+            case 0x43U: { uint64_t x = 0; memcpy(&x, in->raw + 1, 4); PUSH(x); break; }
+            case 0x44U: { uint64_t x; memcpy(&x, in->raw + 1, 8); PUSH(x); break; }
+
+            case 0x45U: UN32(a == 0); break;
+            case 0x46U: BIN32(a == b); break;
+            case 0x47U: BIN32(a != b); break;
+            case 0x48U: BIN32((int32_t)a < (int32_t)b); break;
+            case 0x49U: BIN32(a < b); break;
+            case 0x4AU: BIN32((int32_t)a > (int32_t)b); break;
+            case 0x4BU: BIN32(a > b); break;
+            case 0x4CU: BIN32((int32_t)a <= (int32_t)b); break;
+            case 0x4DU: BIN32(a <= b); break;
+            case 0x4EU: BIN32((int32_t)a >= (int32_t)b); break;
+            case 0x4FU: BIN32(a >= b); break;
+
+            case 0x50U: { uint64_t a = POP(); PUSH(U32(a == 0)); break; }
+            case 0x51U: BIN64(U32(a == b)); break;
+            case 0x52U: BIN64(U32(a != b)); break;
+            case 0x53U: BIN64(U32((int64_t)a < (int64_t)b)); break;
+            case 0x54U: BIN64(U32(a < b)); break;
+            case 0x55U: BIN64(U32((int64_t)a > (int64_t)b)); break;
+            case 0x56U: BIN64(U32(a > b)); break;
+            case 0x57U: BIN64(U32((int64_t)a <= (int64_t)b)); break;
+            case 0x58U: BIN64(U32(a <= b)); break;
+            case 0x59U: BIN64(U32((int64_t)a >= (int64_t)b)); break;
+            case 0x5AU: BIN64(U32(a >= b)); break;
+
+            case 0x67U: UN32(a ? __builtin_clz(a) : 32); break;
+            case 0x68U: UN32(a ? __builtin_ctz(a) : 32); break;
+            case 0x69U: UN32(__builtin_popcount(a)); break;
+            case 0x6AU: BIN32(a + b); break;
+            case 0x6BU: BIN32(a - b); break;
+            case 0x6CU: BIN32(a * b); break;
+            case 0x6DU:
+            case 0x6EU:
+            case 0x6FU:
+            case 0x70U:
+            {
+                uint32_t b = POP(), a = POP();
+                if (b == 0)
+                    TRAP("integer divide by zero");
+                int ovf = ((int32_t)a == INT32_MIN && (int32_t)b == -1);
+                if (in->op == 0x6DU && ovf)
+                    TRAP("integer overflow");
+                PUSH(U32(in->op == 0x6DU ? (uint32_t)((int32_t)a / (int32_t)b) :
+                         in->op == 0x6EU ? a / b :
+                         in->op == 0x6FU ? (ovf ? 0 : (uint32_t)((int32_t)a % (int32_t)b)) : a % b));
+                break;
+            }
+            case 0x71U: BIN32(a & b); break;
+            case 0x72U: BIN32(a | b); break;
+            case 0x73U: BIN32(a ^ b); break;
+            case 0x74U: BIN32(a << (b & 31U)); break;
+            case 0x75U: BIN32((uint32_t)((int32_t)a >> (b & 31U))); break;
+            case 0x76U: BIN32(a >> (b & 31U)); break;
+            case 0x77U: BIN32((a << (b & 31U)) | (a >> ((32U - (b & 31U)) & 31U))); break;
+            case 0x78U: BIN32((a >> (b & 31U)) | (a << ((32U - (b & 31U)) & 31U))); break;
+
+            case 0x79U: UN64(a ? __builtin_clzll(a) : 64); break;
+            case 0x7AU: UN64(a ? __builtin_ctzll(a) : 64); break;
+            case 0x7BU: UN64(__builtin_popcountll(a)); break;
+            case 0x7CU: BIN64(a + b); break;
+            case 0x7DU: BIN64(a - b); break;
+            case 0x7EU: BIN64(a * b); break;
+            case 0x7FU:
+            case 0x80U:
+            case 0x81U:
+            case 0x82U:
+            {
+                uint64_t b = POP(), a = POP();
+                if (b == 0)
+                    TRAP("integer divide by zero");
+                int ovf = ((int64_t)a == INT64_MIN && (int64_t)b == -1);
+                if (in->op == 0x7FU && ovf)
+                    TRAP("integer overflow");
+                PUSH(in->op == 0x7FU ? (uint64_t)((int64_t)a / (int64_t)b) :
+                     in->op == 0x80U ? a / b :
+                     in->op == 0x81U ? (ovf ? 0 : (uint64_t)((int64_t)a % (int64_t)b)) : a % b);
+                break;
+            }
+            case 0x83U: BIN64(a & b); break;
+            case 0x84U: BIN64(a | b); break;
+            case 0x85U: BIN64(a ^ b); break;
+            case 0x86U: BIN64(a << (b & 63U)); break;
+            case 0x87U: BIN64((uint64_t)((int64_t)a >> (b & 63U))); break;
+            case 0x88U: BIN64(a >> (b & 63U)); break;
+            case 0x89U: BIN64((a << (b & 63U)) | (a >> ((64U - (b & 63U)) & 63U))); break;
+            case 0x8AU: BIN64((a >> (b & 63U)) | (a << ((64U - (b & 63U)) & 63U))); break;
+
+            case 0xA7U: UN64(U32(a)); break;
+            case 0xACU: UN64((int64_t)(int32_t)a); break;
+            case 0xADU: UN64(U32(a)); break;
+
+            // reinterpretations only relabel the bits
+            case 0xBCU: case 0xBDU: case 0xBEU: case 0xBFU: break;
+
+            case 0xC0U: UN32((int32_t)(int8_t)a); break;
+            case 0xC1U: UN32((int32_t)(int16_t)a); break;
+            case 0xC2U: UN64((int64_t)(int8_t)a); break;
+            case 0xC3U: UN64((int64_t)(int16_t)a); break;
+            case 0xC4U: UN64((int64_t)(int32_t)a); break;
+
+            case 0xFCU:
+            {
+                if (in->sub == 10 || in->sub == 11)
+                {
+                    uint64_t len = (uint32_t)POP();
+                    uint64_t src = (uint32_t)POP();
+                    uint64_t dst = (uint32_t)POP();
+                    if (dst + len > v->mem_len || (in->sub == 10 && src + len > v->mem_len))
+                        TRAP("out of bounds memory access");
+                    if (in->sub == 10)
+                        memmove(v->mem + dst, v->mem + src, len);
+                    else
+                        memset(v->mem + dst, (uint8_t)src, len);
+                    if (len && dst + len > v->mem_high)
+                        v->mem_high = dst + len;
+                    break;
+                }
+                if (in->sub <= 7)
+                {
+                    const char* why = float_op(v, in);
+                    if (why)
+                        TRAP(why);
+                    break;
+                }
+                TRAP("unsupported instruction");
+            }
+
+            default:
+            {
+                if (in->op >= 0x5BU && in->op <= 0xBBU)
+                {
+                    const char* why = float_op(v, in);
+                    if (why)
+                        TRAP(why);
+                    break;
+                }
+                TRAP("unsupported instruction");
+            }
+        }
+
+        if (br == UINT32_MAX)
+        {
+            pc++;
+            continue;
+        }
+
+        // branch: keep the label's values, drop the rest of its operands and continue where it says
+        if (br >= n)
+            TRAP("branch depth out of range");
+        uint32_t li = n - 1 - br;
+        label* l = L + li;
+        memmove(v->stack + l->height, v->stack + v->sp - l->arity, l->arity * sizeof(uint64_t));
+        v->sp = l->height + l->arity;
+        pc = l->cont;
+        n = (l->loop ? li + 1 : li);
+    }
+
+    // results go where the arguments were
+    memmove(v->stack + fp, v->stack + v->sp - t->rc, t->rc * sizeof(uint64_t));
+    v->sp = fp + t->rc;
+
+out:
+    free(L);
+    return r;
+
+    #undef TOP
+    #undef POP
+    #undef PUSH
+    #undef TRAP
+    #undef U32
+    #undef BIN32
+    #undef BIN64
+    #undef UN32
+    #undef UN64
+}
+
+static int invoke(
+    vm*         v,
+    uint32_t    idx)
+{
+    if (idx < v->m.import_func_count)
+        return host_call(v, idx);
+    if (idx - v->m.import_func_count >= v->m.func_count)
+        return trap(v, "call to an undefined function");
+    if (v->depth >= MAX_CALL_DEPTH)
+        return trap(v, "call stack exhausted");
+
+    v->wasm_calls++;
+    if (++v->depth > v->peak_depth)
+        v->peak_depth = v->depth;
+    int r = execute(v, idx);
+    v->depth--;
+    return r;
+}
+
+typedef struct
+{
+    int         outcome;
+    int64_t     code;
+    char        msg[128];
+    uint64_t    instrs;
+    uint64_t    host_calls;
+    uint64_t    wasm_calls;
+    uint64_t    guard_hits;
+    uint64_t    added_hits;     // of those, hits of guards --auto-guard inserted
+    uint32_t    guards;
+    uint64_t    mem_len;
+    uint64_t    mem_high;
+    uint32_t    peak_sp;
+    int         peak_depth;
+} run_result;
+
+static int run_hook(
+    uint8_t*        buf,
+    ssize_t         len,
+    const char*     entry,
+    uint32_t        arg,
+    script*         s,
+    uint64_t        limit,
+    int             verbose,
+    run_result*     res)
+{
+    vm v;
+    memset(&v, 0, sizeof(v));
+    v.script = s;
+    v.limit = limit;
+    v.verbose = verbose;
+
+    for (uint32_t i = 0; s && i < s->count; ++i)
+        s->r[i].used = 0;
+
+    if (instantiate(&v, buf, len))
+    {
+        release(&v);
+        return 1;
+    }
+
+    int idx = wasm_find_export(&v.m, entry);
+    wasm_type* t = (idx >= 0 ? wasm_func_type(&v.m, idx) : 0);
+    if (!t || idx < v.m.import_func_count || t->pc > 1)
+    {
+        release(&v);
+        return fprintf(stderr, "Module has no %s(i32) export\n", entry);
+    }
+
+    if (t->pc)
+        v.stack[v.sp++] = arg;
+    v.outcome = OUT_RETURNED;
+    if (invoke(&v, idx) == 0)
+        v.code = (t->rc && v.sp ? (int64_t)v.stack[v.sp - 1] : 0);
+
+    memset(res, 0, sizeof(*res));
+    res->outcome = v.outcome;
+    res->code = v.code;
+    memcpy(res->msg, v.msg, sizeof(res->msg));
+    res->instrs = v.instrs;
+    res->host_calls = v.host_calls;
+    res->wasm_calls = v.wasm_calls;
+    for (uint32_t i = 0; i < v.guard_count; ++i)
+    {
+        res->guard_hits += v.guards[i].hits;
+        if (IS_AUTO_GUARD_ID(v.guards[i].id))
+            res->added_hits += v.guards[i].hits;
+        if (verbose)
+            fprintf(stderr, "    guard %d: %ld of %d\n", v.guards[i].id, v.guards[i].hits, v.guards[i].max);
+    }
+    res->guards = v.guard_count;
+    res->mem_len = v.mem_len;
+    res->mem_high = v.mem_high;
+    res->peak_sp = v.peak_sp;
+    res->peak_depth = v.peak_depth;
+
+    release(&v);
+    return 0;
+}
+
+static void report(
+    const char*     name,
+    const char*     entry,
+    run_result*     r)
+{
+    printf("%s: %s() -> %s %ld", name, entry, outcome_name[r->outcome], r->code);
+    if (r->msg[0])
+        printf(" \"%s\"", r->msg);
+    printf("\n");
+    printf("    instructions  %ld\n", r->instrs);
+    printf("    guard hits    %ld (%d guards)\n", r->guard_hits, r->guards);
+    printf("    calls         %ld host, %ld wasm, depth %d\n", r->host_calls, r->wasm_calls, r->peak_depth);
+    printf("    memory        %ld pages, highest write 0x%lX, stack %d values\n",
+            r->mem_len / 0x10000U, r->mem_high, r->peak_sp);
+}
+
+static int read_file(
+    const char* fn,
+    arena*      a,
+    uint8_t**   buf,
+    ssize_t*    len)
+{
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return fprintf(stderr, "Could not open file `%s` for reading\n", fn);
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return fprintf(stderr, "Could not read file `%s`\n", fn);
+    }
+    *len = st.st_size;
+    *buf = arena_alloc(a, *len + 1);
+    ssize_t upto = 0;
+    while (*buf && upto < *len)
+    {
+        ssize_t r = read(fd, *buf + upto, *len - upto);
+        if (r <= 0)
+            break;
+        upto += r;
+    }
+    close(fd);
+    if (!*buf || upto != *len)
+        return fprintf(stderr, "Could not read file `%s`\n", fn);
+    return 0;
+}
+
+// clean a copy of the input the way hook-cleaner would, with the cleaner's log kept out of the report
+static int clean(
+    uint8_t*    in,
+    ssize_t     in_len,
+    run_opts*   opts,
+    int         verbose,
+    arena*      a,
+    uint8_t**   out,
+    ssize_t*    out_len)
+{
+    uint8_t* buf = arena_alloc(a, in_len);
+    if (!buf)
+        return 1;
+    memcpy(buf, in, in_len);
+
+    int saved_stderr = -1;
+    if (!verbose)
+    {
+        fflush(stderr);
+        saved_stderr = dup(2);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        close(devnull);
+    }
+
+    ssize_t len = in_len;
+    int retval = run_passes(&buf, &len, opts, a, 0, 0, 0);
+    *out = buf;
+    *out_len = len;
+
+    if (!verbose)
+    {
+        fflush(stderr);
+        dup2(saved_stderr, 2);
+        close(saved_stderr);
+    }
+    return retval;
+}
+
+/*
+ * Runs the original and the cleaned build and checks that they agree. Returns non-zero if either fails to run,
+ * they end differently, or (unless outcome_only) the cleaned one executes more instructions. Hits of guards
+ * --auto-guard inserted and calls to the --instrument counter don't count as ending differently.
+ */
+static int compare(
+    const char*     name,
+    uint8_t*        a,
+    ssize_t         a_len,
+    const char*     cleaned_name,
+    uint8_t*        b,
+    ssize_t         b_len,
+    const char*     entry,
+    uint32_t        arg,
+    script*         s,
+    uint64_t        limit,
+    int             outcome_only,
+    int             verbose)
+{
+    run_result ra, rb;
+    if (run_hook(a, a_len, entry, arg, s, limit, verbose, &ra))
+        return fprintf(stderr, "%s: could not run\n", name);
+    report(name, entry, &ra);
+    if (run_hook(b, b_len, entry, arg, s, limit, verbose, &rb))
+        return fprintf(stderr, "%s: could not run\n", cleaned_name);
+    report(cleaned_name, entry, &rb);
+
+    if (ra.outcome != rb.outcome || ra.code != rb.code || strcmp(ra.msg, rb.msg) != 0 ||
+        ra.host_calls != rb.host_calls || ra.guard_hits - ra.added_hits != rb.guard_hits - rb.added_hits)
+    {
+        printf("    MISMATCH: the cleaned build ends differently\n");
+        return 1;
+    }
+
+    int64_t delta = (int64_t)rb.instrs - (int64_t)ra.instrs;
+    printf("    %s: %+ld instructions (%.1f%%)\n", (delta > 0 ? "REGRESSION" : "ok"), delta,
+            (ra.instrs ? delta * 100.0 / ra.instrs : 0.0));
+    return delta > 0 && !outcome_only;
+}
+
+int main(int argc, char** argv)
+{
+    script s = { 0 };
+    script* sp = 0;
+    const char* entry = "hook";
+    uint32_t arg = 0;
+    uint64_t limit = DEFAULT_LIMIT;
+    int verbose = 0;
+    int do_clean = 0;
+    int outcome_only = 0;
+    run_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.passes = PASSES_O1;
+
+    int a = 1;
+    for (; a < argc && argv[a][0] == '-' && argv[a][1] != '\0'; ++a)
+    {
+        if (strncmp(argv[a], "--script=", 9) == 0 && argv[a][9])
+        {
+            if (parse_script(argv[a] + 9, &s))
+                return 1;
+            sp = &s;
+        }
+        else if (strcmp(argv[a], "--cbak") == 0)
+            entry = "cbak";
+        else if (strncmp(argv[a], "--arg=", 6) == 0)
+            arg = strtoul(argv[a] + 6, 0, 0);
+        else if (strncmp(argv[a], "--limit=", 8) == 0 && strtoull(argv[a] + 8, 0, 0) > 0)
+            limit = strtoull(argv[a] + 8, 0, 0);
+        else if (strcmp(argv[a], "--clean") == 0)
+            do_clean = 1;
+        else if (strcmp(argv[a], "--outcome-only") == 0)
+            outcome_only = 1;
+        else if (strcmp(argv[a], "--peephole") == 0)
+            opts.passes |= PASS_PEEPHOLE;
+        else if (strcmp(argv[a], "--no-inline") == 0)
+            opts.passes &= ~PASS_INLINE;
+        else if (strcmp(argv[a], "-v") == 0)
+            verbose = 1;
+        else
+            break;
+    }
+
+    int files = argc - a;
+    if (files < 1 || (!do_clean && files > 2) || (a < argc && argv[a][0] == '-' && argv[a][1] != '\0'))
+    {
+        fprintf(stderr,
+            "Usage: %s [options] hook.wasm [cleaned.wasm]\n"
+            "       %s [options] --clean hook.wasm ...\n"
+            "       Runs hook() with the env imports stubbed and reports the instructions executed, guard hits,\n"
+            "       calls and memory used. Given two builds, or --clean to clean each input in-process, runs both\n"
+            "       and fails if they end differently or the cleaned build executes more instructions.\n"
+            "Options:\n"
+            "       --script=FILE   Responses for the stubbed imports, one `name value [hex]` per line. Repeated\n"
+            "                       names answer in turn, the last one repeats. Unscripted imports return 0.\n"
+            "       --cbak          Run cbak() instead of hook().\n"
+            "       --arg=N         Argument passed to hook() / cbak() (default 0).\n"
+            "       --limit=N       Trap after N instructions (default %lld).\n"
+            "       --outcome-only  Only fail when the builds end differently, for builds that are expected to\n"
+            "                       run longer, such as instrumented ones.\n"
+            "       --peephole, --no-inline\n"
+            "                       Cleaner options for --clean.\n"
+            "       -v              Show traces, host calls, guard counts and the cleaner's log.\n",
+            argv[0], argv[0], DEFAULT_LIMIT);
+        return 1;
+    }
+
+    arena ar;
+    arena_init(&ar, ARENA_LIMIT);
+
+    int retval = 0;
+    if (do_clean)
+    {
+        for (; a < argc; ++a)
+        {
+            uint8_t* in;
+            uint8_t* out;
+            ssize_t in_len, out_len;
+            char name[4096];
+            arena_reset(&ar);
+            if (read_file(argv[a], &ar, &in, &in_len) ||
+                clean(in, in_len, &opts, verbose, &ar, &out, &out_len))
+            {
+                fprintf(stderr, "%s: could not clean\n", argv[a]);
+                retval = 1;
+                continue;
+            }
+            snprintf(name, sizeof(name), "%s (cleaned)", argv[a]);
+            retval |= (compare(argv[a], in, in_len, name, out, out_len, entry, arg, sp, limit, outcome_only,
+                        verbose) != 0);
+        }
+    }
+    else if (files == 2)
+    {
+        uint8_t* x;
+        uint8_t* y;
+        ssize_t x_len, y_len;
+        retval = read_file(argv[a], &ar, &x, &x_len) || read_file(argv[a + 1], &ar, &y, &y_len) ||
+            compare(argv[a], x, x_len, argv[a + 1], y, y_len, entry, arg, sp, limit, outcome_only, verbose);
+    }
+    else
+    {
+        uint8_t* x;
+        ssize_t x_len;
+        run_result r;
+        retval = read_file(argv[a], &ar, &x, &x_len) ||
+            run_hook(x, x_len, entry, arg, sp, limit, verbose, &r);
+        if (retval == 0)
+        {
+            report(argv[a], entry, &r);
+            retval = (r.outcome == OUT_TRAP);
+        }
+    }
+
+    arena_free(&ar);
+    for (uint32_t i = 0; i < s.count; ++i)
+        free(s.r[i].data);
+    free(s.r);
+    return retval != 0;
+}
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// functions with more declared locals, or more basic blocks times locals than the budget, are left as they are
+#define MAX_COALESCE_LOCALS 4096
+#define MAX_COALESCE_WORDS  (1U << 21)
+
+#define BIT_SET(s, i)   ((s)[(i) >> 6] |= (1ULL << ((i) & 63)))
+#define BIT_CLR(s, i)   ((s)[(i) >> 6] &= ~(1ULL << ((i) & 63)))
+#define BIT_GET(s, i)   (((s)[(i) >> 6] >> ((i) & 63)) & 1)
+
+typedef struct
+{
+    uint32_t    first;      // first instruction
+    uint32_t    last;       // and last one
+    uint32_t    succ[2];    // successor blocks, UINT32_MAX for none. A br_table's are in the pool instead
+    int64_t     brt;        // br_table pool index of the last instruction, -1 if it isn't one
+} live_block;
+
+// every structural instruction and every branch ends a block, so each one is the last instruction of its own
+static int ends_block(
+    uint8_t op)
+{
+    return (op >= 0x02U && op <= 0x05U) || op == 0x0BU || (op >= 0x0CU && op <= 0x0FU) || op == 0x00U;
+}
+
+// the instruction a branch to label depth d goes to: the end of a block or if, the head of a loop, or UINT32_MAX for
+// the function's own label
+static uint32_t label_target(
+    wasm_func*  f,
+    uint32_t*   open,
+    uint32_t    sp,
+    uint32_t*   end_of,
+    uint64_t    d)
+{
+    if (d >= sp)
+        return UINT32_MAX;
+    uint32_t s = open[sp - 1 - d];
+    return (f->ins[s].op == 0x03U ? s + 1 : end_of[s]);
+}
+
+/*
+ * Split the body into basic blocks and find where each one goes next. `blk` gets the block each instruction is in,
+ * the targets of br_tables are written to `brt` (laid out like the body's pool) as block numbers.
+ */
+static uint32_t split_blocks(
+    wasm_func*      f,
+    live_block*     b,
+    uint32_t*       blk,
+    uint32_t*       brt)
+{
+    uint32_t n = f->ins_count;
+    uint32_t* end_of = malloc(sizeof(uint32_t) * n);     // block, loop, if and else -> their end
+    uint32_t* else_of = malloc(sizeof(uint32_t) * n);    // if -> its else
+    uint32_t* open = malloc(sizeof(uint32_t) * n);
+    uint32_t sp = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        end_of[i] = else_of[i] = UINT32_MAX;
+        uint8_t op = f->ins[i].op;
+        if (op == 0x02U || op == 0x03U || op == 0x04U)
+            open[sp++] = i;
+        else if (op == 0x05U && sp > 0)
+            else_of[open[sp - 1]] = i;
+        else if (op == 0x0BU && sp > 0)
+        {
+            uint32_t s = open[--sp];
+            end_of[s] = i;
+            if (else_of[s] != UINT32_MAX)
+                end_of[else_of[s]] = i;
+        }
+    }
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        if (i == 0 || ends_block(f->ins[i - 1].op) || ends_block(f->ins[i].op))
+        {
+            if (count)
+                b[count - 1].last = i - 1;
+            b[count++] = (live_block){ .first = i, .succ = { UINT32_MAX, UINT32_MAX }, .brt = -1 };
+        }
+        blk[i] = count - 1;
+    }
+    if (count)
+        b[count - 1].last = n - 1;
+
+    // branches are only ever last in their block, so the labels can be followed block by block
+    sp = 0;
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        live_block* bl = b + k;
+        uint32_t i = bl->last;
+        wasm_instr* in = f->ins + i;
+        uint32_t t = UINT32_MAX;
+        bl->succ[0] = (i + 1 < n ? blk[i + 1] : UINT32_MAX);
+
+        switch (in->op)
+        {
+            case 0x02U:
+            case 0x03U:
+                open[sp++] = i;
+                break;
+
+            case 0x04U:
+                open[sp++] = i;
+                t = (else_of[i] != UINT32_MAX ? else_of[i] + 1 : end_of[i]);
+                break;
+
+            case 0x05U:
+                bl->succ[0] = UINT32_MAX;
+                t = end_of[i];
+                break;
+
+            case 0x0BU:
+                if (sp > 0)
+                    sp--;
+                break;
+
+            case 0x0CU:
+                bl->succ[0] = UINT32_MAX;
+                t = label_target(f, open, sp, end_of, in->imm);
+                break;
+
+            case 0x0DU:
+                t = label_target(f, open, sp, end_of, in->imm);
+                break;
+
+            case 0x0EU:
+                bl->succ[0] = UINT32_MAX;
+                bl->brt = in->imm2;
+                for (int64_t j = 0; j <= in->imm; ++j)
+                {
+                    uint32_t l = label_target(f, open, sp, end_of, f->brt[in->imm2 + j]);
+                    brt[in->imm2 + j] = (l < n ? blk[l] : UINT32_MAX);
+                }
+                break;
+
+            case 0x00U:
+            case 0x0FU:
+                bl->succ[0] = UINT32_MAX;
+                break;
+        }
+        bl->succ[1] = (t < n ? blk[t] : UINT32_MAX);
+    }
+
+    free(end_of);
+    free(else_of);
+    free(open);
+    return count;
+}
+
+/*
+ * Share slots between the declared locals of one function that are never live at the same time. Liveness is
+ * worked out per basic block to a fixed point, two locals interfere if either is written while the other is live
+ * (or both are live on entry, where they hold their zero), and each local then takes the first slot of its type
+ * none of whose locals it interferes with. The slots are declared one group per type, in the order the types were
+ * first declared. Parameters are left where they are.
+ */
+static int coalesce_func(
+    wasm_module*    m,
+    wasm_func*      f,
+    uint32_t*       saved)
+{
+    uint32_t params = m->types[f->type].pc;
+    uint64_t declared = 0;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        declared += f->locals[i].count;
+    if (declared < 2 || declared > MAX_COALESCE_LOCALS || f->ins_count == 0)
+        return 0;
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+        if (f->ins[i].op >= 0x20U && f->ins[i].op <= 0x22U && f->ins[i].imm >= params &&
+            f->ins[i].imm - params >= declared)
+            return fprintf(stderr, "Local index %ld out of range\n", f->ins[i].imm);
+
+    uint32_t words = (declared + 63) / 64;
+    live_block* b = malloc(sizeof(live_block) * f->ins_count);
+    uint32_t* blk = malloc(sizeof(uint32_t) * f->ins_count);
+    uint32_t* brt = malloc(sizeof(uint32_t) * (f->brt_count + 1));
+    uint32_t count = split_blocks(f, b, blk, brt);
+    free(blk);
+
+    if ((uint64_t)count * words > MAX_COALESCE_WORDS)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Too many blocks and locals to coalesce: %d x %ld\n", count, declared);
+        free(b);
+        free(brt);
+        return 0;
+    }
+
+    uint64_t* gen = calloc((uint64_t)count * words, sizeof(uint64_t));
+    uint64_t* kill = calloc((uint64_t)count * words, sizeof(uint64_t));
+    uint64_t* live_in = calloc((uint64_t)count * words, sizeof(uint64_t));
+    uint64_t* live = malloc(sizeof(uint64_t) * words);
+
+    for (uint32_t k = 0; k < count; ++k)
+        for (uint32_t i = b[k].first; i <= b[k].last; ++i)
+        {
+            wasm_instr* ins = f->ins + i;
+            if (ins->op < 0x20U || ins->op > 0x22U || ins->imm < params)
+                continue;
+            uint32_t x = ins->imm - params;
+            if (ins->op == 0x20U && !BIT_GET(kill + (uint64_t)k * words, x))
+                BIT_SET(gen + (uint64_t)k * words, x);
+            else if (ins->op != 0x20U)
+                BIT_SET(kill + (uint64_t)k * words, x);
+        }
+
+    // in = gen | (out & ~kill), out being the union of the successors' ins, backwards until nothing changes
+    for (int changed = 1; changed; )
+    {
+        changed = 0;
+        for (uint32_t k = count; k-- > 0; )
+        {
+            memset(live, 0, sizeof(uint64_t) * words);
+            uint32_t sc = (b[k].brt >= 0 ? f->ins[b[k].last].imm + 1 : 2);
+            for (uint32_t s = 0; s < sc; ++s)
+            {
+                uint32_t t = (b[k].brt >= 0 ? brt[b[k].brt + s] : b[k].succ[s]);
+                if (t != UINT32_MAX)
+                    for (uint32_t w = 0; w < words; ++w)
+                        live[w] |= live_in[(uint64_t)t * words + w];
+            }
+            for (uint32_t w = 0; w < words; ++w)
+            {
+                uint64_t v = gen[(uint64_t)k * words + w] | (live[w] & ~kill[(uint64_t)k * words + w]);
+                if (v != live_in[(uint64_t)k * words + w])
+                {
+                    live_in[(uint64_t)k * words + w] = v;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    // interference: every write against what's live after it, then the entry
+    uint64_t* inter = calloc((uint64_t)declared * words, sizeof(uint64_t));
+    for (uint32_t k = 0; k < count; ++k)
+    {
+        memset(live, 0, sizeof(uint64_t) * words);
+        uint32_t sc = (b[k].brt >= 0 ? f->ins[b[k].last].imm + 1 : 2);
+        for (uint32_t s = 0; s < sc; ++s)
+        {
+            uint32_t t = (b[k].brt >= 0 ? brt[b[k].brt + s] : b[k].succ[s]);
+            if (t != UINT32_MAX)
+                for (uint32_t w = 0; w < words; ++w)
+                    live[w] |= live_in[(uint64_t)t * words + w];
+        }
+
+        for (uint32_t i = b[k].last + 1; i-- > b[k].first; )
+        {
+            wasm_instr* ins = f->ins + i;
+            if (ins->op < 0x20U || ins->op > 0x22U || ins->imm < params)
+                continue;
+            uint32_t x = ins->imm - params;
+            if (ins->op == 0x20U)
+                BIT_SET(live, x);
+            else
+            {
+                for (uint32_t w = 0; w < words; ++w)
+                    inter[(uint64_t)x * words + w] |= live[w];
+                BIT_CLR(live, x);
+            }
+        }
+    }
+    for (uint32_t x = 0; x < declared; ++x)
+        if (BIT_GET(live_in, x))
+            for (uint32_t w = 0; w < words; ++w)
+                inter[(uint64_t)x * words + w] |= live_in[w];
+    for (uint32_t x = 0; x < declared; ++x)
+        for (uint32_t y = 0; y < declared; ++y)
+            if (BIT_GET(inter + (uint64_t)x * words, y))
+                BIT_SET(inter + (uint64_t)y * words, x);
+
+    free(gen);
+    free(kill);
+    free(live_in);
+    free(live);
+    free(b);
+    free(brt);
+
+    // slots, each with the union of its locals' interference
+    uint8_t* type = malloc(declared);
+    for (uint32_t i = 0, k = 0; i < f->local_group_count; ++i)
+        for (uint32_t j = 0; j < f->locals[i].count; ++j)
+            type[k++] = f->locals[i].type;
+
+    uint8_t* slot_type = malloc(declared);
+    uint64_t* slot_inter = calloc((uint64_t)declared * words, sizeof(uint64_t));
+    uint32_t* slot = malloc(sizeof(uint32_t) * declared);
+    uint32_t slots = 0;
+    for (uint32_t x = 0; x < declared; ++x)
+    {
+        uint32_t s = 0;
+        while (s < slots && (slot_type[s] != type[x] || BIT_GET(slot_inter + (uint64_t)s * words, x)))
+            s++;
+        if (s == slots)
+            slot_type[slots++] = type[x];
+        slot[x] = s;
+        for (uint32_t w = 0; w < words; ++w)
+            slot_inter[(uint64_t)s * words + w] |= inter[(uint64_t)x * words + w];
+    }
+    free(inter);
+    free(slot_inter);
+
+    // one group per type, the types in the order they were first declared
+    wasm_local_group* groups = calloc(f->local_group_count, sizeof(wasm_local_group));
+    uint32_t* slot_new = malloc(sizeof(uint32_t) * slots);
+    uint32_t group_count = 0, next = 0;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+    {
+        uint8_t t = f->locals[i].type;
+        uint32_t g = 0;
+        while (g < group_count && groups[g].type != t)
+            g++;
+        if (g < group_count)
+            continue;
+
+        uint32_t c = 0;
+        for (uint32_t s = 0; s < slots; ++s)
+            if (slot_type[s] == t)
+            {
+                slot_new[s] = params + next++;
+                c++;
+            }
+        if (c)
+            groups[group_count++] = (wasm_local_group){ .count = c, .type = t };
+    }
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        wasm_instr* ins = f->ins + i;
+        if (ins->op >= 0x20U && ins->op <= 0x22U && ins->imm >= params)
+            ins->imm = slot_new[slot[ins->imm - params]];
+    }
+
+    *saved += declared - slots;
+    free(f->locals);
+    f->locals = groups;
+    f->local_group_count = group_count;
+
+    free(type);
+    free(slot_type);
+    free(slot);
+    free(slot_new);
+    return 0;
+}
+
+// coalesce the declared locals of every defined function, see coalesce_func
+int coalesce_locals(
+    wasm_module*    m)
+{
+    uint32_t saved = 0;
+    for (uint32_t i = 0; i < m->func_count; ++i)
+    {
+        wasm_func* f = m->funcs + i;
+        if (wasm_decode_body(m, f))
+            return fprintf(stderr, "Could not decode function %d\n", i + m->import_func_count);
+        if (f->type >= m->type_count)
+            return fprintf(stderr, "Function %d has invalid type %d\n", i + m->import_func_count, f->type);
+        if (coalesce_func(m, f, &saved))
+            return 1;
+    }
+
+    if (DEBUG)
+        fprintf(stderr, "Coalesced locals: %d slots saved\n", saved);
+    return 0;
+}
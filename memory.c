@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+#define PAGE_SIZE 65536U
+
+// bytes accessed by each load and store 0x28 - 0x3E
+static const uint8_t access_width[] =
+{
+    4, 8, 4, 8, 1, 1, 2, 2, 1, 1, 2, 2, 4, 4, 4, 8, 4, 8, 1, 2, 1, 2, 4
+};
+
+// value of an `i32.const N; end` constant expression
+static int const_expr_i32(
+    uint8_t*    expr,
+    uint32_t    len,
+    int64_t*    value)
+{
+    wasm_instr in;
+    if (wasm_decode_instr(expr, expr + len, &in, 0) || in.op != 0x41U || in.len + 1 != len)
+        return 1;
+    *value = (uint32_t)in.imm;
+    return 0;
+}
+
+// an i32 constant on the value stack, followed until something consumes it
+typedef struct
+{
+    uint8_t     known;
+    uint32_t    value;
+    uint32_t    at;
+} const_val;
+
+static void add_use(
+    addr_use**  uses,
+    uint32_t*   count,
+    uint32_t*   cap,
+    uint64_t    lo,
+    uint64_t    hi,
+    uint32_t    at)
+{
+    // wasm-ld lays static data out from --global-base (1024) up, so small numbers aren't bases of anything
+    if (hi == ADDR_UNBOUNDED && lo < STATIC_BASE)
+        return;
+    if (*count == *cap)
+    {
+        *cap = (*cap ? *cap * 2 : 64);
+        *uses = realloc(*uses, sizeof(addr_use) * *cap);
+    }
+    (*uses)[(*count)++] = (addr_use){ lo, hi, at };
+}
+
+/*
+ * Every address the code and data could reach memory at other than through the stack pointer, as far as it can be
+ * told from the constants in them. An i32 constant that is the address of a load or store is a use of exactly the
+ * bytes accessed. A memory offset on an access through any other address, and a constant that goes anywhere but
+ * into a comparison, a scaling or a drop (added to an index, passed to a call, stored, kept in a local), are bases
+ * with no known extent, as is every aligned word of the data segments, which may hold a pointer. Only straight-line
+ * code is followed, a constant carried into or out of a block is a base too. Bases below where the linker starts
+ * static data are left out. The list is over-approximate: most of the bases are plain numbers, and the callers only
+ * care about the ones in memory they'd like to give up.
+ */
+int address_uses(
+    wasm_module*    m,
+    addr_use**      uses,
+    uint32_t*       count)
+{
+    uint32_t cap = 0;
+    *uses = 0;
+    *count = 0;
+
+    for (uint32_t i = 0; i < m->data_count; ++i)
+    {
+        wasm_data* d = m->data + i;
+        int64_t off = 0;
+        if (d->mode == 1 || const_expr_i32(d->offset, d->offset_len, &off))
+            off = 0;
+        for (uint64_t a = (off + 3) & ~3ULL; a + 4 <= (uint64_t)off + d->bytes_len; a += 4)
+        {
+            uint8_t* w = d->bytes + (a - off);
+            add_use(uses, count, &cap, w[0] | w[1] << 8 | w[2] << 16 | (uint32_t)w[3] << 24, ADDR_UNBOUNDED, a);
+        }
+    }
+
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+            return 1;
+
+        const_val* st = malloc(sizeof(const_val) * (f->ins_count + 1));
+        uint32_t n = 0;
+
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+        {
+            wasm_instr* in = f->ins + i;
+            int pop = 0, push = 0, bases = 1;
+
+            if (in->op == 0x41U)
+            {
+                st[n++] = (const_val){ 1, (uint32_t)in->imm, in->off };
+                continue;
+            }
+
+            if ((in->op == 0x6AU || in->op == 0x6BU) && n >= 2 && st[n - 1].known && st[n - 2].known)
+            {
+                // folded, the sum is followed in their place
+                uint32_t v = (in->op == 0x6AU ? st[n - 2].value + st[n - 1].value : st[n - 2].value - st[n - 1].value);
+                st[n - 2].value = v;
+                n--;
+                continue;
+            }
+
+            if (in->op >= 0x28U && in->op <= 0x3EU)
+            {
+                // the address is the first operand
+                pop = (in->op <= 0x35U ? 1 : 2);
+                push = (in->op <= 0x35U);
+                if (n >= (uint32_t)pop && st[n - pop].known)
+                {
+                    uint64_t a = (uint64_t)st[n - pop].value + in->imm2;
+                    add_use(uses, count, &cap, a, a + access_width[in->op - 0x28U], st[n - pop].at);
+                    st[n - pop].known = 0;
+                }
+                else
+                    add_use(uses, count, &cap, in->imm2, ADDR_UNBOUNDED, in->off);
+            }
+            else if (in->op == 0x1AU || (in->op >= 0x45U && in->op <= 0x4FU) ||
+                     (in->op >= 0x67U && in->op <= 0x70U && in->op != 0x6AU && in->op != 0x6BU) ||
+                     (in->op >= 0x74U && in->op <= 0x78U))
+            {
+                // drops, comparisons, bit counts, multiplication, division and shifts don't make addresses
+                pop = (in->op == 0x1AU || in->op == 0x45U || (in->op >= 0x67U && in->op <= 0x69U) ? 1 : 2);
+                push = (in->op != 0x1AU);
+                bases = 0;
+            }
+            else if (in->op > 0x11U && wasm_stack_effect(m, in, &pop, &push) == 0)
+                ;
+            else
+            {
+                // control, and anything this can't follow: whatever is on the stack leaves it
+                pop = n;
+                push = 0;
+            }
+
+            if ((uint32_t)pop > n)
+                pop = n;
+            for (uint32_t k = n - pop; k < n; ++k)
+                if (st[k].known && bases)
+                    add_use(uses, count, &cap, st[k].value, ADDR_UNBOUNDED, st[k].at);
+            n -= pop;
+            while (push-- > 0)
+                st[n++] = (const_val){ 0 };
+        }
+
+        for (uint32_t k = 0; k < n; ++k)
+            if (st[k].known)
+                add_use(uses, count, &cap, st[k].value, ADDR_UNBOUNDED, st[k].at);
+        free(st);
+    }
+
+    return 0;
+}
+
+/*
+ * Lower the declared memory to the fewest pages that still hold everything the hook can touch: the active data
+ * segments, the stack (which grows down from the stack pointer global's initial value) and every constant address
+ * the retained code loads from or stores to (see address_uses). This assumes, as hooks without a heap allocator
+ * do, that every pointer the code dereferences is derived from one of those. The pass declines, and says why, when
+ * the page count is observable (memory.size / memory.grow), when the code reads an address-like global it can't
+ * account for, such as __heap_base, or when the code or data holds a base address above the data and stack, where
+ * the object it points at could run past any page count chosen.
+ */
+int shrink_memory(
+    wasm_module*    m)
+{
+    if (!m->has_memory)
+        return 0;
+
+    uint64_t needed = 0;
+    const char* unsafe = 0;
+    uint64_t unsafe_at = 0;
+
+    for (uint32_t i = 0; i < m->data_count && !unsafe; ++i)
+    {
+        wasm_data* d = m->data + i;
+        int64_t off;
+        if (d->mode == 1)
+            continue;
+        if (const_expr_i32(d->offset, d->offset_len, &off))
+            unsafe = "a data segment has a non-constant offset";
+        else if (off + d->bytes_len > needed)
+            needed = off + d->bytes_len;
+    }
+
+    // globals the retained code reads or writes, see below
+    uint8_t* global_used = calloc(m->import_global_count + m->global_count + 1, 2);
+    uint8_t* global_written = global_used + m->import_global_count + m->global_count + 1;
+
+    for (uint32_t fi = 0; fi < m->func_count && !unsafe; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+        {
+            free(global_used);
+            return 1;
+        }
+
+        for (uint32_t i = 0; i < f->ins_count && !unsafe; ++i)
+        {
+            wasm_instr* in = f->ins + i;
+
+            if (in->op == 0x3FU || in->op == 0x40U)
+            {
+                unsafe = "the code uses memory.size or memory.grow";
+                unsafe_at = in->off;
+            }
+            else if ((in->op == 0x23U || in->op == 0x24U) && in->imm < m->import_global_count + m->global_count)
+            {
+                global_used[in->imm] = 1;
+                if (in->op == 0x24U)
+                    global_written[in->imm] = 1;
+            }
+        }
+    }
+
+    // The stack pointer is the mutable i32 global the code writes, everything below its initial value may be
+    // used by the stack. A read-only i32 global is an address the code computes from (e.g. __heap_base), which
+    // is only safe if it already lies within what we keep.
+    for (uint32_t g = m->import_global_count; g < m->import_global_count + m->global_count && !unsafe; ++g)
+    {
+        wasm_global* gl = m->globals + (g - m->import_global_count);
+        int64_t v;
+        if (!global_used[g] || gl->valtype != WASM_I32)
+            continue;
+        if (const_expr_i32(gl->init, gl->init_len, &v))
+            unsafe = "a referenced global has a non-constant initialiser";
+        else if (global_written[g])
+        {
+            if (v > needed)
+                needed = v;
+        }
+        else if (v > needed)
+        {
+            unsafe = "the code reads an address global above the data and stack";
+            unsafe_at = g;
+        }
+    }
+
+    for (uint32_t g = 0; g < m->import_global_count && !unsafe; ++g)
+        if (global_used[g])
+            unsafe = "the code reads an imported global";
+
+    free(global_used);
+
+    // Static storage the data segments don't cover (bss) sits below the stack, so a base above both is an object
+    // of unknown size in memory that would be given up. Exact accesses just raise what's needed.
+    addr_use* uses = 0;
+    uint32_t use_count = 0;
+    if (!unsafe && address_uses(m, &uses, &use_count))
+        return 1;
+
+    uint64_t bounded = needed;
+    for (uint32_t i = 0; i < use_count && !unsafe; ++i)
+        if (uses[i].hi != ADDR_UNBOUNDED)
+            needed = (uses[i].hi > needed ? uses[i].hi : needed);
+        else if (uses[i].lo >= bounded && uses[i].lo < (uint64_t)m->mem_min * PAGE_SIZE)
+        {
+            unsafe = "the code or data holds an address above the data and stack it can't bound";
+            unsafe_at = uses[i].at;
+        }
+    free(uses);
+
+    if (unsafe)
+    {
+        fprintf(stderr, "Memory: keeping %d pages, can't prove shrinking safe: %s (0x%lX)\n",
+                m->mem_min, unsafe, unsafe_at);
+        return 0;
+    }
+
+    uint32_t pages = (needed + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 0)
+        pages = 1;
+
+    if (pages >= m->mem_min)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Memory: %d pages needed for highest address 0x%lX, already minimal\n",
+                    m->mem_min, needed);
+        return 0;
+    }
+
+    fprintf(stderr, "Memory: %d -> %d pages (highest address used 0x%lX)\n", m->mem_min, pages, needed);
+    m->mem_min = pages;
+    // without memory.grow the maximum is never reached, so it can come down with the minimum
+    if ((m->mem_flags & 1U) && m->mem_max > pages)
+        m->mem_max = pages;
+
+    return 0;
+}
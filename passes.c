@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cleaner.h"
+
+/*
+ * The pass pipeline. Passes run in three stages: `pre` passes rewrite the input as read, `clean` is the cleaner
+ * itself, which always runs, and `post` passes all work on one parsed module of the cleaner's output that is
+ * emitted once at the end. Within a stage passes run in table order, whatever order they were asked for in.
+ */
+
+#define STAGE_PRE   0
+#define STAGE_CLEAN 1
+#define STAGE_POST  2
+
+typedef struct
+{
+    const char* name;
+    uint8_t     stage;
+    uint32_t    bit;        // PASS_* flag selecting it, 0 if it always runs
+    int         (*run)(wasm_module* m, run_opts* opts, reloc_map* map);     // post passes only
+} pass_def;
+
+static int run_auto_guard(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    return auto_guard(m, map);
+}
+
+static int run_simplify_cfg(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return simplify_cfg(m);
+}
+
+static int run_peephole(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return peephole(m);
+}
+
+static int run_coalesce_locals(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return coalesce_locals(m);
+}
+
+static int run_prune_globals(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return prune_globals(m);
+}
+
+static int run_shrink_stack(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return shrink_stack(m);
+}
+
+static int run_shrink_memory(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return shrink_memory(m);
+}
+
+static int run_canonicalize(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    (void)opts;
+    (void)map;
+    return canonicalize(m);
+}
+
+// also writes the site list, by input offset when there's a map to get there
+static int run_instrument(
+    wasm_module*    m,
+    run_opts*       opts,
+    reloc_map*      map)
+{
+    prof_site* sites = 0;
+    uint32_t site_count = 0;
+    int retval = instrument(m, &sites, &site_count);
+
+    if (retval == 0 && opts->instrument_sites)
+    {
+        for (uint32_t i = 0; i < site_count && map; ++i)
+        {
+            int64_t in = reloc_lookup(map, sites[i].off);
+            if (in >= 0)
+                sites[i].off = in;
+        }
+
+        FILE* f = fopen(opts->instrument_sites, "w");
+        if (!f || write_prof_sites(sites, site_count, f) != 0)
+            retval = fprintf(stderr, "Could not write instrumentation sites `%s`\n", opts->instrument_sites);
+        if (f)
+            fclose(f);
+    }
+    free(sites);
+    return retval;
+}
+
+// guards go in first, while the loops are as the compiler left them, and instrumentation goes last so the other
+// passes only ever see the hook's own code
+static const pass_def pass_table[] =
+{
+    { "inline",          STAGE_PRE,      PASS_INLINE,          0 },
+    { "clean",           STAGE_CLEAN,    0,                    0 },
+    { "auto-guard",      STAGE_POST,     PASS_AUTO_GUARD,      run_auto_guard },
+    { "simplify-cfg",    STAGE_POST,     PASS_SIMPLIFY_CFG,    run_simplify_cfg },
+    { "peephole",        STAGE_POST,     PASS_PEEPHOLE,        run_peephole },
+    { "shrink-stack",    STAGE_POST,     PASS_SHRINK_STACK,    run_shrink_stack },
+    { "coalesce-locals", STAGE_POST,     PASS_COALESCE_LOCALS, run_coalesce_locals },
+    { "prune-globals",   STAGE_POST,     PASS_PRUNE_GLOBALS,   run_prune_globals },
+    { "shrink-memory",   STAGE_POST,     PASS_SHRINK_MEMORY,   run_shrink_memory },
+    { "canonical",       STAGE_POST,     PASS_CANONICAL,       run_canonicalize },
+    { "instrument",      STAGE_POST,     PASS_INSTRUMENT,      run_instrument },
+};
+
+#define PASS_COUNT (sizeof(pass_table) / sizeof(pass_table[0]))
+
+static double now_ms()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static void record(
+    pass_stats*     st,
+    const char*     name,
+    double          start,
+    ssize_t         before,
+    ssize_t         after)
+{
+    if (!st || st->count >= MAX_PASS_STATS)
+        return;
+    st->p[st->count++] = (pass_stat){ .name = name, .ms = now_ms() - start, .before = before, .after = after };
+}
+
+// encoded size of the module as it stands
+static ssize_t module_size(
+    wasm_module*    m)
+{
+    wasm_buf b = { 0 };
+    ssize_t len = (wasm_emit(m, &b) == 0 ? (ssize_t)b.len : -1);
+    free(b.p);
+    return len;
+}
+
+/*
+ * Parse a comma separated list of pass names into PASS_* flags. `clean` is accepted but always runs anyway, an
+ * empty list leaves just the cleaner.
+ */
+int parse_passes(
+    const char* list,
+    uint32_t*   passes)
+{
+    *passes = 0;
+    while (*list)
+    {
+        size_t n = strcspn(list, ",");
+        uint32_t i = 0;
+        for (; i < PASS_COUNT; ++i)
+            if (strlen(pass_table[i].name) == n && strncmp(pass_table[i].name, list, n) == 0)
+                break;
+        if (i == PASS_COUNT)
+        {
+            fprintf(stderr, "Unknown pass `%.*s`, known passes:", (int)n, list);
+            for (i = 0; i < PASS_COUNT; ++i)
+                fprintf(stderr, " %s", pass_table[i].name);
+            return fprintf(stderr, "\n");
+        }
+        *passes |= pass_table[i].bit;
+        list += n + (list[n] == ',');
+    }
+    return 0;
+}
+
+static int any_post(
+    run_opts*   opts)
+{
+    int any = 0;
+    for (uint32_t i = 0; i < PASS_COUNT; ++i)
+        any |= (pass_table[i].stage == STAGE_POST && (opts->passes & pass_table[i].bit));
+    return any;
+}
+
+// the post stage, replacing *out with the rewritten module allocated from `a` and `map` (if given) with the map
+// from the rewritten module to whatever `map` mapped the cleaned module to
+static int run_post(
+    uint8_t**   out,
+    ssize_t*    len,
+    run_opts*   opts,
+    arena*      a,
+    reloc_map*  map,
+    pass_stats* st)
+{
+    if (!any_post(opts))
+        return 0;
+
+    wasm_module m;
+    if (wasm_parse(*out, *len, &m))
+        return fprintf(stderr, "Could not parse cleaned module for optimization\n");
+
+    int retval = 0;
+    ssize_t size = *len;
+    for (uint32_t i = 0; i < PASS_COUNT && retval == 0; ++i)
+    {
+        const pass_def* p = pass_table + i;
+        if (p->stage != STAGE_POST || !(opts->passes & p->bit))
+            continue;
+
+        double start = now_ms();
+        retval = p->run(&m, opts, map);
+        if (retval == 0 && st)
+        {
+            // sizes cost an emit, so they're only taken when someone looks at them
+            ssize_t after = module_size(&m);
+            record(st, p->name, start, size, after);
+            size = after;
+        }
+    }
+
+    reloc_map pass = { 0 };
+    if (map)
+        m.map = &pass;
+
+    wasm_buf b = { 0 };
+    if (retval == 0)
+        retval = wasm_emit(&m, &b);
+
+    wasm_free(&m);
+
+    if (retval != 0)
+    {
+        free(b.p);
+        reloc_free(&pass);
+        return retval;
+    }
+
+    if (map)
+    {
+        reloc_compose(&pass, map);
+        reloc_free(map);
+        *map = pass;
+    }
+
+    if (DEBUG)
+        fprintf(stderr, "Optimized output: %ld -> %ld bytes\n", *len, b.len);
+
+    uint8_t* n = arena_alloc(a, b.len);
+    if (n)
+        memcpy(n, b.p, b.len);
+    free(b.p);
+    if (!n)
+        return 1;
+
+    *out = n;
+    *len = b.len;
+    return 0;
+}
+
+/*
+ * Run the selected passes over the module in `*buf`, which is rewritten in place, replacing *buf and *len with the
+ * output allocated from `a`. If `map` is given it receives the output -> input offset map. If `st` is given each
+ * pass that ran is recorded in it with its time and the size before and after. If `segs` is given and no post pass
+ * needs the output in one piece, the sections the cleaner copies as they are stay in the input and the output is
+ * the pieces in `segs` (segs->count is 0 otherwise).
+ */
+int run_passes(
+    uint8_t**   buf,
+    ssize_t*    len,
+    run_opts*   opts,
+    arena*      a,
+    reloc_map*  map,
+    pass_stats* st,
+    out_segs*   segs)
+{
+    if (st)
+        st->count = 0;
+    if (segs)
+        segs->count = 0;
+
+    // map of the pre stage, composed into the cleaner's once that exists
+    reloc_map pre_map = { 0 };
+
+    int retval = 0;
+    double start = now_ms();
+    ssize_t before = *len;
+    if (opts->passes & PASS_INLINE)
+    {
+        retval = inline_helpers(buf, len, (opts->inline_limit ? opts->inline_limit : DEFAULT_INLINE_LIMIT), a,
+                (map ? &pre_map : 0));
+        record(st, "inline", start, before, *len);
+    }
+
+    uint8_t* out = 0;
+    if (retval == 0)
+    {
+        start = now_ms();
+        before = *len;
+        retval = cleaner(*buf, &out, len, a, map, (opts->max_work ? opts->max_work : DEFAULT_MAX_WORK),
+                (any_post(opts) ? 0 : segs));
+        record(st, "clean", start, before, *len);
+    }
+
+    if (retval == 0)
+    {
+        // map back past the inlining to the input as read
+        reloc_compose(map, &pre_map);
+        retval = run_post(&out, len, opts, a, map, st);
+    }
+    reloc_free(&pre_map);
+
+    if (retval == 0)
+        *buf = out;
+    return retval;
+}
+
+void print_pass_stats(
+    pass_stats* st,
+    FILE*       f)
+{
+    for (int i = 0; i < st->count; ++i)
+    {
+        pass_stat* p = st->p + i;
+        fprintf(f, "Pass %-14s %9.3f ms %8ld -> %8ld bytes (%+ld)\n", p->name, p->ms, p->before, p->after,
+                p->after - p->before);
+    }
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// a constant of the given type (0x41 i32.const / 0x42 i64.const) with the given value
+#define IS_CONST(in, type, val) ((in)->op == (type) && (in)->imm == (val))
+
+// i32 and i64 binary operators as offsets from i32.add (0x6A) / i64.add (0x7C), in opcode order. Division and
+// remainder can trap and are never folded or dropped
+enum
+{
+    BIN_ADD = 0, BIN_SUB, BIN_MUL, BIN_DIV_S, BIN_DIV_U, BIN_REM_S, BIN_REM_U,
+    BIN_AND, BIN_OR, BIN_XOR, BIN_SHL, BIN_SHR_S, BIN_SHR_U
+};
+
+// returns the operator index relative to add if `op` is a foldable i32 (type 0x41) or i64 (type 0x42) binop, -1
+// for anything else, division and remainder included
+static int binop(
+    uint8_t     op,
+    uint8_t*    type)
+{
+    int k;
+    if (op >= 0x6AU && op <= 0x78U)
+    {
+        *type = 0x41U;
+        k = op - 0x6AU;
+    }
+    else if (op >= 0x7CU && op <= 0x8AU)
+    {
+        *type = 0x42U;
+        k = op - 0x7CU;
+    }
+    else
+        return -1;
+
+    return (k <= BIN_MUL || (k >= BIN_AND && k <= BIN_SHR_U) ? k : -1);
+}
+
+static int64_t fold(
+    uint8_t     type,
+    int         k,
+    int64_t     a,
+    int64_t     b)
+{
+    if (type == 0x41U)
+    {
+        uint32_t x = a, y = b;
+        switch (k)
+        {
+            case BIN_ADD:   return (int32_t)(x + y);
+            case BIN_SUB:   return (int32_t)(x - y);
+            case BIN_MUL:   return (int32_t)(x * y);
+            case BIN_AND:   return (int32_t)(x & y);
+            case BIN_OR:    return (int32_t)(x | y);
+            case BIN_XOR:   return (int32_t)(x ^ y);
+            case BIN_SHL:   return (int32_t)(x << (y & 31U));
+            case BIN_SHR_S: return (int32_t)x >> (y & 31U);
+            case BIN_SHR_U: return (int32_t)(x >> (y & 31U));
+        }
+    }
+    else
+    {
+        uint64_t x = a, y = b;
+        switch (k)
+        {
+            case BIN_ADD:   return (int64_t)(x + y);
+            case BIN_SUB:   return (int64_t)(x - y);
+            case BIN_MUL:   return (int64_t)(x * y);
+            case BIN_AND:   return (int64_t)(x & y);
+            case BIN_OR:    return (int64_t)(x | y);
+            case BIN_XOR:   return (int64_t)(x ^ y);
+            case BIN_SHL:   return (int64_t)(x << (y & 63U));
+            case BIN_SHR_S: return (int64_t)x >> (y & 63U);
+            case BIN_SHR_U: return (int64_t)(x >> (y & 63U));
+        }
+    }
+    return 0;
+}
+
+/*
+ * Append `in` to the rewritten body `o`, simplifying against what has already been written. Because every
+ * rewrite only ever shortens the tail, patterns exposed by an earlier rewrite are caught as later instructions
+ * arrive (e.g. a chain of constant additions folds down to one constant).
+ */
+static int append(
+    wasm_instr* o,
+    uint32_t*   n,
+    wasm_instr* in)
+{
+    wasm_instr* last = (*n >= 1 ? o + *n - 1 : 0);
+    wasm_instr* prev = (*n >= 2 ? o + *n - 2 : 0);
+
+    // local.set x; local.get x -> local.tee x
+    if (in->op == 0x20U && last && last->op == 0x21U && last->imm == in->imm)
+    {
+        last->op = 0x22U;
+        return 1;
+    }
+
+    if (in->op == 0x1AU && last)
+    {
+        // a side effect free push followed by drop disappears entirely
+        if (last->op == 0x20U || last->op == 0x23U || (last->op >= 0x41U && last->op <= 0x44U))
+        {
+            (*n)--;
+            return 1;
+        }
+
+        // local.tee x; drop -> local.set x
+        if (last->op == 0x22U)
+        {
+            last->op = 0x21U;
+            return 1;
+        }
+    }
+
+    uint8_t type;
+    int k = binop(in->op, &type);
+    if (k >= 0 && last && last->op == type)
+    {
+        // x op const -> const when both operands are constant
+        if (prev && prev->op == type)
+        {
+            prev->imm = fold(type, k, prev->imm, last->imm);
+            (*n)--;
+            return 1;
+        }
+
+        // identities: x + 0, x - 0, x | 0, x ^ 0, x << 0, x >> 0, x * 1
+        if ((k != BIN_MUL && k != BIN_AND && IS_CONST(last, type, 0)) ||
+            (k == BIN_MUL && IS_CONST(last, type, 1)))
+        {
+            (*n)--;
+            return 1;
+        }
+    }
+
+    o[(*n)++] = *in;
+    return 0;
+}
+
+typedef struct
+{
+    uint8_t     kind;       // 0x02 block, 0x03 loop, 0x04 if, 0x00 function body
+    int         height;     // operand stack height below the block's params
+    int         params;
+    int         results;
+    int         unreachable;
+} ctl;
+
+/*
+ * Remove `br 0` that sits directly before the end of the block it targets. That's only a no-op when the operand
+ * stack holds exactly the block's results at that point, since br discards anything beneath them. Returns the
+ * number of branches removed, or -1 if the body contains something the height tracking doesn't understand.
+ */
+static int remove_trivial_br(
+    wasm_module*    m,
+    wasm_func*      f)
+{
+    wasm_type* ft = m->types + f->type;
+    ctl* stack = malloc(sizeof(ctl) * (f->ins_count + 1));
+    uint8_t* drop = calloc(f->ins_count, 1);
+    int sp = 0;
+    int height = 0;
+    int removed = 0;
+    stack[0] = (ctl){ .kind = 0x00U, .height = 0, .results = ft->rc };
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        ctl* top = stack + sp;
+
+        if (in->op == 0x0CU && in->imm == 0 && i + 1 < f->ins_count && f->ins[i+1].op == 0x0BU &&
+            top->kind != 0x03U && !top->unreachable && height == top->height + top->results)
+        {
+            drop[i] = 1;
+            removed++;
+            continue;
+        }
+
+        switch (in->op)
+        {
+            case 0x02U: case 0x03U: case 0x04U:
+            {
+                int params, results;
+                if (wasm_block_arity(m, in->imm, &params, &results))
+                {
+                    free(stack);
+                    free(drop);
+                    return -1;
+                }
+                if (in->op == 0x04U)
+                    height--;
+                height -= params;
+                stack[++sp] = (ctl){ .kind = in->op, .height = height, .params = params, .results = results };
+                height += params;
+                continue;
+            }
+
+            case 0x05U:
+            {
+                height = top->height + top->params;
+                top->unreachable = 0;
+                continue;
+            }
+
+            case 0x0BU:
+            {
+                height = top->height + top->results;
+                if (sp > 0)
+                    sp--;
+                continue;
+            }
+
+            case 0x00U: case 0x0CU: case 0x0EU: case 0x0FU:
+            {
+                // unreachable, br, br_table, return: the rest of the block is stack polymorphic
+                top->unreachable = 1;
+                height = top->height;
+                continue;
+            }
+        }
+
+        int pop, push;
+        if (wasm_stack_effect(m, in, &pop, &push))
+        {
+            free(stack);
+            free(drop);
+            return -1;
+        }
+
+        height += push - pop;
+        if (height < top->height)
+            height = top->height;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+        if (!drop[i])
+            f->ins[n++] = f->ins[i];
+    f->ins_count = n;
+
+    free(stack);
+    free(drop);
+    return removed;
+}
+
+/*
+ * Opt-in peephole pass over the retained bodies. Rewrites local.set x; local.get x into local.tee x, drops side
+ * effect free values that are immediately dropped, folds constant integer arithmetic, removes arithmetic
+ * identities and branches to the immediately following end of their own block.
+ */
+int peephole(
+    wasm_module*    m)
+{
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+            return 1;
+
+        uint32_t before = f->ins_count;
+        int changed = 1;
+        while (changed)
+        {
+            changed = 0;
+
+            uint32_t n = 0;
+            for (uint32_t i = 0; i < f->ins_count; ++i)
+            {
+                wasm_instr in = f->ins[i];
+                changed |= append(f->ins, &n, &in);
+            }
+            f->ins_count = n;
+
+            int removed = remove_trivial_br(m, f);
+            if (removed > 0)
+                changed = 1;
+        }
+
+        if (DEBUG)
+            fprintf(stderr, "Peephole func %d: %d -> %d instructions\n",
+                    fi + m->import_func_count, before, f->ins_count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// mark every global a constant expression reads, returns nonzero if it reads a defined (not imported) global
+static int expr_globals(
+    wasm_module*    m,
+    uint8_t*        expr,
+    uint32_t        len,
+    uint8_t*        used)
+{
+    int defined = 0;
+    uint8_t* end = expr + len;
+    wasm_instr in;
+    for (uint8_t* p = expr; p < end && !wasm_decode_instr(p, end, &in, 0); p += in.len)
+        if (in.op == 0x23U && in.imm < m->import_global_count + m->global_count)
+        {
+            used[in.imm] = 1;
+            if (in.imm >= m->import_global_count)
+                defined = 1;
+        }
+    return defined;
+}
+
+/*
+ * Remove defined globals that nothing refers to any more. Only hook() and cbak() survive cleaning, so compiler
+ * helpers such as __data_end, __heap_base and __dso_handle are usually left dangling. Imported globals are kept,
+ * they are part of the module's interface. References from the retained bodies and from global exports are
+ * renumbered.
+ */
+int prune_globals(
+    wasm_module*    m)
+{
+    uint32_t total = m->import_global_count + m->global_count;
+    if (!m->global_count)
+        return 0;
+
+    uint8_t* used = calloc(total, 1);
+    uint32_t* remap = calloc(total, sizeof(uint32_t));
+    int retval = 0;
+
+    for (uint32_t i = 0; i < m->export_count; ++i)
+        if (m->exports[i].kind == 0x03U && m->exports[i].idx < total)
+            used[m->exports[i].idx] = 1;
+
+    // init expressions are kept raw, so a global referenced from one must not move
+    int pinned = 0;
+    for (uint32_t i = 0; i < m->global_count; ++i)
+        pinned |= expr_globals(m, m->globals[i].init, m->globals[i].init_len, used);
+    for (uint32_t i = 0; i < m->data_count; ++i)
+        if (m->data[i].mode != 1)
+            pinned |= expr_globals(m, m->data[i].offset, m->data[i].offset_len, used);
+
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+        {
+            retval = 1;
+            goto done;
+        }
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+            if ((f->ins[i].op == 0x23U || f->ins[i].op == 0x24U) && f->ins[i].imm < total)
+                used[f->ins[i].imm] = 1;
+    }
+
+    if (pinned)
+    {
+        fprintf(stderr, "Globals: an initialiser refers to a defined global, not renumbering\n");
+        goto done;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t g = 0; g < total; ++g)
+    {
+        if (g < m->import_global_count)
+        {
+            remap[g] = g;
+            continue;
+        }
+
+        if (!used[g])
+        {
+            if (DEBUG)
+                fprintf(stderr, "Globals: removing unreferenced global %d\n", g);
+            continue;
+        }
+
+        remap[g] = m->import_global_count + n;
+        m->globals[n++] = m->globals[g - m->import_global_count];
+    }
+
+    if (n == m->global_count)
+        goto done;
+
+    fprintf(stderr, "Globals: %d -> %d defined globals\n", m->global_count, n);
+    m->global_count = n;
+
+    for (uint32_t fi = 0; fi < m->func_count; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        for (uint32_t i = 0; i < f->ins_count; ++i)
+            if ((f->ins[i].op == 0x23U || f->ins[i].op == 0x24U) && f->ins[i].imm < total)
+                f->ins[i].imm = remap[f->ins[i].imm];
+    }
+
+    for (uint32_t i = 0; i < m->export_count; ++i)
+        if (m->exports[i].kind == 0x03U && m->exports[i].idx < total)
+            m->exports[i].idx = remap[m->exports[i].idx];
+
+done:
+    free(used);
+    free(remap);
+    return retval;
+}
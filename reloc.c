@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+/*
+ * Relocation maps from output to input offsets, one entry per instruction in the retained bodies.
+ *
+ * File format: the magic "HRM1", the entry count as a leb128, then per entry (in ascending output order) the
+ * distance from the previous entry's output offset as a leb128 and the difference from the previous entry's
+ * input offset as a signed leb128. Both start from 0. Consecutive instructions are usually copied as is, so
+ * most entries take two bytes.
+ */
+
+static const uint8_t magic[4] = { 'H', 'R', 'M', '1' };
+
+void reloc_add(
+    reloc_map*  map,
+    uint32_t    out,
+    uint32_t    in)
+{
+    if (!map)
+        return;
+    if (map->count == map->cap)
+    {
+        map->cap = (map->cap ? map->cap * 2 : 256);
+        map->e = realloc(map->e, map->cap * sizeof(reloc_entry));
+        if (!map->e)
+        {
+            fprintf(stderr, "Could not allocate %ld bytes\n", (uint64_t)(map->cap * sizeof(reloc_entry)));
+            exit(101);
+        }
+    }
+    map->e[map->count++] = (reloc_entry){ .out = out, .in = in };
+}
+
+// add `delta` to the output offset of the entries from index `from` on whose output offset is at least `at`
+void reloc_shift(
+    reloc_map*  map,
+    uint32_t    from,
+    uint32_t    at,
+    int64_t     delta)
+{
+    if (!map)
+        return;
+    for (uint32_t i = from; i < map->count; ++i)
+        if (map->e[i].out >= at)
+            map->e[i].out += delta;
+}
+
+// the output bytes [lo, mid) and [mid, hi) swapped places, move the entries from index `from` on with them
+void reloc_rotate(
+    reloc_map*  map,
+    uint32_t    from,
+    uint32_t    lo,
+    uint32_t    mid,
+    uint32_t    hi)
+{
+    if (!map)
+        return;
+    for (uint32_t i = from; i < map->count; ++i)
+    {
+        uint32_t o = map->e[i].out;
+        if (o >= lo && o < mid)
+            map->e[i].out = o + (hi - mid);
+        else if (o >= mid && o < hi)
+            map->e[i].out = o - (mid - lo);
+    }
+}
+
+static int cmp_entry(
+    const void* a,
+    const void* b)
+{
+    const reloc_entry* x = a;
+    const reloc_entry* y = b;
+    return (x->out > y->out) - (x->out < y->out);
+}
+
+void reloc_sort(
+    reloc_map*  map)
+{
+    if (map && map->count)
+        qsort(map->e, map->count, sizeof(reloc_entry), cmp_entry);
+}
+
+/*
+ * Input offset of the instruction at output offset `out`. Offsets inside an instruction resolve to the
+ * instruction containing them. Returns -1 if `out` lies before the first mapped instruction.
+ */
+int64_t reloc_lookup(
+    reloc_map*  map,
+    uint32_t    out)
+{
+    if (!map || !map->count || out < map->e[0].out)
+        return -1;
+
+    uint32_t lo = 0, hi = map->count;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->e[mid].out <= out)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return map->e[lo].in;
+}
+
+// rewrite `outer` (output -> intermediate) into output -> input using `inner` (intermediate -> input)
+void reloc_compose(
+    reloc_map*  outer,
+    reloc_map*  inner)
+{
+    if (!outer || !inner || !inner->count)
+        return;
+    for (uint32_t i = 0; i < outer->count; ++i)
+    {
+        int64_t in = reloc_lookup(inner, outer->e[i].in);
+        if (in >= 0)
+            outer->e[i].in = in;
+    }
+}
+
+void reloc_free(
+    reloc_map*  map)
+{
+    if (!map)
+        return;
+    free(map->e);
+    memset(map, 0, sizeof(*map));
+}
+
+int reloc_write(
+    reloc_map*  map,
+    FILE*       f)
+{
+    wasm_buf b = { 0 };
+    wasm_put(&b, magic, sizeof(magic));
+    wasm_put_leb(&b, map->count);
+
+    uint32_t out = 0, in = 0;
+    for (uint32_t i = 0; i < map->count; ++i)
+    {
+        wasm_put_leb(&b, map->e[i].out - out);
+        wasm_put_sleb(&b, (int64_t)map->e[i].in - (int64_t)in);
+        out = map->e[i].out;
+        in = map->e[i].in;
+    }
+
+    int retval = (fwrite(b.p, 1, b.len, f) != b.len);
+    free(b.p);
+    return retval;
+}
+
+int reloc_read(
+    uint8_t*    buf,
+    ssize_t     len,
+    reloc_map*  map)
+{
+    uint8_t* p = buf;
+    uint8_t* end = buf + len;
+    memset(map, 0, sizeof(*map));
+
+    if (len < (ssize_t)sizeof(magic) || memcmp(buf, magic, sizeof(magic)) != 0)
+        return fprintf(stderr, "Not a relocation map\n");
+    p += sizeof(magic);
+
+    uint64_t count = leb(&p, end, 0);
+    if (count > (uint64_t)(end - p) / 2)
+        return fprintf(stderr, "Relocation map entry count %ld exceeds its size\n", count);
+
+    int64_t out = 0, in = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint8_t* before = p;
+        out += leb(&p, end, 0);
+        if (p == before)
+            return fprintf(stderr, "Truncated relocation map at entry %ld\n", i);
+        before = p;
+        in += (int64_t)leb(&p, end, 1);
+        if (p == before)
+            return fprintf(stderr, "Truncated relocation map at entry %ld\n", i);
+        reloc_add(map, out, in);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+/*
+ * Looks up offsets in a relocation map written by hook-cleaner --reloc-map. Offsets are output offsets, e.g. of
+ * a trap or a profiler sample in the cleaned hook, and are translated to the offset of the same instruction in
+ * the original input (which is what the compiler's symbols refer to).
+ */
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr,
+            "Usage: %s map.hrm [offset ...]\n"
+            "       Prints the input offset of the instruction at each output offset (decimal or 0x hex),\n"
+            "       or the whole map if no offsets are given.\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if (!f)
+        return fprintf(stderr, "Could not open file `%s` for reading\n", argv[1]);
+
+    uint8_t* buf = 0;
+    size_t len = 0, cap = 0;
+    for (;;)
+    {
+        if (len == cap)
+        {
+            cap = (cap ? cap * 2 : 4096);
+            buf = realloc(buf, cap);
+            if (!buf)
+                return fprintf(stderr, "Could not allocate %ld bytes\n", (uint64_t)cap);
+        }
+        size_t r = fread(buf + len, 1, cap - len, f);
+        if (r == 0)
+            break;
+        len += r;
+    }
+    fclose(f);
+
+    reloc_map map;
+    if (reloc_read(buf, len, &map) != 0)
+        return 1;
+    free(buf);
+
+    int retval = 0;
+    if (argc == 2)
+    {
+        for (uint32_t i = 0; i < map.count; ++i)
+            printf("0x%X -> 0x%X\n", map.e[i].out, map.e[i].in);
+    }
+    else
+    {
+        for (int i = 2; i < argc; ++i)
+        {
+            char* end;
+            uint64_t out = strtoull(argv[i], &end, 0);
+            int64_t in = (*end || out > UINT32_MAX ? -1 : reloc_lookup(&map, out));
+            if (in < 0)
+            {
+                printf("%s -> ?\n", argv[i]);
+                retval = 1;
+            }
+            else
+                printf("0x%lX -> 0x%lX\n", out, in);
+        }
+    }
+
+    reloc_free(&map);
+    return retval;
+}
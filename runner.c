@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <time.h>
+#include "cleaner.h"
+
+/*
+ * In-process test runner. Every *.wasm in the test directory is cleaned once per variant below, the output is
+ * checked with the built-in validator and compared byte for byte against the golden output in expected/. The
+ * golden output is then run against the input by hook-run, which has to end the same way for each of a few
+ * arguments, so a miscompile can't be stored as the expected output.
+ */
+
+extern char** environ;
+
+typedef struct
+{
+    const char* name;       // golden file suffix, empty for the plain clean
+    run_opts    opts;
+} variant;
+
+static const variant variants[] =
+{
+    { "",           { .passes = PASSES_O1 } },
+    { "peephole",   { .passes = PASSES_O1 | PASS_PEEPHOLE } },
+    { "cfg",        { .passes = PASSES_O1 | PASS_SIMPLIFY_CFG } },
+    { "locals",     { .passes = PASSES_O1 | PASS_COALESCE_LOCALS } },
+    { "memory",     { .passes = PASSES_O1 | PASS_SHRINK_MEMORY } },
+    { "stack",      { .passes = PASSES_O1 | PASS_SHRINK_STACK | PASS_SHRINK_MEMORY } },
+    { "globals",    { .passes = PASSES_O1 | PASS_PRUNE_GLOBALS } },
+    { "canonical",  { .passes = PASSES_O1 | PASS_CANONICAL } },
+    { "instrument", { .passes = PASSES_O1 | PASS_INSTRUMENT } },
+    { "guard",      { .passes = PASSES_O1 | PASS_AUTO_GUARD } },
+    { "os",         { .passes = PASSES_OS } },
+};
+
+#define VARIANT_COUNT (sizeof(variants) / sizeof(variants[0]))
+
+typedef struct
+{
+    char*       file;       // input file name, relative to the test directory
+    int         variant;
+    int         pass;
+    const char* reason;
+    ssize_t     in_len;
+    ssize_t     out_len;
+} job;
+
+static const char*  dir = "tests";
+static char         hook_run[4096];     // the interpreter, next to this binary
+static int          update = 0;
+static job*         jobs = 0;
+static int          job_count = 0;
+static int          next_job = 0;
+
+static int read_file(const char* fn, arena* a, uint8_t** buf, ssize_t* len)
+{
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 1;
+    }
+    *len = st.st_size;
+    *buf = arena_alloc(a, *len + 1);
+    ssize_t upto = 0;
+    while (*buf && upto < *len)
+    {
+        ssize_t r = read(fd, *buf + upto, *len - upto);
+        if (r <= 0)
+            break;
+        upto += r;
+    }
+    close(fd);
+    return (!*buf || upto != *len);
+}
+
+static int write_file(const char* fn, uint8_t* buf, ssize_t len)
+{
+    int fd = open(fn, O_TRUNC | O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0)
+        return 1;
+    ssize_t upto = 0;
+    while (upto < len)
+    {
+        ssize_t w = write(fd, buf + upto, len - upto);
+        if (w <= 0)
+            break;
+        upto += w;
+    }
+    close(fd);
+    return upto != len;
+}
+
+static void golden_name(char* out, size_t n, job* j)
+{
+    const char* v = variants[j->variant].name;
+    int base_len = strlen(j->file) - 5;     // without .wasm
+    snprintf(out, n, "%s/expected/%.*s%s%s.wasm", dir, base_len, j->file, (*v ? "." : ""), v);
+}
+
+// hook() arguments the outcome check runs with, and the instructions each run may take (loops.wasm never ends)
+static const char* run_args[] = { "--arg=0", "--arg=1", "--arg=2", "--arg=5" };
+#define RUN_LIMIT "--limit=1000000"
+
+// 0 if hook-run finds the input and output end the same way for every argument
+static int same_outcome(
+    const char*     input,
+    const char*     output)
+{
+    char script[4096];
+    snprintf(script, sizeof(script), "--script=%s/bench.script", dir);
+    int has_script = (access(script + 9, R_OK) == 0);
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+
+    int bad = 0;
+    for (size_t i = 0; i < sizeof(run_args) / sizeof(run_args[0]) && !bad; ++i)
+    {
+        char* argv[8];
+        int n = 0;
+        argv[n++] = hook_run;
+        argv[n++] = "--outcome-only";
+        argv[n++] = RUN_LIMIT;
+        argv[n++] = (char*)run_args[i];
+        if (has_script)
+            argv[n++] = script;
+        argv[n++] = (char*)input;
+        argv[n++] = (char*)output;
+        argv[n] = 0;
+
+        pid_t pid;
+        int status;
+        bad = (posix_spawn(&pid, hook_run, &fa, 0, argv, environ) != 0 || waitpid(pid, &status, 0) != pid ||
+                !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+    }
+
+    posix_spawn_file_actions_destroy(&fa);
+    return bad;
+}
+
+static void run_job(job* j, arena* a)
+{
+    char fn[4096];
+    uint8_t* inp = 0;
+    uint8_t* out = 0;
+    uint8_t* gold = 0;
+    ssize_t gold_len = 0;
+
+    snprintf(fn, sizeof(fn), "%s/%s", dir, j->file);
+    if (read_file(fn, a, &inp, &j->in_len))
+    {
+        j->reason = "could not read input";
+        return;
+    }
+
+    // a second copy goes through with the output left in pieces, which must come to the same bytes
+    uint8_t* inp2 = arena_alloc(a, j->in_len + 1);
+    if (!inp2)
+    {
+        j->reason = "out of memory";
+        return;
+    }
+    memcpy(inp2, inp, j->in_len);
+
+    // and a third stays as read, for the incremental cache below
+    uint8_t* orig = arena_alloc(a, j->in_len + 1);
+    if (!orig)
+    {
+        j->reason = "out of memory";
+        return;
+    }
+    memcpy(orig, inp, j->in_len);
+
+    run_opts opts = variants[j->variant].opts;
+    ssize_t len = j->in_len;
+    if (run_passes(&inp, &len, &opts, a, 0, 0, 0) != 0)
+    {
+        j->reason = "cleaning failed";
+        return;
+    }
+    out = inp;
+
+    j->out_len = len;
+
+    out_segs segs;
+    ssize_t len2 = j->in_len;
+    if (run_passes(&inp2, &len2, &opts, a, 0, 0, &segs) != 0 || len2 != len)
+    {
+        j->reason = "cleaning into pieces differs";
+        return;
+    }
+    for (int i = 0, at = 0; i < segs.count; at += segs.s[i++].iov_len)
+        if (at + segs.s[i].iov_len > len || memcmp(out + at, segs.s[i].iov_base, segs.s[i].iov_len) != 0)
+        {
+            j->reason = "cleaning into pieces differs";
+            return;
+        }
+
+    if (wasm_validate(out, len) != 0)
+    {
+        j->reason = "output failed validation";
+        return;
+    }
+
+    // a cache of this clean gives the output back, and with different data bytes the output of cleaning those
+    cache_sections cs;
+    if (cache_scan(orig, j->in_len, &cs) == 0)
+    {
+        wasm_buf b = { 0 };
+        cache_encode(&cs, &opts, out, len, &b);
+        uint8_t* again = 0;
+        ssize_t again_len = 0;
+        int stale = 0;
+        int bad = (cache_reuse(b.p, b.len, orig, &cs, &opts, a, &again, &again_len, 0, &stale) != 0 || stale ||
+                again_len != len || memcmp(again, out, len) != 0);
+
+        // the last byte of the data section is the last segment's, unless that's empty (the layout says)
+        cache_sections cs2;
+        if (!bad && cs.data >= 0)
+            orig[cs.s[cs.data].off + cs.s[cs.data].len - 1] ^= 0x5AU;
+        if (!bad && cs.data >= 0 && cache_scan(orig, j->in_len, &cs2) == 0 &&
+                memcmp(cs2.layout, cs.layout, HOOK_HASH_SIZE) == 0 &&
+                cache_reuse(b.p, b.len, orig, &cs2, &opts, a, &again, &again_len, 0, &stale) == 0)
+        {
+            uint8_t* full = arena_alloc(a, j->in_len + 1);
+            ssize_t full_len = j->in_len;
+            bad = (!full || !stale);
+            if (!bad)
+            {
+                memcpy(full, orig, j->in_len);
+                bad = (run_passes(&full, &full_len, &opts, a, 0, 0, 0) != 0 || full_len != again_len ||
+                        memcmp(full, again, again_len) != 0);
+            }
+        }
+        free(b.p);
+        if (bad)
+        {
+            j->reason = "incremental reuse differs";
+            return;
+        }
+    }
+
+    // the hex codec's vector paths against a plain encoding, and back
+    char* hex = arena_alloc(a, 2 * len + 3);
+    uint8_t* back = arena_alloc(a, len + 1);
+    if (!hex || !back)
+    {
+        j->reason = "out of memory";
+        return;
+    }
+    hex_encode(out, len, hex);
+    for (ssize_t i = 0; i < len; ++i)
+    {
+        char d[3];
+        snprintf(d, sizeof(d), "%02X", out[i]);
+        if (hex[2 * i] != d[0] || hex[2 * i + 1] != d[1])
+        {
+            j->reason = "hex encoding differs";
+            return;
+        }
+    }
+    if (hex_decode(hex, 2 * len, back) != 0 || memcmp(back, out, len) != 0)
+    {
+        j->reason = "hex round trip differs";
+        return;
+    }
+
+    golden_name(fn, sizeof(fn), j);
+    if (update)
+    {
+        if (write_file(fn, out, len))
+        {
+            j->reason = "could not write golden output";
+            return;
+        }
+    }
+    else if (read_file(fn, a, &gold, &gold_len))
+    {
+        j->reason = "golden output missing (run with -u)";
+        return;
+    }
+    else if (gold_len != len || memcmp(gold, out, len) != 0)
+    {
+        j->reason = "output differs from golden";
+        return;
+    }
+
+    char in_fn[4096];
+    snprintf(in_fn, sizeof(in_fn), "%s/%s", dir, j->file);
+    if (same_outcome(in_fn, fn))
+    {
+        j->reason = "output ends differently from the input (hook-run)";
+        return;
+    }
+
+    j->pass = 1;
+}
+
+// each worker reuses one arena for all its jobs
+static void* worker(void* arg)
+{
+    arena a;
+    arena_init(&a, ARENA_LIMIT);
+    for (;;)
+    {
+        int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_SEQ_CST);
+        if (i >= job_count)
+            break;
+        arena_reset(&a);
+        run_job(jobs + i, &a);
+    }
+    arena_free(&a);
+    return 0;
+}
+
+static int cmp_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int main(int argc, char** argv)
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:uvh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': threads = atoi(optarg); break;
+            case 'u': update = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr,
+                    "Usage: %s [-j threads] [-u] [-v] [testdir]\n"
+                    "       Cleans and validates every *.wasm in testdir (default: tests) in-process and\n"
+                    "       compares the output against testdir/expected/, then checks with hook-run that the\n"
+                    "       output ends the same way as the input.\n"
+                    "       -u  write the golden outputs instead of comparing against them\n"
+                    "       -v  show the cleaner's log output\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        dir = argv[optind];
+    if (threads < 1)
+        threads = 1;
+
+    const char* slash = strrchr(argv[0], '/');
+    snprintf(hook_run, sizeof(hook_run), "%.*shook-run", (int)(slash ? slash - argv[0] + 1 : 2),
+            (slash ? argv[0] : "./"));
+    if (access(hook_run, X_OK) != 0)
+        return fprintf(stderr, "The outcome checks need %s, build it first (make hook-run)\n", hook_run);
+
+    DIR* d = opendir(dir);
+    if (!d)
+        return fprintf(stderr, "Could not open test directory `%s`\n", dir);
+
+    char** files = 0;
+    int file_count = 0;
+    struct dirent* e;
+    while ((e = readdir(d)))
+    {
+        size_t n = strlen(e->d_name);
+        if (n <= 5 || strcmp(e->d_name + n - 5, ".wasm") != 0)
+            continue;
+        files = realloc(files, sizeof(char*) * (file_count + 1));
+        files[file_count++] = strdup(e->d_name);
+    }
+    closedir(d);
+    qsort(files, file_count, sizeof(char*), cmp_names);
+
+    if (update)
+    {
+        char fn[4096];
+        snprintf(fn, sizeof(fn), "%s/expected", dir);
+        mkdir(fn, 0755);
+    }
+
+    job_count = file_count * VARIANT_COUNT;
+    jobs = calloc(job_count + 1, sizeof(job));
+    for (int i = 0; i < file_count; ++i)
+        for (int v = 0; v < VARIANT_COUNT; ++v)
+        {
+            jobs[i * VARIANT_COUNT + v].file = files[i];
+            jobs[i * VARIANT_COUNT + v].variant = v;
+        }
+
+    // the cleaner logs heavily to stderr, keep it out of the report unless asked for
+    int saved_stderr = -1;
+    if (!verbose)
+    {
+        fflush(stderr);
+        saved_stderr = dup(2);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+        close(devnull);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if (threads > job_count)
+        threads = (job_count ? job_count : 1);
+    pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+    for (int i = 0; i < threads; ++i)
+        pthread_create(tids + i, 0, worker, 0);
+    for (int i = 0; i < threads; ++i)
+        pthread_join(tids[i], 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (!verbose)
+    {
+        fflush(stderr);
+        dup2(saved_stderr, 2);
+        close(saved_stderr);
+    }
+
+    int passed = 0;
+    ssize_t saved = 0;
+    for (int i = 0; i < job_count; ++i)
+    {
+        job* j = jobs + i;
+        const char* v = variants[j->variant].name;
+        if (j->pass)
+        {
+            passed++;
+            saved += j->in_len - j->out_len;
+            printf("TEST %d -- %s%s%s \t-- PASS (-%ld b)\n", i + 1, j->file, (*v ? " " : ""), v,
+                    j->in_len - j->out_len);
+        }
+        else
+            printf("TEST %d -- %s%s%s \t-- FAIL %s\n", i + 1, j->file, (*v ? " " : ""), v, j->reason);
+    }
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1000000.0;
+    if (passed == job_count)
+        printf("All tests passed%s! Average bytes saved: %ld b (%.1f ms, %d threads)\n",
+                (update ? " and golden outputs written" : ""), (job_count ? saved / job_count : 0), ms, threads);
+    else
+        printf("NOT All tests passed: %d failed.\n", job_count - passed);
+
+    for (int i = 0; i < file_count; ++i)
+        free(files[i]);
+    free(files);
+    free(jobs);
+    free(tids);
+
+    return (passed == job_count ? 0 : 1);
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+#define STACK_ALIGN 16U
+
+// value of an `i32.const N; end` constant expression
+static int const_expr_i32(
+    uint8_t*    expr,
+    uint32_t    len,
+    int64_t*    value)
+{
+    wasm_instr in;
+    if (wasm_decode_instr(expr, expr + len, &in, 0) || in.op != 0x41U || in.len + 1 != len)
+        return 1;
+    *value = (uint32_t)in.imm;
+    return 0;
+}
+
+// what the evaluation below knows about a value: nothing, a constant, or the stack pointer on entry plus k
+#define VAL_UNKNOWN 0
+#define VAL_CONST   1
+#define VAL_SP      2
+
+typedef struct
+{
+    uint8_t     kind;
+    int64_t     v;      // the constant, or k
+} stack_val;
+
+// bytes accessed by each load and store 0x28 - 0x3E
+static const uint8_t access_width[] =
+{
+    4, 8, 4, 8, 1, 1, 2, 2, 1, 1, 2, 2, 4, 4, 4, 8, 4, 8, 1, 2, 1, 2, 4
+};
+
+/*
+ * How far below the stack pointer a function (hook() or cbak(), run once from the initial stack pointer) reaches,
+ * by following the stack pointer through the body: it may be read once, outside any block and before it's set,
+ * and from there copied through locals written only once, offset by constants (directly or held in such locals)
+ * and set back. Whatever it's set to has to be a known offset, an access through it a known offset at or below it,
+ * and it can't have an unknown amount subtracted from it, which is how a dynamic alloca looks. Adding an unknown
+ * amount is indexing into a frame, which is trusted to stay in the frame. The value stack is followed within
+ * straight-line code only, anything carried into or out of a block is unknown.
+ */
+static int frame_size(
+    wasm_module*    m,
+    wasm_func*      f,
+    uint32_t        sp,
+    uint32_t*       frame,
+    const char**    why,
+    uint32_t*       why_at)
+{
+    uint32_t params = m->types[f->type].pc, locals = params;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        locals += f->locals[i].count;
+
+    // locals written once, and where
+    uint32_t* writes = calloc(locals + 1, sizeof(uint32_t));
+    uint32_t* written_at = calloc(locals + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+        if ((f->ins[i].op == 0x21U || f->ins[i].op == 0x22U) && f->ins[i].imm < locals)
+        {
+            writes[f->ins[i].imm]++;
+            written_at[f->ins[i].imm] = i;
+        }
+
+    stack_val* lv = calloc(locals + 1, sizeof(stack_val));
+    stack_val* st = malloc(sizeof(stack_val) * (f->ins_count + 1));
+    uint32_t n = 0, reads = 0;
+    int depth = 0, set = 0;
+    int64_t lowest = 0;
+
+    *why = 0;
+    for (uint32_t i = 0; i < f->ins_count && !*why; ++i)
+    {
+        wasm_instr* in = f->ins + i;
+        stack_val a = { VAL_UNKNOWN }, b = { VAL_UNKNOWN };
+        *why_at = in->off;
+
+        switch (in->op)
+        {
+            case 0x02U:
+            case 0x03U:
+            case 0x04U:
+                depth++;
+                n = 0;
+                break;
+
+            case 0x0BU:
+                depth--;
+                n = 0;
+                break;
+
+            case 0x05U:
+            case 0x0CU:
+            case 0x0DU:
+            case 0x0EU:
+            case 0x0FU:
+            case 0x00U:
+                n = 0;
+                break;
+
+            case 0x41U:
+                st[n++] = (stack_val){ VAL_CONST, (int32_t)in->imm };
+                break;
+
+            case 0x23U:
+                if (in->imm != sp)
+                    st[n++] = (stack_val){ VAL_UNKNOWN };
+                else if (reads++ || depth != 0 || set)
+                    *why = "the stack pointer is read more than once, inside a block or after it's set";
+                else
+                    st[n++] = (stack_val){ VAL_SP, 0 };
+                break;
+
+            case 0x24U:
+                a = (n ? st[--n] : a);
+                if (in->imm != sp)
+                    break;
+                if (a.kind != VAL_SP || a.v > 0)
+                    *why = "the stack pointer is set to something other than a known frame";
+                set = 1;
+                break;
+
+            case 0x20U:
+                if (in->imm < locals && writes[in->imm] == 1 && written_at[in->imm] < i)
+                    st[n++] = lv[in->imm];
+                else
+                    st[n++] = (stack_val){ VAL_UNKNOWN };
+                break;
+
+            case 0x21U:
+            case 0x22U:
+                a = (n ? st[--n] : a);
+                if (in->imm < locals && writes[in->imm] == 1 && depth == 0)
+                    lv[in->imm] = a;
+                if (in->op == 0x22U)
+                    st[n++] = a;
+                break;
+
+            case 0x6AU:
+            case 0x6BU:
+                b = (n ? st[--n] : b);
+                a = (n ? st[--n] : a);
+                if (in->op == 0x6BU && a.kind == VAL_SP && b.kind != VAL_CONST)
+                    *why = "an unknown amount is taken off the stack pointer";
+                else if (a.kind == VAL_CONST && b.kind == VAL_CONST)
+                    st[n++] = (stack_val){ VAL_CONST, (int32_t)(in->op == 0x6AU ? a.v + b.v : a.v - b.v) };
+                else if (a.kind == VAL_SP && b.kind == VAL_CONST)
+                    st[n++] = (stack_val){ VAL_SP, (in->op == 0x6AU ? a.v + b.v : a.v - b.v) };
+                else if (in->op == 0x6AU && a.kind == VAL_CONST && b.kind == VAL_SP)
+                    st[n++] = (stack_val){ VAL_SP, a.v + b.v };
+                else
+                    st[n++] = (stack_val){ VAL_UNKNOWN };
+
+                if (n && st[n - 1].kind == VAL_SP && -st[n - 1].v > lowest)
+                    lowest = -st[n - 1].v;
+                break;
+
+            default:
+            {
+                int pop, push;
+                if (wasm_stack_effect(m, in, &pop, &push))
+                {
+                    *why = "the code uses vector instructions";
+                    break;
+                }
+
+                // an access through the stack pointer, the address being the first operand
+                if (in->op >= 0x28U && in->op <= 0x3EU && n >= (uint32_t)pop && st[n - pop].kind == VAL_SP &&
+                    st[n - pop].v + (int64_t)in->imm2 + access_width[in->op - 0x28U] > 0)
+                    *why = "the code accesses memory above the stack pointer";
+
+                n = (n > (uint32_t)pop ? n - pop : 0);
+                while (push-- > 0)
+                    st[n++] = (stack_val){ VAL_UNKNOWN };
+            }
+        }
+    }
+
+    free(writes);
+    free(written_at);
+    free(lv);
+    free(st);
+
+    *frame = lowest;
+    return (*why != 0);
+}
+
+/*
+ * Move the shadow stack down to just above everything else in memory and make it only as deep as the code can
+ * take it. Clang reserves a fixed stack (64 KiB by default) by starting the stack pointer global that far above the
+ * data, and the pages that takes are allocated on every execution. hook() and cbak() are all that's left after
+ * cleaning and each runs once from the initial stack pointer, so the stack is as deep as the larger of their frames
+ * (see frame_size). The stack pointer's initial value is rewritten to that depth above the highest address the
+ * module otherwise uses: the data segments and every load or store at a constant address (see address_uses).
+ * shrink-memory, which runs next, then gives the freed pages back.
+ *
+ * Like shrink-memory this trusts the code to stay within its frames and declines, saying why, whenever it can't
+ * account for something: a frame it can't follow, a base address between the data and the old stack pointer,
+ * which is how static arrays the data segments don't hold are reached, calls to defined functions, memory.size /
+ * memory.grow, bulk memory or SIMD instructions, or reads of any other global, which could be a heap base.
+ */
+int shrink_stack(
+    wasm_module*    m)
+{
+    if (!m->has_memory)
+        return 0;
+
+    // the stack pointer is the one defined mutable i32 global the code writes
+    int64_t sp = -1;
+    const char* why = 0;
+    uint32_t why_at = 0;
+    for (uint32_t fi = 0; fi < m->func_count && !why; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (wasm_decode_body(m, f))
+            return 1;
+        for (uint32_t i = 0; i < f->ins_count && !why; ++i)
+            if (f->ins[i].op == 0x24U && sp >= 0 && f->ins[i].imm != sp)
+            {
+                why = "the code writes more than one global";
+                why_at = f->ins[i].off;
+            }
+            else if (f->ins[i].op == 0x24U)
+                sp = f->ins[i].imm;
+    }
+    if (sp < 0)
+        return 0;
+
+    int64_t old_top = 0;
+    wasm_global* g = (sp >= m->import_global_count && sp < m->import_global_count + m->global_count ?
+        m->globals + (sp - m->import_global_count) : 0);
+    if (!why && (!g || g->valtype != WASM_I32 || !g->mut || const_expr_i32(g->init, g->init_len, &old_top)))
+        why = "the stack pointer isn't a defined i32 global with a constant initial value";
+    for (uint32_t i = 0; i < m->export_count && !why; ++i)
+        if (m->exports[i].kind == 0x03U && m->exports[i].idx == sp)
+            why = "the stack pointer is exported";
+
+    // the highest address anything but the stack could be at
+    uint64_t top = 0;
+    for (uint32_t i = 0; i < m->data_count && !why; ++i)
+    {
+        wasm_data* d = m->data + i;
+        int64_t off;
+        if (d->mode == 1)
+            continue;
+        if (const_expr_i32(d->offset, d->offset_len, &off))
+            why = "a data segment has a non-constant offset";
+        else if (off + d->bytes_len > top)
+            top = off + d->bytes_len;
+    }
+
+    uint32_t* frame = calloc(m->func_count + 1, sizeof(uint32_t));
+    for (uint32_t fi = 0; fi < m->func_count && !why; ++fi)
+    {
+        wasm_func* f = m->funcs + fi;
+        if (f->type >= m->type_count)
+        {
+            why = "a function has an invalid type";
+            break;
+        }
+        if (frame_size(m, f, sp, frame + fi, &why, &why_at))
+            break;
+
+        for (uint32_t i = 0; i < f->ins_count && !why; ++i)
+        {
+            wasm_instr* in = f->ins + i;
+            why_at = in->off;
+            if (in->op == 0x3FU || in->op == 0x40U)
+                why = "the code uses memory.size or memory.grow";
+            else if ((in->op == 0xFCU && in->sub >= 8 && in->sub <= 11) || in->op == 0xFDU)
+                why = "the code uses bulk memory or SIMD instructions";
+            else if (in->op == 0x11U || (in->op == 0x10U && in->imm >= m->import_func_count))
+                why = "the code calls functions other than imports";
+            else if ((in->op == 0x23U || in->op == 0x24U) && in->imm != sp)
+                why = "the code reads a global other than the stack pointer";
+        }
+    }
+
+    // Static storage the data segments don't cover (bss) sits between them and the stack, and only the exact
+    // accesses say how much of it is used. A base there could be an object running up to the old stack pointer.
+    addr_use* uses = 0;
+    uint32_t use_count = 0;
+    if (!why && address_uses(m, &uses, &use_count))
+    {
+        free(frame);
+        return 1;
+    }
+
+    // nothing static is below where the linker starts it, but address_uses leaves the small constants that could
+    // still point there out, so the stack isn't moved into it
+    if (top < STATIC_BASE)
+        top = STATIC_BASE;
+    uint64_t data_top = top;
+    for (uint32_t i = 0; i < use_count && !why; ++i)
+        if (uses[i].lo >= (uint64_t)old_top)
+            continue;
+        else if (uses[i].hi != ADDR_UNBOUNDED)
+            top = (uses[i].hi > top ? uses[i].hi : top);
+        else if (uses[i].lo >= data_top)
+        {
+            why = "the code or data holds an address between the data and the stack it can't bound";
+            why_at = uses[i].at;
+        }
+    free(uses);
+
+    uint64_t deepest = 0;
+    const char* names[] = { "hook", "cbak" };
+    for (int e = 0; e < 2 && !why; ++e)
+    {
+        int idx = wasm_find_export(m, names[e]);
+        if (idx >= m->import_func_count && idx - m->import_func_count < m->func_count &&
+            frame[idx - m->import_func_count] > deepest)
+            deepest = frame[idx - m->import_func_count];
+    }
+    free(frame);
+
+    if (why)
+    {
+        fprintf(stderr, "Stack: keeping the stack pointer at 0x%lX, can't prove moving it safe: %s (0x%X)\n",
+                old_top, why, why_at);
+        return 0;
+    }
+
+    uint64_t new_top = (top + deepest + STACK_ALIGN - 1) & ~(uint64_t)(STACK_ALIGN - 1);
+    if (new_top >= (uint64_t)old_top)
+    {
+        if (DEBUG)
+            fprintf(stderr, "Stack: %ld bytes deep above 0x%lX, the stack pointer at 0x%lX is already lower\n",
+                    deepest, top, old_top);
+        return 0;
+    }
+
+    fprintf(stderr, "Stack: %ld bytes deep, stack pointer 0x%lX -> 0x%lX\n", deepest, old_top, new_top);
+
+    // a smaller value never takes more bytes, so the initialiser is rewritten in place
+    wasm_buf b = { 0 };
+    wasm_put_byte(&b, 0x41U);
+    wasm_put_sleb(&b, (int32_t)new_top);
+    wasm_put_byte(&b, 0x0BU);
+    memcpy(g->init, b.p, b.len);
+    g->init_len = b.len;
+    free(b.p);
+    return 0;
+}
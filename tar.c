@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cleaner.h"
+
+/*
+ * Tar stream mode: reads a tar archive on stdin and writes it to stdout with every regular `.wasm` member cleaned
+ * in-process and everything else passed through as is. Cleaning can run on several threads, members are still
+ * written in input order. A member that fails to clean stops the stream, so a partly cleaned archive is never
+ * mistaken for a good one. Only the size and checksum of a cleaned member's header change.
+ */
+
+#define TAR_BLOCK 512
+
+// members read ahead of the one being written, per job
+#define TAR_WINDOW_PER_JOB 4
+
+typedef struct
+{
+    uint8_t*    head;       // the member's header, preceded by any pax or GNU long name blocks for it
+    size_t      head_len;
+    char        name[4096];
+    uint8_t*    data;       // the module, then the cleaned module
+    ssize_t     len;
+    int         done;
+    int         failed;
+    char        hash[HOOK_HASH_SIZE * 2 + 1];
+    char        hash_in[HOOK_HASH_SIZE * 2 + 1];
+} tar_member;
+
+typedef struct
+{
+    run_opts*       opts;
+    tar_member*     m;
+    int             window;
+    uint64_t        next_read;  // members read so far
+    uint64_t        next_job;   // members handed to a worker so far
+    int             stop;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} tar_state;
+
+// 1 if the stream ended before anything was read, 2 if it ended part way
+static int read_full(
+    uint8_t*    buf,
+    size_t      n)
+{
+    size_t upto = 0;
+    while (upto < n)
+    {
+        ssize_t r = read(0, buf + upto, n - upto);
+        if (r <= 0)
+            return (upto ? 2 : 1);
+        upto += r;
+    }
+    return 0;
+}
+
+static int write_full(
+    const uint8_t*  buf,
+    size_t          n)
+{
+    size_t upto = 0;
+    while (upto < n)
+    {
+        ssize_t w = write(1, buf + upto, n - upto);
+        if (w <= 0)
+            return fprintf(stderr, "Could not write the tar stream, only wrote %ld out of %ld bytes\n", upto, n);
+        upto += w;
+    }
+    return 0;
+}
+
+static uint64_t padded(
+    uint64_t    n)
+{
+    return (n + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+// numeric header fields are octal, or base-256 big endian when the top bit of the first byte is set
+static uint64_t tar_number(
+    const uint8_t*  f,
+    int             len)
+{
+    uint64_t v = 0;
+    if (f[0] & 0x80U)
+    {
+        for (int i = 1; i < len; ++i)
+            v = (v << 8) | f[i];
+        return v;
+    }
+    for (int i = 0; i < len && f[i] != 0; ++i)
+        if (f[i] >= '0' && f[i] <= '7')
+            v = (v << 3) | (f[i] - '0');
+    return v;
+}
+
+static uint32_t tar_checksum(
+    const uint8_t*  h)
+{
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; ++i)
+        sum += (i >= 148 && i < 156 ? ' ' : h[i]);
+    return sum;
+}
+
+static void append(
+    tar_member*     m,
+    const uint8_t*  p,
+    size_t          n)
+{
+    m->head = realloc(m->head, m->head_len + n);
+    memcpy(m->head + m->head_len, p, n);
+    m->head_len += n;
+}
+
+// the path record of a pax extended header, if it has one. A size record would go stale once the member is
+// cleaned, so those aren't supported
+static int pax_path(
+    const uint8_t*  p,
+    uint64_t        len,
+    char*           name,
+    size_t          name_size)
+{
+    uint64_t at = 0;
+    while (at < len)
+    {
+        char* sp = memchr(p + at, ' ', len - at);
+        uint64_t rec = strtoull((const char*)p + at, 0, 10);
+        if (!sp || rec == 0 || rec > len - at)
+            return fprintf(stderr, "Malformed pax header record\n");
+        const char* key = sp + 1;
+        const char* eq = memchr(key, '=', (const char*)p + at + rec - key);
+        if (eq && eq - key == 4 && memcmp(key, "size", 4) == 0)
+            return fprintf(stderr, "Pax size records aren't supported\n");
+        if (eq && eq - key == 4 && memcmp(key, "path", 4) == 0)
+        {
+            size_t n = (const char*)p + at + rec - 1 - (eq + 1);
+            if (n >= name_size)
+                n = name_size - 1;
+            memcpy(name, eq + 1, n);
+            name[n] = '\0';
+        }
+        at += rec;
+    }
+    return 0;
+}
+
+/*
+ * Read the next member's header blocks into `m`. Long names and pax headers that belong to the member are kept
+ * with it. Sets *end at the end of the archive, and *size to the size of the data that follows.
+ */
+static int read_header(
+    tar_member* m,
+    int*        end,
+    uint64_t*   size,
+    int*        is_wasm)
+{
+    uint8_t h[TAR_BLOCK];
+    memset(m, 0, sizeof(*m));
+    *end = 0;
+
+    for (;;)
+    {
+        int r = read_full(h, TAR_BLOCK);
+        if (r)
+        {
+            if (m->head_len || r == 2)
+                return fprintf(stderr, "Tar stream ends inside a member's headers\n");
+            *end = 1;
+            return 0;
+        }
+
+        int zero = 1;
+        for (int i = 0; i < TAR_BLOCK && zero; ++i)
+            zero = (h[i] == 0);
+        if (zero)
+        {
+            if (m->head_len)
+                return fprintf(stderr, "Tar stream ends inside a member's headers\n");
+            *end = 1;
+            return 0;
+        }
+
+        if (tar_checksum(h) != tar_number(h + 148, 8))
+            return fprintf(stderr, "Bad tar header checksum\n");
+
+        append(m, h, TAR_BLOCK);
+        *size = tar_number(h + 124, 12);
+        uint8_t type = h[156];
+
+        if (type != 'L' && type != 'K' && type != 'x' && type != 'g')
+        {
+            if (!m->name[0])
+            {
+                // ustar splits long names into a prefix and the name
+                if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+                    snprintf(m->name, sizeof(m->name), "%.155s/%.100s", h + 345, h);
+                else
+                    snprintf(m->name, sizeof(m->name), "%.100s", h);
+            }
+            size_t n = strlen(m->name);
+            *is_wasm = ((type == '0' || type == '\0' || type == '7') && n > 5 &&
+                    strcmp(m->name + n - 5, ".wasm") == 0);
+            return 0;
+        }
+
+        // the data of these is part of the next member's headers
+        if (*size > (1U << 20))
+            return fprintf(stderr, "Tar extended header of %ld bytes\n", *size);
+        uint8_t* ext = malloc(padded(*size) + 1);
+        if (read_full(ext, padded(*size)))
+        {
+            free(ext);
+            return fprintf(stderr, "Tar stream ends inside an extended header\n");
+        }
+        int retval = 0;
+        if (type == 'L')
+            snprintf(m->name, sizeof(m->name), "%.*s", (int)*size, ext);
+        else if (type == 'x')
+            retval = pax_path(ext, *size, m->name, sizeof(m->name));
+        append(m, ext, padded(*size));
+        free(ext);
+        if (retval)
+            return retval;
+    }
+}
+
+static void clean_member(
+    tar_member* m,
+    run_opts*   opts,
+    arena*      a)
+{
+    uint8_t* buf = m->data;
+    ssize_t len = m->len;
+    uint8_t hash[HOOK_HASH_SIZE];
+    if (opts->hash_input)
+    {
+        hook_hash(buf, len, hash);
+        hook_hash_hex(hash, m->hash_in);
+    }
+
+    int retval = run_passes(&buf, &len, opts, a, 0, 0, 0);
+    if (retval == 0 && opts->validate)
+        retval = wasm_validate(buf, len);
+    if (retval == 0)
+    {
+        uint8_t* out = malloc(len ? len : 1);
+        memcpy(out, buf, len);
+        free(m->data);
+        m->data = out;
+        m->len = len;
+        if (opts->hash)
+        {
+            hook_hash(out, len, hash);
+            hook_hash_hex(hash, m->hash);
+        }
+    }
+    m->failed = (retval != 0);
+}
+
+// write a member whose data has been read, with its header's size and checksum updated for the cleaned data
+static int write_member(
+    tar_member*     m,
+    run_opts*       opts)
+{
+    if (m->failed)
+        return fprintf(stderr, "Could not clean tar member `%s`\n", m->name);
+
+    uint8_t* h = m->head + m->head_len - TAR_BLOCK;
+    char field[13];
+    snprintf(field, sizeof(field), "%011lo", (uint64_t)m->len);
+    memcpy(h + 124, field, 12);
+    snprintf(field, sizeof(field), "%06o", tar_checksum(h));
+    memcpy(h + 148, field, 7);
+    h[155] = ' ';
+
+    uint8_t zero[TAR_BLOCK] = { 0 };
+    int retval = write_full(m->head, m->head_len);
+    if (retval == 0)
+        retval = write_full(m->data, m->len);
+    if (retval == 0)
+        retval = write_full(zero, padded(m->len) - m->len);
+
+    fprintf(stderr, "Tar member `%s`: %ld bytes\n", m->name, m->len);
+    if (retval == 0 && opts->hash_input)
+        fprintf(stderr, "InputHash: %s  %s\n", m->hash_in, m->name);
+    if (retval == 0 && opts->hash)
+        fprintf(stderr, "HookHash: %s  %s\n", m->hash, m->name);
+
+    free(m->head);
+    free(m->data);
+    m->head = 0;
+    m->data = 0;
+    return retval;
+}
+
+// copy a member that isn't cleaned straight through
+static int pass_member(
+    tar_member* m,
+    uint64_t    size)
+{
+    int retval = write_full(m->head, m->head_len);
+    free(m->head);
+    m->head = 0;
+
+    uint8_t buf[64 * TAR_BLOCK];
+    for (uint64_t left = padded(size); left && retval == 0;)
+    {
+        size_t n = (left < sizeof(buf) ? left : sizeof(buf));
+        if (read_full(buf, n))
+            return fprintf(stderr, "Tar stream ends inside member `%s`\n", m->name);
+        retval = write_full(buf, n);
+        left -= n;
+    }
+    return retval;
+}
+
+static void* tar_worker(
+    void*   arg)
+{
+    tar_state* s = arg;
+    arena a;
+    arena_init(&a, ARENA_LIMIT);
+
+    pthread_mutex_lock(&s->lock);
+    for (;;)
+    {
+        while (!s->stop && s->next_job == s->next_read)
+            pthread_cond_wait(&s->cond, &s->lock);
+        if (s->next_job == s->next_read)
+            break;
+        tar_member* m = s->m + (s->next_job++ % s->window);
+        pthread_mutex_unlock(&s->lock);
+
+        arena_reset(&a);
+        clean_member(m, s->opts, &a);
+
+        pthread_mutex_lock(&s->lock);
+        m->done = 1;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    arena_free(&a);
+    return 0;
+}
+
+/*
+ * Write out members from `*next_write` on, in order, until reaching one that isn't cleaned yet. With `all`, wait
+ * for the ones being cleaned until everything read is written.
+ */
+static int flush(
+    tar_state*  s,
+    uint64_t*   next_write,
+    int         all)
+{
+    int retval = 0;
+    pthread_mutex_lock(&s->lock);
+    while (*next_write < s->next_read && retval == 0)
+    {
+        tar_member* m = s->m + (*next_write % s->window);
+        if (!m->done)
+        {
+            if (!all)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&s->lock);
+        retval = write_member(m, s->opts);
+        pthread_mutex_lock(&s->lock);
+        (*next_write)++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return retval;
+}
+
+int run_tar(
+    run_opts*   opts,
+    int         jobs)
+{
+    if (jobs < 1)
+        jobs = 1;
+
+    tar_state s = { .opts = opts, .window = jobs * TAR_WINDOW_PER_JOB };
+    s.m = calloc(s.window, sizeof(tar_member));
+    pthread_mutex_init(&s.lock, 0);
+    pthread_cond_init(&s.cond, 0);
+
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    for (int i = 0; i < jobs; ++i)
+        pthread_create(threads + i, 0, tar_worker, &s);
+
+    uint64_t next_write = 0;
+    int retval = 0;
+    int members = 0, cleaned = 0;
+    for (;;)
+    {
+        tar_member m;
+        int end = 0, is_wasm = 0;
+        uint64_t size = 0;
+        if ((retval = read_header(&m, &end, &size, &is_wasm)) != 0 || end)
+            break;
+        members++;
+
+        if (!is_wasm)
+        {
+            // everything before it goes out first, then it's streamed through
+            if ((retval = flush(&s, &next_write, 1)) != 0 || (retval = pass_member(&m, size)) != 0)
+                break;
+            continue;
+        }
+
+        if (size > ARENA_LIMIT)
+        {
+            free(m.head);
+            retval = fprintf(stderr, "Tar member `%s` is too large to clean: %ld bytes\n", m.name, size);
+            break;
+        }
+        m.len = size;
+        m.data = malloc(padded(size) + 1);
+        if (read_full(m.data, padded(size)))
+        {
+            free(m.head);
+            free(m.data);
+            retval = fprintf(stderr, "Tar stream ends inside member `%s`\n", m.name);
+            break;
+        }
+        cleaned++;
+
+        // wait for room in the window, writing out what's done in the meantime
+        while (retval == 0 && s.next_read - next_write == (uint64_t)s.window)
+        {
+            retval = flush(&s, &next_write, 0);
+            pthread_mutex_lock(&s.lock);
+            if (retval == 0 && s.next_read - next_write == (uint64_t)s.window &&
+                    !s.m[next_write % s.window].done)
+                pthread_cond_wait(&s.cond, &s.lock);
+            pthread_mutex_unlock(&s.lock);
+        }
+        if (retval)
+        {
+            free(m.head);
+            free(m.data);
+            break;
+        }
+
+        pthread_mutex_lock(&s.lock);
+        s.m[s.next_read % s.window] = m;
+        s.next_read++;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        retval = flush(&s, &next_write, 0);
+        if (retval)
+            break;
+    }
+
+    if (retval == 0)
+        retval = flush(&s, &next_write, 1);
+
+    pthread_mutex_lock(&s.lock);
+    s.stop = 1;
+    if (retval)
+    {
+        // drop what hasn't been started, the workers finish what they have
+        s.next_read = s.next_job;
+    }
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    for (int i = 0; i < jobs; ++i)
+        pthread_join(threads[i], 0);
+
+    for (int i = 0; i < s.window; ++i)
+    {
+        free(s.m[i].head);
+        free(s.m[i].data);
+    }
+
+    // the end of archive marker
+    if (retval == 0)
+    {
+        uint8_t zero[2 * TAR_BLOCK] = { 0 };
+        retval = write_full(zero, sizeof(zero));
+    }
+
+    if (retval == 0)
+        fprintf(stderr, "Tar stream: %d members, %d cleaned\n", members, cleaned);
+
+    free(threads);
+    free(s.m);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    return retval;
+}
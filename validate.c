@@ -0,0 +1,795 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+/*
+ * Structural and type-checking validator for (cleaned) modules. It follows the validation algorithm in the
+ * appendix of the WebAssembly core specification: section order and sizes, index bounds for every index space,
+ * constant expressions, and per-function operand stack typing with block balance. Vector instructions are not
+ * supported and are reported as invalid.
+ */
+
+#define UNKNOWN 0x00U   // operand of unknown type, only appears in unreachable code
+
+typedef struct
+{
+    uint8_t         op;         // 0x02 block, 0x03 loop, 0x04 if, 0x05 else, 0x00 function body
+    const uint8_t*  start;      // param types
+    uint32_t        start_len;
+    const uint8_t*  end;        // result types
+    uint32_t        end_len;
+    uint32_t        height;
+    int             unreachable;
+} vctl;
+
+typedef struct
+{
+    wasm_module*    m;
+    uint32_t        func;       // function index being validated, for messages
+    uint32_t        off;        // offset of the instruction being validated, for messages
+
+    uint8_t*        vals;
+    uint32_t        vals_len;
+    uint32_t        vals_cap;
+
+    vctl*           ctrls;
+    uint32_t        ctrls_len;
+    uint32_t        ctrls_cap;
+
+    uint8_t*        locals;
+    uint32_t        local_count;
+
+    uint8_t*        global_types;   // full global index space (imports first)
+    uint8_t*        global_mut;
+    uint32_t        global_count;
+
+    int             has_memory;
+    int             has_table;
+    int             has_datacount;
+    uint32_t        data_count;
+} vstate;
+
+#define VFAIL(...)\
+    return (fprintf(stderr, "Validation failed in func %d at 0x%X: ", v->func, v->off),\
+            fprintf(stderr, __VA_ARGS__), fprintf(stderr, "\n"), 1)
+
+static int push_val(vstate* v, uint8_t t)
+{
+    if (v->vals_len == v->vals_cap)
+    {
+        v->vals_cap = (v->vals_cap ? v->vals_cap * 2 : 64);
+        v->vals = realloc(v->vals, v->vals_cap);
+        if (!v->vals)
+            return fprintf(stderr, "Could not allocate operand stack\n");
+    }
+    v->vals[v->vals_len++] = t;
+    return 0;
+}
+
+// pop one operand, expecting `expect` (UNKNOWN accepts anything), the popped type is returned in *got
+static int pop_val(vstate* v, uint8_t expect, uint8_t* got)
+{
+    vctl* c = v->ctrls + v->ctrls_len - 1;
+    uint8_t t;
+    if (v->vals_len == c->height)
+    {
+        if (!c->unreachable)
+            VFAIL("operand stack underflow");
+        t = UNKNOWN;
+    }
+    else
+        t = v->vals[--v->vals_len];
+
+    if (t != expect && t != UNKNOWN && expect != UNKNOWN)
+        VFAIL("type mismatch, expected 0x%02X got 0x%02X", expect, t);
+
+    if (got)
+        *got = (t == UNKNOWN ? expect : t);
+    return 0;
+}
+
+static int push_vals(vstate* v, const uint8_t* t, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i)
+        if (push_val(v, t[i]))
+            return 1;
+    return 0;
+}
+
+static int pop_vals(vstate* v, const uint8_t* t, uint32_t n)
+{
+    for (uint32_t i = n; i > 0; --i)
+        if (pop_val(v, t[i-1], 0))
+            return 1;
+    return 0;
+}
+
+static int push_ctrl(vstate* v, uint8_t op, const uint8_t* in, uint32_t in_len, const uint8_t* out, uint32_t out_len)
+{
+    if (v->ctrls_len == v->ctrls_cap)
+    {
+        v->ctrls_cap = (v->ctrls_cap ? v->ctrls_cap * 2 : 16);
+        v->ctrls = realloc(v->ctrls, v->ctrls_cap * sizeof(vctl));
+        if (!v->ctrls)
+            return fprintf(stderr, "Could not allocate control stack\n");
+    }
+    v->ctrls[v->ctrls_len++] = (vctl)
+    {
+        .op = op, .start = in, .start_len = in_len, .end = out, .end_len = out_len,
+        .height = v->vals_len, .unreachable = 0
+    };
+    return push_vals(v, in, in_len);
+}
+
+static int pop_ctrl(vstate* v, vctl* frame)
+{
+    if (v->ctrls_len == 0)
+        VFAIL("control stack underflow");
+    vctl* c = v->ctrls + v->ctrls_len - 1;
+    if (pop_vals(v, c->end, c->end_len))
+        return 1;
+    if (v->vals_len != c->height)
+        VFAIL("%d values left on the stack at the end of a block", v->vals_len - c->height);
+    *frame = *c;
+    v->ctrls_len--;
+    return 0;
+}
+
+static void set_unreachable(vstate* v)
+{
+    vctl* c = v->ctrls + v->ctrls_len - 1;
+    v->vals_len = c->height;
+    c->unreachable = 1;
+}
+
+static int label_types(vstate* v, uint64_t depth, const uint8_t** t, uint32_t* n)
+{
+    if (depth >= v->ctrls_len)
+        VFAIL("branch depth %ld out of range", depth);
+    vctl* c = v->ctrls + v->ctrls_len - 1 - depth;
+    *t = (c->op == 0x03U ? c->start : c->end);
+    *n = (c->op == 0x03U ? c->start_len : c->end_len);
+    return 0;
+}
+
+static int is_valtype(uint8_t t)
+{
+    return (t == WASM_I32 || t == WASM_I64 || t == WASM_F32 || t == WASM_F64 ||
+            t == WASM_FUNCREF || t == WASM_EXTERNREF);
+}
+
+// storage for the single result of a value-typed block, indexed by value type
+static const uint8_t single_type[256] =
+{
+    [WASM_I32] = WASM_I32, [WASM_I64] = WASM_I64, [WASM_F32] = WASM_F32, [WASM_F64] = WASM_F64,
+    [WASM_FUNCREF] = WASM_FUNCREF, [WASM_EXTERNREF] = WASM_EXTERNREF,
+};
+
+static int block_type(vstate* v, int64_t bt, const uint8_t** in, uint32_t* in_len,
+                      const uint8_t** out, uint32_t* out_len)
+{
+    *in = 0; *in_len = 0; *out = 0; *out_len = 0;
+    if (bt == -64)
+        return 0;
+    if (bt < 0)
+    {
+        uint8_t t = bt & 0x7FU;
+        if (!is_valtype(t))
+            VFAIL("invalid block type 0x%02X", t);
+        *out = single_type + t;
+        *out_len = 1;
+        return 0;
+    }
+    if (bt >= v->m->type_count)
+        VFAIL("block type index %ld out of range", bt);
+    wasm_type* ft = v->m->types + bt;
+    *in = ft->p; *in_len = ft->pc;
+    *out = ft->r; *out_len = ft->rc;
+    return 0;
+}
+
+// natural alignment (log2) of each load/store, and the value type it moves
+static const uint8_t mem_align[] =
+{
+    2, 3, 2, 3, 0, 0, 1, 1, 0, 0, 1, 1, 2, 2,   // loads 0x28 - 0x35
+    2, 3, 2, 3, 0, 1, 0, 1, 2                   // stores 0x36 - 0x3E
+};
+
+static const uint8_t mem_type[] =
+{
+    WASM_I32, WASM_I64, WASM_F32, WASM_F64, WASM_I32, WASM_I32, WASM_I32, WASM_I32,
+    WASM_I64, WASM_I64, WASM_I64, WASM_I64, WASM_I64, WASM_I64,
+    WASM_I32, WASM_I64, WASM_F32, WASM_F64, WASM_I32, WASM_I32, WASM_I64, WASM_I64, WASM_I64
+};
+
+// operand and result types of the numeric instructions 0x45 - 0xC4: { a, b, result }, b = 0 for unary
+static int numeric_sig(uint8_t op, uint8_t* a, uint8_t* b, uint8_t* r)
+{
+    const uint8_t I = WASM_I32, L = WASM_I64, F = WASM_F32, D = WASM_F64;
+    *b = 0;
+    if (op == 0x45U)                    { *a = I; *r = I; }
+    else if (op <= 0x4FU)               { *a = I; *b = I; *r = I; }
+    else if (op == 0x50U)               { *a = L; *r = I; }
+    else if (op <= 0x5AU)               { *a = L; *b = L; *r = I; }
+    else if (op <= 0x60U)               { *a = F; *b = F; *r = I; }
+    else if (op <= 0x66U)               { *a = D; *b = D; *r = I; }
+    else if (op <= 0x69U)               { *a = I; *r = I; }
+    else if (op <= 0x78U)               { *a = I; *b = I; *r = I; }
+    else if (op <= 0x7BU)               { *a = L; *r = L; }
+    else if (op <= 0x8AU)               { *a = L; *b = L; *r = L; }
+    else if (op <= 0x91U)               { *a = F; *r = F; }
+    else if (op <= 0x98U)               { *a = F; *b = F; *r = F; }
+    else if (op <= 0x9FU)               { *a = D; *r = D; }
+    else if (op <= 0xA6U)               { *a = D; *b = D; *r = D; }
+    else
+    {
+        // conversions, one operand each
+        const uint8_t conv[][2] =
+        {
+            {L, I}, {F, I}, {F, I}, {D, I}, {D, I},                 // 0xA7 - 0xAB
+            {I, L}, {I, L}, {F, L}, {F, L}, {D, L}, {D, L},         // 0xAC - 0xB1
+            {I, F}, {I, F}, {L, F}, {L, F}, {D, F},                 // 0xB2 - 0xB6
+            {I, D}, {I, D}, {L, D}, {L, D}, {F, D},                 // 0xB7 - 0xBB
+            {F, I}, {D, L}, {I, F}, {L, D},                         // 0xBC - 0xBF
+            {I, I}, {I, I}, {L, L}, {L, L}, {L, L}                  // 0xC0 - 0xC4
+        };
+        if (op > 0xC4U)
+            return 1;
+        *a = conv[op - 0xA7U][0];
+        *r = conv[op - 0xA7U][1];
+    }
+    return 0;
+}
+
+static int validate_instr(vstate* v, wasm_func* f, wasm_instr* in)
+{
+    wasm_module* m = v->m;
+    uint8_t op = in->op;
+    uint8_t t, t2;
+    const uint8_t *bi, *bo;
+    uint32_t bin, bon;
+
+    switch (op)
+    {
+        case 0x00U: set_unreachable(v); return 0;
+        case 0x01U: return 0;
+
+        case 0x02U: case 0x03U: case 0x04U:
+        {
+            if (block_type(v, in->imm, &bi, &bin, &bo, &bon))
+                return 1;
+            if (op == 0x04U && pop_val(v, WASM_I32, 0))
+                return 1;
+            if (pop_vals(v, bi, bin))
+                return 1;
+            return push_ctrl(v, op, bi, bin, bo, bon);
+        }
+
+        case 0x05U:
+        {
+            vctl c;
+            if (v->ctrls_len == 0 || v->ctrls[v->ctrls_len - 1].op != 0x04U)
+                VFAIL("else without if");
+            if (pop_ctrl(v, &c))
+                return 1;
+            return push_ctrl(v, 0x05U, c.start, c.start_len, c.end, c.end_len);
+        }
+
+        case 0x0BU:
+        {
+            vctl c;
+            if (pop_ctrl(v, &c))
+                return 1;
+            if (c.op == 0x04U &&
+                (c.start_len != c.end_len || (c.start_len && memcmp(c.start, c.end, c.start_len) != 0)))
+                VFAIL("if without else must not change the stack");
+            return push_vals(v, c.end, c.end_len);
+        }
+
+        case 0x0CU:
+        {
+            if (label_types(v, in->imm, &bo, &bon) || pop_vals(v, bo, bon))
+                return 1;
+            set_unreachable(v);
+            return 0;
+        }
+
+        case 0x0DU:
+        {
+            if (pop_val(v, WASM_I32, 0) || label_types(v, in->imm, &bo, &bon) ||
+                pop_vals(v, bo, bon) || push_vals(v, bo, bon))
+                return 1;
+            return 0;
+        }
+
+        case 0x0EU:
+        {
+            if (pop_val(v, WASM_I32, 0))
+                return 1;
+            uint32_t* labels = f->brt + in->imm2;
+            uint32_t dn;
+            if (label_types(v, labels[in->imm], &bo, &dn))
+                return 1;
+            for (uint64_t i = 0; i < in->imm; ++i)
+            {
+                const uint8_t* lt;
+                uint32_t ln;
+                if (label_types(v, labels[i], &lt, &ln))
+                    return 1;
+                if (ln != dn)
+                    VFAIL("br_table labels have inconsistent arity");
+                // popping doesn't overwrite the stack, so restoring the length checks every label
+                // against the same operands
+                uint32_t saved = v->vals_len;
+                if (pop_vals(v, lt, ln))
+                    return 1;
+                v->vals_len = saved;
+            }
+            if (pop_vals(v, bo, dn))
+                return 1;
+            set_unreachable(v);
+            return 0;
+        }
+
+        case 0x0FU:
+        {
+            wasm_type* ft = m->types + f->type;
+            if (pop_vals(v, ft->r, ft->rc))
+                return 1;
+            set_unreachable(v);
+            return 0;
+        }
+
+        case 0x10U:
+        {
+            wasm_type* ft = wasm_func_type(m, in->imm);
+            if (!ft)
+                VFAIL("call to function %ld out of range", in->imm);
+            if (pop_vals(v, ft->p, ft->pc))
+                return 1;
+            return push_vals(v, ft->r, ft->rc);
+        }
+
+        case 0x11U:
+        {
+            if (!v->has_table || in->imm2 != 0)
+                VFAIL("call_indirect without a table");
+            if (in->imm >= m->type_count)
+                VFAIL("call_indirect type %ld out of range", in->imm);
+            wasm_type* ft = m->types + in->imm;
+            if (pop_val(v, WASM_I32, 0) || pop_vals(v, ft->p, ft->pc))
+                return 1;
+            return push_vals(v, ft->r, ft->rc);
+        }
+
+        case 0x1AU: return pop_val(v, UNKNOWN, 0);
+
+        case 0x1BU:
+        case 0x1CU:
+        {
+            uint8_t want = UNKNOWN;
+            if (op == 0x1CU)
+            {
+                if (in->imm != 1)
+                    VFAIL("select must have exactly one type");
+                want = in->raw[in->len - 1];
+                if (!is_valtype(want))
+                    VFAIL("invalid select type 0x%02X", want);
+            }
+            if (pop_val(v, WASM_I32, 0) || pop_val(v, want, &t) || pop_val(v, (t ? t : want), &t2))
+                return 1;
+            if (op == 0x1BU && (t == WASM_FUNCREF || t == WASM_EXTERNREF))
+                VFAIL("untyped select on reference types");
+            return push_val(v, (t2 ? t2 : t));
+        }
+
+        case 0x20U: case 0x21U: case 0x22U:
+        {
+            if (in->imm >= v->local_count)
+                VFAIL("local %ld out of range", in->imm);
+            t = v->locals[in->imm];
+            if (op == 0x20U)
+                return push_val(v, t);
+            if (pop_val(v, t, 0))
+                return 1;
+            return (op == 0x22U ? push_val(v, t) : 0);
+        }
+
+        case 0x23U: case 0x24U:
+        {
+            if (in->imm >= v->global_count)
+                VFAIL("global %ld out of range", in->imm);
+            t = v->global_types[in->imm];
+            if (op == 0x23U)
+                return push_val(v, t);
+            if (!v->global_mut[in->imm])
+                VFAIL("global.set on immutable global %ld", in->imm);
+            return pop_val(v, t, 0);
+        }
+
+        case 0x3FU: case 0x40U:
+        {
+            if (!v->has_memory || in->imm != 0)
+                VFAIL("memory instruction without a memory");
+            if (op == 0x40U && pop_val(v, WASM_I32, 0))
+                return 1;
+            return push_val(v, WASM_I32);
+        }
+
+        case 0x41U: return push_val(v, WASM_I32);
+        case 0x42U: return push_val(v, WASM_I64);
+        case 0x43U: return push_val(v, WASM_F32);
+        case 0x44U: return push_val(v, WASM_F64);
+
+        case 0xD0U:
+        {
+            if (in->imm != WASM_FUNCREF && in->imm != WASM_EXTERNREF)
+                VFAIL("ref.null with invalid type");
+            return push_val(v, in->imm);
+        }
+
+        case 0xD1U:
+        {
+            if (pop_val(v, UNKNOWN, &t))
+                return 1;
+            if (t != UNKNOWN && t != WASM_FUNCREF && t != WASM_EXTERNREF)
+                VFAIL("ref.is_null on a non-reference");
+            return push_val(v, WASM_I32);
+        }
+
+        case 0xD2U:
+        {
+            if (!wasm_func_type(m, in->imm))
+                VFAIL("ref.func %ld out of range", in->imm);
+            return push_val(v, WASM_FUNCREF);
+        }
+
+        case 0xFCU:
+        {
+            if (in->sub <= 7)
+            {
+                static const uint8_t from[] = { WASM_F32, WASM_F32, WASM_F64, WASM_F64,
+                                                WASM_F32, WASM_F32, WASM_F64, WASM_F64 };
+                if (pop_val(v, from[in->sub], 0))
+                    return 1;
+                return push_val(v, (in->sub < 4 ? WASM_I32 : WASM_I64));
+            }
+            if (in->sub == 8 || in->sub == 10 || in->sub == 11)
+            {
+                if (!v->has_memory)
+                    VFAIL("bulk memory instruction without a memory");
+                if (in->sub == 8 && (!v->has_datacount || in->imm >= v->data_count))
+                    VFAIL("memory.init data segment %ld out of range", in->imm);
+                for (int i = 0; i < 3; ++i)
+                    if (pop_val(v, WASM_I32, 0))
+                        return 1;
+                return 0;
+            }
+            if (in->sub == 9)
+            {
+                if (!v->has_datacount || in->imm >= v->data_count)
+                    VFAIL("data.drop segment %ld out of range", in->imm);
+                return 0;
+            }
+            VFAIL("table instruction 0xFC %d without a table", in->sub);
+        }
+
+        case 0x25U: case 0x26U:
+            VFAIL("table instruction without a table");
+
+        case 0xFDU:
+            VFAIL("vector instructions are not supported");
+    }
+
+    if (op >= 0x28U && op <= 0x3EU)
+    {
+        if (!v->has_memory)
+            VFAIL("memory access without a memory");
+        if (in->imm > mem_align[op - 0x28U])
+            VFAIL("alignment 2^%ld larger than natural", in->imm);
+        t = mem_type[op - 0x28U];
+        if (op <= 0x35U)
+            return (pop_val(v, WASM_I32, 0) || push_val(v, t));
+        return (pop_val(v, t, 0) || pop_val(v, WASM_I32, 0));
+    }
+
+    if (op >= 0x45U && op <= 0xC4U)
+    {
+        uint8_t a, b, r;
+        if (numeric_sig(op, &a, &b, &r))
+            VFAIL("unknown numeric instruction 0x%02X", op);
+        if (b && pop_val(v, b, 0))
+            return 1;
+        if (pop_val(v, a, 0))
+            return 1;
+        return push_val(v, r);
+    }
+
+    VFAIL("unknown instruction 0x%02X", op);
+}
+
+static int validate_func(vstate* v, uint32_t fi)
+{
+    wasm_module* m = v->m;
+    wasm_func* f = m->funcs + fi;
+    v->func = fi + m->import_func_count;
+    v->off = f->off;
+
+    if (f->type >= m->type_count)
+        VFAIL("function type %d out of range", f->type);
+    wasm_type* ft = m->types + f->type;
+
+    uint64_t count = ft->pc;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+    {
+        count += f->locals[i].count;
+        if (!is_valtype(f->locals[i].type))
+            VFAIL("invalid local type 0x%02X", f->locals[i].type);
+    }
+    if (count > 50000)
+        VFAIL("too many locals (%ld)", count);
+
+    v->locals = malloc(count + 1);
+    v->local_count = count;
+    memcpy(v->locals, ft->p, ft->pc);
+    uint32_t upto = ft->pc;
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+        for (uint32_t j = 0; j < f->locals[i].count; ++j)
+            v->locals[upto++] = f->locals[i].type;
+
+    v->vals_len = 0;
+    v->ctrls_len = 0;
+
+    int rv = wasm_decode_body(m, f);
+    if (!rv)
+        rv = push_ctrl(v, 0x00U, 0, 0, ft->r, ft->rc);
+
+    for (uint32_t i = 0; !rv && i < f->ins_count; ++i)
+    {
+        v->off = f->ins[i].off;
+        if (v->ctrls_len == 0)
+        {
+            fprintf(stderr, "Validation failed in func %d at 0x%X: code after the final end\n", v->func, v->off);
+            rv = 1;
+            break;
+        }
+        rv = validate_instr(v, f, f->ins + i);
+    }
+
+    if (!rv && v->ctrls_len != 0)
+    {
+        fprintf(stderr, "Validation failed in func %d: unbalanced blocks\n", v->func);
+        rv = 1;
+    }
+
+    free(v->locals);
+    v->locals = 0;
+    return rv;
+}
+
+// a constant expression producing `type`, only immutable imported globals may be read
+static int validate_const_expr(vstate* v, uint8_t* expr, uint32_t len, uint8_t type)
+{
+    wasm_instr in;
+    if (wasm_decode_instr(expr, expr + len, &in, 0))
+        VFAIL("bad constant expression");
+    if (in.len + 1 != len || expr[in.len] != 0x0BU)
+        VFAIL("constant expression must be a single instruction");
+
+    uint8_t t;
+    switch (in.op)
+    {
+        case 0x41U: t = WASM_I32; break;
+        case 0x42U: t = WASM_I64; break;
+        case 0x43U: t = WASM_F32; break;
+        case 0x44U: t = WASM_F64; break;
+        case 0xD0U: t = in.imm; break;
+        case 0xD2U: t = WASM_FUNCREF; break;
+        case 0x23U:
+        {
+            if (in.imm >= v->m->import_global_count)
+                VFAIL("constant expression reads non-imported global %ld", in.imm);
+            if (v->global_mut[in.imm])
+                VFAIL("constant expression reads mutable global %ld", in.imm);
+            t = v->global_types[in.imm];
+            break;
+        }
+        default:
+            VFAIL("instruction 0x%02X is not constant", in.op);
+    }
+
+    if (t != type)
+        VFAIL("constant expression has type 0x%02X, expected 0x%02X", t, type);
+    return 0;
+}
+
+static int is_utf8(const uint8_t* s, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; )
+    {
+        uint8_t c = s[i];
+        int len = (c < 0x80U ? 1 : (c & 0xE0U) == 0xC0U ? 2 : (c & 0xF0U) == 0xE0U ? 3 : (c & 0xF8U) == 0xF0U ? 4 : 0);
+        if (!len || i + len > n)
+            return 0;
+        uint32_t cp = (len == 1 ? c : c & (0x7FU >> len));
+        for (int j = 1; j < len; ++j)
+        {
+            if ((s[i+j] & 0xC0U) != 0x80U)
+                return 0;
+            cp = (cp << 6) | (s[i+j] & 0x3FU);
+        }
+        // reject overlong encodings, surrogates and anything past U+10FFFF
+        if ((len == 2 && cp < 0x80U) || (len == 3 && cp < 0x800U) || (len == 4 && cp < 0x10000U) ||
+            (cp >= 0xD800U && cp <= 0xDFFFU) || cp > 0x10FFFFU)
+            return 0;
+        i += len;
+    }
+    return 1;
+}
+
+// order in which non-custom sections must appear, data count sits between element and code
+static int section_rank(uint8_t id)
+{
+    static const int rank[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 11, 12, 10 };
+    return (id <= 12 ? rank[id] : -1);
+}
+
+int wasm_validate(
+    uint8_t*    buf,
+    ssize_t     len)
+{
+    // section order and sizes, before anything relies on them
+    {
+        uint8_t* base = buf;
+        uint8_t* p = buf + 8;
+        uint8_t* end = buf + len;
+        int last = 0;
+        if (len < 8)
+            return fprintf(stderr, "Validation failed: module too short\n");
+        while (p < end)
+        {
+            uint8_t id = *p++;
+            uint8_t* before = p;
+            uint64_t size = leb(&p, end, 0);
+            if (p == before || size > (uint64_t)(end - p))
+                return fprintf(stderr, "Validation failed: section %d at 0x%lX overruns the module\n",
+                        id, (uint64_t)(before - 1 - base));
+            int r = section_rank(id);
+            if (r < 0)
+                return fprintf(stderr, "Validation failed: unknown section id %d\n", id);
+            if (r != 0)
+            {
+                if (r <= last)
+                    return fprintf(stderr, "Validation failed: section %d out of order or duplicated\n", id);
+                last = r;
+            }
+            p += size;
+        }
+    }
+
+    wasm_module m;
+    if (wasm_parse(buf, len, &m))
+        return fprintf(stderr, "Validation failed: module does not parse\n");
+
+    vstate vs;
+    memset(&vs, 0, sizeof(vs));
+    vstate* v = &vs;
+    v->m = &m;
+    v->func = -1;
+    int rv = 0;
+
+    // gather the index spaces
+    uint32_t func_total = m.import_func_count + m.func_count;
+    v->global_count = m.import_global_count + m.global_count;
+    v->global_types = calloc(v->global_count + 1, 1);
+    v->global_mut = calloc(v->global_count + 1, 1);
+    v->has_memory = m.has_memory;
+
+    for (int i = 0; i < m.sec_count; ++i)
+    {
+        if (m.sec[i].id == 0x04U)
+            v->has_table = 1;
+        if (m.sec[i].id == 0x0CU)
+        {
+            uint8_t* p = m.sec[i].start;
+            v->has_datacount = 1;
+            v->data_count = leb(&p, m.sec[i].start + m.sec[i].len, 0);
+        }
+    }
+
+    uint32_t g = 0;
+    for (uint32_t i = 0; i < m.import_count && !rv; ++i)
+    {
+        wasm_import* im = m.imports + i;
+        if (!is_utf8(im->mod, im->mod_len) || !is_utf8(im->name, im->name_len))
+        {
+            rv = fprintf(stderr, "Validation failed: import %d name is not valid UTF-8\n", i);
+            break;
+        }
+        switch (im->kind)
+        {
+            case 0x00U:
+                if (im->type >= m.type_count)
+                    rv = fprintf(stderr, "Validation failed: import %d has type %d out of range\n", i, im->type);
+                break;
+            case 0x01U: v->has_table = 1; break;
+            case 0x02U:
+                if (v->has_memory)
+                    rv = fprintf(stderr, "Validation failed: more than one memory\n");
+                v->has_memory = 1;
+                break;
+            case 0x03U:
+                v->global_types[g] = im->desc[0];
+                v->global_mut[g++] = im->desc[1];
+                break;
+        }
+    }
+
+    for (uint32_t i = 0; i < m.global_count && !rv; ++i)
+    {
+        v->global_types[g] = m.globals[i].valtype;
+        v->global_mut[g] = m.globals[i].mut;
+        if (!is_valtype(m.globals[i].valtype) || m.globals[i].mut > 1)
+            rv = fprintf(stderr, "Validation failed: global %d has an invalid type\n", g);
+        else
+            rv = validate_const_expr(v, m.globals[i].init, m.globals[i].init_len, m.globals[i].valtype);
+        g++;
+    }
+
+    for (uint32_t i = 0; i < m.type_count && !rv; ++i)
+    {
+        for (uint32_t j = 0; j < m.types[i].pc && !rv; ++j)
+            if (!is_valtype(m.types[i].p[j]))
+                rv = fprintf(stderr, "Validation failed: type %d has an invalid param type\n", i);
+        for (uint32_t j = 0; j < m.types[i].rc && !rv; ++j)
+            if (!is_valtype(m.types[i].r[j]))
+                rv = fprintf(stderr, "Validation failed: type %d has an invalid result type\n", i);
+    }
+
+    if (!rv && m.has_memory && ((m.mem_flags & ~1U) || m.mem_min > 65536 ||
+        ((m.mem_flags & 1U) && (m.mem_max > 65536 || m.mem_max < m.mem_min))))
+        rv = fprintf(stderr, "Validation failed: invalid memory limits\n");
+
+    for (uint32_t i = 0; i < m.export_count && !rv; ++i)
+    {
+        wasm_export* e = m.exports + i;
+        if ((e->kind == 0x00U && e->idx >= func_total) ||
+            (e->kind == 0x01U && (!v->has_table || e->idx != 0)) ||
+            (e->kind == 0x02U && (!v->has_memory || e->idx != 0)) ||
+            (e->kind == 0x03U && e->idx >= v->global_count) || e->kind > 0x03U)
+            rv = fprintf(stderr, "Validation failed: export %d refers to an invalid index\n", i);
+        else if (!is_utf8(e->name, e->name_len))
+            rv = fprintf(stderr, "Validation failed: export %d name is not valid UTF-8\n", i);
+
+        for (uint32_t j = 0; j < i && !rv; ++j)
+            if (m.exports[j].name_len == e->name_len && memcmp(m.exports[j].name, e->name, e->name_len) == 0)
+                rv = fprintf(stderr, "Validation failed: duplicate export name\n");
+    }
+
+    if (!rv && v->has_datacount && v->data_count != m.data_count)
+        rv = fprintf(stderr, "Validation failed: data count %d doesn't match %d segments\n",
+                v->data_count, m.data_count);
+
+    for (uint32_t i = 0; i < m.data_count && !rv; ++i)
+    {
+        wasm_data* d = m.data + i;
+        if (d->mode == 1)
+            continue;
+        if (!v->has_memory || d->mem != 0)
+            rv = fprintf(stderr, "Validation failed: data segment %d without a memory\n", i);
+        else
+            rv = validate_const_expr(v, d->offset, d->offset_len, WASM_I32);
+    }
+
+    for (uint32_t i = 0; i < m.func_count && !rv; ++i)
+        rv = validate_func(v, i);
+
+    free(v->vals);
+    free(v->ctrls);
+    free(v->global_types);
+    free(v->global_mut);
+    wasm_free(&m);
+    return rv;
+}
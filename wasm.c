@@ -0,0 +1,1182 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cleaner.h"
+
+// these mirror the macros in cleaner(), but operate on a local cursor `p` bounded by `end`
+#define WREQUIRE(need)\
+{\
+    if ((uint64_t)(end - p) < (uint64_t)(need))\
+        return fprintf(stderr, "Truncated web assembly at 0x%lX (need %ld bytes). SrcLine: %d\n",\
+            (uint64_t)(p - base), (uint64_t)(need), __LINE__);\
+}
+
+// every one of `count` entries takes at least `min` bytes, reject counts the remaining bytes can't hold
+#define WCOUNT(count, min)\
+{\
+    if ((uint64_t)(count) > (uint64_t)(end - p) / (min))\
+        return fprintf(stderr, "Declared count %ld at 0x%lX exceeds the remaining %ld bytes. SrcLine: %d\n",\
+            (uint64_t)(count), (uint64_t)(p - base), (uint64_t)(end - p), __LINE__);\
+}
+
+#define WLEB(dst, is_signed)\
+{\
+    uint8_t* before = p;\
+    dst = leb(&p, end, (is_signed));\
+    if (p == before)\
+        return fprintf(stderr, "Truncated leb128 at 0x%lX. SrcLine: %d\n", (uint64_t)(p - base), __LINE__);\
+}
+
+// grow a dynamic array so that at least `need` elements fit
+static void* grow(
+    void*       ptr,
+    uint32_t*   cap,
+    uint32_t    need,
+    size_t      elem)
+{
+    if (need <= *cap)
+        return ptr;
+    uint32_t ncap = (*cap ? *cap * 2 : 16);
+    while (ncap < need)
+        ncap *= 2;
+    void* n = realloc(ptr, ncap * elem);
+    if (!n)
+    {
+        fprintf(stderr, "Could not allocate %ld bytes\n", (uint64_t)(ncap * elem));
+        exit(101);
+    }
+    *cap = ncap;
+    return n;
+}
+
+int wasm_decode_instr(
+    uint8_t*    p,
+    uint8_t*    end,
+    wasm_instr* in,
+    wasm_func*  f)
+{
+    uint8_t* base = p;
+    uint64_t tmp;
+
+    memset(in, 0, sizeof(*in));
+    in->raw = p;
+
+    WREQUIRE(1);
+    uint8_t ins = *p++;
+    in->op = ins;
+
+    switch (ins)
+    {
+        case 0x02U: // block
+        case 0x03U: // loop
+        case 0x04U: // if
+        {
+            WREQUIRE(1);
+            WLEB(in->imm, 1);
+            break;
+        }
+
+        case 0x0CU: // br
+        case 0x0DU: // br_if
+        case 0x10U: // call
+        case 0x20U: // local.get
+        case 0x21U: // local.set
+        case 0x22U: // local.tee
+        case 0x23U: // global.get
+        case 0x24U: // global.set
+        case 0x25U: // table.get
+        case 0x26U: // table.set
+        case 0xD2U: // ref.func
+        {
+            WLEB(in->imm, 0);
+            break;
+        }
+
+        case 0x0EU: // br_table
+        {
+            uint64_t vc;
+            WLEB(vc, 0);
+            // every label takes at least one byte
+            WCOUNT(vc, 1);
+            in->imm = vc;
+            if (f)
+            {
+                in->imm2 = f->brt_count;
+                f->brt = grow(f->brt, &f->brt_cap, f->brt_count + vc + 1, sizeof(uint32_t));
+            }
+            for (uint64_t i = 0; i <= vc; ++i)
+            {
+                WLEB(tmp, 0);
+                if (f)
+                    f->brt[f->brt_count++] = tmp;
+            }
+            break;
+        }
+
+        case 0x11U: // call_indirect
+        {
+            WLEB(in->imm, 0);
+            WLEB(in->imm2, 0);
+            break;
+        }
+
+        case 0x1CU: // select t*
+        {
+            uint64_t vc;
+            WLEB(vc, 0);
+            WREQUIRE(vc);
+            in->imm = vc;
+            p += vc;
+            break;
+        }
+
+        case 0x3FU: // memory.size
+        case 0x40U: // memory.grow
+        case 0xD0U: // ref.null
+        {
+            WREQUIRE(1);
+            in->imm = *p++;
+            break;
+        }
+
+        case 0x41U: // i32.const
+        case 0x42U: // i64.const
+        {
+            WLEB(in->imm, 1);
+            if (ins == 0x41U)
+                in->imm = (int32_t)in->imm;
+            break;
+        }
+
+        case 0x43U: // f32.const
+        {
+            WREQUIRE(4);
+            p += 4;
+            break;
+        }
+
+        case 0x44U: // f64.const
+        {
+            WREQUIRE(8);
+            p += 8;
+            break;
+        }
+
+        case 0xFCU:
+        {
+            WLEB(tmp, 0);
+            in->sub = tmp;
+            switch (tmp)
+            {
+                case 8:     // memory.init
+                {
+                    WLEB(in->imm, 0);
+                    WREQUIRE(1);
+                    p++;
+                    break;
+                }
+                case 9:     // data.drop
+                case 13:    // elem.drop
+                case 15:    // table.grow
+                case 16:    // table.size
+                case 17:    // table.fill
+                {
+                    WLEB(in->imm, 0);
+                    break;
+                }
+                case 10:    // memory.copy
+                {
+                    WREQUIRE(2);
+                    p += 2;
+                    break;
+                }
+                case 11:    // memory.fill
+                {
+                    WREQUIRE(1);
+                    p++;
+                    break;
+                }
+                case 12:    // table.init
+                case 14:    // table.copy
+                {
+                    WLEB(in->imm, 0);
+                    WLEB(in->imm2, 0);
+                    break;
+                }
+                default:
+                {
+                    if (tmp > 7)
+                        return fprintf(stderr, "Unknown 0xFC instruction %ld at 0x%lX\n",
+                                tmp, (uint64_t)(p - base));
+                }
+            }
+            break;
+        }
+
+        case 0xFDU:
+        {
+            WLEB(tmp, 0);
+            in->sub = tmp;
+            // see the vector instruction handling in cleaner()
+            if (tmp <= 11 || tmp == 92 || tmp == 93)
+            {
+                WLEB(in->imm, 0);
+                WLEB(in->imm2, 0);
+            }
+            else if (tmp >= 84 && tmp <= 91)
+            {
+                WLEB(in->imm, 0);
+                WLEB(in->imm2, 0);
+                WREQUIRE(1);
+                p++;
+            }
+            else if (tmp == 12 || tmp == 13)
+            {
+                WREQUIRE(16);
+                p += 16;
+            }
+            else if (tmp >= 21 && tmp <= 34)
+            {
+                WREQUIRE(1);
+                p++;
+            }
+            break;
+        }
+
+        default:
+        {
+            // single memargs
+            if (ins >= 0x28U && ins <= 0x3EU)
+            {
+                WLEB(in->imm, 0);
+                WLEB(in->imm2, 0);
+                break;
+            }
+
+            // single byte instructions
+            if (ins == 0x00U || ins == 0x01U || ins == 0x05U || ins == 0x0BU ||
+                ins == 0x0FU || ins == 0x1AU || ins == 0x1BU || ins == 0xD1U ||
+                (ins >= 0x45U && ins <= 0xC4U))
+                break;
+
+            return fprintf(stderr, "Unknown instruction 0x%02X at 0x%lX\n", ins, (uint64_t)(p - base - 1));
+        }
+    }
+
+    in->len = p - base;
+    return 0;
+}
+
+int wasm_decode_body(
+    wasm_module*    m,
+    wasm_func*      f)
+{
+    if (f->ins)
+        return 0;
+
+    uint8_t* p = f->expr;
+    uint8_t* end = f->expr + f->expr_len;
+    int depth = 1;
+
+    while (p < end)
+    {
+        f->ins = grow(f->ins, &f->ins_cap, f->ins_count + 1, sizeof(wasm_instr));
+        wasm_instr* in = f->ins + f->ins_count;
+        if (wasm_decode_instr(p, end, in, f))
+            return fprintf(stderr, "Could not decode function body at 0x%lX\n", (uint64_t)(p - m->buf));
+
+        in->off = p - m->buf;
+        p += in->len;
+        f->ins_count++;
+
+        if (in->op == 0x02U || in->op == 0x03U || in->op == 0x04U)
+            depth++;
+        else if (in->op == 0x0BU && --depth == 0)
+            break;
+    }
+
+    if (depth != 0 || p != end)
+        return fprintf(stderr, "Function body at 0x%lX is not properly terminated\n", (uint64_t)f->off);
+
+    return 0;
+}
+
+// skip a constant expression (global initialisers, data segment offsets) up to and including its end
+static int skip_expr(
+    uint8_t*    base,
+    uint8_t**   pp,
+    uint8_t*    end)
+{
+    uint8_t* p = *pp;
+    wasm_instr in;
+    while (p < end)
+    {
+        if (wasm_decode_instr(p, end, &in, 0))
+            return fprintf(stderr, "Bad constant expression at 0x%lX\n", (uint64_t)(p - base));
+        p += in.len;
+        if (in.op == 0x0BU)
+        {
+            *pp = p;
+            return 0;
+        }
+    }
+    return fprintf(stderr, "Unterminated constant expression at 0x%lX\n", (uint64_t)(*pp - base));
+}
+
+int wasm_parse(
+    uint8_t*        buf,
+    ssize_t         len,
+    wasm_module*    m)
+{
+    memset(m, 0, sizeof(*m));
+    m->buf = buf;
+    m->len = len;
+
+    uint8_t* base = buf;
+    uint8_t* p = buf;
+    uint8_t* end = buf + len;
+    uint64_t tmp;
+
+    WREQUIRE(8);
+    if (p[0] != 0x00U || p[1] != 0x61U || p[2] != 0x73U || p[3] != 0x6DU || p[4] != 0x01U || p[5] || p[6] || p[7])
+        return fprintf(stderr, "Not a version 1 web assembly module\n");
+    p += 8;
+
+    while (p < end)
+    {
+        uint8_t id = *p++;
+        uint64_t section_len;
+        WLEB(section_len, 0);
+        WREQUIRE(section_len);
+
+        if (m->sec_count >= WASM_MAX_SECTIONS)
+            return fprintf(stderr, "Too many sections in wasm\n");
+
+        wasm_section* s = m->sec + m->sec_count++;
+        s->id = id;
+        s->start = p;
+        s->len = section_len;
+
+        uint8_t* section_end = p + section_len;
+        uint8_t* outer_end = end;
+        end = section_end;
+
+        switch (id)
+        {
+            case 0x01U: // types
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 3);
+                m->types = calloc(count + 1, sizeof(wasm_type));
+                m->type_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    WREQUIRE(1);
+                    if (*p++ != 0x60U)
+                        return fprintf(stderr, "Illegal func type didn't start with 0x60U at %lX\n", (uint64_t)(p - base));
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp);
+                    m->types[i].pc = tmp;
+                    m->types[i].p = p;
+                    p += tmp;
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp);
+                    m->types[i].rc = tmp;
+                    m->types[i].r = p;
+                    p += tmp;
+                }
+                break;
+            }
+
+            case 0x02U: // imports
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 4);
+                m->imports = calloc(count + 1, sizeof(wasm_import));
+                m->import_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    wasm_import* im = m->imports + i;
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp);
+                    im->mod = p;
+                    im->mod_len = tmp;
+                    p += tmp;
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp);
+                    im->name = p;
+                    im->name_len = tmp;
+                    p += tmp;
+                    WREQUIRE(1);
+                    im->kind = *p++;
+                    im->desc = p;
+                    switch (im->kind)
+                    {
+                        case 0x00U:
+                        {
+                            WLEB(im->type, 0);
+                            if (im->type >= m->type_count)
+                                return fprintf(stderr, "Import %ld type %d out of range\n", i, im->type);
+                            m->import_func_count++;
+                            break;
+                        }
+                        case 0x01U: // table: reftype limits
+                        {
+                            WREQUIRE(2);
+                            p++;
+                        }   // fallthrough
+                        case 0x02U: // memory: limits
+                        {
+                            WREQUIRE(1);
+                            int dual = (*p++ == 0x01U);
+                            WLEB(tmp, 0);
+                            if (dual)
+                                WLEB(tmp, 0);
+                            break;
+                        }
+                        case 0x03U: // global: valtype mut
+                        {
+                            WREQUIRE(2);
+                            p += 2;
+                            m->import_global_count++;
+                            break;
+                        }
+                        default:
+                            return fprintf(stderr, "Unknown import kind %d at 0x%lX\n", im->kind, (uint64_t)(p - base));
+                    }
+                    im->desc_len = p - im->desc;
+                }
+                break;
+            }
+
+            case 0x03U: // functions
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 1);
+                m->funcs = calloc(count + 1, sizeof(wasm_func));
+                m->func_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    WLEB(m->funcs[i].type, 0);
+                    if (m->funcs[i].type >= m->type_count)
+                        return fprintf(stderr, "Func %ld type %d out of range\n", i, m->funcs[i].type);
+                }
+                break;
+            }
+
+            case 0x05U: // memory
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                if (count > 1)
+                    return fprintf(stderr, "Only one memory is supported\n");
+                if (count == 1)
+                {
+                    WREQUIRE(1);
+                    m->has_memory = 1;
+                    m->mem_flags = *p++;
+                    WLEB(m->mem_min, 0);
+                    if (m->mem_flags & 1U)
+                        WLEB(m->mem_max, 0);
+                }
+                break;
+            }
+
+            case 0x06U: // globals
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 3);
+                m->globals = calloc(count + 1, sizeof(wasm_global));
+                m->global_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    WREQUIRE(2);
+                    m->globals[i].valtype = *p++;
+                    m->globals[i].mut = *p++;
+                    m->globals[i].init = p;
+                    if (skip_expr(base, &p, end))
+                        return 1;
+                    m->globals[i].init_len = p - m->globals[i].init;
+                }
+                break;
+            }
+
+            case 0x07U: // exports
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 3);
+                m->exports = calloc(count + 1, sizeof(wasm_export));
+                m->export_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp + 1);
+                    m->exports[i].name = p;
+                    m->exports[i].name_len = tmp;
+                    p += tmp;
+                    m->exports[i].kind = *p++;
+                    WLEB(m->exports[i].idx, 0);
+                    if (m->exports[i].kind == 0x00U && m->exports[i].idx >= m->import_func_count + m->func_count)
+                        return fprintf(stderr, "Export of function %d, which doesn't exist\n", m->exports[i].idx);
+                }
+                break;
+            }
+
+            case 0x0AU: // code
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                if (count != m->func_count)
+                    return fprintf(stderr, "Code section has %ld bodies but function section declares %d\n",
+                            count, m->func_count);
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    wasm_func* f = m->funcs + i;
+                    f->off = p - base;
+                    uint64_t size;
+                    WLEB(size, 0);
+                    WREQUIRE(size);
+                    uint8_t* body_end = p + size;
+
+                    uint64_t groups;
+                    WLEB(groups, 0);
+                    WCOUNT(groups, 2);
+                    f->locals = calloc(groups + 1, sizeof(wasm_local_group));
+                    f->local_group_count = groups;
+                    for (uint64_t j = 0; j < groups; ++j)
+                    {
+                        WLEB(f->locals[j].count, 0);
+                        WREQUIRE(1);
+                        f->locals[j].type = *p++;
+                    }
+
+                    if (p >= body_end)
+                        return fprintf(stderr, "Function body %ld has no expression\n", i);
+
+                    f->expr = p;
+                    f->expr_len = body_end - p;
+                    p = body_end;
+                }
+                break;
+            }
+
+            case 0x0BU: // data
+            {
+                uint64_t count;
+                WLEB(count, 0);
+                WCOUNT(count, 2);
+                m->data = calloc(count + 1, sizeof(wasm_data));
+                m->data_count = count;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    wasm_data* d = m->data + i;
+                    WLEB(d->mode, 0);
+                    if (d->mode > 2)
+                        return fprintf(stderr, "Unknown data segment mode %d\n", d->mode);
+                    if (d->mode == 2)
+                        WLEB(d->mem, 0);
+                    if (d->mode != 1)
+                    {
+                        d->offset = p;
+                        if (skip_expr(base, &p, end))
+                            return 1;
+                        d->offset_len = p - d->offset;
+                    }
+                    WLEB(tmp, 0);
+                    WREQUIRE(tmp);
+                    d->bytes = p;
+                    d->bytes_len = tmp;
+                    p += tmp;
+                }
+                break;
+            }
+
+            default:
+            {
+                // custom, table, start, element, data count: kept raw
+                p = section_end;
+                break;
+            }
+        }
+
+        if (p != section_end)
+            return fprintf(stderr, "Section %d at 0x%lX has %ld trailing bytes\n",
+                    id, (uint64_t)(s->start - base), (int64_t)(section_end - p));
+        end = outer_end;
+    }
+
+    return 0;
+}
+
+void wasm_free(
+    wasm_module*    m)
+{
+    for (uint32_t i = 0; i < m->func_count; ++i)
+    {
+        free(m->funcs[i].locals);
+        free(m->funcs[i].ins);
+        free(m->funcs[i].brt);
+    }
+    free(m->types);
+    free(m->imports);
+    free(m->funcs);
+    free(m->globals);
+    free(m->exports);
+    free(m->data);
+    memset(m, 0, sizeof(*m));
+}
+
+// returns the function index of the named function export or -1
+int wasm_find_export(
+    wasm_module*    m,
+    const char*     name)
+{
+    size_t n = strlen(name);
+    for (uint32_t i = 0; i < m->export_count; ++i)
+        if (m->exports[i].kind == 0x00U && m->exports[i].name_len == n &&
+            memcmp(m->exports[i].name, name, n) == 0)
+            return m->exports[i].idx;
+    return -1;
+}
+
+// returns the function index of the named function import from env or -1
+int wasm_find_import(
+    wasm_module*    m,
+    const char*     name)
+{
+    size_t n = strlen(name);
+    int func_idx = 0;
+    for (uint32_t i = 0; i < m->import_count; ++i)
+    {
+        wasm_import* im = m->imports + i;
+        if (im->kind != 0x00U)
+            continue;
+        if (im->name_len == n && memcmp(im->name, name, n) == 0 &&
+            im->mod_len == 3 && memcmp(im->mod, "env", 3) == 0)
+            return func_idx;
+        func_idx++;
+    }
+    return -1;
+}
+
+// the guard the cleaner puts at every loop head, starting at instruction i: i32.const id; i32.const max; call _g; drop
+int wasm_is_guard(
+    wasm_func*  f,
+    uint32_t    i,
+    int         guard_idx)
+{
+    return i + 3 < f->ins_count && f->ins[i].op == 0x41U && f->ins[i + 1].op == 0x41U &&
+        f->ins[i + 2].op == 0x10U && f->ins[i + 2].imm == guard_idx && f->ins[i + 3].op == 0x1AU;
+}
+
+wasm_type* wasm_func_type(
+    wasm_module*    m,
+    uint32_t        func_idx)
+{
+    uint32_t t = UINT32_MAX;
+    if (func_idx < m->import_func_count)
+    {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < m->import_count; ++i)
+            if (m->imports[i].kind == 0x00U && n++ == func_idx)
+            {
+                t = m->imports[i].type;
+                break;
+            }
+    }
+    else if (func_idx - m->import_func_count < m->func_count)
+        t = m->funcs[func_idx - m->import_func_count].type;
+    else
+        return 0;
+
+    return (t < m->type_count ? m->types + t : 0);
+}
+
+// number of values a block type takes from and leaves on the stack
+int wasm_block_arity(
+    wasm_module*    m,
+    int64_t         block_type,
+    int*            params,
+    int*            results)
+{
+    *params = 0;
+    *results = 0;
+
+    if (block_type == -64)  // 0x40 empty
+        return 0;
+
+    if (block_type < 0)     // single value type
+    {
+        *results = 1;
+        return 0;
+    }
+
+    if (block_type >= m->type_count)
+        return fprintf(stderr, "Block type %ld out of range\n", block_type);
+
+    *params = m->types[block_type].pc;
+    *results = m->types[block_type].rc;
+    return 0;
+}
+
+/*
+ * How many operands a (non-control) instruction pops and pushes. Control instructions (block, loop, if, else, end,
+ * br, br_table, return, unreachable) are the caller's business, as are vector instructions, for which this
+ * returns non-zero.
+ */
+int wasm_stack_effect(
+    wasm_module*    m,
+    wasm_instr*     in,
+    int*            pop,
+    int*            push)
+{
+    uint8_t op = in->op;
+    *pop = 0;
+    *push = 0;
+
+    switch (op)
+    {
+        case 0x01U:                     // nop
+        case 0x0DU:                     // br_if
+        {
+            *pop = (op == 0x0DU);
+            return 0;
+        }
+        case 0x10U:                     // call
+        case 0x11U:                     // call_indirect
+        {
+            wasm_type* t = (op == 0x10U ? wasm_func_type(m, in->imm) :
+                            (in->imm < m->type_count ? m->types + in->imm : 0));
+            if (!t)
+                return 1;
+            *pop = t->pc + (op == 0x11U);
+            *push = t->rc;
+            return 0;
+        }
+        case 0x1AU: *pop = 1;               return 0;   // drop
+        case 0x1BU:                                     // select
+        case 0x1CU: *pop = 3; *push = 1;    return 0;   // select t*
+        case 0x20U: *push = 1;              return 0;   // local.get
+        case 0x21U: *pop = 1;               return 0;   // local.set
+        case 0x22U: *pop = 1; *push = 1;    return 0;   // local.tee
+        case 0x23U: *push = 1;              return 0;   // global.get
+        case 0x24U: *pop = 1;               return 0;   // global.set
+        case 0x25U: *pop = 1; *push = 1;    return 0;   // table.get
+        case 0x26U: *pop = 2;               return 0;   // table.set
+        case 0x3FU: *push = 1;              return 0;   // memory.size
+        case 0x40U: *pop = 1; *push = 1;    return 0;   // memory.grow
+        case 0xD0U: *push = 1;              return 0;   // ref.null
+        case 0xD1U: *pop = 1; *push = 1;    return 0;   // ref.is_null
+        case 0xD2U: *push = 1;              return 0;   // ref.func
+        case 0xFCU:
+        {
+            switch (in->sub)
+            {
+                case 9: case 13:                return 0;   // data.drop elem.drop
+                case 15: *pop = 2; *push = 1;   return 0;   // table.grow
+                case 16: *push = 1;             return 0;   // table.size
+                default:
+                    if (in->sub <= 7)                       // trunc_sat
+                    {
+                        *pop = 1;
+                        *push = 1;
+                    }
+                    else
+                        *pop = 3;                           // memory/table init copy fill
+                    return 0;
+            }
+        }
+    }
+
+    if (op >= 0x28U && op <= 0x35U)     // loads
+    {
+        *pop = 1;
+        *push = 1;
+        return 0;
+    }
+
+    if (op >= 0x36U && op <= 0x3EU)     // stores
+    {
+        *pop = 2;
+        return 0;
+    }
+
+    if (op >= 0x41U && op <= 0x44U)     // consts
+    {
+        *push = 1;
+        return 0;
+    }
+
+    if (op >= 0x45U && op <= 0xC4U)     // numeric
+    {
+        *push = 1;
+        *pop =
+            (op == 0x45U || op == 0x50U ||                  // eqz
+            (op >= 0x67U && op <= 0x69U) ||                 // i32 clz ctz popcnt
+            (op >= 0x79U && op <= 0x7BU) ||                 // i64 clz ctz popcnt
+            (op >= 0x8BU && op <= 0x91U) ||                 // f32 unary
+            (op >= 0x99U && op <= 0x9FU) ||                 // f64 unary
+            op >= 0xA7U) ? 1 : 2;                           // conversions / extensions
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Output helpers
+ */
+
+void wasm_buf_need(
+    wasm_buf*   b,
+    size_t      n)
+{
+    if (b->len + n <= b->cap)
+        return;
+    size_t ncap = (b->cap ? b->cap * 2 : 1024);
+    while (ncap < b->len + n)
+        ncap *= 2;
+    uint8_t* p = realloc(b->p, ncap);
+    if (!p)
+    {
+        fprintf(stderr, "Could not allocate %ld bytes\n", ncap);
+        exit(101);
+    }
+    b->p = p;
+    b->cap = ncap;
+}
+
+void wasm_put(
+    wasm_buf*       b,
+    const void*     data,
+    size_t          n)
+{
+    if (!n)
+        return;
+    wasm_buf_need(b, n);
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+}
+
+void wasm_put_byte(
+    wasm_buf*   b,
+    uint8_t     v)
+{
+    wasm_buf_need(b, 1);
+    b->p[b->len++] = v;
+}
+
+void wasm_put_leb(
+    wasm_buf*   b,
+    uint64_t    v)
+{
+    wasm_buf_need(b, 10);
+    uint8_t* o = b->p + b->len;
+    leb_out(v, &o);
+    b->len = o - b->p;
+}
+
+void wasm_put_sleb(
+    wasm_buf*   b,
+    int64_t     v)
+{
+    wasm_buf_need(b, 10);
+    int more = 1;
+    while (more)
+    {
+        uint8_t byte = v & 0x7FU;
+        v >>= 7;
+        if ((v == 0 && !(byte & 0x40U)) || (v == -1 && (byte & 0x40U)))
+            more = 0;
+        else
+            byte |= 0x80U;
+        b->p[b->len++] = byte;
+    }
+}
+
+int wasm_encode_instr(
+    wasm_buf*   b,
+    wasm_func*  f,
+    wasm_instr* in)
+{
+    uint8_t op = in->op;
+
+    switch (op)
+    {
+        case 0x02U: case 0x03U: case 0x04U:     // block loop if
+        case 0x41U: case 0x42U:                 // i32.const i64.const
+        {
+            wasm_put_byte(b, op);
+            wasm_put_sleb(b, in->imm);
+            return 0;
+        }
+
+        case 0x0CU: case 0x0DU: case 0x10U:
+        case 0x20U: case 0x21U: case 0x22U: case 0x23U: case 0x24U:
+        case 0x25U: case 0x26U: case 0xD2U:
+        {
+            wasm_put_byte(b, op);
+            wasm_put_leb(b, in->imm);
+            return 0;
+        }
+
+        case 0x0EU:                             // br_table
+        {
+            wasm_put_byte(b, op);
+            wasm_put_leb(b, in->imm);
+            for (uint64_t i = 0; i <= in->imm; ++i)
+                wasm_put_leb(b, f->brt[in->imm2 + i]);
+            return 0;
+        }
+
+        case 0x11U:                             // call_indirect
+        {
+            wasm_put_byte(b, op);
+            wasm_put_leb(b, in->imm);
+            wasm_put_leb(b, in->imm2);
+            return 0;
+        }
+
+        case 0x3FU: case 0x40U: case 0xD0U:     // memory.size memory.grow ref.null
+        {
+            wasm_put_byte(b, op);
+            wasm_put_byte(b, in->imm);
+            return 0;
+        }
+
+        case 0xFCU:
+        {
+            wasm_put_byte(b, op);
+            wasm_put_leb(b, in->sub);
+            switch (in->sub)
+            {
+                case 8:  wasm_put_leb(b, in->imm); wasm_put_byte(b, 0); break;
+                case 9: case 13: case 15: case 16: case 17:
+                         wasm_put_leb(b, in->imm); break;
+                case 10: wasm_put_byte(b, 0); wasm_put_byte(b, 0); break;
+                case 11: wasm_put_byte(b, 0); break;
+                case 12: case 14:
+                         wasm_put_leb(b, in->imm); wasm_put_leb(b, in->imm2); break;
+            }
+            return 0;
+        }
+
+        case 0x43U: case 0x44U: case 0x1CU: case 0xFDU:
+        {
+            // opaque immediates are copied from the source encoding
+            if (!in->raw || !in->len)
+                return fprintf(stderr, "Can't encode synthesized instruction 0x%02X\n", op);
+            wasm_put(b, in->raw, in->len);
+            return 0;
+        }
+    }
+
+    if (op >= 0x28U && op <= 0x3EU)             // memargs
+    {
+        wasm_put_byte(b, op);
+        wasm_put_leb(b, in->imm);
+        wasm_put_leb(b, in->imm2);
+        return 0;
+    }
+
+    wasm_put_byte(b, op);
+    return 0;
+}
+
+static int emit_body(
+    wasm_buf*   b,
+    wasm_func*  f,
+    reloc_map*  map)
+{
+    wasm_put_leb(b, f->local_group_count);
+    for (uint32_t i = 0; i < f->local_group_count; ++i)
+    {
+        wasm_put_leb(b, f->locals[i].count);
+        wasm_put_byte(b, f->locals[i].type);
+    }
+
+    if (!f->ins)
+    {
+        wasm_put(b, f->expr, f->expr_len);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < f->ins_count; ++i)
+    {
+        reloc_add(map, b->len, f->ins[i].off);
+        if (wasm_encode_instr(b, f, f->ins + i))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Write a module back out. Sections the module representation understands are regenerated from it, so passes
+ * only need to edit the parsed view and every size comes out minimally encoded. Anything else is copied as is.
+ */
+int wasm_emit(
+    wasm_module*    m,
+    wasm_buf*       o)
+{
+    wasm_put(o, m->buf, 8);
+
+    wasm_buf s = { 0 };
+
+    for (int i = 0; i < m->sec_count; ++i)
+    {
+        wasm_section* sec = m->sec + i;
+        s.len = 0;
+        uint32_t sec_map_start = (m->map ? m->map->count : 0);
+
+        switch (sec->id)
+        {
+            case 0x01U:
+            {
+                if (!m->type_count)
+                    continue;
+                wasm_put_leb(&s, m->type_count);
+                for (uint32_t j = 0; j < m->type_count; ++j)
+                {
+                    wasm_type* t = m->types + j;
+                    wasm_put_byte(&s, 0x60U);
+                    wasm_put_leb(&s, t->pc);
+                    wasm_put(&s, t->p, t->pc);
+                    wasm_put_leb(&s, t->rc);
+                    wasm_put(&s, t->r, t->rc);
+                }
+                break;
+            }
+
+            case 0x02U:
+            {
+                if (!m->import_count)
+                    continue;
+                wasm_put_leb(&s, m->import_count);
+                for (uint32_t j = 0; j < m->import_count; ++j)
+                {
+                    wasm_import* im = m->imports + j;
+                    wasm_put_leb(&s, im->mod_len);
+                    wasm_put(&s, im->mod, im->mod_len);
+                    wasm_put_leb(&s, im->name_len);
+                    wasm_put(&s, im->name, im->name_len);
+                    wasm_put_byte(&s, im->kind);
+                    if (im->kind == 0x00U)
+                        wasm_put_leb(&s, im->type);
+                    else
+                        wasm_put(&s, im->desc, im->desc_len);
+                }
+                break;
+            }
+
+            case 0x03U:
+            {
+                wasm_put_leb(&s, m->func_count);
+                for (uint32_t j = 0; j < m->func_count; ++j)
+                    wasm_put_leb(&s, m->funcs[j].type);
+                break;
+            }
+
+            case 0x05U:
+            {
+                if (!m->has_memory)
+                    continue;
+                wasm_put_leb(&s, 1);
+                wasm_put_byte(&s, m->mem_flags);
+                wasm_put_leb(&s, m->mem_min);
+                if (m->mem_flags & 1U)
+                    wasm_put_leb(&s, m->mem_max);
+                break;
+            }
+
+            case 0x06U:
+            {
+                if (!m->global_count)
+                    continue;
+                wasm_put_leb(&s, m->global_count);
+                for (uint32_t j = 0; j < m->global_count; ++j)
+                {
+                    wasm_put_byte(&s, m->globals[j].valtype);
+                    wasm_put_byte(&s, m->globals[j].mut);
+                    wasm_put(&s, m->globals[j].init, m->globals[j].init_len);
+                }
+                break;
+            }
+
+            case 0x07U:
+            {
+                wasm_put_leb(&s, m->export_count);
+                for (uint32_t j = 0; j < m->export_count; ++j)
+                {
+                    wasm_export* e = m->exports + j;
+                    wasm_put_leb(&s, e->name_len);
+                    wasm_put(&s, e->name, e->name_len);
+                    wasm_put_byte(&s, e->kind);
+                    wasm_put_leb(&s, e->idx);
+                }
+                break;
+            }
+
+            case 0x0AU:
+            {
+                wasm_put_leb(&s, m->func_count);
+                wasm_buf body = { 0 };
+                for (uint32_t j = 0; j < m->func_count; ++j)
+                {
+                    body.len = 0;
+                    uint32_t body_map_start = (m->map ? m->map->count : 0);
+
+                    // mapping needs every instruction, not a verbatim copy of the body
+                    if ((m->map && wasm_decode_body(m, m->funcs + j)) || emit_body(&body, m->funcs + j, m->map))
+                    {
+                        free(body.p);
+                        free(s.p);
+                        return fprintf(stderr, "Could not encode function body %d\n", j);
+                    }
+                    wasm_put_leb(&s, body.len);
+                    reloc_shift(m->map, body_map_start, 0, s.len);
+                    wasm_put(&s, body.p, body.len);
+                }
+                free(body.p);
+                break;
+            }
+
+            case 0x0BU:
+            {
+                wasm_put_leb(&s, m->data_count);
+                for (uint32_t j = 0; j < m->data_count; ++j)
+                {
+                    wasm_data* d = m->data + j;
+                    wasm_put_leb(&s, d->mode);
+                    if (d->mode == 2)
+                        wasm_put_leb(&s, d->mem);
+                    if (d->mode != 1)
+                        wasm_put(&s, d->offset, d->offset_len);
+                    wasm_put_leb(&s, d->bytes_len);
+                    wasm_put(&s, d->bytes, d->bytes_len);
+                }
+                break;
+            }
+
+            default:
+            {
+                wasm_put(&s, sec->start, sec->len);
+                break;
+            }
+        }
+
+        wasm_put_byte(o, sec->id);
+        wasm_put_leb(o, s.len);
+        reloc_shift(m->map, sec_map_start, 0, o->len);
+        wasm_put(o, s.p, s.len);
+    }
+
+    free(s.p);
+    return 0;
+}